@@ -4,20 +4,47 @@
 #include <boot.h>
 
 #include <endian.h>
+#include <stdbool.h>
 #include <sys/include/kernel.h>
 
+extern phys __loader_start[1], __loader_end[1];
+
 /*
  * The Apex executable boot image is assembled as follows:
  * 1. Boot loader
  * 2. Zero terminated array of file sizes (32bit big endian)
- * 3. Padding up to 8-byte boundary
+ * 3. Padding up to page boundary
  * 4. Apex kernel
  * 5. Boot files
+ *
+ * Each file is padded to a page boundary relative to the start of the image
+ * so that a boot archive in ROM can be mapped in place by the kernel when
+ * the image itself is page aligned.
+ */
+static phys *
+file_align(phys *p)
+{
+	return __loader_start + PAGE_ALIGN((size_t)(p - __loader_start));
+}
+
+/*
+ * Check if region is in ROM
  */
+static bool
+in_rom(const phys *p, size_t len)
+{
+#if defined(CONFIG_ROM_BASE_PHYS)
+	const phys *const rom = (phys *)CONFIG_ROM_BASE_PHYS;
+	return p >= rom && len <= CONFIG_ROM_SIZE &&
+	    (size_t)(p - rom) <= CONFIG_ROM_SIZE - len;
+#else
+	return false;
+#endif
+}
+
 int
 load_bootimg(void)
 {
-	extern phys __loader_end[1];
 	phys *p, *file_data;
 	uint32_t *file_sizes = (uint32_t *)__loader_end;
 	size_t files = 0;
@@ -34,14 +61,14 @@ load_bootimg(void)
 		return -1;
 	}
 
-	file_data = ALIGNn(__loader_end + (files + 1) * sizeof(uint32_t), 8);
+	file_data = file_align(__loader_end + (files + 1) * sizeof(uint32_t));
 
 	dbg("Found %zu boot files:\n", files);
 	p = file_data;
 	for (size_t i = 0; i < files; ++i) {
 		size_t sz = be32toh(file_sizes[i]);
 		dbg("  %zu: %p -> %p (%zu bytes)\n", i, p, p + sz, sz);
-		p += sz;
+		p = file_align(p + sz);
 	}
 
 	dbg("Loading kernel from file 0\n");
@@ -50,8 +77,12 @@ load_bootimg(void)
 
 	if (files > 1) {
 		dbg("Passing file 1 to kernel as boot archive\n");
-		args.archive_addr = file_data + be32toh(file_sizes[0]);
+		args.archive_addr = file_align(file_data + be32toh(file_sizes[0]));
 		args.archive_size = be32toh(file_sizes[1]);
+
+		/* the kernel reads the archive in place, it is never copied */
+		if (in_rom(args.archive_addr, args.archive_size))
+			dbg("Boot archive is in ROM\n");
 	}
 
 	if (files > 2)
@@ -36,7 +36,8 @@ machine_driver_init(bootargs *bootargs)
 void
 machine_idle(void)
 {
-	/* nothing to do for now */
+	/* wait for interrupt, wakes on pending interrupts even if masked */
+	asm volatile("wfi");
 }
 
 [[noreturn]] void
@@ -61,6 +61,12 @@ endif
 ifeq ($(origin CONFIG_CROSS_COMPILE),undefined)
     CONFIG_CROSS_COMPILE :=
 endif
+ifeq ($(origin CONFIG_BOOT_ARCHIVE_XIP),undefined)
+    CONFIG_BOOT_ARCHIVE_XIP :=
+endif
+ifeq ($(origin CONFIG_BOOT_ARCHIVE_SHA256),undefined)
+    CONFIG_BOOT_ARCHIVE_SHA256 :=
+endif
 
 #
 # Make paths relative to $(CONFIG_SRCDIR) or absolute
@@ -320,6 +326,33 @@ define fn_archive_a_rule
     $$(eval undefine SOURCES)
 endef
 
+#
+# Rule to create a compressed ROM file system archive
+#
+# Files matching a pattern in CONFIG_BOOT_ARCHIVE_XIP are stored uncompressed
+# so that they can be executed in place. If CONFIG_BOOT_ARCHIVE_SHA256 is set
+# file digests are included so that file integrity is checked on first use.
+#
+define fn_archive_crom_rule
+    # fn_archive_crom_rule
+
+    # include built object flags
+    -include $(tgt).flags
+
+    $(tgt)_MKCROMFS := $(CONFIG_APEXDIR)/sys/fs/cromfs/mkcromfs
+    $(tgt)_CLEAN :=
+    $(tgt)_SOURCES := $$(SOURCES)
+    $(tgt)_MKCROMFSFLAGS := $$(addprefix -x ,$$(CONFIG_BOOT_ARCHIVE_XIP))
+    $(tgt)_MKCROMFSFLAGS += $$(if $$(CONFIG_BOOT_ARCHIVE_SHA256),-s)
+
+    $$(eval $$(call fn_flags_rule,$(tgt).flags,$$($(tgt)_SOURCES) $$($(tgt)_MKCROMFSFLAGS)))
+
+    $(tgt): $(tgt).flags $$($(tgt)_SOURCES)
+	$$($(tgt)_MKCROMFS) $$($(tgt)_MKCROMFSFLAGS) -o $$@ $$(wordlist 2,$$(words $$^),$$^)
+
+    $$(eval undefine SOURCES)
+endef
+
 #
 # Rule to build executable boot image
 #
@@ -328,10 +361,13 @@ endef
 # The resultant boot image is laid out as follows:
 # 1. Boot loader
 # 2. Zero terminated array of file sizes (32bit big endian)
-# 3. Padding up to 8-byte boundary
+# 3. Padding up to page boundary
 # 4. Apex kernel
 # 5. Boot files
 #
+# Each file is padded to a page boundary so that boot archives can be mapped
+# in place when the image is page aligned.
+#
 define fn_bootimg_rule
     # fn_bootimg_rule
 
@@ -348,8 +384,8 @@ define fn_bootimg_rule
 	cat $$($(tgt)_BOOTLOADER) > $$@
 	$$(foreach a,$$($(tgt)_FILES),perl -e "print pack('N', `stat -c %s $$a`)" >> $$@;)
 	perl -e "print pack('N', 0)" >> $$@
-	truncate -s $$$$((($$$$(stat -c %s $$@) + 7) & -8)) $$@
-	cat $$($(tgt)_FILES) >> $$@
+	truncate -s $$$$((($$$$(stat -c %s $$@) + $(CONFIG_PAGE_SIZE) - 1) & -$(CONFIG_PAGE_SIZE))) $$@
+	$$(foreach a,$$($(tgt)_FILES),cat $$a >> $$@; truncate -s $$$$((($$$$(stat -c %s $$@) + $(CONFIG_PAGE_SIZE) - 1) & -$(CONFIG_PAGE_SIZE))) $$@;)
 
     $$(eval undefine SOURCES)
 endef
@@ -24,9 +24,14 @@ INCLUDE := \
     $(CONFIG_SRCDIR) \
 
 SOURCES := \
+    fs/epoll.c \
+    fs/eventfd.c \
     fs/mount.c \
+    fs/pcache.c \
     fs/pipe.c \
+    fs/poll.c \
     fs/syscalls.cpp \
+    fs/timerfd.c \
     fs/util/dirbuf_add.c \
     fs/util/for_each_iov.c \
     fs/vfs.c \
@@ -56,6 +61,7 @@ SOURCES := \
     lib/string_utils.cpp \
     mem/access.cpp \
     mem/kmem.c \
+    mem/kmem_cache.c \
     mem/page.cpp \
     mem/vm.cpp \
     sync/cond.c \
@@ -72,6 +78,11 @@ else
 SOURCES += mem/untranslated.cpp
 endif
 
+# Boot time tracing
+ifneq ($(origin CONFIG_BOOTTRACE),undefined)
+SOURCES += kern/boottrace.c
+endif
+
 # Configured file systems. devfs and ramfs are always required.
 ifneq ($(origin CONFIG_FS),undefined)
     include $(addsuffix /include.mk,$(CONFIG_FS))
@@ -220,6 +220,39 @@ struct fpu {
 static_assert(sizeof(struct fpu) == 24, "Bad FPU size");
 static struct fpu *const FPU = (struct fpu*)0xe000ef34;
 
+/*
+ * Debug Exception and Monitor Control Register
+ */
+union dcb_demcr {
+	struct {
+		uint32_t : 24;
+		uint32_t TRCENA : 1;
+		uint32_t : 7;
+	};
+	uint32_t r;
+};
+static union dcb_demcr *const DEMCR = (union dcb_demcr*)0xe000edfc;
+
+/*
+ * Data Watchpoint and Trace unit
+ */
+struct dwt {
+	union dwt_ctrl {
+		struct {
+			uint32_t CYCCNTENA : 1;
+			uint32_t : 24;
+			uint32_t NOCYCCNT : 1;
+			uint32_t NOEXTTRIG : 1;
+			uint32_t NOTRCPKT : 1;
+			uint32_t NUMCOMP : 4;
+		};
+		uint32_t r;
+	} CTRL;
+	uint32_t CYCCNT;
+};
+static_assert(sizeof(struct dwt) == 8, "Bad DWT size");
+static struct dwt *const DWT = (struct dwt*)0xe0001000;
+
 /*
  * MPU
  */
@@ -1,5 +1,6 @@
 #include <arch.h>
 
+#include <cpu.h>
 #include <debug.h>
 #include <sys/auxv.h>
 
@@ -44,3 +45,30 @@ arch_kstack_align(void *sp)
 	/* arm requires 8-byte aligned stack */
 	return (void*)((intptr_t)sp & -8);
 }
+
+/*
+ * Start cycle counter, returns false if the core does not have one
+ */
+bool
+arch_cycles_init(void)
+{
+	union dcb_demcr demcr = read32(DEMCR);
+	demcr.TRCENA = 1;
+	write32(DEMCR, demcr.r);
+
+	union dwt_ctrl ctrl = read32(&DWT->CTRL);
+	if (ctrl.NOCYCCNT)
+		return false;
+	write32(&DWT->CYCCNT, 0);
+	ctrl.CYCCNTENA = 1;
+	write32(&DWT->CTRL, ctrl.r);
+
+	/* some emulators implement DWT as read as zero */
+	return read32(&DWT->CTRL).CYCCNTENA;
+}
+
+uint32_t
+arch_cycles(void)
+{
+	return read32(&DWT->CYCCNT);
+}
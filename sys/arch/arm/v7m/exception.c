@@ -1,6 +1,7 @@
 #include <arch.h>
 
 #include "exception_frame.h"
+#include <clock.h>
 #include <cpu.h>
 #include <debug.h>
 #include <irq.h>
@@ -170,7 +171,11 @@ exc_UsageFault(struct exception_frame_basic *e, bool handler_mode, int exc)
 __fast_text void
 exc_SysTick(void)
 {
+#if defined(CONFIG_TICKLESS)
+	timer_tick(clock_ticks());
+#else
 	timer_tick(1);
+#endif
 }
 
 /*
@@ -0,0 +1,223 @@
+#include "init.h"
+
+#include <compiler.h>
+#include <debug.h>
+#include <errno.h>
+#include <fs.h>
+#include <kernel.h>
+#include <mmap.h>
+#include <poll.h>
+#include <sch.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <task.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Blocks a thread reading an eventfd, then writes to the eventfd from a
+ * second thread which must wake the reader. Then blocks one thread reading a
+ * timerfd and another polling it, and arms the timer from a third thread.
+ * Both sleepers must wake when the timer expires. A thread which sleeps with
+ * the file locked makes the others hang, which is reported as a failure
+ * once they have not finished in time.
+ */
+
+#define SETTLE 100000000	/* time for a thread to block, ns */
+#define TIMEOUT 2000000000	/* time for threads to finish, ns */
+#define PERIOD 50000000		/* timerfd period, ns */
+
+/*
+ * Operation run on its own thread
+ *
+ * Operations are static so that a thread which hangs never refers to a
+ * stack frame which has gone.
+ */
+struct op {
+	int fd;
+	uint64_t value;
+	struct pollfd *pfd;		/* in user memory */
+	struct itimerspec *its;		/* in user memory */
+	ssize_t result;
+	bool done;
+};
+
+static struct op ops[3];
+
+static void
+op_exit(struct op *o)
+{
+	write_once(&o->done, true);
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+static void
+reader(void *arg)
+{
+	struct op *o = arg;
+
+	o->result = kpread(o->fd, &o->value, sizeof o->value, 0);
+	op_exit(o);
+}
+
+static void
+writer(void *arg)
+{
+	struct op *o = arg;
+
+	o->result = kpwrite(o->fd, &o->value, sizeof o->value, 0);
+	op_exit(o);
+}
+
+static void
+poller(void *arg)
+{
+	struct op *o = arg;
+
+	o->result = sc_poll(o->pfd, 1, TIMEOUT / 2000000);
+	op_exit(o);
+}
+
+static void
+arm(void *arg)
+{
+	struct op *o = arg;
+
+	o->result = sc_timerfd_settime(o->fd, 0, o->its, NULL);
+	op_exit(o);
+}
+
+static bool
+start(void (*fn)(void *), struct op *o)
+{
+	if (kthread_create(fn, o, PRI_KERN_LOW, "anonfd_test", MA_NORMAL))
+		return true;
+	dbg("*** anonfd test: can't create thread\n");
+	return false;
+}
+
+/*
+ * wait_ops - wait for the first 'n' operations to finish
+ */
+static bool
+wait_ops(size_t n)
+{
+	const uint_fast64_t deadline = timer_monotonic() + TIMEOUT;
+
+	for (size_t i = 0; i < n; ++i) {
+		while (!read_once(&ops[i].done)) {
+			if (timer_monotonic() >= deadline)
+				return false;
+			timer_delay(SETTLE / 10);
+		}
+	}
+	return true;
+}
+
+static bool
+test_eventfd(void)
+{
+	int fd;
+
+	if ((fd = sc_eventfd2(0, 0)) < 0) {
+		dbg("*** anonfd test: eventfd failed %d\n", fd);
+		return false;
+	}
+
+	ops[0] = (struct op){.fd = fd};
+	ops[1] = (struct op){.fd = fd, .value = 5};
+	if (!start(reader, &ops[0]))
+		return false;
+	timer_delay(SETTLE);
+	if (!start(writer, &ops[1]))
+		return false;
+
+	if (!wait_ops(2)) {
+		dbg("*** anonfd test: eventfd write did not wake reader\n");
+		return false;
+	}
+	kclose(fd);
+
+	if (ops[1].result != sizeof(uint64_t) ||
+	    ops[0].result != sizeof(uint64_t) || ops[0].value != 5) {
+		dbg("*** anonfd test: eventfd read %d value %llu write %d\n",
+		    (int)ops[0].result, (unsigned long long)ops[0].value,
+		    (int)ops[1].result);
+		return false;
+	}
+	return true;
+}
+
+static bool
+test_timerfd(struct pollfd *pfd, struct itimerspec *its)
+{
+	int fd;
+
+	if ((fd = sc_timerfd_create(CLOCK_MONOTONIC, 0)) < 0) {
+		dbg("*** anonfd test: timerfd failed %d\n", fd);
+		return false;
+	}
+
+	/* periodic so that the poller sees an expiry the reader missed */
+	*pfd = (struct pollfd){.fd = fd, .events = POLLIN};
+	*its = (struct itimerspec){
+		.it_value.tv_nsec = PERIOD,
+		.it_interval.tv_nsec = PERIOD,
+	};
+	ops[0] = (struct op){.fd = fd};
+	ops[1] = (struct op){.pfd = pfd};
+	ops[2] = (struct op){.fd = fd, .its = its};
+	if (!start(reader, &ops[0]))
+		return false;
+	timer_delay(SETTLE);
+	if (!start(poller, &ops[1]))
+		return false;
+	timer_delay(SETTLE);
+	if (!start(arm, &ops[2]))
+		return false;
+
+	if (!wait_ops(3)) {
+		dbg("*** anonfd test: timerfd sleepers did not wake\n");
+		return false;
+	}
+	kclose(fd);
+
+	if (ops[2].result != 0 ||
+	    ops[0].result != sizeof(uint64_t) || !ops[0].value ||
+	    ops[1].result != 1 || !(pfd->revents & POLLIN)) {
+		dbg("*** anonfd test: timerfd settime %d read %d value %llu "
+		    "poll %d revents %x\n", (int)ops[2].result,
+		    (int)ops[0].result, (unsigned long long)ops[0].value,
+		    (int)ops[1].result, pfd->revents);
+		return false;
+	}
+	return true;
+}
+
+void
+anonfd_test_init(void)
+{
+	void *u;
+
+	/* poll and timerfd_settime take user pointers */
+	if ((u = mmapfor(kern_task.as, NULL, PAGE_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0,
+	    MA_NORMAL)) > (void *)-4096UL) {
+		dbg("*** anonfd test: allocation failed\n");
+		return;
+	}
+	struct pollfd *pfd = u;
+	struct itimerspec *its = (struct itimerspec *)(pfd + 1);
+
+	if (!test_eventfd() || !test_timerfd(pfd, its)) {
+		/* user memory is left mapped in case a thread is still hung */
+		dbg("*** anonfd test: failed\n");
+		return;
+	}
+	munmapfor(kern_task.as, u, PAGE_SIZE);
+	dbg("anonfd test: passed\n");
+}
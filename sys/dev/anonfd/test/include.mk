@@ -0,0 +1,5 @@
+#
+# Anonymous File Test
+#
+SOURCES += \
+    dev/anonfd/test/anonfd_test.c
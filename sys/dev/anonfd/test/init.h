@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Anonymous File Test
+ *
+ * For example:
+ *  driver sys/dev/anonfd/test()
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void anonfd_test_init(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -34,6 +34,17 @@ struct syst {
 static_assert(sizeof(struct syst) == 16, "Bad SYST size");
 static struct syst *const SYST = (struct syst*)0xe000e010;
 
+#if defined(CONFIG_TICKLESS)
+/*
+ * Tickless idle state
+ */
+static uint32_t tick_count;	/* SysTick counts per tick */
+static uint32_t idle_load;	/* counts programmed for idle, 0 if not idle */
+static uint32_t idle_start;	/* counts into current tick when idle began */
+static uint32_t carry;		/* counts elapsed but not yet accounted */
+static unsigned skipped;	/* ticks elapsed while idle */
+#endif
+
 /*
  * Initialise
  */
@@ -44,6 +55,9 @@ arm_armv7m_systick_init(const struct arm_armv7m_systick_desc *d)
 	assert(!read32(&SYST->CSR).ENABLE);
 
 	/* set systick timer to interrupt us at CONFIG_HZ */
+#if defined(CONFIG_TICKLESS)
+	tick_count = d->clock / CONFIG_HZ;
+#endif
 	write32(&SYST->RVR, d->clock / CONFIG_HZ - 1);
 	write32(&SYST->CVR, 0);
 
@@ -78,9 +92,102 @@ clock_ns_since_tick(void)
 
 	/* convert count to nanoseconds */
 	/* REVISIT: fractional multiply instead of 64-bit division? */
+#if defined(CONFIG_TICKLESS)
+	assert(!idle_load);
+	const uint32_t r = tick_count;
+	uint32_t ns = ((cvr ? r - cvr : 0) + carry) * 1000000000ULL /
+	    (r * CONFIG_HZ);
+	if (tick_pending)
+		ns += (skipped ?: 1) * (1000000000 / CONFIG_HZ);
+#else
 	const uint32_t r = read32(&SYST->RVR) + 1;
 	uint32_t ns = cvr ? (r - cvr) * 1000000000ULL / (r * CONFIG_HZ) : 0;
 	if (tick_pending)
 		ns += 1000000000 / CONFIG_HZ;
+#endif
 	return ns;
 }
+
+#if defined(CONFIG_TICKLESS)
+/*
+ * Stop ticking until up to ticks tick boundaries have passed
+ *
+ * Must be called with interrupts disabled & followed by clock_wake.
+ */
+void
+clock_idle(unsigned ticks)
+{
+	assert(!idle_load);
+
+	if (ticks < 2 || read32(&SCB->ICSR).PENDSTSET)
+		return;
+
+	/* counts remaining in current tick */
+	const uint32_t cvr = read32(&SYST->CVR);
+	if (!cvr)
+		return;
+
+	/* SysTick is a 24-bit counter */
+	const uint32_t max = (0x1000000 - cvr) / tick_count + 1;
+	if (ticks > max)
+		ticks = max;
+
+	/* interrupt on tick boundary after ticks, a few counts are lost
+	   while reprogramming the counter */
+	idle_start = tick_count - cvr;
+	idle_load = cvr + (ticks - 1) * tick_count;
+	write32(&SYST->RVR, idle_load - 1);
+	write32(&SYST->CVR, 0);
+}
+
+/*
+ * Resume ticking after clock_idle
+ *
+ * Must be called with interrupts disabled.
+ */
+void
+clock_wake(void)
+{
+	if (!idle_load)
+		return;
+
+	/* get CVR, making sure that we handle rollovers */
+	uint32_t cvr;
+	bool fired;
+	do {
+		fired = read32(&SCB->ICSR).PENDSTSET;
+		cvr = read32(&SYST->CVR);
+	} while (fired != read32(&SCB->ICSR).PENDSTSET);
+
+	/* work out how many counts elapsed while idle */
+	uint32_t elapsed = cvr ? idle_load - cvr : idle_load;
+	if (fired)
+		elapsed = idle_load + (cvr ? idle_load - cvr : 0);
+
+	/* restart periodic tick */
+	write32(&SYST->RVR, tick_count - 1);
+	write32(&SYST->CVR, 0);
+	write32(&SCB->ICSR, (union scb_icsr){.PENDSTCLR = 1}.r);
+	idle_load = 0;
+
+	/* account for elapsed ticks, carrying over any partial tick */
+	const uint32_t total = idle_start + elapsed + carry;
+	skipped = total / tick_count;
+	carry = total % tick_count;
+	if (skipped)
+		write32(&SCB->ICSR, (union scb_icsr){.PENDSTSET = 1}.r);
+}
+
+/*
+ * Return number of ticks elapsed
+ *
+ * Called from the SysTick exception handler.
+ */
+unsigned
+clock_ticks(void)
+{
+	const unsigned ticks = skipped ?: 1;
+	skipped = 0;
+	return ticks;
+}
+#endif
@@ -0,0 +1,152 @@
+#include "init.h"
+
+#include <algorithm>
+#include <cstring>
+#include <debug.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <kernel.h>
+#include <linux/fs.h>
+#include <page.h>
+#include <stdio.h>
+#include <timer.h>
+
+/*
+ * Each test starts with an empty block cache. Writes are followed by a cache
+ * flush which is included in the throughput figure but not in the latency of
+ * any single operation.
+ */
+
+namespace {
+
+constexpr size_t sizes[] = {512, 4096, 16384, 65536};
+constexpr unsigned max_ops = 256;
+constexpr size_t max_size = 65536;
+
+/*
+ * Page ownership identifier for block benchmark
+ */
+char block_bench_id;
+
+uint32_t
+bench_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/*
+ * percentile - latency at percentile p of sorted latencies
+ */
+unsigned long
+percentile(const uint_fast64_t *lat, unsigned ops, unsigned p)
+{
+	return lat[std::min(ops - 1, ops * p / 100)] / 1000;
+}
+
+/*
+ * run - run one benchmark and report results
+ */
+bool
+run(int fd, std::byte *buf, uint64_t dev_size, size_t size, bool random,
+    bool write, uint_fast64_t *lat)
+{
+	const unsigned ops = std::min<uint64_t>(max_ops, dev_size / size);
+	const char *name = random ? (write ? "randwrite" : "randread")
+				  : (write ? "write" : "read");
+	uint32_t seed = 1;
+
+	if (!ops)
+		return true;
+	if (auto r = kioctl(fd, BLKFLSBUF); r < 0) {
+		dbg("*** block bench: flush failed %d\n", r);
+		return false;
+	}
+
+	const auto start = timer_monotonic();
+	for (unsigned i = 0; i < ops; ++i) {
+		const off_t off = (random ? bench_rand(&seed) % (dev_size / size)
+					  : i) * size;
+		const auto t = timer_monotonic();
+		const ssize_t r = write ? kpwrite(fd, buf, size, off)
+					: kpread(fd, buf, size, off);
+		lat[i] = timer_monotonic() - t;
+		if (r != (ssize_t)size) {
+			dbg("*** block bench: %s failed at %lld, %zd\n", name,
+			    (long long)off, r);
+			return false;
+		}
+	}
+	if (write) {
+		if (auto r = kioctl(fd, BLKFLSBUF); r < 0) {
+			dbg("*** block bench: flush failed %d\n", r);
+			return false;
+		}
+	}
+	const uint_fast64_t us = std::max<uint_fast64_t>(
+	    (timer_monotonic() - start) / 1000, 1);
+
+	/* bytes per microsecond is MB/s */
+	const uint_fast64_t rate = (uint_fast64_t)ops * size * 100 / us;
+	std::sort(lat, lat + ops);
+	info("block bench: %-9s %5zu: %4lu.%02lu MB/s, latency us "
+	     "p50 %lu p90 %lu p99 %lu max %lu\n", name, size,
+	     (unsigned long)(rate / 100), (unsigned long)(rate % 100),
+	     percentile(lat, ops, 50), percentile(lat, ops, 90),
+	     percentile(lat, ops, 99), (unsigned long)(lat[ops - 1] / 1000));
+	return true;
+}
+
+}
+
+void
+block_bench_init(const char *name)
+{
+	char path[32];
+	snprintf(path, sizeof path, "/dev/%s", name);
+
+	const int fd = kopen(path, O_RDWR);
+	if (fd < 0) {
+		dbg("*** block bench: failed to open %s %d\n", path, fd);
+		return;
+	}
+
+	uint64_t dev_size;
+	if (auto r = kioctl(fd, BLKGETSIZE64, &dev_size); r < 0) {
+		dbg("*** block bench: failed to get size %d\n", r);
+		kclose(fd);
+		return;
+	}
+
+	const size_t alloc = PAGE_ALIGN(max_size + max_ops * sizeof(uint_fast64_t));
+	phys *p = page_alloc(alloc, MA_NORMAL, &block_bench_id);
+	if (!p) {
+		dbg("*** block bench: allocation failed\n");
+		kclose(fd);
+		return;
+	}
+	std::byte *buf = static_cast<std::byte *>(phys_to_virt(p));
+	uint_fast64_t *lat = reinterpret_cast<uint_fast64_t *>(buf + max_size);
+	uint32_t seed = 2;
+	for (size_t i = 0; i < max_size; ++i)
+		buf[i] = static_cast<std::byte>(bench_rand(&seed));
+
+	info("block bench: %s, %llu KiB\n", path,
+	    (unsigned long long)dev_size / 1024);
+	bool pass = true;
+	for (auto size : sizes) {
+		for (auto random : {false, true}) {
+			for (auto write : {true, false}) {
+				if (pass)
+					pass = run(fd, buf, dev_size, size,
+					    random, write, lat);
+			}
+		}
+	}
+
+	page_free(p, alloc, &block_bench_id);
+	kclose(fd);
+
+	if (!pass)
+		dbg("*** block bench: failed\n");
+}
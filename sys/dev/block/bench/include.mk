@@ -0,0 +1,5 @@
+#
+# Block Device Benchmark
+#
+SOURCES += \
+    dev/block/bench/block_bench.cpp
@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+ * Block Device Benchmark
+ *
+ * Runs sequential and random reads and writes of various sizes through the
+ * named block device and reports throughput and latency percentiles. Data on
+ * the device is overwritten.
+ *
+ * For example, on a RAM block device with emulated timing:
+ *  driver sys/dev/block/ram{.name = "ram0", .size = 0x200000, .latency_us = 100, .bandwidth = 20000000, .erase_size = 0x10000}
+ *  driver sys/dev/block/bench("ram0")
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void block_bench_init(const char *name);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
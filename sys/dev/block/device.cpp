@@ -8,11 +8,114 @@
 #include <fs/util.h>
 #include <kernel.h>
 #include <linux/fs.h>
+#include <stdlib.h>
 #include <sys/uio.h>
+#include <thread.h>
 #include <timer.h>
 
+/*
+ * Each block device caches a configurable number of device pages. Buffers
+ * are recycled in least recently used order. Dirty buffers are written back
+ * when evicted, when the device is closed, or by a write-back thread shared
+ * by all block devices once they have been dirty for writeback_delay.
+ *
+ * Transfers of whole pages which are not cached bypass the cache. Small
+ * sequential reads double the read-ahead window on each sequential access up
+ * to ra_max_ pages.
+ *
+ * Caches are expected to be small so buffers are found by linear search.
+ *
+ * Device transfers are queued as requests which are kept in offset order.
+ * Adjacent requests in the same direction are merged into a single driver
+ * transfer. A request which overlaps a queued request, where either is a
+ * write, starts a new batch and requests are never reordered across batches.
+ * Within a batch requests are dispatched in ascending offset order starting
+ * from the end of the previous dispatch, unless a request has passed its
+ * deadline in which case it is dispatched first.
+ *
+ * There is no dispatch thread. A thread waiting for a request runs the queue
+ * if no other thread is doing so. The device mutex is released while the
+ * driver runs so that other threads can use the cache and queue requests in
+ * the meantime. Buffers with a transfer in progress are marked busy.
+ */
+
 namespace {
 
+constexpr auto invalid_off = std::numeric_limits<off_t>::max();
+constexpr uint_fast64_t writeback_delay = 1000000000;	/* nanoseconds */
+constexpr size_t max_iov = 16;		/* maximum pages per cache transfer */
+constexpr size_t max_merge = 256 * 1024;	/* maximum merged request */
+constexpr uint_fast64_t read_expire = 500000000;	/* nanoseconds */
+constexpr uint_fast64_t write_expire = 5000000000;	/* nanoseconds */
+
+a::mutex wb_mutex;			/* protects write-back state */
+a::condition_variable wb_cond;
+list wb_queue = LIST_INIT(wb_queue);	/* devices in deadline order */
+block::device *wb_active;		/* device being written back */
+thread *wb_thread;
+
+/*
+ * copy_iov - copy between iov and buffer, advancing iov
+ */
+void
+copy_iov(const iovec *&iov, size_t &iov_off, std::byte *buf, size_t len,
+    bool write)
+{
+	while (len) {
+		std::byte *p = static_cast<std::byte *>(iov->iov_base) + iov_off;
+		const auto cp = std::min(len, iov->iov_len - iov_off);
+		if (write)
+			memcpy(buf, p, cp);
+		else
+			memcpy(p, buf, cp);
+		buf += cp;
+		len -= cp;
+		iov_off += cp;
+		if (iov_off == iov->iov_len) {
+			++iov;
+			iov_off = 0;
+		}
+	}
+}
+
+/*
+ * count_iov - count iovs spanned by len bytes starting at iov_off
+ */
+size_t
+count_iov(const iovec *iov, size_t iov_off, size_t len)
+{
+	size_t n = 0;
+	for (; len; ++iov, ++n) {
+		len -= std::min(len, iov->iov_len - iov_off);
+		iov_off = 0;
+	}
+	return n;
+}
+
+/*
+ * append_iov - append iovs describing len bytes starting at iov_off
+ */
+iovec *
+append_iov(iovec *dst, const iovec *iov, size_t iov_off, size_t len)
+{
+	for (; len; ++iov, ++dst) {
+		const auto l = std::min(len, iov->iov_len - iov_off);
+		*dst = {static_cast<std::byte *>(iov->iov_base) + iov_off, l};
+		len -= l;
+		iov_off = 0;
+	}
+	return dst;
+}
+
+/*
+ * overlap - test if two device ranges overlap
+ */
+bool
+overlap(off_t a, size_t alen, off_t b, size_t blen)
+{
+	return a < b + (off_t)blen && b < a + (off_t)alen;
+}
+
 int
 block_open(file *f)
 {
@@ -58,12 +161,23 @@ namespace block {
 /*
  * device::device - block device constructor
  */
-device::device(::device *dev, off_t size)
+device::device(::device *dev, off_t size, size_t cache_pages)
 : dev_{dev}
 , nopens_{0}
 , size_{size}
-, buf_{0, {0, nullptr}}
+, cache_pages_{std::max<size_t>(cache_pages, 2)}
+, cache_{0, {0, nullptr}}
+, bufs_{nullptr}
+, ndirty_{0}
+, ra_next_{invalid_off}
+, ra_pages_{1}
+, ra_max_{std::min(cache_pages_ / 2, max_iov)}
+, wb_deadline_{0}
+, rq_batch_{0}
+, rq_pos_{0}
+, dispatching_{false}
 {
+	list_init(&rq_);
 	device_attach(dev_, &block_io, DF_BLK, this);
 }
 
@@ -84,42 +198,82 @@ device::~device()
 }
 
 /*
- * device::open - open block device and allocate block buffer
+ * device::open - open block device and allocate block cache
  */
 int
 device::open()
 {
 	std::lock_guard l{mutex_};
 
-	if (nopens_++)
+	if (nopens_) {
+		++nopens_;
 		return 0;
-	std::unique_ptr<phys> buf{page_alloc(PAGE_SIZE, MA_NORMAL | MA_DMA, this),
-	    {PAGE_SIZE, this}};
-	if (!buf)
+	}
+
+	/* write-back thread is started on first use */
+	{
+		std::lock_guard wl{wb_mutex};
+		if (!wb_thread && !(wb_thread = kthread_create(&writeback_thread,
+		    nullptr, PRI_KERN_LOW, "blkwb", MA_NORMAL)))
+			return DERR(-ENOMEM);
+	}
+
+	const size_t len = cache_pages_ * PAGE_SIZE;
+	std::unique_ptr<phys> cache{page_alloc(len, MA_NORMAL | MA_DMA, this),
+	    {len, this}};
+	if (!cache)
 		return DERR(-ENOMEM);
-	if (auto r = v_open(); r < 0)
+	buffer *bufs = static_cast<buffer *>(malloc(cache_pages_ * sizeof *bufs));
+	if (!bufs)
+		return DERR(-ENOMEM);
+	if (auto r = v_open(); r < 0) {
+		free(bufs);
 		return r;
-	buf_ = std::move(buf);
-	off_ = std::numeric_limits<off_t>::max();
-	dirty_ = false;
+	}
+	cache_ = std::move(cache);
+	bufs_ = bufs;
+	list_init(&lru_);
+	for (size_t i = 0; i < cache_pages_; ++i) {
+		bufs_[i].off = invalid_off;
+		bufs_[i].dirty = false;
+		bufs_[i].busy = false;
+		list_insert(list_last(&lru_), &bufs_[i].lru);
+	}
+	ndirty_ = 0;
+	ra_next_ = invalid_off;
+	ra_pages_ = 1;
+	++nopens_;
 	return 0;
 }
 
 /*
- * device::close - close block device and free block buffer
+ * device::close - close block device and free block cache
  */
 int
 device::close()
 {
-	std::lock_guard l{mutex_};
+	std::unique_lock l{mutex_};
 
 	assert(nopens_ > 0);
 
 	if (--nopens_)
 		return 0;
-	sync();
-	buf_.reset();
-	return v_close();
+	if (auto r = sync(l); r < 0)
+		dbg("%s: write-back failed %d\n", dev_->name, r);
+	drain(l);
+	dequeue_writeback();
+	cache_.reset();
+	free(bufs_);
+	bufs_ = nullptr;
+	ndirty_ = 0;
+	const auto r = v_close();
+	l.unlock();
+
+	/* wait for write-back thread to finish with this device */
+	std::unique_lock wl{wb_mutex};
+	wb_cond.wait(wl, [&]{ return wb_active != this; });
+
+	return r;
 }
 
 /*
@@ -146,7 +300,7 @@ device::write(const iovec *iov, size_t count, off_t off)
 int
 device::ioctl(unsigned long cmd, void *arg)
 {
-	std::lock_guard l{mutex_};
+	std::unique_lock l{mutex_};
 
 	assert(nopens_ > 0);
 
@@ -163,19 +317,30 @@ device::ioctl(unsigned long cmd, void *arg)
 		return true;
 	};
 
+	/* wait for device to go idle with range evicted from cache */
+	auto quiesce = [&]{
+		do {
+			drain(l);
+			invalidate(l, arg64[0], arg64[1]);
+		} while (dispatching_ || !list_empty(&rq_));
+	};
+
 	switch (cmd) {
 	case BLKDISCARD:
 	case BLKSECDISCARD:
 		/* discard data, no read guarantees */
 		if (!valid_range())
 			return DERR(-EINVAL);
+		quiesce();
 		return v_discard(arg64[0], arg64[1], cmd == BLKSECDISCARD);
 	case BLKZEROOUT: {
 		/* discard data, guarantee read will return zeros */
 		if (!valid_range())
 			return DERR(-EINVAL);
+		quiesce();
 		if (auto r = v_zeroout(arg64[0], arg64[1]); r != -ENOTSUP)
 			return r;
+		l.unlock();
 
 		/* device doesn't support zeroing, allocate a page of zeros */
 		std::unique_ptr<phys> p{page_alloc(PAGE_SIZE, MA_NORMAL | MA_DMA, this),
@@ -220,6 +385,24 @@ device::ioctl(unsigned long cmd, void *arg)
 			return -EINVAL;
 		*arg64 = size_;
 		return 0;
+	case BLKFLSBUF:
+		/* write back and invalidate block cache */
+		if (auto r = sync(l); r < 0)
+			return r;
+		invalidate(l, 0, size_);
+		return 0;
+	case BLKRAGET:
+		/* get maximum read-ahead in 512 byte sectors */
+		if (!ALIGNED(arg, long))
+			return -EINVAL;
+		*static_cast<long *>(arg) = ra_max_ * PAGE_SIZE / 512;
+		return 0;
+	case BLKRASET:
+		/* set maximum read-ahead in 512 byte sectors */
+		ra_max_ = std::clamp<size_t>(
+		    reinterpret_cast<uintptr_t>(arg) * 512 / PAGE_SIZE, 1,
+		    std::min(cache_pages_ / 2, max_iov));
+		return 0;
 	}
 
 	return v_ioctl(cmd, arg);
@@ -228,10 +411,10 @@ device::ioctl(unsigned long cmd, void *arg)
 /*
  * device::transfer - transfer data to/from block device
  */
-int
+ssize_t
 device::transfer(const iovec *iov, size_t count, off_t off, bool write)
 {
-	std::lock_guard l{mutex_};
+	std::unique_lock l{mutex_};
 
 	assert(nopens_ > 0);
 
@@ -248,110 +431,570 @@ device::transfer(const iovec *iov, size_t count, off_t off, bool write)
 		return l;
 	}());
 
-	std::byte *buf = static_cast<std::byte *>(phys_to_virt(buf_.get()));
+	/* grow read-ahead window on sequential reads */
+	if (!write) {
+		ra_pages_ = off == ra_next_ ? std::min(ra_pages_ * 2, ra_max_) : 1;
+		ra_next_ = off + len;
+	}
+
 	size_t iov_off = 0;
 	size_t t = 0;
+	while (t < len) {
+		const off_t pos = off + t;
+		const off_t page = PAGE_TRUNC(pos);
+		const size_t align = pos - page;
+		buffer *b = lookup(page);
+
+		/* wait for transfer in progress */
+		if (b && b->busy) {
+			cond_.wait(l);
+			continue;
+		}
 
-	/* clean write buffer if reading */
-	if (!write)
-		sync();
-
-	/* align start of transfer to page boundary */
-	if (const size_t align = off & PAGE_MASK; align) {
-		if (auto r = fill(off); r < 0)
-			return r;
-		const auto fix = std::min(PAGE_SIZE - align, len);
-		while (t < fix) {
-			auto cp = std::min(fix - t, iov->iov_len);
-			auto bufloc = buf + align + t;
+		/* transfer uncached whole pages directly */
+		if (!align && len - t >= PAGE_SIZE && (write || !b)) {
+			const size_t max = PAGE_TRUNC(len - t);
+			size_t n = PAGE_SIZE;
 			if (write) {
-				memcpy(bufloc, iov->iov_base, cp);
-				dirty_ = true;
-			} else memcpy(iov->iov_base, bufloc, cp);
-			t += cp;
-			if (cp >= iov->iov_len)
+				n = max;
+				invalidate(l, pos, n);
+			} else while (n < max && !lookup(pos + n))
+				n += PAGE_SIZE;
+			request rq{
+				.iov = iov,
+				.iov_off = iov_off,
+				.len = n,
+				.off = pos,
+				.write = write,
+			};
+			auto r = io(l, rq);
+			if (r <= 0)
+				return r < 0 ? r : DERR(-EIO);
+			assert(!(r & PAGE_MASK));
+			t += r;
+			iov_off += r;
+			while (t < len && iov_off >= iov->iov_len) {
+				iov_off -= iov->iov_len;
 				++iov;
-			else
-				iov_off = cp;
+			}
+			continue;
+		}
+
+		/* transfer partial or cached page through cache */
+		if (!b) {
+			const auto r = fill(l, page, write ? 1 : ra_pages_, &b);
+			if (r == -EAGAIN)
+				continue;
+			if (r < 0)
+				return r;
+		} else {
+			list_remove(&b->lru);
+			list_insert(&lru_, &b->lru);
 		}
+		const size_t cp = std::min<size_t>(PAGE_SIZE - align, len - t);
+		copy_iov(iov, iov_off, data(b) + align, cp, write);
+		if (write)
+			mark_dirty(b);
+		t += cp;
 	}
 
-	/* transfer whole pages directly from block device */
-	while (len - t >= PAGE_SIZE) {
-		auto r = write
-		    ? v_write(iov, iov_off, PAGE_TRUNC(len - t), off + t)
-		    : v_read(iov, iov_off, PAGE_TRUNC(len - t), off + t);
-		if (r < 0)
-			return r;
-		assert(!(r & PAGE_MASK));
-		t += r;
-		iov_off += r;
-		while (iov_off >= iov->iov_len) {
-			iov_off -= iov->iov_len;
-			++iov;
+	return t;
+}
+
+/*
+ * device::data - get data for cache buffer
+ */
+std::byte *
+device::data(const buffer *b) const
+{
+	return static_cast<std::byte *>(phys_to_virt(cache_.get())) +
+	    (b - bufs_) * PAGE_SIZE;
+}
+
+/*
+ * device::lookup - find cache buffer for page at 'off'
+ */
+device::buffer *
+device::lookup(off_t off) const
+{
+	for (size_t i = 0; i < cache_pages_; ++i) {
+		if (bufs_[i].off == off)
+			return &bufs_[i];
+	}
+	return nullptr;
+}
+
+/*
+ * device::fill - read pages into cache
+ *
+ * Reads up to 'n' pages starting at 'off', stopping early at the end of the
+ * device or at a page which is already cached. The page at 'off' must not be
+ * cached. On success the buffer for 'off' is returned in 'bp'.
+ *
+ * Returns -EAGAIN if the cache changed while waiting for a clean buffer, in
+ * which case the caller must look up the page again.
+ */
+int
+device::fill(std::unique_lock<a::mutex> &l, off_t off, size_t n, buffer **bp)
+{
+	mutex_.assert_locked();
+
+	iovec iov[max_iov];
+	list *v = list_last(&lru_);
+	buffer *b = nullptr;
+	size_t i = 0;
+
+	/* claim clean buffers from the least recently used end of the cache */
+	n = std::min(n, max_iov);
+	for (; i < n; ++i) {
+		const off_t o = off + i * PAGE_SIZE;
+		if (o >= size_ || (i && lookup(o)))
+			break;
+		for (b = nullptr; !list_end(&lru_, v); v = list_prev(v)) {
+			if (!list_entry(v, buffer, lru)->busy) {
+				b = list_entry(v, buffer, lru);
+				break;
+			}
 		}
+		if (!b || b->dirty)
+			break;
+		v = list_prev(v);
+		b->off = o;
+		b->busy = true;
+		iov[i] = {data(b), PAGE_SIZE};
 	}
 
-	/* final partial page */
-	if (t < len) {
-		if (auto r = fill(off + t); r < 0)
-			return r;
-		while (t < len) {
-			std::byte *p = static_cast<std::byte *>(iov->iov_base);
-			auto cp = std::min(len - t, iov->iov_len - iov_off);
-			auto bufloc = buf + ((off + t) & PAGE_MASK);
-			if (write) {
-				memcpy(bufloc, p + iov_off, cp);
-				dirty_ = true;
-			} else memcpy(p + iov_off, bufloc, cp);
-			t += cp;
-			++iov;
-			iov_off = 0;
+	if (!i) {
+		/* every buffer is busy */
+		if (!b) {
+			cond_.wait(l);
+			return -EAGAIN;
 		}
+		/* least recently used buffer must be written back first */
+		if (auto r = write_back(l, b); r < 0)
+			return r;
+		return -EAGAIN;
 	}
 
-	return t;
+	request rq{
+		.iov = iov,
+		.len = i * PAGE_SIZE,
+		.off = off,
+		.write = false,
+		.done = &device::fill_done,
+	};
+	if (const auto r = io(l, rq); r <= 0)
+		return r < 0 ? r : DERR(-EIO);
+
+	/* buffer may have been recycled while the mutex was released */
+	if (!(b = lookup(off)) || b->busy)
+		return -EAGAIN;
+
+	*bp = b;
+	return 0;
+}
+
+/*
+ * device::fill_done - cache fill completed
+ */
+void
+device::fill_done(request &rq)
+{
+	const size_t valid = rq.result > 0 ? rq.result / PAGE_SIZE : 0;
+
+	/* pages which could not be read are returned as least recently used,
+	 * read-ahead pages are used less recently than the requested page */
+	for (size_t j = rq.len / PAGE_SIZE; j-- > 0;) {
+		buffer *b = lookup(rq.off + j * PAGE_SIZE);
+		assert(b && b->busy);
+		b->busy = false;
+		list_remove(&b->lru);
+		if (j < valid)
+			list_insert(&lru_, &b->lru);
+		else {
+			b->off = invalid_off;
+			list_insert(list_last(&lru_), &b->lru);
+		}
+	}
 }
 
 /*
- * device::fill - fill block buffer
+ * device::write_back - write back dirty buffer
  *
- * 'off' is aligned to the nearest page boundary.
+ * Following dirty pages are combined into a single transfer.
  */
 int
-device::fill(off_t off)
+device::write_back(std::unique_lock<a::mutex> &l, buffer *first)
 {
 	mutex_.assert_locked();
+	assert(first->dirty && !first->busy);
+
+	iovec iov[max_iov];
+	size_t n = 0;
+	for (buffer *b = first; b && b->dirty && !b->busy && n < max_iov;
+	    b = lookup(b->off + PAGE_SIZE)) {
+		b->busy = true;
+		iov[n++] = {data(b), PAGE_SIZE};
+	}
 
-	off &= ~PAGE_MASK;
-	if (off_ == off)
-		return 0;
-	if (auto r = sync(); r < 0)
-		return r;
-	iovec iov{phys_to_virt(buf_.get()), PAGE_SIZE};
-	if (auto r = v_read(&iov, 0, PAGE_SIZE, off); r != PAGE_SIZE) {
-		off_ = std::numeric_limits<off_t>::max();
+	request rq{
+		.iov = iov,
+		.len = n * PAGE_SIZE,
+		.off = first->off,
+		.write = true,
+		.done = &device::write_back_done,
+	};
+	if (const auto r = io(l, rq); r != (ssize_t)rq.len)
 		return r < 0 ? r : DERR(-EIO);
-	}
-	off_ = off;
 	return 0;
 }
 
 /*
- * device::sync - synchronise block buffer with device
+ * device::write_back_done - write back completed
+ */
+void
+device::write_back_done(request &rq)
+{
+	const size_t written = rq.result > 0 ? rq.result : 0;
+
+	for (size_t i = 0; i < rq.len; i += PAGE_SIZE) {
+		buffer *b = lookup(rq.off + i);
+		assert(b && b->busy);
+		b->busy = false;
+		if (i + PAGE_SIZE <= written)
+			mark_clean(b);
+	}
+}
+
+/*
+ * device::mark_dirty - mark buffer as requiring write-back
+ */
+void
+device::mark_dirty(buffer *b)
+{
+	if (b->dirty)
+		return;
+	b->dirty = true;
+	if (!ndirty_++)
+		queue_writeback();
+}
+
+/*
+ * device::mark_clean - mark buffer as synchronised with device
+ */
+void
+device::mark_clean(buffer *b)
+{
+	if (!b->dirty)
+		return;
+	b->dirty = false;
+	--ndirty_;
+}
+
+/*
+ * device::invalidate - discard cached pages in range
+ *
+ * Dirty pages are discarded without write-back. Waits for transfers in
+ * progress on pages in range to complete.
+ */
+void
+device::invalidate(std::unique_lock<a::mutex> &l, off_t off, uint64_t len)
+{
+	mutex_.assert_locked();
+
+	auto in_range = [&](const buffer *b) {
+		return b->off != invalid_off && b->off >= off &&
+		    (uint64_t)(b->off - off) < len;
+	};
+	cond_.wait(l, [&]{
+		for (size_t i = 0; i < cache_pages_; ++i) {
+			if (bufs_[i].busy && in_range(&bufs_[i]))
+				return false;
+		}
+		return true;
+	});
+
+	for (size_t i = 0; i < cache_pages_; ++i) {
+		buffer *b = &bufs_[i];
+		if (!in_range(b))
+			continue;
+		mark_clean(b);
+		b->off = invalid_off;
+		list_remove(&b->lru);
+		list_insert(list_last(&lru_), &b->lru);
+	}
+	if (!ndirty_)
+		dequeue_writeback();
+}
+
+/*
+ * device::sync - write back all dirty buffers
+ *
+ * Dirty buffers are written in device order with adjacent pages combined
+ * into a single transfer.
  */
 int
-device::sync()
+device::sync(std::unique_lock<a::mutex> &l)
 {
 	mutex_.assert_locked();
 
-	if (!dirty_)
-		return 0;
-	iovec iov{phys_to_virt(buf_.get()), PAGE_SIZE};
-	if (auto r = v_write(&iov, 0, PAGE_SIZE, off_); r != PAGE_SIZE)
-		return r < 0 ? r : DERR(-EIO);
-	dirty_ = false;
-	return 0;
+	int ret = 0;
+	while (ndirty_) {
+		/* find first dirty buffer which is not being written back */
+		buffer *first = nullptr;
+		for (size_t i = 0; i < cache_pages_; ++i) {
+			buffer *b = &bufs_[i];
+			if (b->dirty && !b->busy && (!first || b->off < first->off))
+				first = b;
+		}
+		if (!first) {
+			cond_.wait(l);
+			continue;
+		}
+
+		if ((ret = write_back(l, first)) < 0)
+			break;
+	}
+
+	/* retry failed write-back later */
+	if (ndirty_)
+		queue_writeback();
+	else
+		dequeue_writeback();
+
+	return ret;
+}
+
+/*
+ * device::queue_writeback - queue device for background write-back
+ */
+void
+device::queue_writeback()
+{
+	std::lock_guard l{wb_mutex};
+
+	if (wb_deadline_)
+		return;
+	wb_deadline_ = timer_monotonic() + writeback_delay;
+	if (list_empty(&wb_queue))
+		wb_cond.notify_all();
+	list_insert(list_last(&wb_queue), &wb_link_);
+}
+
+/*
+ * device::dequeue_writeback - remove device from write-back queue
+ */
+void
+device::dequeue_writeback()
+{
+	std::lock_guard l{wb_mutex};
+
+	if (!wb_deadline_)
+		return;
+	list_remove(&wb_link_);
+	wb_deadline_ = 0;
+}
+
+/*
+ * device::io - run request and wait for completion
+ */
+ssize_t
+device::io(std::unique_lock<a::mutex> &l, request &rq)
+{
+	submit(rq);
+	while (!rq.complete) {
+		if (dispatching_)
+			cond_.wait(l);
+		else
+			dispatch(l);
+	}
+	return rq.result;
+}
+
+/*
+ * device::submit - add request to request queue
+ */
+void
+device::submit(request &rq)
+{
+	mutex_.assert_locked();
+	assert(rq.len && !(rq.len & PAGE_MASK) && !(rq.off & PAGE_MASK));
+
+	rq.niov = count_iov(rq.iov, rq.iov_off, rq.len);
+	rq.deadline = timer_monotonic() +
+	    (rq.write ? write_expire : read_expire);
+	rq.result = 0;
+	rq.complete = false;
+
+	/* a request which conflicts with the current batch starts a new one */
+	request *q;
+	list_for_each_entry(q, &rq_, link) {
+		if (q->batch != rq_batch_ || !(q->write || rq.write))
+			continue;
+		if (overlap(q->off, q->len, rq.off, rq.len)) {
+			++rq_batch_;
+			break;
+		}
+	}
+	rq.batch = rq_batch_;
+
+	/* new requests are always in the last batch, insert in offset order */
+	list *prev = list_last(&rq_);
+	for (; !list_end(&rq_, prev); prev = list_prev(prev)) {
+		q = list_entry(prev, request, link);
+		if (q->batch != rq.batch || q->off <= rq.off)
+			break;
+	}
+	list_insert(prev, &rq.link);
+}
+
+/*
+ * device::dispatch - run next request from request queue
+ *
+ * Must be called with no other dispatch in progress. Releases the device
+ * mutex while the driver runs.
+ */
+void
+device::dispatch(std::unique_lock<a::mutex> &l)
+{
+	mutex_.assert_locked();
+	assert(!dispatching_ && !list_empty(&rq_));
+
+	/* choose expired request or next request in ascending order */
+	request *head = list_entry(list_first(&rq_), request, link);
+	request *next = nullptr, *expired = nullptr, *q;
+	const auto now = timer_monotonic();
+	list_for_each_entry(q, &rq_, link) {
+		if (q->batch != head->batch)
+			break;
+		if (q->deadline <= now &&
+		    (!expired || q->deadline < expired->deadline))
+			expired = q;
+		if (!next && q->off >= rq_pos_)
+			next = q;
+	}
+	request *first = expired ?: next ?: head;
+	request *last = first;
+
+	/* merge adjacent requests */
+	size_t len = first->len;
+	size_t niov = first->niov;
+	auto mergeable = [&](list *node, bool back) {
+		if (list_end(&rq_, node))
+			return false;
+		const request *m = list_entry(node, request, link);
+		return m->batch == first->batch &&
+		    m->write == first->write &&
+		    (back ? m->off + (off_t)m->len == first->off
+			  : m->off == last->off + (off_t)last->len) &&
+		    len + m->len <= max_merge &&
+		    niov + m->niov <= std::size(rq_iov_);
+	};
+	while (mergeable(list_prev(&first->link), true)) {
+		first = list_entry(list_prev(&first->link), request, link);
+		len += first->len;
+		niov += first->niov;
+	}
+	while (mergeable(list_next(&last->link), false)) {
+		last = list_entry(list_next(&last->link), request, link);
+		len += last->len;
+		niov += last->niov;
+	}
+
+	/* move requests to dispatch list, merged requests use rq_iov_ */
+	list run;
+	list_init(&run);
+	iovec *dst = rq_iov_;
+	for (request *r = first;;) {
+		list *const n = list_next(&r->link);
+		if (first != last)
+			dst = append_iov(dst, r->iov, r->iov_off, r->len);
+		list_remove(&r->link);
+		list_insert(list_last(&run), &r->link);
+		if (r == last)
+			break;
+		r = list_entry(n, request, link);
+	}
+	const iovec *iov = first != last ? rq_iov_ : first->iov;
+	const size_t iov_off = first != last ? 0 : first->iov_off;
+	const off_t off = first->off;
+	const bool write = first->write;
+
+	dispatching_ = true;
+	rq_pos_ = off + len;
+	l.unlock();
+	const auto r = write
+	    ? v_write(iov, iov_off, len, off)
+	    : v_read(iov, iov_off, len, off);
+	l.lock();
+	dispatching_ = false;
+
+	/* complete requests in device order */
+	size_t pos = 0;
+	while (!list_empty(&run)) {
+		q = list_entry(list_first(&run), request, link);
+		list_remove(&q->link);
+		q->result = r < 0 ? r
+		    : std::clamp<ssize_t>(r - pos, 0, q->len);
+		pos += q->len;
+		if (q->done)
+			(this->*q->done)(*q);
+		q->complete = true;
+	}
+	cond_.notify_all();
+}
+
+/*
+ * device::drain - wait for request queue to empty
+ */
+void
+device::drain(std::unique_lock<a::mutex> &l)
+{
+	while (dispatching_ || !list_empty(&rq_)) {
+		if (dispatching_)
+			cond_.wait(l);
+		else
+			dispatch(l);
+	}
+}
+
+/*
+ * device::writeback_thread - write back devices as their deadlines expire
+ *
+ * Devices are queued with a fixed delay so the queue is in deadline order.
+ */
+void
+device::writeback_thread(void *)
+{
+	std::unique_lock l{wb_mutex};
+
+	while (true) {
+		if (list_empty(&wb_queue)) {
+			wb_cond.wait(l);
+			continue;
+		}
+
+		device *d = list_entry(list_first(&wb_queue), device, wb_link_);
+		if (const auto now = timer_monotonic(); d->wb_deadline_ > now) {
+			wb_cond.wait_for(l, d->wb_deadline_ - now);
+			continue;
+		}
+		list_remove(&d->wb_link_);
+		d->wb_deadline_ = 0;
+		wb_active = d;
+		l.unlock();
+
+		{
+			std::unique_lock dl{d->mutex_};
+			if (auto r = d->sync(dl); r < 0)
+				dbg("%s: write-back failed %d\n",
+				    d->dev_->name, r);
+		}
+
+		l.lock();
+		wb_active = nullptr;
+		wb_cond.notify_all();
+	}
 }
 
 }
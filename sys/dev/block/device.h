@@ -5,18 +5,19 @@
  * Generic Block Device
  */
 
+#include <list.h>
 #include <memory>
 #include <page.h>
 #include <sync.h>
+#include <sys/uio.h>
 
 struct device;
-struct iovec;
 
 namespace block {
 
 class device {
 public:
-	device(::device *, off_t size);
+	device(::device *, off_t size, size_t cache_pages = 8);
 	virtual ~device();
 
 	int open();
@@ -35,17 +36,74 @@ private:
 	virtual int v_discard(off_t, uint64_t, bool secure) = 0;
 	virtual bool v_discard_sets_to_zero() = 0;
 
+	/*
+	 * Cached device page
+	 */
+	struct buffer {
+		list lru;		/* link on lru_, most recently used first */
+		off_t off;		/* device offset, invalid_off if unused */
+		bool dirty;		/* buffer must be written back */
+		bool busy;		/* device transfer in progress */
+	};
+
+	/*
+	 * Device transfer request
+	 */
+	struct request {
+		list link;		/* link on rq_ */
+		const iovec *iov;	/* data */
+		size_t iov_off;		/* offset into first iov */
+		size_t niov;		/* number of iovs spanned */
+		size_t len;		/* transfer length */
+		off_t off;		/* device offset */
+		bool write;		/* transfer direction */
+		unsigned batch;		/* never reordered across batches */
+		uint_fast64_t deadline;	/* dispatch deadline */
+		void (device::*done)(request &);  /* completion callback */
+		ssize_t result;		/* bytes transferred or error */
+		bool complete;		/* request has completed */
+	};
+
 	ssize_t transfer(const iovec *, size_t, off_t, bool);
-	int fill(off_t);
-	int sync();
+	std::byte *data(const buffer *) const;
+	buffer *lookup(off_t) const;
+	int fill(std::unique_lock<a::mutex> &, off_t, size_t, buffer **);
+	void fill_done(request &);
+	int write_back(std::unique_lock<a::mutex> &, buffer *);
+	void write_back_done(request &);
+	void mark_dirty(buffer *);
+	void mark_clean(buffer *);
+	void invalidate(std::unique_lock<a::mutex> &, off_t, uint64_t);
+	int sync(std::unique_lock<a::mutex> &);
+	void queue_writeback();
+	void dequeue_writeback();
+	ssize_t io(std::unique_lock<a::mutex> &, request &);
+	void submit(request &);
+	void dispatch(std::unique_lock<a::mutex> &);
+	void drain(std::unique_lock<a::mutex> &);
+
+	static void writeback_thread(void *);
 
 	a::mutex mutex_;
+	a::condition_variable cond_;	/* buffer or request state changed */
 	::device *dev_;
 	size_t nopens_;
 	off_t size_;
-	std::unique_ptr<phys> buf_;
-	off_t off_;
-	bool dirty_;
+	const size_t cache_pages_;	/* number of pages in cache */
+	std::unique_ptr<phys> cache_;	/* cache memory */
+	buffer *bufs_;			/* buffer for each cache page */
+	list lru_;			/* buffers in lru order */
+	size_t ndirty_;			/* number of dirty buffers */
+	off_t ra_next_;			/* offset expected for sequential read */
+	size_t ra_pages_;		/* current read-ahead window */
+	size_t ra_max_;			/* maximum read-ahead window */
+	list wb_link_;			/* link on write-back queue */
+	uint_fast64_t wb_deadline_;	/* write-back deadline, 0 if clean */
+	list rq_;			/* queued requests in (batch, off) order */
+	unsigned rq_batch_;		/* batch for new requests */
+	off_t rq_pos_;			/* end of last dispatched request */
+	bool dispatching_;		/* a thread is running a request */
+	iovec rq_iov_[32];		/* iovs for merged requests */
 };
 
 }
@@ -0,0 +1,5 @@
+#
+# RAM Block Device
+#
+SOURCES += \
+    dev/block/ram/ram.cpp
@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * RAM Block Device
+ *
+ * Block device backed by kernel memory. Transfers can be slowed down to
+ * emulate slower storage: each transfer costs latency_us plus its length at
+ * bandwidth bytes per second. Rewriting an erase block which has been written
+ * since it was last discarded costs a read-modify-write of the whole block.
+ *
+ * For example:
+ *  driver sys/dev/block/ram{.name = "ram0", .size = 0x100000, .latency_us = 100, .bandwidth = 10000000, .erase_size = 0x10000}
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct block_ram_desc {
+	const char *name;
+	unsigned long size;		/* bytes, multiple of PAGE_SIZE */
+	unsigned long latency_us;	/* per transfer, 0 for none */
+	unsigned long bandwidth;	/* bytes per second, 0 for unlimited */
+	unsigned long erase_size;	/* bytes, 0 for PAGE_SIZE */
+};
+
+void block_ram_init(const struct block_ram_desc *);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -0,0 +1,228 @@
+#include "init.h"
+
+#include "ram.h"
+#include <algorithm>
+#include <cstring>
+#include <debug.h>
+#include <device.h>
+#include <errno.h>
+#include <kernel.h>
+#include <linux/fs.h>
+#include <timer.h>
+
+/*
+ * Emulated timing is tracked as the time at which the device becomes idle.
+ * timer_delay rounds up to the next clock tick so a transfer usually ends
+ * late; up to max_credit of that overrun is credited to following transfers
+ * so that throughput stays close to the configured bandwidth.
+ */
+
+namespace {
+
+constexpr uint_fast64_t max_credit = 10000000;
+
+/*
+ * Page ownership identifier for RAM block devices
+ */
+char ram_id;
+
+}
+
+namespace block {
+
+/*
+ * ram::ram
+ */
+ram::ram(::device *d, std::unique_ptr<phys> mem, const block_ram_desc &desc)
+: device{d, static_cast<off_t>(desc.size)}
+, mem_{std::move(mem)}
+, size_{desc.size}
+, latency_{desc.latency_us * 1000ull}
+, bandwidth_{desc.bandwidth}
+, erase_size_{desc.erase_size ?: PAGE_SIZE}
+, programmed_{std::make_unique<bool[]>(div_ceil(size_, erase_size_))}
+, busy_{0}
+{ }
+
+/*
+ * ram::~ram
+ */
+ram::~ram()
+{ }
+
+/*
+ * ram::v_open
+ */
+int
+ram::v_open()
+{
+	return 0;
+}
+
+/*
+ * ram::v_close
+ */
+int
+ram::v_close()
+{
+	return 0;
+}
+
+/*
+ * ram::v_read
+ */
+ssize_t
+ram::v_read(const iovec *iov, size_t iov_off, size_t len, off_t off)
+{
+	delay(len);
+	return copy(iov, iov_off, len, off, false);
+}
+
+/*
+ * ram::v_write
+ *
+ * Writing to an erased block only programs the bytes written. Writing to a
+ * block which has already been programmed reads back and rewrites the whole
+ * erase block.
+ */
+ssize_t
+ram::v_write(const iovec *iov, size_t iov_off, size_t len, off_t off)
+{
+	uint_fast64_t cost = 0;
+	for (off_t o = off; o < static_cast<off_t>(off + len);) {
+		const size_t eb = o / erase_size_;
+		const off_t end = std::min<off_t>((eb + 1) * erase_size_,
+		    off + len);
+		cost += programmed_[eb] ? 2 * erase_size_ : end - o;
+		programmed_[eb] = true;
+		o = end;
+	}
+	delay(cost);
+	return copy(iov, iov_off, len, off, true);
+}
+
+/*
+ * ram::v_ioctl
+ */
+int
+ram::v_ioctl(unsigned long cmd, void *arg)
+{
+	switch (cmd) {
+	case BLKIOMIN:
+		/* get minimum efficient write size */
+		if (!ALIGNED(arg, unsigned))
+			return -EINVAL;
+		*static_cast<unsigned *>(arg) = erase_size_;
+		return 0;
+	}
+	return -ENOTSUP;
+}
+
+/*
+ * ram::v_zeroout
+ *
+ * Discarded data reads back as zeros so zeroing is a discard.
+ */
+int
+ram::v_zeroout(off_t off, uint64_t len)
+{
+	return v_discard(off, len, false);
+}
+
+/*
+ * ram::v_discard
+ *
+ * Erase blocks which are completely discarded become erased.
+ */
+int
+ram::v_discard(off_t off, uint64_t len, bool)
+{
+	const size_t first = div_ceil<size_t>(off, erase_size_);
+	const size_t last = (off + len) / erase_size_;
+	for (size_t eb = first; eb < last; ++eb)
+		programmed_[eb] = false;
+	if (off + len == size_ && first <= last &&
+	    last < div_ceil(size_, erase_size_))
+		programmed_[last] = false;
+	memset(static_cast<std::byte *>(phys_to_virt(mem_.get())) + off, 0,
+	    len);
+	delay(0);
+	return 0;
+}
+
+/*
+ * ram::v_discard_sets_to_zero
+ */
+bool
+ram::v_discard_sets_to_zero()
+{
+	return true;
+}
+
+/*
+ * ram::copy - copy between iovs and backing store
+ */
+ssize_t
+ram::copy(const iovec *iov, size_t iov_off, size_t len, off_t off, bool write)
+{
+	std::byte *mem = static_cast<std::byte *>(phys_to_virt(mem_.get())) +
+	    off;
+	for (size_t t = 0; t < len;) {
+		std::byte *p = static_cast<std::byte *>(iov->iov_base) + iov_off;
+		const auto cp = std::min(len - t, iov->iov_len - iov_off);
+		if (write)
+			memcpy(mem + t, p, cp);
+		else
+			memcpy(p, mem + t, cp);
+		t += cp;
+		++iov;
+		iov_off = 0;
+	}
+	return len;
+}
+
+/*
+ * ram::delay - emulate a transfer of len bytes
+ */
+void
+ram::delay(uint_fast64_t len)
+{
+	uint_fast64_t ns = latency_;
+	if (bandwidth_)
+		ns += len * 1000000000 / bandwidth_;
+	if (!ns)
+		return;
+	const auto now = timer_monotonic();
+	busy_ = std::max(busy_, now - std::min(now, max_credit)) + ns;
+	if (busy_ > now)
+		timer_delay(busy_ - now);
+}
+
+}
+
+/*
+ * block_ram_init
+ */
+void
+block_ram_init(const block_ram_desc *d)
+{
+	if (!d->size || d->size & PAGE_MASK) {
+		dbg("*** block ram: %s: bad size %lu\n", d->name, d->size);
+		return;
+	}
+
+	std::unique_ptr<phys> mem{page_alloc(d->size, MA_NORMAL, &ram_id),
+	    {d->size, &ram_id}};
+	if (!mem) {
+		dbg("*** block ram: %s: allocation failed\n", d->name);
+		return;
+	}
+	memset(phys_to_virt(mem.get()), 0, d->size);
+
+	::device *dev;
+	if (!(dev = device_reserve(d->name, false)))
+		return;
+
+	/* block device lives forever */
+	new block::ram(dev, std::move(mem), *d);
+}
@@ -0,0 +1,43 @@
+#ifndef dev_block_ram_ram_h
+#define dev_block_ram_ram_h
+
+/*
+ * RAM Block Device
+ */
+
+#include <dev/block/device.h>
+
+struct block_ram_desc;
+
+namespace block {
+
+class ram final : public device {
+public:
+	ram(::device *, std::unique_ptr<phys>, const block_ram_desc &);
+	~ram() override;
+
+private:
+	int v_open() override;
+	int v_close() override;
+	ssize_t v_read(const iovec *, size_t, size_t, off_t) override;
+	ssize_t v_write(const iovec *, size_t, size_t, off_t) override;
+	int v_ioctl(unsigned long, void *) override;
+	int v_zeroout(off_t, uint64_t) override;
+	int v_discard(off_t, uint64_t, bool secure) override;
+	bool v_discard_sets_to_zero() override;
+
+	ssize_t copy(const iovec *, size_t, size_t, off_t, bool);
+	void delay(uint_fast64_t);
+
+	const std::unique_ptr<phys> mem_;	/* backing store */
+	const size_t size_;			/* size of backing store */
+	const uint_fast64_t latency_;		/* per transfer latency (ns) */
+	const unsigned long bandwidth_;		/* bytes per second, 0 if unlimited */
+	const size_t erase_size_;		/* erase block size */
+	const std::unique_ptr<bool[]> programmed_;	/* erase block written since discard */
+	uint_fast64_t busy_;			/* emulated end of last transfer */
+};
+
+}
+
+#endif
@@ -0,0 +1,672 @@
+#include "init.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <debug.h>
+#include <dev/block/device.h>
+#include <device.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <kernel.h>
+#include <linux/fs.h>
+#include <mmap.h>
+#include <page.h>
+#include <sch.h>
+#include <sync.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <task.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Runs the block cache against a RAM backed block device. Random reads and
+ * writes of random length are checked against a shadow copy, then small
+ * sequential reads are used to check read-ahead and finally background
+ * write-back is checked by comparing the backing store with the shadow copy
+ * while the device is still open. Ioctls which return data through a pointer
+ * are checked to reject pointers outside of user memory.
+ *
+ * The request queue is checked by holding the first transfer in the driver
+ * while other threads queue page sized requests behind it. Once released the
+ * order of driver transfers must follow the elevator, merge adjacent
+ * requests in the same direction, keep overlapping requests in submission
+ * order and dispatch expired requests first. Several threads then run
+ * random reads and writes on separate parts of the device at the same time.
+ * These checks run before the single threaded checks above.
+ */
+
+namespace {
+
+constexpr unsigned cache_pages = 4;
+constexpr unsigned random_ops = 2000;
+constexpr size_t max_op = 3 * PAGE_SIZE;
+constexpr unsigned workers = 4;
+constexpr uint_fast64_t queue_delay = 20000000;	/* time to queue request */
+constexpr uint_fast64_t expire_delay = 600000000;	/* past read deadline */
+
+/*
+ * Page ownership identifier for block test
+ */
+char block_test_id;
+
+/*
+ * RAM backed block device which counts and logs device accesses
+ *
+ * While held the next transfer waits in the driver until released.
+ */
+class ramdev final : public block::device {
+public:
+	struct op {
+		off_t off;
+		size_t len;
+		bool write;
+	};
+
+	ramdev(::device *d, std::byte *mem, size_t size)
+	: block::device{d, static_cast<off_t>(size), cache_pages}
+	, mem_{mem}
+	, hold_{false}
+	, held_{false}
+	, nops_{0}
+	, reads{0}
+	, writes{0}
+	{ }
+
+	void
+	hold()
+	{
+		std::lock_guard l{gate_mutex_};
+		hold_ = true;
+		held_ = false;
+		nops_ = 0;
+	}
+
+	void
+	wait_held()
+	{
+		std::unique_lock l{gate_mutex_};
+		gate_cond_.wait(l, [&]{ return held_; });
+	}
+
+	void
+	release()
+	{
+		std::lock_guard l{gate_mutex_};
+		hold_ = false;
+		gate_cond_.notify_all();
+	}
+
+	const op *ops() const { return ops_; }
+	size_t nops() const { return nops_; }
+
+private:
+	int v_open() override { return 0; }
+	int v_close() override { return 0; }
+	int v_ioctl(unsigned long, void *) override { return -ENOTSUP; }
+	int v_zeroout(off_t, uint64_t) override { return -ENOTSUP; }
+	int v_discard(off_t, uint64_t, bool) override { return -ENOTSUP; }
+	bool v_discard_sets_to_zero() override { return false; }
+
+	ssize_t
+	v_read(const iovec *iov, size_t iov_off, size_t len, off_t off) override
+	{
+		++reads;
+		record(len, off, false);
+		return copy(iov, iov_off, len, off, false);
+	}
+
+	ssize_t
+	v_write(const iovec *iov, size_t iov_off, size_t len, off_t off) override
+	{
+		++writes;
+		record(len, off, true);
+		return copy(iov, iov_off, len, off, true);
+	}
+
+	void
+	record(size_t len, off_t off, bool write)
+	{
+		std::unique_lock l{gate_mutex_};
+		if (nops_ < std::size(ops_))
+			ops_[nops_++] = {off, len, write};
+		if (!hold_)
+			return;
+		held_ = true;
+		gate_cond_.notify_all();
+		gate_cond_.wait(l, [&]{ return !hold_; });
+	}
+
+	ssize_t
+	copy(const iovec *iov, size_t iov_off, size_t len, off_t off,
+	    bool write)
+	{
+		assert(!(len & PAGE_MASK) && !(off & PAGE_MASK));
+		for (size_t t = 0; t < len;) {
+			std::byte *p = static_cast<std::byte *>(iov->iov_base) +
+			    iov_off;
+			const auto cp = std::min(len - t, iov->iov_len - iov_off);
+			if (write)
+				memcpy(mem_ + off + t, p, cp);
+			else
+				memcpy(p, mem_ + off + t, cp);
+			t += cp;
+			++iov;
+			iov_off = 0;
+		}
+		return len;
+	}
+
+	std::byte *const mem_;
+	a::mutex gate_mutex_;
+	a::condition_variable gate_cond_;
+	bool hold_;			/* hold next transfer in driver */
+	bool held_;			/* a transfer is being held */
+	op ops_[16];			/* transfers since hold */
+	size_t nops_;
+
+public:
+	unsigned reads;
+	unsigned writes;
+};
+
+uint32_t
+test_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/*
+ * transfer - read or write a buffer split across two iovs
+ */
+ssize_t
+transfer(ramdev &d, std::byte *buf, size_t len, off_t off, bool write)
+{
+	const size_t split = len / 3;
+	iovec iov[2]{{buf, split}, {buf + split, len - split}};
+	return write ? d.write(iov, 2, off) : d.read(iov, 2, off);
+}
+
+/*
+ * check_ioctl - ioctls returning data must validate the user pointer
+ */
+bool
+check_ioctl()
+{
+	const int fd = kopen("/dev/blktest", O_RDONLY);
+	if (fd < 0) {
+		dbg("*** block test: open failed\n");
+		return false;
+	}
+
+	bool pass = true;
+	if (sc_ioctl(fd, BLKRAGET, &block_test_id) != -EFAULT) {
+		dbg("*** block test: BLKRAGET accepted bad pointer\n");
+		pass = false;
+	}
+
+	long *ra = static_cast<long *>(mmapfor(kern_task.as, NULL, PAGE_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0,
+	    MA_NORMAL));
+	if (ra > (long *)-4096UL) {
+		dbg("*** block test: allocation failed\n");
+		pass = false;
+	} else {
+		if (sc_ioctl(fd, BLKRAGET, ra) != 0 || *ra <= 0) {
+			dbg("*** block test: BLKRAGET failed\n");
+			pass = false;
+		}
+		munmapfor(kern_task.as, ra, PAGE_SIZE);
+	}
+
+	kclose(fd);
+	return pass;
+}
+
+/*
+ * Page sized transfer run on its own thread
+ */
+struct job {
+	ramdev *d;
+	std::byte *buf;
+	off_t off;
+	bool write;
+	uint_fast64_t delay;	/* time to wait after starting, 0 for default */
+	ssize_t result;
+};
+
+/*
+ * Random transfers within part of the device run on their own thread
+ */
+struct worker {
+	ramdev *d;
+	std::byte *shadow;
+	std::byte *buf;
+	off_t base;
+	size_t len;
+	uint32_t seed;
+	bool pass;
+};
+
+a::mutex done_mutex;
+a::condition_variable done_cond;
+unsigned ndone;			/* threads finished */
+
+constexpr off_t
+pg(unsigned n)
+{
+	return static_cast<off_t>(n) * PAGE_SIZE;
+}
+
+void
+fill_random(std::byte *buf, size_t len, uint32_t *seed)
+{
+	for (size_t i = 0; i < len; ++i)
+		buf[i] = static_cast<std::byte>(test_rand(seed));
+}
+
+void
+finish()
+{
+	std::lock_guard l{done_mutex};
+	++ndone;
+	done_cond.notify_all();
+}
+
+bool
+start(void (*fn)(void *), void *arg)
+{
+	return kthread_create(fn, arg, PRI_KERN_LOW, "block_test", MA_NORMAL);
+}
+
+void
+wait_done(unsigned n)
+{
+	std::unique_lock l{done_mutex};
+	done_cond.wait(l, [&]{ return ndone == n; });
+	ndone = 0;
+}
+
+void
+job_thread(void *arg)
+{
+	job *j = static_cast<job *>(arg);
+
+	j->result = transfer(*j->d, j->buf, PAGE_SIZE, j->off, j->write);
+	finish();
+
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+void
+worker_thread(void *arg)
+{
+	worker *w = static_cast<worker *>(arg);
+
+	w->pass = true;
+	for (unsigned i = 0; i < random_ops / workers && w->pass; ++i) {
+		const off_t off = w->base + test_rand(&w->seed) % w->len;
+		const size_t len = std::min<size_t>(
+		    1 + test_rand(&w->seed) % max_op, w->base + w->len - off);
+		const bool write = test_rand(&w->seed) & 1;
+		if (write) {
+			fill_random(w->buf, len, &w->seed);
+			memcpy(w->shadow + off, w->buf, len);
+		}
+		if (transfer(*w->d, w->buf, len, off, write) != (ssize_t)len) {
+			dbg("*** block test: concurrent transfer failed\n");
+			w->pass = false;
+		} else if (!write && memcmp(w->buf, w->shadow + off, len)) {
+			dbg("*** block test: concurrent bad data off %lld "
+			    "len %zu\n", (long long)off, len);
+			w->pass = false;
+		}
+	}
+	finish();
+
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+/*
+ * queue - run jobs while the first job is held in the driver
+ *
+ * Each job is started once the previous job has queued its request so the
+ * requests are submitted in array order.
+ */
+bool
+queue(ramdev &d, job *jobs, size_t n)
+{
+	size_t started = 0;
+
+	d.hold();
+	for (; started < n; ++started) {
+		if (!start(&job_thread, &jobs[started]))
+			break;
+		if (!started)
+			d.wait_held();
+		timer_delay(jobs[started].delay ?: queue_delay);
+	}
+	d.release();
+	wait_done(started);
+
+	if (started != n) {
+		dbg("*** block test: can't create thread\n");
+		return false;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (jobs[i].result != PAGE_SIZE) {
+			dbg("*** block test: queued transfer failed\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * check_order - check driver transfers since device was held
+ */
+bool
+check_order(const ramdev &d, const ramdev::op *expect, size_t n,
+    const char *test)
+{
+	bool pass = d.nops() == n;
+	for (size_t i = 0; pass && i < n; ++i) {
+		pass = d.ops()[i].off == expect[i].off &&
+		    d.ops()[i].len == expect[i].len &&
+		    d.ops()[i].write == expect[i].write;
+	}
+	if (pass)
+		return true;
+
+	dbg("*** block test: %s: bad transfer order\n", test);
+	for (size_t i = 0; i < d.nops(); ++i)
+		dbg("  %s off %lld len %zu\n", d.ops()[i].write ? "write" : "read",
+		    (long long)d.ops()[i].off, d.ops()[i].len);
+	return false;
+}
+
+/*
+ * check_reads - check data returned by queued reads
+ */
+bool
+check_reads(const job *jobs, size_t n, const std::byte *shadow,
+    const char *test)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (!jobs[i].write &&
+		    memcmp(jobs[i].buf, shadow + jobs[i].off, PAGE_SIZE)) {
+			dbg("*** block test: %s: bad data off %lld\n", test,
+			    (long long)jobs[i].off);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * check_device - check device contents
+ */
+bool
+check_device(const std::byte *mem, const std::byte *shadow, size_t size,
+    const char *test)
+{
+	if (memcmp(mem, shadow, size)) {
+		dbg("*** block test: %s: bad device contents\n", test);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * test_merge - requests are dispatched in ascending order from the end of
+ * the previous transfer and adjacent requests in the same direction merge
+ */
+bool
+test_merge(ramdev &d, std::byte *mem, std::byte *shadow, std::byte *bufs,
+    size_t size)
+{
+	uint32_t seed = 3;
+	job jobs[]{
+		{&d, bufs, pg(0), false},
+		{&d, bufs + pg(1), pg(5), false},
+		{&d, bufs + pg(2), pg(3), false},
+		{&d, bufs + pg(3), pg(2), true},
+		{&d, bufs + pg(4), pg(1), false},
+		{&d, bufs + pg(5), pg(4), false},
+	};
+	fill_random(jobs[3].buf, PAGE_SIZE, &seed);
+	memcpy(shadow + pg(2), jobs[3].buf, PAGE_SIZE);
+
+	const ramdev::op expect[]{
+		{pg(0), PAGE_SIZE, false},
+		{pg(1), PAGE_SIZE, false},
+		{pg(2), PAGE_SIZE, true},
+		{pg(3), 3 * PAGE_SIZE, false},
+	};
+	return queue(d, jobs, std::size(jobs)) &&
+	    check_order(d, expect, std::size(expect), "merge") &&
+	    check_reads(jobs, std::size(jobs), shadow, "merge") &&
+	    check_device(mem, shadow, size, "merge");
+}
+
+/*
+ * test_overlap - overlapping requests complete in submission order
+ *
+ * The read of page 6 must see the first write and must complete before the
+ * second write. The read of page 2 may move ahead of the read of page 6 but
+ * not ahead of the first write.
+ */
+bool
+test_overlap(ramdev &d, std::byte *mem, std::byte *shadow, std::byte *bufs,
+    size_t size)
+{
+	uint32_t seed = 4;
+	job jobs[]{
+		{&d, bufs, pg(0), false},
+		{&d, bufs + pg(1), pg(6), true},
+		{&d, bufs + pg(2), pg(6), false},
+		{&d, bufs + pg(3), pg(2), false},
+		{&d, bufs + pg(4), pg(6), true},
+	};
+	fill_random(jobs[1].buf, PAGE_SIZE, &seed);
+	fill_random(jobs[4].buf, PAGE_SIZE, &seed);
+	memcpy(shadow + pg(6), jobs[1].buf, PAGE_SIZE);
+
+	const ramdev::op expect[]{
+		{pg(0), PAGE_SIZE, false},
+		{pg(6), PAGE_SIZE, true},
+		{pg(2), PAGE_SIZE, false},
+		{pg(6), PAGE_SIZE, false},
+		{pg(6), PAGE_SIZE, true},
+	};
+	if (!queue(d, jobs, std::size(jobs)) ||
+	    !check_order(d, expect, std::size(expect), "overlap") ||
+	    !check_reads(jobs, std::size(jobs), shadow, "overlap"))
+		return false;
+	memcpy(shadow + pg(6), jobs[4].buf, PAGE_SIZE);
+	return check_device(mem, shadow, size, "overlap");
+}
+
+/*
+ * test_deadline - an expired request is dispatched ahead of the elevator
+ */
+bool
+test_deadline(ramdev &d, std::byte *mem, std::byte *shadow, std::byte *bufs,
+    size_t size)
+{
+	job jobs[]{
+		{&d, bufs, pg(4), false},
+		{&d, bufs + pg(1), pg(1), false, expire_delay},
+		{&d, bufs + pg(2), pg(6), false},
+	};
+
+	const ramdev::op expect[]{
+		{pg(4), PAGE_SIZE, false},
+		{pg(1), PAGE_SIZE, false},
+		{pg(6), PAGE_SIZE, false},
+	};
+	return queue(d, jobs, std::size(jobs)) &&
+	    check_order(d, expect, std::size(expect), "deadline") &&
+	    check_reads(jobs, std::size(jobs), shadow, "deadline") &&
+	    check_device(mem, shadow, size, "deadline");
+}
+
+/*
+ * test_concurrent - random transfers from several threads at once
+ *
+ * Each thread owns a separate part of the device and checks its reads
+ * against the shadow copy.
+ */
+bool
+test_concurrent(ramdev &d, std::byte *mem, std::byte *shadow,
+    std::byte *bufs, size_t size)
+{
+	const size_t len = PAGE_TRUNC(size / workers);
+	worker w[workers];
+	unsigned started = 0;
+
+	for (; started < workers; ++started) {
+		w[started] = {
+			.d = &d,
+			.shadow = shadow,
+			.buf = bufs + started * max_op,
+			.base = static_cast<off_t>(started * len),
+			.len = len,
+			.seed = 5 + started,
+		};
+		if (!start(&worker_thread, &w[started]))
+			break;
+	}
+	wait_done(started);
+
+	if (started != workers) {
+		dbg("*** block test: can't create thread\n");
+		return false;
+	}
+	for (unsigned i = 0; i < workers; ++i) {
+		if (!w[i].pass)
+			return false;
+	}
+	return true;
+}
+
+bool
+run(ramdev &d, std::byte *mem, std::byte *shadow, std::byte *buf,
+    size_t size)
+{
+	uint32_t seed = 1;
+
+	/* random reads and writes */
+	for (unsigned i = 0; i < random_ops; ++i) {
+		const off_t off = test_rand(&seed) % size;
+		const size_t len = std::min<size_t>(
+		    1 + test_rand(&seed) % max_op, size - off);
+		const bool write = test_rand(&seed) & 1;
+		if (write) {
+			for (size_t j = 0; j < len; ++j)
+				buf[j] = static_cast<std::byte>(test_rand(&seed));
+			memcpy(shadow + off, buf, len);
+		}
+		if (transfer(d, buf, len, off, write) != (ssize_t)len) {
+			dbg("*** block test: transfer failed at %u\n", i);
+			return false;
+		}
+		if (!write && memcmp(buf, shadow + off, len)) {
+			dbg("*** block test: bad data at %u off %lld len %zu\n",
+			    i, (long long)off, len);
+			return false;
+		}
+	}
+
+	/* small sequential reads should be served by read-ahead */
+	const unsigned reads = d.reads;
+	for (off_t off = 0; off < (off_t)size; off += 512) {
+		if (transfer(d, buf, 512, off, false) != 512 ||
+		    memcmp(buf, shadow + off, 512)) {
+			dbg("*** block test: sequential read failed\n");
+			return false;
+		}
+	}
+	dbg("block test: %zu sequential reads took %u device reads\n",
+	    size / 512, d.reads - reads);
+
+	/* dirty data must reach the device without closing it */
+	for (off_t off = 100; off < (off_t)size; off += PAGE_SIZE) {
+		memset(buf, 0x5a, 100);
+		memcpy(shadow + off, buf, 100);
+		if (transfer(d, buf, 100, off, true) != 100) {
+			dbg("*** block test: write failed\n");
+			return false;
+		}
+	}
+	timer_delay(2000000000);
+	if (memcmp(mem, shadow, size)) {
+		dbg("*** block test: write-back did not complete\n");
+		return false;
+	}
+
+	return true;
+}
+
+}
+
+void
+block_test_init(unsigned pages)
+{
+	if (pages < cache_pages * 2) {
+		dbg("*** block test: need at least %u pages\n", cache_pages * 2);
+		return;
+	}
+
+	const size_t size = pages * PAGE_SIZE;
+	const size_t alloc = size * 2 + max_op * (workers + 1);
+	phys *p = page_alloc(alloc, MA_NORMAL, &block_test_id);
+	if (!p) {
+		dbg("*** block test: allocation failed\n");
+		return;
+	}
+	std::byte *mem = static_cast<std::byte *>(phys_to_virt(p));
+	std::byte *shadow = mem + size;
+	std::byte *buf = shadow + size;
+	std::byte *bufs = buf + max_op;
+	uint32_t seed = 2;
+	for (size_t i = 0; i < size; ++i)
+		mem[i] = static_cast<std::byte>(test_rand(&seed));
+	memcpy(shadow, mem, size);
+
+	::device *dev;
+	if (!(dev = device_reserve("blktest", false))) {
+		dbg("*** block test: device_reserve failed\n");
+		page_free(p, alloc, &block_test_id);
+		return;
+	}
+
+	auto d = std::make_unique<ramdev>(dev, mem, size);
+	bool pass = false;
+	if (check_ioctl() && d->open() == 0) {
+		pass = test_merge(*d, mem, shadow, bufs, size) &&
+		    test_overlap(*d, mem, shadow, bufs, size) &&
+		    test_deadline(*d, mem, shadow, bufs, size) &&
+		    test_concurrent(*d, mem, shadow, bufs, size) &&
+		    run(*d, mem, shadow, buf, size);
+		d->close();
+	}
+	if (pass)
+		pass = !memcmp(mem, shadow, size);
+	const unsigned reads = d->reads, writes = d->writes;
+	d.reset();
+
+	page_free(p, alloc, &block_test_id);
+
+	if (!pass) {
+		dbg("*** block test: failed\n");
+		return;
+	}
+	dbg("block test: passed, %u device reads, %u device writes\n",
+	    reads, writes);
+}
@@ -0,0 +1,5 @@
+#
+# Block Cache Test
+#
+SOURCES += \
+    dev/block/test/block_test.cpp
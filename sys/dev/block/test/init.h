@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Block Cache Test
+ *
+ * For example:
+ *  driver sys/dev/block/test(16)
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void block_test_init(unsigned pages);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
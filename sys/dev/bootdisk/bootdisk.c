@@ -10,6 +10,7 @@
 #include <fs/util.h>
 #include <kernel.h>
 #include <kmem.h>
+#include <linux/fs.h>
 #include <string.h>
 
 #define rdbg(...)
@@ -28,7 +29,7 @@ bootdisk_read(struct file *f, void *buf, size_t len, off_t offset)
 	if (archive_size - offset < len)
 		len = archive_size - offset;
 
-	/* Copy data */
+	/* Copy data, the archive is read in place which may be ROM */
 	memcpy(buf, archive_addr + offset, len);
 
 	return len;
@@ -41,11 +42,27 @@ bootdisk_read_iov(struct file *f, const struct iovec *iov, size_t count,
 	return for_each_iov(f, iov, count, offset, bootdisk_read);
 }
 
+static int
+bootdisk_ioctl(struct file *f, u_long cmd, void *arg)
+{
+	switch (cmd) {
+	case DIOCXIPADDR:
+		/* archive is memory resident and can be executed in place */
+		*(const void **)arg = archive_addr;
+		return 0;
+	case BLKGETSIZE64:
+		*(uint64_t *)arg = archive_size;
+		return 0;
+	}
+	return DERR(-EINVAL);
+}
+
 /*
  * Device I/O table
  */
 static struct devio io = {
 	.read = bootdisk_read_iov,
+	.ioctl = bootdisk_ioctl,
 };
 
 /*
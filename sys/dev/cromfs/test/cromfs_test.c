@@ -0,0 +1,569 @@
+#include "init.h"
+
+#include <compiler.h>
+#include <debug.h>
+#include <device.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/cromfs/cromfs.h>
+#include <fs/file.h>
+#include <fs/util.h>
+#include <kernel.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <page.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Mounts images built by mkcromfs from a test block device and reads every
+ * file back, comparing each with the file the image was built from. The
+ * files cover compressed blocks, incompressible blocks stored raw, an empty
+ * file, a file of exactly one block, files which end part way through a
+ * block and a file stored uncompressed for execute in place. Each image is
+ * mounted once in place, where execute in place must return the file data
+ * within the image, and once through device reads, where it must fail.
+ *
+ * A copy of the image with digests is then damaged so that reads of the
+ * damaged files fail with EIO while other files still read back, and copies
+ * of the image without digests are given bad metadata which crom_check must
+ * reject with EINVAL.
+ */
+
+#define DEV "/dev/cromtest0"
+#define MNT "/cromtest"
+#define CHUNK 1000		/* read size which does not divide block size */
+#define MAX_DEPTH 4		/* directory levels in test images */
+#define DIRBUF (PAGE_SIZE / MAX_DEPTH)
+
+/*
+ * Images and source files, see images.S
+ */
+#define BLOB(name) \
+	extern const char cromfs_test_##name[], cromfs_test_##name##_end[]
+BLOB(plain);
+BLOB(sha256);
+BLOB(block);
+BLOB(small);
+BLOB(empty);
+BLOB(random);
+BLOB(text);
+BLOB(prog);
+
+#define SIZE(name) ((size_t)(cromfs_test_##name##_end - cromfs_test_##name))
+
+/*
+ * Expected contents of test images
+ */
+struct expect {
+	const char *path;		/* relative to mount point */
+	const char *data;		/* NULL for directory */
+	const char *end;
+	bool xip;
+	bool seen;
+};
+
+#define EXPECT_DIR(path) {path, NULL, NULL, false, false}
+#define EXPECT_REG(path, name, xip) \
+	{path, cromfs_test_##name, cromfs_test_##name##_end, xip, false}
+
+static struct expect files[] = {
+	EXPECT_DIR("dir"),
+	EXPECT_REG("dir/block", block, false),
+	EXPECT_REG("dir/small", small, false),
+	EXPECT_REG("empty", empty, false),
+	EXPECT_REG("random", random, false),
+	EXPECT_REG("text", text, false),
+	EXPECT_DIR("xip"),
+	EXPECT_REG("xip/prog", prog, true),
+};
+
+/*
+ * Page ownership identifier for cromfs test
+ */
+static char cromfs_test_id;
+
+/*
+ * Image served by test device
+ */
+static const char *image;
+static size_t image_size;
+static uint64_t dev_size;
+static bool image_xip;		/* image can be used in place */
+
+/*
+ * Scratch memory
+ */
+static char *buf;		/* file data */
+static char *dirbuf;		/* directory entries, DIRBUF per level */
+static char *copy;		/* damaged image */
+static char path[PATH_MAX];
+
+/*
+ * Pointers into an image
+ */
+struct view {
+	struct crom_super *sb;
+	struct crom_inode *inodes;
+	struct crom_dirent *dirents;
+	char *names;
+	uint32_t *index;
+};
+
+static ssize_t
+dev_read(struct file *f, void *p, size_t len, off_t offset)
+{
+	if (offset > image_size)
+		return DERR(-EIO);
+	if (image_size - offset < len)
+		len = image_size - offset;
+	memcpy(p, image + offset, len);
+	return len;
+}
+
+static ssize_t
+dev_read_iov(struct file *f, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	return for_each_iov(f, iov, count, offset, dev_read);
+}
+
+static int
+dev_ioctl(struct file *f, u_long cmd, void *arg)
+{
+	switch (cmd) {
+	case DIOCXIPADDR:
+		if (!image_xip)
+			break;
+		*(const void **)arg = image;
+		return 0;
+	case BLKGETSIZE64:
+		*(uint64_t *)arg = dev_size;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static struct devio io = {
+	.read = dev_read_iov,
+	.ioctl = dev_ioctl,
+};
+
+static int
+mount_image(const char *img, size_t size, uint64_t dsize, bool xip)
+{
+	image = img;
+	image_size = size;
+	dev_size = dsize;
+	image_xip = xip;
+	return mount(DEV, MNT, "cromfs", 0, NULL);
+}
+
+static void
+view_init(struct view *v, char *img)
+{
+	v->sb = (struct crom_super *)img;
+	v->inodes = (struct crom_inode *)(v->sb + 1);
+	v->dirents = (struct crom_dirent *)(v->inodes + v->sb->ninodes);
+	v->names = (char *)(v->dirents + v->sb->ndirents);
+	v->index = (uint32_t *)(v->names + v->sb->names_size);
+}
+
+/*
+ * Find regular file by size and flags, sizes of test files are unique
+ */
+static struct crom_inode *
+view_inode(const struct view *v, size_t size, uint16_t flags)
+{
+	for (size_t i = 0; i < v->sb->ninodes; ++i) {
+		struct crom_inode *ip = &v->inodes[i];
+		if (S_ISREG(ip->mode) && ip->size == size && ip->flags == flags)
+			return ip;
+	}
+	return NULL;
+}
+
+static struct expect *
+find(const char *p)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(files); ++i) {
+		if (!strcmp(files[i].path, p))
+			return &files[i];
+	}
+	return NULL;
+}
+
+/*
+ * check_xip - file data must be addressable if 'mapped', not otherwise
+ */
+static bool
+check_xip(int fd, const struct expect *e, bool mapped)
+{
+	const size_t size = e->end - e->data;
+	struct vnode *vp;
+	bool ok;
+
+	if (!(vp = vn_open(fd, O_RDONLY)))
+		return false;
+	const char *addr = vn_xip(vp, 0, size);
+	if (mapped) {
+		ok = addr && addr >= image &&
+		    addr + size <= image + image_size &&
+		    !memcmp(addr, e->data, size) &&
+		    !vn_xip(vp, 0, PAGE_ALIGN(size) + PAGE_SIZE);
+	} else
+		ok = !addr;
+	vn_close(vp);
+	return ok;
+}
+
+/*
+ * check_file - read file whole and in pieces which cross block boundaries
+ */
+static bool
+check_file(const char *p, const struct expect *e)
+{
+	const size_t size = e->end - e->data;
+	struct stat st;
+	bool ok = false;
+	int fd;
+
+	if ((fd = kopen(p, O_RDONLY)) < 0)
+		return false;
+	if (kfstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size != (off_t)size)
+		goto out;
+	if (kpread(fd, buf, size + 1, 0) != size || memcmp(buf, e->data, size))
+		goto out;
+	memset(buf, 0, size);
+	for (size_t off = 0; off < size; off += CHUNK) {
+		const size_t n = MIN(CHUNK, size - off);
+		if (kpread(fd, buf + off, CHUNK, off) != n)
+			goto out;
+	}
+	if (memcmp(buf, e->data, size) || kpread(fd, buf, CHUNK, size) != 0)
+		goto out;
+	ok = check_xip(fd, e, e->xip && image_xip);
+out:
+	kclose(fd);
+	return ok;
+}
+
+/*
+ * walk - check every entry below 'path', path ends at 'end'
+ */
+static bool
+walk(char *end, unsigned depth)
+{
+	char *const d = dirbuf + depth * DIRBUF;
+	bool ok = false;
+	int fd, len;
+
+	if (depth == MAX_DEPTH)
+		return false;
+	if ((fd = kopen(path, O_RDONLY | O_DIRECTORY)) < 0)
+		return false;
+	while ((len = getdents(fd, (struct dirent *)d, DIRBUF)) > 0) {
+		for (int off = 0; off < len;) {
+			const struct dirent *de = (struct dirent *)(d + off);
+			off += de->d_reclen;
+			if (!strcmp(de->d_name, ".") ||
+			    !strcmp(de->d_name, ".."))
+				continue;
+			const size_t n = strlen(de->d_name);
+			if (end + n + 2 > path + sizeof path)
+				goto out;
+			*end = '/';
+			memcpy(end + 1, de->d_name, n + 1);
+
+			struct expect *e = find(path + sizeof MNT);
+			if (!e || e->seen) {
+				dbg("*** cromfs test: unexpected %s\n", path);
+				goto out;
+			}
+			e->seen = true;
+			if (de->d_type == DT_DIR && !e->data) {
+				if (!walk(end + n + 1, depth + 1))
+					goto out;
+			} else if (de->d_type != DT_REG || !e->data ||
+			    !check_file(path, e)) {
+				dbg("*** cromfs test: bad file %s\n", path);
+				goto out;
+			}
+			*end = 0;
+		}
+	}
+	ok = !len;
+out:
+	kclose(fd);
+	return ok;
+}
+
+/*
+ * test_image - mount image in place and through device reads
+ */
+static bool
+test_image(const char *name, const char *img, size_t size)
+{
+	for (int xip = 1; xip >= 0; --xip) {
+		int err;
+
+		if ((err = mount_image(img, size, size, xip)) < 0) {
+			dbg("*** cromfs test: %s mount failed %d\n", name, err);
+			return false;
+		}
+		for (size_t i = 0; i < ARRAY_SIZE(files); ++i)
+			files[i].seen = false;
+		strcpy(path, MNT);
+		bool ok = walk(path + strlen(path), 0);
+		for (size_t i = 0; i < ARRAY_SIZE(files); ++i)
+			ok = ok && files[i].seen;
+		if ((err = umount(MNT)) < 0) {
+			dbg("*** cromfs test: %s unmount failed %d\n", name,
+			    err);
+			return false;
+		}
+		if (!ok) {
+			dbg("*** cromfs test: %s%s failed\n", name,
+			    xip ? " in place" : "");
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * test_digest - damaged files fail their integrity check
+ *
+ * The first block of 'random' is stored raw so that only its digest can
+ * catch the damage.
+ */
+static bool
+test_digest(void)
+{
+	struct crom_inode *ip;
+	struct view v;
+
+	memcpy(copy, cromfs_test_sha256, SIZE(sha256));
+	view_init(&v, copy);
+	if (!(ip = view_inode(&v, SIZE(random), 0)))
+		return false;
+	copy[v.index[ip->data]] ^= 1;
+	if (!(ip = view_inode(&v, SIZE(prog), CROM_XIP)))
+		return false;
+	copy[ip->data + SIZE(prog) - 1] ^= 1;
+
+	for (int xip = 1; xip >= 0; --xip) {
+		bool ok;
+		int fd;
+
+		if (mount_image(copy, SIZE(sha256), SIZE(sha256), xip) < 0)
+			return false;
+		ok = check_file(MNT "/text", find("text"));
+		if ((fd = kopen(MNT "/random", O_RDONLY)) >= 0) {
+			ok = ok && kpread(fd, buf, CHUNK, 0) == -EIO;
+			kclose(fd);
+		} else
+			ok = false;
+		if ((fd = kopen(MNT "/xip/prog", O_RDONLY)) >= 0) {
+			/* a damaged file must never be mapped */
+			ok = ok && kpread(fd, buf, CHUNK, 0) == -EIO &&
+			    check_xip(fd, find("xip/prog"), false);
+			kclose(fd);
+		} else
+			ok = false;
+		if (umount(MNT) < 0 || !ok) {
+			dbg("*** cromfs test: damaged file was read%s\n",
+			    xip ? " in place" : "");
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Metadata damage which crom_check must reject
+ */
+static void
+bad_magic(struct view *v)
+{
+	v->sb->magic ^= 1;
+}
+
+static void
+bad_shift(struct view *v)
+{
+	v->sb->block_shift = CROM_MIN_SHIFT - 1;
+}
+
+static void
+bad_meta(struct view *v)
+{
+	/* metadata runs past end of image */
+	v->sb->size = sizeof *v->sb;
+}
+
+static void
+bad_index_start(struct view *v)
+{
+	/* first block overlaps metadata */
+	--v->index[0];
+}
+
+static void
+bad_index_end(struct view *v)
+{
+	v->index[v->sb->nblocks] = v->sb->size + 1;
+}
+
+static void
+bad_index_order(struct view *v)
+{
+	v->index[1] = v->index[0] - 1;
+}
+
+static void
+bad_root(struct view *v)
+{
+	v->inodes[0].mode = S_IFREG | 0644;
+}
+
+static void
+bad_dir(struct view *v)
+{
+	v->inodes[0].size = v->sb->ndirents + 1;
+}
+
+static void
+bad_file(struct view *v)
+{
+	/* file runs past last block */
+	view_inode(v, SIZE(random), 0)->size = UINT32_MAX;
+}
+
+static void
+bad_xip(struct view *v)
+{
+	/* file runs past end of image */
+	view_inode(v, SIZE(prog), CROM_XIP)->size = v->sb->size;
+}
+
+static void
+bad_ino(struct view *v)
+{
+	v->dirents[0].ino = v->sb->ninodes;
+}
+
+static void
+bad_ino_root(struct view *v)
+{
+	v->dirents[0].ino = 0;
+}
+
+static void
+bad_namelen(struct view *v)
+{
+	v->dirents[0].namelen = NAME_MAX + 1;
+}
+
+static void
+bad_name(struct view *v)
+{
+	/* name is not terminated */
+	v->names[v->dirents[0].name + v->dirents[0].namelen] = 'x';
+}
+
+static bool
+test_check(void)
+{
+	static const struct {
+		const char *name;
+		void (*damage)(struct view *);
+	} tests[] = {
+		{"magic", bad_magic},
+		{"block shift", bad_shift},
+		{"metadata size", bad_meta},
+		{"index start", bad_index_start},
+		{"index end", bad_index_end},
+		{"index order", bad_index_order},
+		{"root inode", bad_root},
+		{"directory size", bad_dir},
+		{"file size", bad_file},
+		{"xip file size", bad_xip},
+		{"dirent inode", bad_ino},
+		{"dirent root inode", bad_ino_root},
+		{"name length", bad_namelen},
+		{"name terminator", bad_name},
+	};
+	const size_t size = SIZE(plain);
+	struct view v;
+	int err;
+
+	/* image must fit on device */
+	if ((err = mount_image(cromfs_test_plain, size, size - 1, false)) !=
+	    -EINVAL) {
+		if (!err)
+			umount(MNT);
+		dbg("*** cromfs test: image larger than device mounted\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(tests); ++i) {
+		for (int xip = 1; xip >= 0; --xip) {
+			memcpy(copy, cromfs_test_plain, size);
+			view_init(&v, copy);
+			tests[i].damage(&v);
+			if ((err = mount_image(copy, size, size, xip)) ==
+			    -EINVAL)
+				continue;
+			if (!err)
+				umount(MNT);
+			dbg("*** cromfs test: bad %s mount returned %d\n",
+			    tests[i].name, err);
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+cromfs_test_init(void)
+{
+	size_t max = 0;
+	phys *p;
+
+	for (size_t i = 0; i < ARRAY_SIZE(files); ++i)
+		max = MAX(max, (size_t)(files[i].end - files[i].data));
+	const size_t buf_size = PAGE_ALIGN(max + CHUNK);
+	const size_t copy_size = PAGE_ALIGN(MAX(SIZE(plain), SIZE(sha256)));
+	const size_t alloc = buf_size + PAGE_SIZE + copy_size;
+	if (!(p = page_alloc(alloc, MA_NORMAL, &cromfs_test_id))) {
+		dbg("*** cromfs test: allocation failed\n");
+		return;
+	}
+	buf = phys_to_virt(p);
+	dirbuf = buf + buf_size;
+	copy = dirbuf + PAGE_SIZE;
+
+	if (!device_create(&io, "cromtest0", DF_BLK, NULL) ||
+	    mkdir(MNT, 0) < 0) {
+		dbg("*** cromfs test: setup failed\n");
+		goto out;
+	}
+
+	if (!test_image("plain", cromfs_test_plain, SIZE(plain)) ||
+	    !test_image("sha256", cromfs_test_sha256, SIZE(sha256)) ||
+	    !test_digest() || !test_check()) {
+		dbg("*** cromfs test: failed\n");
+		goto out;
+	}
+	dbg("cromfs test: passed\n");
+out:
+	page_free(p, alloc, &cromfs_test_id);
+}
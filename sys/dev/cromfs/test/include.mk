@@ -0,0 +1,27 @@
+#
+# Compressed ROM File System Test
+#
+SOURCES += \
+    dev/cromfs/test/cromfs_test.c \
+    dev/cromfs/test/images.S \
+
+#
+# Test images are built from a generated source tree, once without and once
+# with file digests. The images and source files are included by images.S.
+#
+CROMFS_TEST := $(APEX_SUBDIR)sys/dev/cromfs/test
+CROMFS_TEST_MKTREE := $(CONFIG_APEXDIR)/sys/dev/cromfs/test/mktree
+CROMFS_TEST_MKCROMFS := $(CONFIG_APEXDIR)/sys/fs/cromfs/mkcromfs
+CROMFS_TEST_FLAGS := -b 4096 -a 64 -x 'xip/*'
+CROMFS_TEST_SOURCES := $(addprefix $(CROMFS_TEST)/tree/,dir empty random text xip)
+INCLUDE += $(CONFIG_BUILDDIR)/$(CROMFS_TEST)
+
+$(CROMFS_TEST)/images.o: $(CROMFS_TEST)/plain.crom $(CROMFS_TEST)/sha256.crom
+
+$(CROMFS_TEST)/plain.crom: $(CROMFS_TEST_MKTREE) $(CROMFS_TEST_MKCROMFS) | $(CURDIR)/$(CROMFS_TEST)/
+	rm -rf $(CROMFS_TEST)/tree
+	$(CROMFS_TEST_MKTREE) $(CROMFS_TEST)/tree
+	$(CROMFS_TEST_MKCROMFS) $(CROMFS_TEST_FLAGS) -o $@ $(CROMFS_TEST_SOURCES)
+
+$(CROMFS_TEST)/sha256.crom: $(CROMFS_TEST)/plain.crom
+	$(CROMFS_TEST_MKCROMFS) -s $(CROMFS_TEST_FLAGS) -o $@ $(CROMFS_TEST_SOURCES)
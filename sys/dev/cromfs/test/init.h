@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Compressed ROM File System Test
+ *
+ * For example:
+ *  driver sys/dev/cromfs/test()
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void cromfs_test_init(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -0,0 +1,104 @@
+#include "init.h"
+
+#include <compiler.h>
+#include <debug.h>
+#include <errno.h>
+#include <futex.h>
+#include <kernel.h>
+#include <mmap.h>
+#include <sch.h>
+#include <sys/mman.h>
+#include <task.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Parks a few threads on futex words, then times FUTEX_WAIT & FUTEX_WAKE
+ * over an increasing number of distinct futex words. The cost per operation
+ * should not depend on the number of words which have been used.
+ */
+
+#define WAITERS 16	/* threads parked on futex words */
+
+static int *words;
+static unsigned woken;
+
+static void
+waiter(void *arg)
+{
+	int *w = arg;
+
+	while (*w == 0)
+		futex(&kern_task, w, FUTEX_WAIT | FUTEX_PRIVATE, 0, NULL, NULL);
+	++woken;
+
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+static uint_fast64_t
+test_round(unsigned n)
+{
+	const uint_fast64_t start = timer_monotonic();
+	for (unsigned i = 0; i < n; ++i) {
+		/* word is 0, so wait fails with EAGAIN */
+		futex(&kern_task, &words[i], FUTEX_WAIT | FUTEX_PRIVATE, 1,
+		    NULL, NULL);
+		futex(&kern_task, &words[i], FUTEX_WAKE | FUTEX_PRIVATE, 1,
+		    NULL, NULL);
+	}
+	return (timer_monotonic() - start) / (2 * n);
+}
+
+void
+futex_test_init(unsigned n)
+{
+	if (n < WAITERS * 8) {
+		dbg("*** futex test: need at least %u words\n", WAITERS * 8);
+		return;
+	}
+
+	const size_t size = PAGE_ALIGN(n * sizeof(int));
+	if ((words = mmapfor(kern_task.as, NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, MA_NORMAL)) > (int*)-4096UL) {
+		dbg("*** futex test: allocation failed\n");
+		return;
+	}
+
+	/* park waiters on words spread across the array */
+	woken = 0;
+	unsigned parked = 0;
+	for (; parked < WAITERS; ++parked) {
+		if (!kthread_create(&waiter, &words[parked * (n / WAITERS)],
+		    PRI_KERN_LOW, "futex_test", MA_NORMAL))
+			break;
+	}
+
+	uint_fast64_t ns[4];
+	for (unsigned i = 0; i < ARRAY_SIZE(ns); ++i)
+		ns[i] = test_round(n >> (ARRAY_SIZE(ns) - 1 - i));
+
+	/* release waiters */
+	bool pass = true;
+	for (unsigned i = 0; i < parked; ++i) {
+		int *w = &words[i * (n / WAITERS)];
+		*w = 1;
+		if (futex(&kern_task, w, FUTEX_WAKE | FUTEX_PRIVATE, 1,
+		    NULL, NULL) != 1)
+			pass = false;
+	}
+	if (woken != parked)
+		pass = false;
+
+	munmapfor(kern_task.as, words, size);
+
+	if (!pass) {
+		dbg("*** futex test: failed, %u of %u waiters woken\n",
+		    woken, parked);
+		return;
+	}
+	dbg("futex test: passed, %u waiters, ns/op at %u/%u/%u/%u words: "
+	    "%llu/%llu/%llu/%llu\n", parked, n >> 3, n >> 2, n >> 1, n,
+	    (unsigned long long)ns[0], (unsigned long long)ns[1],
+	    (unsigned long long)ns[2], (unsigned long long)ns[3]);
+}
@@ -0,0 +1,5 @@
+#
+# Futex Benchmark
+#
+SOURCES += \
+    dev/futex/test/futex_test.c
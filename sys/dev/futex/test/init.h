@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Futex Benchmark
+ *
+ * For example:
+ *  driver sys/dev/futex/test(4096)
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void futex_test_init(unsigned words);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
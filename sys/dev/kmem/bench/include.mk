@@ -0,0 +1,5 @@
+#
+# Kernel Memory Benchmark
+#
+SOURCES += \
+    dev/kmem/bench/kmem_bench.cpp
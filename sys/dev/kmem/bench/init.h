@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Kernel Memory Benchmark
+ *
+ * Repeatedly creates and removes files in directory 'dir', maps and unmaps
+ * anonymous memory and creates short lived kernel threads. This churns the
+ * kernel objects behind open, mmap and fork/exec: vnodes, file system
+ * nodes, address space segments and threads. Reports the latency of each
+ * operation, then dumps the kernel memory allocator state, including object
+ * cache statistics, before and after the run.
+ *
+ * For example, on a ramfs mounted at /tmp:
+ *  driver sys/dev/kmem/bench("/tmp", 64)
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void kmem_bench_init(const char *dir, unsigned rounds);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -0,0 +1,257 @@
+#include "init.h"
+
+#include <algorithm>
+#include <atomic>
+#include <debug.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <kernel.h>
+#include <kmem.h>
+#include <mmap.h>
+#include <page.h>
+#include <sch.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <task.h>
+#include <thread.h>
+#include <timer.h>
+#include <unistd.h>
+
+/*
+ * Each round creates a batch of each kind of object. Half of a batch is
+ * released straight away and the other half one round later, so object
+ * lifetimes overlap the way they do on a busy system and the allocator can
+ * fragment. Latencies include everything the operation does, not just the
+ * allocations, so the figures are most useful compared across builds.
+ */
+
+namespace {
+
+constexpr unsigned batch = 16;		/* objects per kind per round */
+constexpr unsigned max_ops = 1024;	/* latency samples per operation */
+
+/*
+ * Page ownership identifier for kmem benchmark
+ */
+char kmem_bench_id;
+
+enum op {
+	OP_CREATE,		/* create and close file */
+	OP_UNLINK,		/* remove file */
+	OP_MMAP,		/* map anonymous page */
+	OP_MUNMAP,		/* unmap anonymous page */
+	OP_THREAD,		/* create kernel thread */
+	NR_OPS,
+};
+
+constexpr const char *op_names[NR_OPS] = {
+	"create", "unlink", "mmap", "munmap", "thread",
+};
+
+/*
+ * Latency samples for each operation
+ */
+struct samples {
+	uint32_t lat[NR_OPS][max_ops];	/* nanoseconds */
+	unsigned n[NR_OPS];
+};
+
+std::atomic<unsigned> exited;		/* threads which have exited */
+
+/*
+ * timed - run operation and record its latency
+ */
+template<typename F>
+auto
+timed(samples *s, op o, F fn)
+{
+	const auto t = timer_monotonic();
+	const auto r = fn();
+	if (s->n[o] < max_ops)
+		s->lat[o][s->n[o]++] = timer_monotonic() - t;
+	return r;
+}
+
+/*
+ * percentile - latency at percentile p of sorted latencies
+ */
+unsigned long
+percentile(const uint32_t *lat, unsigned ops, unsigned p)
+{
+	return lat[std::min(ops - 1, ops * p / 100)] / 1000;
+}
+
+void
+thread_fn(void *)
+{
+	++exited;
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+bool
+create_files(samples *s, const char *dir, unsigned first)
+{
+	char path[64];
+
+	for (unsigned i = first; i < first + batch; ++i) {
+		snprintf(path, sizeof path, "%s/kb%u", dir, i);
+		const int fd = timed(s, OP_CREATE, [&]{
+			const int fd = kopen(path, O_CREAT | O_RDWR, 0644);
+			if (fd >= 0)
+				kclose(fd);
+			return fd;
+		});
+		if (fd < 0) {
+			dbg("*** kmem bench: create %s failed %d\n", path, fd);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+unlink_files(samples *s, const char *dir, unsigned first, unsigned step)
+{
+	char path[64];
+
+	for (unsigned i = first; i < first + batch; i += step) {
+		snprintf(path, sizeof path, "%s/kb%u", dir, i);
+		if (const int r = timed(s, OP_UNLINK, [&]{
+		    return unlink(path); }); r < 0) {
+			dbg("*** kmem bench: unlink %s failed %d\n", path, r);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+map_pages(samples *s, void **maps)
+{
+	for (unsigned i = 0; i < batch; ++i) {
+		maps[i] = timed(s, OP_MMAP, [&]{
+			return mmapfor(kern_task.as, NULL, PAGE_SIZE,
+			    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			    -1, 0, MA_NORMAL);
+		});
+		if (maps[i] > (void *)-4096UL) {
+			dbg("*** kmem bench: mmap failed %d\n",
+			    static_cast<int>(reinterpret_cast<intptr_t>(maps[i])));
+			maps[i] = nullptr;
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+unmap_pages(samples *s, void **maps, unsigned first, unsigned step)
+{
+	for (unsigned i = first; i < batch; i += step) {
+		if (!maps[i])
+			continue;
+		timed(s, OP_MUNMAP, [&]{
+			return munmapfor(kern_task.as, maps[i], PAGE_SIZE);
+		});
+		maps[i] = nullptr;
+	}
+}
+
+bool
+run_threads(samples *s)
+{
+	const unsigned target = exited + batch;
+
+	for (unsigned i = 0; i < batch; ++i) {
+		if (!timed(s, OP_THREAD, [&]{
+			return kthread_create(thread_fn, nullptr, PRI_KERN_LOW,
+			    "kmem_bench", MA_NORMAL);
+		})) {
+			dbg("*** kmem bench: can't create thread\n");
+			return false;
+		}
+	}
+
+	/* exited threads are reaped by the next thread creation */
+	while (exited != target)
+		timer_delay(1000000);
+	return true;
+}
+
+/*
+ * run - churn objects for 'rounds' rounds
+ */
+bool
+run(samples *s, const char *dir, unsigned rounds)
+{
+	void *maps[2][batch] = {};
+	bool pass = true;
+	unsigned r = 0;
+
+	for (; pass && r < rounds; ++r) {
+		void **cur = maps[r & 1], **prev = maps[~r & 1];
+		const unsigned first = (r & 1) * batch;
+
+		pass = create_files(s, dir, first) &&
+		    unlink_files(s, dir, first, 2) &&
+		    (!r || unlink_files(s, dir, batch - first + 1, 2)) &&
+		    map_pages(s, cur) &&
+		    run_threads(s);
+		unmap_pages(s, cur, 0, 2);
+		unmap_pages(s, prev, 1, 2);
+	}
+
+	/* release objects kept from the last round */
+	if (pass && r)
+		pass = unlink_files(s, dir, ((r - 1) & 1) * batch + 1, 2);
+	for (auto m : maps)
+		unmap_pages(s, m, 0, 1);
+	return pass;
+}
+
+}
+
+void
+kmem_bench_init(const char *dir, unsigned rounds)
+{
+	rounds = std::min(rounds, max_ops / batch);
+
+	const size_t alloc = PAGE_ALIGN(sizeof(samples));
+	phys *p = page_alloc(alloc, MA_NORMAL, &kmem_bench_id);
+	if (!p) {
+		dbg("*** kmem bench: allocation failed\n");
+		return;
+	}
+	samples *s = static_cast<samples *>(phys_to_virt(p));
+	*s = {};
+
+	info("kmem bench: %u rounds of %u objects in %s\n", rounds, batch,
+	    dir);
+	kmem_dump();
+
+	if (!run(s, dir, rounds)) {
+		dbg("*** kmem bench: failed\n");
+		page_free(p, alloc, &kmem_bench_id);
+		return;
+	}
+
+	for (unsigned o = 0; o < NR_OPS; ++o) {
+		const auto n = s->n[o];
+		if (!n)
+			continue;
+		uint_fast64_t total = 0;
+		for (unsigned i = 0; i < n; ++i)
+			total += s->lat[o][i];
+		std::sort(s->lat[o], s->lat[o] + n);
+		info("kmem bench: %-6s %4u ops, latency us avg %lu p50 %lu "
+		    "p90 %lu p99 %lu max %lu\n", op_names[o], n,
+		    (unsigned long)(total / n / 1000),
+		    percentile(s->lat[o], n, 50), percentile(s->lat[o], n, 90),
+		    percentile(s->lat[o], n, 99),
+		    (unsigned long)(s->lat[o][n - 1] / 1000));
+	}
+	kmem_dump();
+
+	page_free(p, alloc, &kmem_bench_id);
+}
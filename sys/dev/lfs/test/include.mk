@@ -0,0 +1,5 @@
+#
+# Log-structured File System Test
+#
+SOURCES += \
+    dev/lfs/test/lfs_test.c
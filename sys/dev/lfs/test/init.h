@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * Log-structured File System Test
+ *
+ * Runs on a RAM disk of 'segs' minimum size segments, at least 8.
+ *
+ * For example:
+ *  driver sys/dev/lfs/test(8)
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void lfs_test_init(unsigned segs);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
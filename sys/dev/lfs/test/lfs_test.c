@@ -0,0 +1,580 @@
+#include "init.h"
+
+#include <compiler.h>
+#include <debug.h>
+#include <device.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <fs/lfs/lfs.h>
+#include <fs/util.h>
+#include <jhash3.h>
+#include <kernel.h>
+#include <linux/fs.h>
+#include <page.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+/*
+ * Runs the log-structured file system on a RAM disk. An erased disk is
+ * formatted on first mount, then files are created, written, synced,
+ * renamed and removed and the file system is checked after each remount.
+ *
+ * Power failure is simulated by dropping all writes to the disk while the
+ * file system is unmounted, so the next mount must replay the log from the
+ * latest checkpoint. This is done with the latest checkpoint in each slot,
+ * and again after damaging the latest checkpoint so that the older one is
+ * used. Before other remounts the last batch of the log is torn or given a
+ * stale sequence number, which must make replay discard it.
+ *
+ * Finally files are rewritten until the log has wrapped around the disk
+ * several times, which needs the cleaner to move live blocks out of old
+ * segments, and then the disk is filled until writes fail with ENOSPC.
+ * The disk erases discarded segments so any live data lost to a discard
+ * shows up when the surviving files are checked.
+ */
+
+#define DEV "/dev/lfstest0"
+#define MNT "/lfstest"
+#define MAX_SEGS 64
+#define SEG_SIZE (LFS_MIN_SEG * LFS_BSIZE)
+#define CHURN 8			/* blocks rewritten in each round */
+
+/*
+ * Page ownership identifier for lfs test
+ */
+static char lfs_test_id;
+
+/*
+ * RAM disk
+ */
+static char *disk;
+static size_t disk_size;
+static unsigned nsegs;
+static bool frozen;		/* writes are lost as after power failure */
+static unsigned discards[MAX_SEGS];
+static bool bad_discard;	/* discard was not of a whole segment */
+
+/*
+ * Scratch memory
+ */
+static char *buf;		/* one block */
+static char path[64];
+
+/*
+ * File contents, each file is made up of ranges of pattern data
+ */
+struct range {
+	const char *path;
+	off_t off;
+	size_t len;
+	uint32_t seed;
+};
+
+/* after first power failure */
+static const struct range state_a[] = {
+	{"d/c", 0, 3000, 1},
+	{"d/c", 3000, 4000, 3},
+	{"d/c", 7000, 3000, 1},
+	{"e", 0, 20000, 4},
+};
+static const char *const gone_a[] = {"a", "d/b", "lost", NULL};
+
+/* after second power failure */
+static const struct range state_b[] = {
+	{"e", 0, 3000, 1},
+	{"e", 3000, 4000, 3},
+	{"e", 7000, 3000, 1},
+	{"g", 0, 9000, 7},
+};
+static const char *const gone_b[] = {"a", "d/b", "d/c", "lost", NULL};
+
+static const struct range state_t1[] = {{"t1", 0, 5000, 8}};
+static const char *const gone_t2[] = {"t2", NULL};
+static const char *const gone_t3[] = {"t3", NULL};
+
+static ssize_t
+disk_read(struct file *f, void *p, size_t len, off_t off)
+{
+	if (off > disk_size)
+		return DERR(-EIO);
+	if (disk_size - off < len)
+		len = disk_size - off;
+	memcpy(p, disk + off, len);
+	return len;
+}
+
+static ssize_t
+disk_read_iov(struct file *f, const struct iovec *iov, size_t count,
+    off_t off)
+{
+	return for_each_iov(f, iov, count, off, disk_read);
+}
+
+static ssize_t
+disk_write(struct file *f, void *p, size_t len, off_t off)
+{
+	if (off > disk_size)
+		return DERR(-EIO);
+	if (disk_size - off < len)
+		len = disk_size - off;
+	if (!frozen)
+		memcpy(disk + off, p, len);
+	return len;
+}
+
+static ssize_t
+disk_write_iov(struct file *f, const struct iovec *iov, size_t count,
+    off_t off)
+{
+	return for_each_iov(f, iov, count, off, disk_write);
+}
+
+static int
+disk_ioctl(struct file *f, u_long cmd, void *arg)
+{
+	const uint64_t *range = arg;
+
+	switch (cmd) {
+	case BLKGETSIZE64:
+		*(uint64_t *)arg = disk_size;
+		return 0;
+	case BLKDISCARD:
+		if (range[0] % SEG_SIZE || range[1] != SEG_SIZE ||
+		    range[0] >= disk_size) {
+			bad_discard = true;
+			return -EINVAL;
+		}
+		if (frozen)
+			return 0;
+		/* discarded data is gone as if erased */
+		memset(disk + range[0], 0xff, range[1]);
+		++discards[range[0] / SEG_SIZE];
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static struct devio io = {
+	.read = disk_read_iov,
+	.write = disk_write_iov,
+	.ioctl = disk_ioctl,
+};
+
+static int
+mount_lfs(void)
+{
+	return mount(DEV, MNT, "lfs", 0, NULL);
+}
+
+/*
+ * crash - unmount with all writes lost
+ */
+static bool
+crash(void)
+{
+	frozen = true;
+	const int err = umount(MNT);
+	frozen = false;
+	return !err;
+}
+
+static const char *
+mpath(const char *p)
+{
+	snprintf(path, sizeof path, MNT "/%s", p);
+	return path;
+}
+
+static uint8_t
+pattern(uint32_t seed, off_t off)
+{
+	uint32_t x = (uint32_t)off * 2654435761U ^ seed * 40503U;
+	x ^= x >> 15;
+	x *= 2246822519U;
+	return x ^ x >> 13;
+}
+
+/*
+ * write_range - write pattern data, creating file if necessary
+ */
+static bool
+write_range(const char *p, off_t off, size_t len, uint32_t seed, bool sync)
+{
+	bool ok = true;
+	int fd;
+
+	if ((fd = kopen(mpath(p), O_WRONLY | O_CREAT, 0644)) < 0)
+		return false;
+	for (size_t t = 0; ok && t < len;) {
+		const size_t n = MIN(len - t,
+		    LFS_BSIZE - (size_t)((off + t) % LFS_BSIZE));
+		for (size_t i = 0; i < n; ++i)
+			buf[i] = pattern(seed, off + t + i);
+		ok = kpwrite(fd, buf, n, off + t) == n;
+		t += n;
+	}
+	if (ok && sync)
+		ok = !fsync(fd);
+	kclose(fd);
+	return ok;
+}
+
+static bool
+check_range(int fd, off_t off, size_t len, uint32_t seed)
+{
+	for (size_t t = 0; t < len;) {
+		const size_t n = MIN(len - t, LFS_BSIZE);
+		if (kpread(fd, buf, n, off + t) != n)
+			return false;
+		for (size_t i = 0; i < n; ++i) {
+			if (buf[i] != (char)pattern(seed, off + t + i))
+				return false;
+		}
+		t += n;
+	}
+	return true;
+}
+
+/*
+ * check_state - check file contents and that removed files are gone
+ *
+ * The last range of each file must end at the end of the file.
+ */
+static bool
+check_state(const struct range *r, size_t n, const char *const *gone)
+{
+	struct stat st;
+	int fd;
+
+	for (size_t i = 0; i < n; ++i) {
+		if ((fd = kopen(mpath(r[i].path), O_RDONLY)) < 0) {
+			dbg("*** lfs test: %s missing\n", r[i].path);
+			return false;
+		}
+		bool ok = check_range(fd, r[i].off, r[i].len, r[i].seed);
+		if (ok && (i + 1 == n || strcmp(r[i + 1].path, r[i].path)))
+			ok = !kfstat(fd, &st) &&
+			    st.st_size == r[i].off + (off_t)r[i].len;
+		kclose(fd);
+		if (!ok) {
+			dbg("*** lfs test: %s bad data\n", r[i].path);
+			return false;
+		}
+	}
+	for (; gone && *gone; ++gone) {
+		if ((fd = kopen(mpath(*gone), O_RDONLY)) != -ENOENT) {
+			if (fd >= 0)
+				kclose(fd);
+			dbg("*** lfs test: %s not removed\n", *gone);
+			return false;
+		}
+	}
+	return true;
+}
+
+#define CHECK(state, gone) check_state(state, ARRAY_SIZE(state), gone)
+
+/*
+ * checkpoint - get checkpoint block if present
+ */
+static struct lfs_super *
+checkpoint(int slot)
+{
+	struct lfs_super *sb = (struct lfs_super *)(disk + slot * LFS_BSIZE);
+
+	return sb->magic == LFS_MAGIC ? sb : NULL;
+}
+
+/*
+ * newest_slot - get slot of latest checkpoint, -1 if none
+ */
+static int
+newest_slot(void)
+{
+	const struct lfs_super *a = checkpoint(0), *b = checkpoint(1);
+
+	if (!a && !b)
+		return -1;
+	return !a || (b && b->seq > a->seq);
+}
+
+/*
+ * batch_sum - compute checksum of batch as replay does
+ */
+static uint32_t
+batch_sum(struct lfs_batch *h)
+{
+	const uint32_t sum = h->sum;
+	const size_t hlen = h->hblocks * LFS_BSIZE;
+
+	h->sum = 0;
+	const uint32_t r = jhash((char *)h + hlen,
+	    h->nblocks * LFS_BSIZE - hlen, jhash(h, hlen, 0));
+	h->sum = sum;
+	return r;
+}
+
+/*
+ * last_batch - find last valid batch of log on disk
+ */
+static struct lfs_batch *
+last_batch(void)
+{
+	struct lfs_batch *last = NULL;
+	const int slot = newest_slot();
+
+	if (slot < 0)
+		return NULL;
+	uint32_t pos = checkpoint(slot)->start;
+	uint64_t seq = checkpoint(slot)->seq;
+	for (;;) {
+		struct lfs_batch *h = (struct lfs_batch *)(disk +
+		    pos * LFS_BSIZE);
+		if (h->magic != LFS_BATCH_MAGIC || h->seq != seq ||
+		    !h->hblocks || h->nblocks < h->hblocks ||
+		    h->nblocks > disk_size / LFS_BSIZE - pos ||
+		    batch_sum(h) != h->sum || h->next >= disk_size / LFS_BSIZE)
+			return last;
+		last = h;
+		pos = h->next;
+		++seq;
+	}
+}
+
+/*
+ * test_format - erased disk is formatted on mount
+ */
+static bool
+test_format(void)
+{
+	bool ok;
+
+	if (mount_lfs() < 0)
+		return false;
+	ok = newest_slot() == 0 && !checkpoint(1);
+	for (unsigned s = 1; s < nsegs; ++s)
+		ok = ok && discards[s] == 1;
+	/* nothing logged, so both checkpoints have the same sequence */
+	if (umount(MNT) < 0 || !ok)
+		return false;
+	return checkpoint(0) && checkpoint(1);
+}
+
+/*
+ * test_files - file operations survive power failure once synced
+ */
+static bool
+test_files(void)
+{
+	int fd, slot[2];
+
+	/* replay from latest checkpoint */
+	if (mount_lfs() < 0)
+		return false;
+	if (!write_range("a", 0, 10000, 1, true) ||
+	    mkdir(MNT "/d", 0755) < 0 ||
+	    !write_range("d/b", 0, 5000, 2, false) ||
+	    !write_range("a", 3000, 4000, 3, false) ||
+	    rename(MNT "/a", MNT "/d/c") < 0 ||
+	    unlink(MNT "/d/b") < 0 ||
+	    !write_range("e", 0, 20000, 4, true) ||
+	    !write_range("lost", 0, 100, 5, false) ||
+	    !CHECK(state_a, NULL) || !crash())
+		return false;
+	slot[0] = newest_slot();
+	if (mount_lfs() < 0)
+		return false;
+	if ((fd = kopen(MNT "/d", O_RDONLY | O_DIRECTORY)) < 0 ||
+	    kclose(fd) < 0 || !CHECK(state_a, gone_a) || umount(MNT) < 0) {
+		dbg("*** lfs test: replay from slot %d failed\n", slot[0]);
+		return false;
+	}
+
+	/* unmount checkpointed to other slot, rename replaces 'e' */
+	if ((slot[1] = newest_slot()) == slot[0] || mount_lfs() < 0)
+		return false;
+	if (!CHECK(state_a, gone_a) ||
+	    rename(MNT "/d/c", MNT "/e") < 0 ||
+	    !write_range("g", 0, 9000, 7, true) ||
+	    !crash())
+		return false;
+	if (mount_lfs() < 0)
+		return false;
+	if (!CHECK(state_b, gone_b) || umount(MNT) < 0) {
+		dbg("*** lfs test: replay from slot %d failed\n", slot[1]);
+		return false;
+	}
+
+	/* older checkpoint is used if latest is damaged */
+	if ((slot[0] = newest_slot()) < 0)
+		return false;
+	checkpoint(slot[0])->sum ^= 1;
+	if (mount_lfs() < 0)
+		return false;
+	if (!CHECK(state_b, gone_b) || umount(MNT) < 0) {
+		dbg("*** lfs test: replay from older checkpoint failed\n");
+		return false;
+	}
+	return newest_slot() == slot[0];
+}
+
+/*
+ * test_torn - replay stops at torn or stale batch
+ */
+static bool
+test_torn(void)
+{
+	struct lfs_batch *h;
+
+	if (mount_lfs() < 0)
+		return false;
+	if (!write_range("t1", 0, 5000, 8, true) ||
+	    !write_range("t2", 0, 5000, 9, true) ||
+	    !crash() || !(h = last_batch()) || h->nblocks == h->hblocks)
+		return false;
+
+	/* last data block never reached the disk */
+	memset((char *)h + (h->nblocks - 1) * LFS_BSIZE, 0xff, LFS_BSIZE);
+	if (mount_lfs() < 0)
+		return false;
+	if (!CHECK(state_t1, gone_t2) || !CHECK(state_b, gone_b)) {
+		dbg("*** lfs test: torn batch replayed\n");
+		return false;
+	}
+
+	/* batch from a previous pass over the disk */
+	if (!write_range("t3", 0, 5000, 10, true) ||
+	    !crash() || !(h = last_batch()))
+		return false;
+	--h->seq;
+	h->sum = batch_sum(h);
+	if (mount_lfs() < 0)
+		return false;
+	if (!CHECK(state_t1, gone_t3) || !CHECK(state_b, gone_b)) {
+		dbg("*** lfs test: stale batch replayed\n");
+		return false;
+	}
+	return umount(MNT) == 0;
+}
+
+static bool
+check_log(unsigned rounds)
+{
+	struct stat st;
+	bool ok;
+	int fd;
+
+	if ((fd = kopen(MNT "/log", O_RDONLY)) < 0)
+		return false;
+	ok = !kfstat(fd, &st) && st.st_size == (off_t)rounds * LFS_BSIZE;
+	for (unsigned r = 0; ok && r < rounds; ++r)
+		ok = check_range(fd, r * LFS_BSIZE, LFS_BSIZE, 100 + r);
+	kclose(fd);
+	if ((fd = kopen(MNT "/churn", O_RDONLY)) < 0)
+		return false;
+	ok = ok && check_range(fd, 0, CHURN * LFS_BSIZE, 1000 + rounds - 1);
+	kclose(fd);
+	return ok;
+}
+
+/*
+ * test_clean - cleaner reclaims segments without losing live data
+ *
+ * Every batch written holds a new block of 'log' so each segment written
+ * here keeps live blocks. Once more segments have been started than the
+ * disk holds, at least one of them must have been cleaned and discarded.
+ */
+static bool
+test_clean(void)
+{
+	unsigned rounds, started = 0;
+	struct statfs sf;
+	ssize_t r = 0;
+	int fd;
+
+	if (mount_lfs() < 0 || statfs(MNT, &sf) < 0)
+		return false;
+	rounds = sf.f_blocks / 2 - CHURN;
+	memset(discards, 0, sizeof discards);
+	for (unsigned i = 0; i < rounds; ++i) {
+		if (!write_range("log", i * LFS_BSIZE, LFS_BSIZE, 100 + i,
+		    false) ||
+		    !write_range("churn", 0, CHURN * LFS_BSIZE, 1000 + i,
+		    true)) {
+			dbg("*** lfs test: write failed in round %u\n", i);
+			return false;
+		}
+	}
+	for (unsigned s = 0; s < nsegs; ++s)
+		started += discards[s];
+	if (started < nsegs || !check_log(rounds)) {
+		dbg("*** lfs test: cleaning failed, %u segments started\n",
+		    started);
+		return false;
+	}
+
+	/* fill the disk */
+	if ((fd = kopen(MNT "/fill", O_WRONLY | O_CREAT, 0644)) < 0)
+		return false;
+	memset(buf, 0x5a, LFS_BSIZE);
+	for (unsigned i = 0; i <= sf.f_blocks && r >= 0; ++i)
+		r = kpwrite(fd, buf, LFS_BSIZE, (off_t)i * LFS_BSIZE);
+	kclose(fd);
+	if (r != -ENOSPC || unlink(MNT "/fill") < 0 || !check_log(rounds)) {
+		dbg("*** lfs test: fill returned %zd\n", r);
+		return false;
+	}
+
+	if (umount(MNT) < 0 || mount_lfs() < 0)
+		return false;
+	if (!check_log(rounds) || !CHECK(state_b, gone_b) ||
+	    !CHECK(state_t1, gone_t3)) {
+		dbg("*** lfs test: data lost after cleaning\n");
+		return false;
+	}
+	return umount(MNT) == 0 && !bad_discard;
+}
+
+void
+lfs_test_init(unsigned segs)
+{
+	phys *p;
+
+	if (segs < LFS_MIN_SEGS || segs > MAX_SEGS) {
+		dbg("*** lfs test: need %u to %u segments\n", LFS_MIN_SEGS,
+		    MAX_SEGS);
+		return;
+	}
+	nsegs = segs;
+	disk_size = segs * SEG_SIZE;
+	if (!(p = page_alloc(disk_size + LFS_BSIZE, MA_NORMAL, &lfs_test_id))) {
+		dbg("*** lfs test: allocation failed\n");
+		return;
+	}
+	disk = phys_to_virt(p);
+	buf = disk + disk_size;
+	memset(disk, 0, disk_size);
+
+	if (!device_create(&io, "lfstest0", DF_BLK, NULL) ||
+	    mkdir(MNT, 0) < 0) {
+		dbg("*** lfs test: setup failed\n");
+		page_free(p, disk_size + LFS_BSIZE, &lfs_test_id);
+		return;
+	}
+
+	if (!test_format() || !test_files() || !test_torn() || !test_clean()) {
+		/* disk is left allocated as it may still be mounted */
+		dbg("*** lfs test: failed\n");
+		return;
+	}
+	page_free(p, disk_size + LFS_BSIZE, &lfs_test_id);
+	dbg("lfs test: passed\n");
+}
@@ -0,0 +1,5 @@
+#
+# File Mapping Test
+#
+SOURCES += \
+    dev/mmap/test/mmap_test.c
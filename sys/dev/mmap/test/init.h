@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * File Mapping Test
+ *
+ * Runs once 'path' can be opened, which should name a file on a file system
+ * using the page cache. For example:
+ *  driver sys/dev/mmap/test("/bin/init")
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mmap_test_init(const char *path);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
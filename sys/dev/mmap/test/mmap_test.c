@@ -0,0 +1,136 @@
+#include "init.h"
+
+#include <debug.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <kernel.h>
+#include <mmap.h>
+#include <page.h>
+#include <sch.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <task.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Maps the first page of a file read-only and shared, which maps page cache
+ * pages directly, then replaces the mapping with a fixed anonymous mapping at
+ * the same address. The cache pages must be released and reused rather than
+ * failing with ENOMEM. Finally a read-only private mapping must be able to
+ * be made writable.
+ */
+
+#define OPEN_TRIES 30	/* seconds to wait for file system */
+
+static char buf[PAGE_SIZE];
+
+static bool
+bad_map(const void *p)
+{
+	return p > (void *)-4096UL;
+}
+
+static bool
+test_fixed(int fd, size_t len)
+{
+	char *f, *m;
+
+	f = mmapfor(kern_task.as, NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+	    0, MA_NORMAL);
+	if (bad_map(f)) {
+		dbg("*** mmap test: shared map failed %d\n", (int)f);
+		return false;
+	}
+	if (memcmp(f, buf, len)) {
+		dbg("*** mmap test: shared map has bad data\n");
+		munmapfor(kern_task.as, f, PAGE_SIZE);
+		return false;
+	}
+
+	m = mmapfor(kern_task.as, f, PAGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0, MA_NORMAL);
+	if (bad_map(m)) {
+		dbg("*** mmap test: fixed map over shared map failed %d\n",
+		    (int)m);
+		munmapfor(kern_task.as, f, PAGE_SIZE);
+		return false;
+	}
+	bool pass = m == f;
+	for (size_t i = 0; pass && i < PAGE_SIZE; ++i)
+		pass = !m[i];
+	if (!pass)
+		dbg("*** mmap test: fixed map not zero filled at %p\n", f);
+	memset(m, 0x5a, PAGE_SIZE);
+	munmapfor(kern_task.as, m, PAGE_SIZE);
+	return pass;
+}
+
+static bool
+test_private(int fd, size_t len)
+{
+	char *p;
+	int err;
+
+	p = mmapfor(kern_task.as, NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd,
+	    0, MA_NORMAL);
+	if (bad_map(p)) {
+		dbg("*** mmap test: private map failed %d\n", (int)p);
+		return false;
+	}
+	if ((err = mprotectfor(kern_task.as, p, PAGE_SIZE,
+	    PROT_READ | PROT_WRITE)) < 0) {
+		dbg("*** mmap test: mprotect of private map failed %d\n", err);
+		munmapfor(kern_task.as, p, PAGE_SIZE);
+		return false;
+	}
+	p[0] ^= 0xff;
+	const bool pass = p[0] != buf[0] && !memcmp(p + 1, buf + 1, len - 1);
+	if (!pass)
+		dbg("*** mmap test: private map has bad data\n");
+	munmapfor(kern_task.as, p, PAGE_SIZE);
+	return pass;
+}
+
+static void
+mmap_test(void *arg)
+{
+	const char *path = arg;
+	int fd = -1;
+
+	for (unsigned i = 0; i < OPEN_TRIES && fd < 0; ++i) {
+		if ((fd = kopen(path, O_RDONLY)) < 0)
+			timer_delay(1000000000);
+	}
+	if (fd < 0) {
+		dbg("*** mmap test: can't open %s\n", path);
+		goto out;
+	}
+
+	const ssize_t len = kpread(fd, buf, sizeof buf, 0);
+	if (len <= 0) {
+		dbg("*** mmap test: can't read %s\n", path);
+		kclose(fd);
+		goto out;
+	}
+
+	const bool pass = test_fixed(fd, len) && test_private(fd, len);
+	kclose(fd);
+
+	if (pass)
+		dbg("mmap test: passed\n");
+
+out:
+	thread_terminate(thread_cur());
+	sch_testexit();
+}
+
+void
+mmap_test_init(const char *path)
+{
+	if (!kthread_create(&mmap_test, (void *)path, PRI_KERN_LOW,
+	    "mmap_test", MA_NORMAL))
+		dbg("*** mmap test: can't create thread\n");
+}
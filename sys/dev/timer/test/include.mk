@@ -0,0 +1,5 @@
+#
+# Timer Stress Test
+#
+SOURCES += \
+    dev/timer/test/timer_test.c
@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Timer Stress Test
+ *
+ * For example:
+ *  driver sys/dev/timer/test(4000)
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void timer_test_init(unsigned timers);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
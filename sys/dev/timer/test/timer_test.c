@@ -0,0 +1,116 @@
+#include "init.h"
+
+#include <debug.h>
+#include <kernel.h>
+#include <page.h>
+#include <string.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Arms a large number of one-shot timers with pseudo random timeouts, stops
+ * or re-arms some of them, then checks that every remaining timer fired
+ * exactly once and never early.
+ */
+
+#define MAX_TIMEOUT 500000000	/* nanoseconds */
+
+struct test_timer {
+	struct timer tmr;
+	uint_fast64_t expire;	/* earliest valid expiry time */
+	uint_fast64_t fired;	/* time of expiry, 0 if not fired */
+	unsigned count;		/* number of times fired */
+	bool armed;
+};
+
+static uint_fast64_t max_late;
+
+static uint32_t
+test_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void
+test_expire(void *arg)
+{
+	struct test_timer *t = arg;
+	t->fired = timer_monotonic();
+	++t->count;
+	if (t->fired > t->expire && t->fired - t->expire > max_late)
+		max_late = t->fired - t->expire;
+}
+
+static void
+test_arm(struct test_timer *t, uint32_t *seed)
+{
+	const uint_fast64_t ns = 1 + test_rand(seed) % MAX_TIMEOUT;
+	t->expire = timer_monotonic() + ns;
+	t->armed = true;
+	timer_callout(&t->tmr, ns, 0, test_expire, t);
+}
+
+void
+timer_test_init(unsigned timers)
+{
+	const size_t size = PAGE_ALIGN(timers * sizeof(struct test_timer));
+	phys *p = page_alloc(size, MA_NORMAL, &timer_test_init);
+	if (!p) {
+		dbg("*** timer test: allocation failed\n");
+		return;
+	}
+	struct test_timer *tt = phys_to_virt(p);
+	memset(tt, 0, size);
+	max_late = 0;
+
+	uint32_t seed = 1;
+	const uint_fast64_t start = timer_monotonic();
+
+	/* arm all timers */
+	for (unsigned i = 0; i < timers; ++i)
+		test_arm(&tt[i], &seed);
+	const uint_fast64_t armed = timer_monotonic();
+
+	/* stop every 4th timer, re-arm every 7th */
+	for (unsigned i = 0; i < timers; ++i) {
+		if (i % 4 == 0) {
+			timer_stop(&tt[i].tmr);
+			tt[i].armed = false;
+		} else if (i % 7 == 0)
+			test_arm(&tt[i], &seed);
+	}
+
+	/* wait for everything to expire */
+	timer_delay(MAX_TIMEOUT * 2ULL);
+
+	unsigned fired = 0;
+	bool pass = true;
+	for (unsigned i = 0; i < timers; ++i) {
+		struct test_timer *t = &tt[i];
+		if (t->armed && t->count != 1) {
+			dbg("*** timer test: timer %u fired %u times\n",
+			    i, t->count);
+			pass = false;
+		} else if (!t->armed && t->count) {
+			dbg("*** timer test: stopped timer %u fired\n", i);
+			pass = false;
+		} else if (t->count && t->fired < t->expire) {
+			dbg("*** timer test: timer %u fired early\n", i);
+			pass = false;
+		}
+		fired += t->count;
+		timer_stop(&t->tmr);
+	}
+
+	page_free(p, size, &timer_test_init);
+
+	if (!pass) {
+		dbg("*** timer test: %u timers failed\n", timers);
+		return;
+	}
+	dbg("timer test: %u timers passed, %u fired, armed in %lluus, "
+	    "max latency %lluus\n", timers, fired,
+	    (unsigned long long)(armed - start) / 1000,
+	    (unsigned long long)max_late / 1000);
+}
@@ -10,9 +10,11 @@
 #include <event.h>
 #include <fcntl.h>
 #include <fs/file.h>
+#include <fs/poll.h>
 #include <fs/util.h>
 #include <memory>
 #include <mutex>
+#include <poll.h>
 #include <sch.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -58,7 +60,9 @@ public:
 	ssize_t read(file *, std::span<std::byte>);
 	ssize_t write(file *, std::span<const std::byte>);
 	int ioctl(file *, u_long, void *);
+	int poll(file *, poll_table *);
 	void terminate();
+	void destroy();
 
 	/* interface to drivers */
 	void *driver_data();
@@ -91,6 +95,7 @@ private:
 	event input_;		    /* input buffer ready */
 	event output_;		    /* output buffer ready */
 	event complete_;	    /* output complete */
+	pollq pollq_;		    /* pollers */
 
 	std::atomic_ulong flags_;   /* tty flags */
 
@@ -159,6 +164,7 @@ tty::tty(size_t rx_bufcnt, size_t rx_bufsiz, std::unique_ptr<phys> rxp,
 	event_init(&input_, "TTY input", event::ev_IO);
 	event_init(&output_, "TTY output", event::ev_IO);
 	event_init(&complete_, "TTY complete", event::ev_IO);
+	pollq_init(&pollq_);
 
 	termios t{};
 	t.c_iflag = TTYDEF_IFLAG;
@@ -477,6 +483,24 @@ tty::ioctl(file *f, u_long cmd, void *arg)
 	return 0;
 }
 
+/*
+ * tty::poll - get tty readiness
+ */
+int
+tty::poll(file *f, poll_table *pt)
+{
+	poll_wait(&pollq_, pt);
+
+	int events = 0;
+	std::lock_guard rl{rxq_lock_};
+	if (rxq_cooked_ != rxq_.begin())
+		events |= POLLIN | POLLRDNORM;
+	std::lock_guard tl{txq_lock_};
+	if (txq_.size() < txq_.capacity())
+		events |= POLLOUT | POLLWRNORM;
+	return events;
+}
+
 /*
  * tty::terminate - terminate all operations running on tty
  */
@@ -486,6 +510,16 @@ tty::terminate()
 	sch_wakeup(&input_, -ENODEV);
 	sch_wakeup(&output_, -ENODEV);
 	sch_wakeup(&complete_, -ENODEV);
+	pollq_notify(&pollq_);
+}
+
+/*
+ * tty::destroy - detach pollers before tty is freed
+ */
+void
+tty::destroy()
+{
+	pollq_destroy(&pollq_);
 }
 
 /*
@@ -574,8 +608,10 @@ tty::tx_getc()
 		return -1;
 	const auto ret = txq_.front();
 	txq_.pop_front();
-	if (txq_.size() <= txq_.capacity() / 2)
+	if (txq_.size() <= txq_.capacity() / 2) {
 		sch_wakeone(&output_);
+		pollq_notify(&pollq_);
+	}
 	tl.unlock();
 
 	if (flags_ & flags::rx_blocked_on_tx_full) {
@@ -632,8 +668,10 @@ tty::tx_advance(size_t count)
 	const auto wakeup = txq_.size() <= txq_.capacity() / 2;
 	tl.unlock();
 
-	if (wakeup)
+	if (wakeup) {
 		sch_wakeone(&output_);
+		pollq_notify(&pollq_);
+	}
 
 	if (flags_ & flags::rx_blocked_on_tx_full) {
 		flags_ &= ~flags::rx_blocked_on_tx_full;
@@ -934,6 +972,7 @@ tty::cook()
 	rl.unlock();
 
 	sch_wakeone(&input_);
+	pollq_notify(&pollq_);
 }
 
 /*
@@ -1136,8 +1175,10 @@ tty::rx_dpc()
 		iproc_(this);
 
 	/* wakeup threads waiting for input */
-	if (dataavail)
+	if (dataavail) {
 		sch_wakeone(&input_);
+		pollq_notify(&pollq_);
+	}
 }
 
 /*
@@ -1212,6 +1253,16 @@ tty_ioctl(file *f, u_long cmd, void *data)
 	return t->ioctl(f, cmd, data);
 }
 
+/*
+ * tty_poll - get tty readiness
+ */
+int
+tty_poll(file *f, poll_table *pt)
+{
+	tty *t = static_cast<tty *>(f->f_data);
+	return t->poll(f, pt);
+}
+
 }
 
 extern "C" {
@@ -1255,6 +1306,7 @@ tty_create(const char *name, long attr, size_t rx_bufsiz, size_t rx_bufmin,
 		.read = tty_read_iov,
 		.write = tty_write_iov,
 		.ioctl = tty_ioctl,
+		.poll = tty_poll,
 	};
 	if (dev = device_create(&tty_io, name, DF_CHR, t.get()); !dev)
 		return (tty *)DERR(-EINVAL);
@@ -1271,7 +1323,7 @@ void
 tty_destroy(tty *t)
 {
 	/* device_hide guarantees that no more threads can call tty_open,
-	 * tty_close, tty_read, tty_write or tty_ioctl on this tty */
+	 * tty_close, tty_read, tty_write, tty_ioctl or tty_poll on this tty */
 	device_hide(t->device());
 
 	/* kill all active operations on this tty */
@@ -1282,6 +1334,7 @@ tty_destroy(tty *t)
 
 	/* destroy tty */
 	device_destroy(t->device());
+	t->destroy();
 	delete t;
 }
 
@@ -42,8 +42,8 @@
  */
 
 #include <ar.h>
-#include <compiler.h>
 #include <debug.h>
+#include <device.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fs.h>
@@ -51,39 +51,177 @@
 #include <fs/mount.h>
 #include <fs/util.h>
 #include <fs/vnode.h>
+#include <jhash3.h>
+#include <kernel.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/param.h>
 #include <sys/uio.h>
 
 #define afsdbg(...)
 
 /*
- * Read an extended filename from archive header
+ * Archive member
  */
-static bool
-read_extended_filename(int fd, const size_t off, char *buf, size_t len)
+struct arfs_file {
+	const char	*name;		/* file name */
+	size_t		 off;		/* offset of file data in archive */
+	size_t		 size;		/* file size */
+	size_t		 next;		/* next file in hash chain */
+};
+
+/*
+ * Archive index, built at mount time
+ */
+struct arfs_mount {
+	void		*xip;		/* archive address for execute in place */
+	size_t		 nfiles;	/* number of files */
+	size_t		 nbuckets;	/* number of hash buckets, power of 2 */
+	struct arfs_file *files;	/* files in archive order */
+	size_t		*buckets;	/* first file in each hash chain */
+	char		*names;		/* name table followed by short names */
+};
+
+/*
+ * Read archive member header
+ *
+ * Returns 0 at end of archive, 1 if a header was read.
+ */
+static int
+read_header(int fd, size_t off, struct ar_hdr *h, size_t *size)
 {
-	char *p;
 	ssize_t rd;
-	size_t size;
+
+	if ((rd = kpread(fd, h, sizeof *h, off)) < 0)
+		return rd;
+	if (rd < (ssize_t)sizeof *h)
+		return 0;
+	if (strncmp(h->ar_fmag, ARFMAG, sizeof ARFMAG - 1))
+		return DERR(-EIO);
+	*size = atol(h->ar_size);
+	return 1;
+}
+
+/*
+ * Get offset of next archive member header
+ */
+static size_t
+next_header(size_t off, size_t size)
+{
+	off += sizeof(struct ar_hdr) + size;
+	return off + off % 2; /* Pad to even boundary */
+}
+
+static size_t
+name_hash(const struct arfs_mount *am, const char *name, size_t len)
+{
+	return jhash(name, len, 0) & (am->nbuckets - 1);
+}
+
+/*
+ * Build index of archive members
+ *
+ * Long names are taken from the GNU '//' name table which is read once and
+ * used in place.
+ */
+static int
+build_index(struct mount *mp)
+{
+	int err;
+	char *p;
 	struct ar_hdr h;
-	if (kpread(fd, &h, sizeof h, SARMAG) != sizeof h)
-		return false;
-	if (strncmp(h.ar_fmag, ARFMAG, sizeof ARFMAG  - 1))
-		return false;
-	if (h.ar_name[0] != '/' || h.ar_name[1] != '/')
-		return false;
-	size = atol(h.ar_size);
-	if (off >= size)
-		return false;
-	if ((rd = kpread(fd, buf, MIN(size - off, len), SARMAG + sizeof h + off)) < 0)
-		return false;
-	buf[rd == len ? len - 1 : rd] = 0;
-	if (!(p = memchr(buf, '/', rd)))
-		return false;
-	*p = 0;
-	return true;
+	struct arfs_mount *am;
+	size_t off, size, nfiles = 0, tbl_off = 0, tbl_size = 0;
+
+	/* count files and find name table */
+	for (off = SARMAG; (err = read_header(mp->m_devfd, off, &h, &size)) > 0;
+	    off = next_header(off, size)) {
+		if (h.ar_name[0] != '/' ||
+		    (h.ar_name[1] >= '0' && h.ar_name[1] <= '9'))
+			++nfiles;
+		else if (h.ar_name[1] == '/') {
+			tbl_off = off + sizeof h;
+			tbl_size = size;
+		}
+	}
+	if (err < 0)
+		return err;
+
+	const size_t nbuckets = nfiles > 1 ? 1UL << ceil_log2(nfiles) : 1;
+	const size_t short_len = sizeof h.ar_name + 1;
+	if (!(am = malloc(sizeof *am + nfiles * sizeof *am->files +
+	    nbuckets * sizeof *am->buckets + tbl_size + 1 +
+	    nfiles * short_len)))
+		return DERR(-ENOMEM);
+	am->xip = NULL;
+	am->nfiles = 0;
+	am->nbuckets = nbuckets;
+	am->files = (struct arfs_file *)(am + 1);
+	am->buckets = (size_t *)(am->files + nfiles);
+	am->names = (char *)(am->buckets + nbuckets);
+	for (size_t i = 0; i < nbuckets; ++i)
+		am->buckets[i] = nfiles;
+
+	/* read name table, names are terminated by "/\n" */
+	if (tbl_size &&
+	    kpread(mp->m_devfd, am->names, tbl_size, tbl_off) != (ssize_t)tbl_size) {
+		free(am);
+		return DERR(-EIO);
+	}
+	for (size_t i = 1; i < tbl_size; ++i) {
+		if (am->names[i] == '\n' && am->names[i - 1] == '/')
+			am->names[i - 1] = 0;
+	}
+	am->names[tbl_size] = 0;
+	p = am->names + tbl_size + 1;
+
+	/* index files */
+	for (off = SARMAG; (err = read_header(mp->m_devfd, off, &h, &size)) > 0;
+	    off = next_header(off, size)) {
+		const char *name;
+		if (am->nfiles == nfiles)
+			break;
+		if (h.ar_name[0] == '/') {
+			if (h.ar_name[1] < '0' || h.ar_name[1] > '9')
+				continue;
+			/* extended filename */
+			const size_t n = atol(h.ar_name + 1);
+			if (n >= tbl_size) {
+				err = DERR(-EIO);
+				break;
+			}
+			name = am->names + n;
+		} else {
+			/* short name is terminated by '/' or padded */
+			size_t n = sizeof h.ar_name;
+			const char *e = memchr(h.ar_name, '/', n);
+			if (e)
+				n = e - h.ar_name;
+			while (n && h.ar_name[n - 1] == ' ')
+				--n;
+			memcpy(p, h.ar_name, n);
+			p[n] = 0;
+			name = p;
+			p += n + 1;
+		}
+		struct arfs_file *f = &am->files[am->nfiles];
+		const size_t b = name_hash(am, name, strlen(name));
+		f->name = name;
+		f->off = off + sizeof h;
+		f->size = size;
+		f->next = am->buckets[b];
+		am->buckets[b] = am->nfiles++;
+	}
+	if (err < 0) {
+		free(am);
+		return err;
+	}
+
+	/* Files can be executed in place if device is memory resident */
+	if (kioctl(mp->m_devfd, DIOCXIPADDR, &am->xip) < 0)
+		am->xip = NULL;
+
+	mp->m_data = am;
+	return 0;
 }
 
 /*
@@ -108,11 +246,26 @@ arfs_mount(struct mount *mp, int flags, const void *data)
 		return DERR(-EINVAL);
 	}
 
+	/* Index archive so that lookups need no device I/O */
+	if ((err = build_index(mp)) < 0)
+		return err;
+
 	/* Ok, we find the archive */
 	mp->m_flags |= MS_RDONLY;
 	return 0;
 }
 
+/*
+ * Unmount file system.
+ */
+static int
+arfs_umount(struct mount *mp)
+{
+	free(mp->m_data);
+	mp->m_data = NULL;
+	return 0;
+}
+
 /*
  * Lookup vnode for the specified file/directory.
  * The vnode is filled properly.
@@ -121,63 +274,25 @@ static int
 arfs_lookup(struct vnode *dvp, const char *name, const size_t name_len,
     struct vnode *vp)
 {
-	struct ar_hdr h;
-	const struct mount *mp = vp->v_mount;
-	size_t off = SARMAG;
-	size_t size;
-	char *ar_name;
-	char name_buf[128];
+	const struct arfs_mount *am = vp->v_mount->m_data;
+	const struct arfs_file *f;
 
 	afsdbg("arfs_lookup: name=(%zu):%s\n", name_len, name);
 
-	/* File name too long - impossible to match */
-	if (name_len >= sizeof name_buf - 1)
-		return DERR(-ENOENT);
-
-	for (;;) {
-		int err;
+	for (size_t i = am->buckets[name_hash(am, name, name_len)];
+	    i != am->nfiles; i = f->next) {
+		f = &am->files[i];
+		if (strncmp(name, f->name, name_len) || f->name[name_len])
+			continue;
 
-		if ((err = kpread(mp->m_devfd, &h, sizeof(h), off)) < 0)
-			return err;
-		if (err == 0)
-			return DERR(-ENOENT);
-
-		/* Check file header */
-		if (strncmp(h.ar_fmag, ARFMAG, sizeof(ARFMAG) - 1))
-			return DERR(-EIO);
-
-		/* Get file size */
-		size = atol(h.ar_size);
-
-		if (h.ar_name[0] == '/') {
-			/* filename directory */
-			if (h.ar_name[1] == '/')
-				goto next;
-			/* extended filename */
-			if (!read_extended_filename(mp->m_devfd,
-			    atol(h.ar_name + 1), name_buf, sizeof name_buf))
-				return DERR(-EIO);
-			ar_name = name_buf;
-		} else
-			ar_name = h.ar_name;
-
-		/* Compare file name */
-		if (!strncmp(name, ar_name, name_len) &&
-		    (!ar_name[name_len] || ar_name[name_len] == '/'))
-			break;
-
-		/* Proceed to next archive header */
-next:
-		off += sizeof(h) + size;
-		off += off % 2; /* Pad to even boundary */
+		/* No write access */
+		vp->v_mode = S_IFREG | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+		vp->v_size = f->size;
+		vp->v_data = (void *)f->off;
+		return 0;
 	}
 
-	/* No write access */
-	vp->v_mode = S_IFREG | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-	vp->v_size = size;
-	vp->v_data = (void *)(off + sizeof(struct ar_hdr));
-
-	return 0;
+	return DERR(-ENOENT);
 }
 
 static ssize_t
@@ -212,13 +327,35 @@ arfs_read_iov(struct file *fp, const struct iovec *iov, size_t count,
 	return for_each_iov(fp, iov, count, offset, arfs_read);
 }
 
+/*
+ * Get address of file data for execute in place.
+ */
+static int
+arfs_xip(struct vnode *vp, off_t off, size_t len, void **addr)
+{
+	const struct arfs_mount *am = vp->v_mount->m_data;
+
+	if (!am->xip)
+		return -ENOTSUP;
+
+	/*
+	 * Archive members are not padded to a page boundary, so the bytes
+	 * after a member belong to the next member rather than reading as
+	 * zero. A mapping which extends past the end of the file can't
+	 * execute in place and falls back to the page cache.
+	 */
+	if (off < 0 || off >= vp->v_size || (off_t)len > vp->v_size - off)
+		return -EINVAL;
+
+	*addr = (char *)am->xip + (size_t)vp->v_data + off;
+	return 0;
+}
+
 static int
 arfs_readdir(struct file *fp, struct dirent *buf, size_t len)
 {
-	const struct mount *mp = fp->f_vnode->v_mount;
+	const struct arfs_mount *am = fp->f_vnode->v_mount->m_data;
 	size_t remain = len;
-	int err = 0;
-	char name_buf[128];
 
 	if (fp->f_offset == 0) {
 		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, "."))
@@ -232,61 +369,18 @@ arfs_readdir(struct file *fp, struct dirent *buf, size_t len)
 		++fp->f_offset;
 	}
 
-	size_t i = 2;
-	off_t off = SARMAG;	/* offset in archive image */
-	for (;;) {
-		struct ar_hdr h;
-
-		/* read file header */
-		if ((err = kpread(mp->m_devfd, &h, sizeof(h), off)) <= 0)
-			goto out;
-
-		/* Check file header */
-		if (strncmp(h.ar_fmag, ARFMAG, sizeof(ARFMAG) - 1)) {
-			err = DERR(-EIO);
+	for (size_t i = fp->f_offset - 2; i < am->nfiles; ++i) {
+		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_REG,
+		    am->files[i].name))
 			goto out;
-		}
-
-		/* Get file size */
-		size_t size = atol(h.ar_size);
-
-		if (i == fp->f_offset) {
-			/* Convert archive name */
-			char *p;
-			if (!(p = memchr(h.ar_name, '/', ARRAY_SIZE(h.ar_name)))) {
-				err = DERR(-EIO);
-				goto out;
-			}
-			const char *name = 0;
-			if (p != h.ar_name) {
-				*p = 0;
-				name = h.ar_name;
-			} else if (h.ar_name[1] != '/') {
-				/* Extended filename */
-				if (!read_extended_filename(mp->m_devfd,
-				    atol(h.ar_name + 1), name_buf, sizeof name_buf))
-					return DERR(-EIO);
-				name = name_buf;
-			}
-			if (name && dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_REG, name))
-				goto out;
-			++fp->f_offset;
-		}
-
-		/* Proceed to next archive header */
-		off += sizeof(h) + size;
-		off += off % 2; /* Pad to even boundary */
-
-		++i;
+		++fp->f_offset;
 	}
 
 out:
-	if (remain != len)
-		return len - remain;
-
-	return err;
+	return len - remain;
 }
 
+
 /*
  * vnode operations
  */
@@ -297,6 +391,7 @@ const struct vnops arfs_vnops = {
 	.vop_write = (vnop_write_fn)vop_nullop,
 	.vop_seek = (vnop_seek_fn)vop_nullop,
 	.vop_ioctl = (vnop_ioctl_fn)vop_einval,
+	.vop_poll = (vnop_poll_fn)vop_pollready,
 	.vop_fsync = (vnop_fsync_fn)vop_nullop,
 	.vop_readdir = arfs_readdir,
 	.vop_lookup = arfs_lookup,
@@ -307,6 +402,7 @@ const struct vnops arfs_vnops = {
 	.vop_setattr = (vnop_setattr_fn)vop_nullop,
 	.vop_inactive = (vnop_inactive_fn)vop_nullop,
 	.vop_truncate = (vnop_truncate_fn)vop_nullop,
+	.vop_xip = arfs_xip,
 };
 
 /*
@@ -315,11 +411,12 @@ const struct vnops arfs_vnops = {
 static const struct vfsops arfs_vfsops = {
 	.vfs_init = (vfsop_init_fn)vfs_nullop,
 	.vfs_mount = arfs_mount,
-	.vfs_umount = (vfsop_umount_fn)vfs_nullop,
+	.vfs_umount = arfs_umount,
 	.vfs_sync = (vfsop_sync_fn)vfs_nullop,
 	.vfs_vget = (vfsop_vget_fn)vfs_nullop,
 	.vfs_statfs = (vfsop_statfs_fn)vfs_nullop,
 	.vfs_vnops = &arfs_vnops,
+	.vfs_flags = VFSF_PCACHE | VFSF_NCACHE,
 };
 
 REGISTER_FILESYSTEM(arfs);
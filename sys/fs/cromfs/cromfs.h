@@ -0,0 +1,70 @@
+#ifndef cromfs_h
+#define cromfs_h
+
+/*
+ * cromfs.h - compressed ROM file system image format
+ *
+ * Images are built by mkcromfs. All fields are little endian.
+ *
+ *	| super | inodes | dirents | names | block index | digests | blocks |
+ *	| xip data |
+ *
+ * Everything up to the end of the digest table is metadata which is used in
+ * place if the image is memory resident.
+ *
+ * Regular files and symbolic links are split into blocks of 1 << block_shift
+ * bytes which are LZ4 compressed individually. Block i occupies image bytes
+ * [index[i], index[i + 1]) and is stored uncompressed if that is no smaller
+ * than its uncompressed size. The blocks of a file are consecutive in the
+ * index.
+ *
+ * Files flagged CROM_XIP are stored uncompressed, aligned to a page, so
+ * that they can be mapped or executed in place.
+ *
+ * Directory entries are sorted by name. Inode 0 is the root directory.
+ *
+ * If the image has CROM_SHA256 set the digest table holds the SHA-256 digest
+ * of the uncompressed data of each inode, indexed by inode number.
+ * Directories have all zero digests. Otherwise the table is empty.
+ */
+
+#include <stdint.h>
+
+#define CROM_MAGIC	0x4d4f5243	/* "CROM" */
+#define CROM_VERSION	1
+#define CROM_MIN_SHIFT	12		/* minimum block size 4KiB */
+#define CROM_MAX_SHIFT	16		/* maximum block size 64KiB */
+#define CROM_DIGEST_LEN	32		/* bytes in SHA-256 digest */
+
+/* image flags */
+#define CROM_SHA256	0x0001		/* image has digest table */
+
+struct crom_super {
+	uint32_t	 magic;
+	uint32_t	 version;
+	uint32_t	 flags;
+	uint32_t	 size;		/* image size */
+	uint32_t	 block_shift;	/* log2 of block size */
+	uint32_t	 ninodes;	/* number of inodes */
+	uint32_t	 ndirents;	/* number of directory entries */
+	uint32_t	 names_size;	/* bytes in name table */
+	uint32_t	 nblocks;	/* number of compressed blocks */
+};
+
+/* inode flags */
+#define CROM_XIP	0x0001		/* data is uncompressed at 'data' */
+
+struct crom_inode {
+	uint16_t	 mode;
+	uint16_t	 flags;
+	uint32_t	 size;		/* bytes, or entries for a directory */
+	uint32_t	 data;		/* first block, image offset or dirent */
+};
+
+struct crom_dirent {
+	uint32_t	 ino;
+	uint32_t	 name;		/* offset in name table */
+	uint32_t	 namelen;
+};
+
+#endif /* !cromfs_h */
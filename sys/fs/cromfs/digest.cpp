@@ -0,0 +1,28 @@
+/*
+ * digest.cpp - file digests for compressed ROM file system
+ */
+
+#include "digest.h"
+
+#include <algorithm>
+#include <lib/crypto/sha256.h>
+
+/*
+ * crom_digest - calculate SHA-256 digest of data returned by 'next'
+ */
+int
+crom_digest(crom_chunk_fn next, void *arg, uint8_t *digest)
+{
+	crypto::sha256 h;
+	const void *data;
+	size_t len;
+	int r;
+
+	while ((r = next(arg, &data, &len)) > 0)
+		h.process({static_cast<const std::byte *>(data), len});
+	if (r < 0)
+		return r;
+	const auto d = h.complete();
+	std::copy(d.begin(), d.end(), reinterpret_cast<std::byte *>(digest));
+	return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef digest_h
+#define digest_h
+
+/*
+ * digest.h - file digests for compressed ROM file system
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Get next chunk of data to hash. Returns 1 if '*data' and '*len' are
+ * set, 0 at end of data or a negative error code.
+ */
+typedef int (*crom_chunk_fn)(void *, const void **, size_t *);
+
+int crom_digest(crom_chunk_fn, void *, uint8_t *);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* !digest_h */
@@ -0,0 +1,9 @@
+#
+# Compressed ROM File System
+#
+
+SOURCES += \
+    fs/cromfs/digest.cpp \
+    fs/cromfs/lz4.c \
+    fs/cromfs/vnops.c \
+
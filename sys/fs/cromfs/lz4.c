@@ -0,0 +1,87 @@
+/*
+ * lz4.c - LZ4 block decompression
+ *
+ * Decodes the LZ4 block format: a sequence of tokens, each giving a run of
+ * literals followed by a match copied from earlier output. The input is
+ * untrusted so every length and offset is checked.
+ */
+
+#include "lz4.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * lz4_length - read extended length
+ */
+static int
+lz4_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	unsigned b;
+
+	do {
+		if (*ip == end)
+			return -EIO;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/*
+ * lz4_decompress - decompress block from 'src' to 'dst'
+ *
+ * Returns decompressed length or -EIO if the block is corrupt or does not
+ * fit in 'dlen' bytes.
+ */
+ssize_t
+lz4_decompress(const void *src, size_t slen, void *dst, size_t dlen)
+{
+	const uint8_t *ip = src;
+	const uint8_t *const iend = ip + slen;
+	uint8_t *op = dst;
+	uint8_t *const oend = op + dlen;
+
+	while (ip < iend) {
+		const unsigned token = *ip++;
+		size_t len = token >> 4;
+
+		/* literals */
+		if (len == 15 && lz4_length(&ip, iend, &len) < 0)
+			return -EIO;
+		if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+			return -EIO;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* match */
+		if (iend - ip < 2)
+			return -EIO;
+		const size_t off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!off || off > (size_t)(op - (uint8_t *)dst))
+			return -EIO;
+		len = token & 15;
+		if (len == 15 && lz4_length(&ip, iend, &len) < 0)
+			return -EIO;
+		len += 4;
+		if ((size_t)(oend - op) < len)
+			return -EIO;
+		const uint8_t *m = op - off;
+		if (off >= len) {
+			memcpy(op, m, len);
+			op += len;
+		} else {
+			/* overlapping match repeats a pattern */
+			while (len--)
+				*op++ = *m++;
+		}
+	}
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,13 @@
+#ifndef lz4_h
+#define lz4_h
+
+/*
+ * lz4.h - LZ4 block decompression
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+ssize_t lz4_decompress(const void *, size_t, void *, size_t);
+
+#endif /* !lz4_h */
@@ -0,0 +1,619 @@
+/*
+ * vnops.c - vnode operations for compressed ROM file system.
+ */
+
+/**
+ * General design:
+ *
+ * CROMFS is a read-only file system for images built by mkcromfs. File
+ * data is compressed in blocks which are decompressed on demand so that
+ * only the parts of an image which are used cost memory. A few recently
+ * used blocks are kept decompressed so that reads smaller than a block
+ * don't decompress it repeatedly. Reads of whole blocks decompress straight
+ * into the caller's buffer.
+ *
+ * If the image is memory resident its metadata and compressed blocks are
+ * used in place and files stored uncompressed can be executed in place.
+ * Otherwise the metadata is read into memory at mount time.
+ *
+ * Images may carry a SHA-256 digest for each file. A file is checked against
+ * its digest when it is first read or mapped rather than at mount time so
+ * that files which are never used cost nothing. The result is remembered
+ * until the file system is unmounted.
+ */
+
+#include "cromfs.h"
+
+#include "digest.h"
+#include "lz4.h"
+#include <debug.h>
+#include <device.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <fs/mount.h>
+#include <fs/util.h>
+#include <fs/vnode.h>
+#include <kernel.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <page.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sync.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#define cfsdbg(...)
+
+#define CROM_CACHE	4		/* decompressed blocks cached per mount */
+
+/* file digest state */
+#define CROM_UNCHECKED	0
+#define CROM_GOOD	1
+#define CROM_BAD	2
+
+/*
+ * Page ownership identifier for CROMFS
+ */
+static char cromfs_id;
+
+/*
+ * Decompressed block
+ */
+struct crom_cache {
+	uint32_t	 blk;		/* block number */
+	unsigned	 used;		/* time of last use, 0 if empty */
+	char		*data;		/* decompressed data */
+};
+
+/*
+ * Mounted image
+ */
+struct crom_mount {
+	struct mutex	 lock;		/* protects cache, buf, clock and checked */
+	int		 fd;		/* device */
+	const char	*xip;		/* image address if memory resident */
+	char		*meta;		/* metadata copy if not resident */
+	char		*buf;		/* compressed block if not resident */
+	size_t		 meta_len;	/* bytes of metadata */
+	size_t		 bsize;		/* block size */
+	struct crom_super sb;
+	const struct crom_inode *inodes;
+	const struct crom_dirent *dirents;
+	const char	*names;
+	const uint32_t	*index;		/* block index */
+	const uint8_t	*digests;	/* file digests, NULL if none */
+	uint8_t		*checked;	/* digest state per inode */
+	unsigned	 clock;		/* cache use counter */
+	struct crom_cache cache[CROM_CACHE];
+};
+
+/*
+ * Iterator over file data for digest calculation
+ */
+struct crom_walk {
+	struct crom_mount *cm;
+	const struct crom_inode *ip;
+	uint32_t	 pos;		/* bytes done */
+};
+
+/*
+ * Get number of blocks in file
+ */
+static uint64_t
+crom_nblocks(const struct crom_mount *cm, uint32_t size)
+{
+	return ((uint64_t)size + cm->bsize - 1) >> cm->sb.block_shift;
+}
+
+/*
+ * Check image metadata so that lookups and reads need no further checks
+ */
+static int
+crom_check(const struct crom_mount *cm)
+{
+	const struct crom_super *sb = &cm->sb;
+
+	if (!sb->ninodes || !S_ISDIR(cm->inodes[0].mode))
+		return DERR(-EINVAL);
+	if (cm->index[0] < cm->meta_len || cm->index[sb->nblocks] > sb->size)
+		return DERR(-EINVAL);
+	for (size_t i = 0; i < sb->nblocks; ++i) {
+		if (cm->index[i] > cm->index[i + 1] ||
+		    cm->index[i + 1] - cm->index[i] > cm->bsize)
+			return DERR(-EINVAL);
+	}
+	for (size_t i = 0; i < sb->ninodes; ++i) {
+		const struct crom_inode *ip = &cm->inodes[i];
+		if (S_ISDIR(ip->mode)) {
+			if ((uint64_t)ip->data + ip->size > sb->ndirents)
+				return DERR(-EINVAL);
+		} else if (ip->flags & CROM_XIP) {
+			if ((uint64_t)ip->data + ip->size > sb->size)
+				return DERR(-EINVAL);
+		} else if (ip->data + crom_nblocks(cm, ip->size) > sb->nblocks)
+			return DERR(-EINVAL);
+	}
+	for (size_t i = 0; i < sb->ndirents; ++i) {
+		const struct crom_dirent *d = &cm->dirents[i];
+		if (!d->ino || d->ino >= sb->ninodes || !d->namelen ||
+		    d->namelen > NAME_MAX ||
+		    (uint64_t)d->name + d->namelen >= sb->names_size ||
+		    cm->names[d->name + d->namelen])
+			return DERR(-EINVAL);
+	}
+	return 0;
+}
+
+/*
+ * Free mount data
+ */
+static void
+crom_free(struct crom_mount *cm)
+{
+	for (size_t i = 0; i < CROM_CACHE; ++i) {
+		if (cm->cache[i].data)
+			page_free(virt_to_phys(cm->cache[i].data), cm->bsize,
+			    &cromfs_id);
+	}
+	if (cm->buf)
+		page_free(virt_to_phys(cm->buf), cm->bsize, &cromfs_id);
+	free(cm->checked);
+	free(cm->meta);
+	free(cm);
+}
+
+/*
+ * Decompress block 'b' of uncompressed length 'len' to 'dst'
+ */
+static int
+crom_decompress(struct crom_mount *cm, uint32_t b, char *dst, size_t len)
+{
+	const uint32_t start = cm->index[b];
+	const size_t clen = cm->index[b + 1] - start;
+	const char *src;
+	ssize_t r;
+
+	if (cm->xip)
+		src = cm->xip + start;
+	else {
+		if ((r = kpread(cm->fd, cm->buf, clen, start)) < 0)
+			return r;
+		if ((size_t)r != clen)
+			return DERR(-EIO);
+		src = cm->buf;
+	}
+
+	/* incompressible blocks are stored as is */
+	if (clen >= len) {
+		if (clen != len)
+			return DERR(-EIO);
+		memcpy(dst, src, len);
+		return 0;
+	}
+	if (lz4_decompress(src, clen, dst, len) != (ssize_t)len)
+		return DERR(-EIO);
+	return 0;
+}
+
+/*
+ * Find block in cache
+ */
+static struct crom_cache *
+crom_cached(struct crom_mount *cm, uint32_t b)
+{
+	for (size_t i = 0; i < CROM_CACHE; ++i) {
+		struct crom_cache *c = &cm->cache[i];
+		if (c->used && c->blk == b) {
+			c->used = ++cm->clock;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Decompress block into least recently used cache entry
+ */
+static int
+crom_fill(struct crom_mount *cm, uint32_t b, size_t len,
+    struct crom_cache **cp)
+{
+	struct crom_cache *c = &cm->cache[0];
+	phys *p;
+	int err;
+
+	for (size_t i = 1; i < CROM_CACHE; ++i) {
+		if (cm->cache[i].used < c->used)
+			c = &cm->cache[i];
+	}
+	if (!c->data) {
+		if (!(p = page_alloc(cm->bsize, MA_NORMAL, &cromfs_id)))
+			return DERR(-ENOMEM);
+		c->data = phys_to_virt(p);
+	}
+	c->used = 0;
+	if ((err = crom_decompress(cm, b, c->data, len)) < 0)
+		return err;
+	c->blk = b;
+	c->used = ++cm->clock;
+	*cp = c;
+	return 0;
+}
+
+/*
+ * Get next block of file data for digest
+ */
+static int
+crom_walk_next(void *arg, const void **data, size_t *len)
+{
+	struct crom_walk *w = arg;
+	struct crom_mount *cm = w->cm;
+	const struct crom_inode *ip = w->ip;
+	struct crom_cache *c;
+	ssize_t r;
+
+	if (w->pos == ip->size)
+		return 0;
+	size_t n = MIN(cm->bsize, ip->size - w->pos);
+
+	if (!(ip->flags & CROM_XIP)) {
+		const uint32_t b = ip->data + (w->pos >> cm->sb.block_shift);
+		if (!(c = crom_cached(cm, b)) && (r = crom_fill(cm, b, n, &c)) < 0)
+			return r;
+		*data = c->data;
+	} else if (cm->xip) {
+		/* resident uncompressed data can be hashed in one go */
+		n = ip->size;
+		*data = cm->xip + ip->data;
+	} else {
+		if ((r = kpread(cm->fd, cm->buf, n, ip->data + w->pos)) < 0)
+			return r;
+		if ((size_t)r != n)
+			return DERR(-EIO);
+		*data = cm->buf;
+	}
+	*len = n;
+	w->pos += n;
+	return 1;
+}
+
+/*
+ * Check file against its digest on first access
+ *
+ * Must be called with cm->lock held.
+ */
+static int
+crom_verify(struct crom_mount *cm, const struct crom_inode *ip)
+{
+	const size_t ino = ip - cm->inodes;
+	struct crom_walk w = {.cm = cm, .ip = ip};
+	uint8_t digest[CROM_DIGEST_LEN];
+	int err;
+
+	if (!cm->digests)
+		return 0;
+	switch (cm->checked[ino]) {
+	case CROM_GOOD:
+		return 0;
+	case CROM_BAD:
+		return DERR(-EIO);
+	}
+
+	/* read errors may be transient so only remember digest mismatch */
+	if ((err = crom_digest(crom_walk_next, &w, digest)) < 0)
+		return err;
+	if (memcmp(digest, cm->digests + ino * CROM_DIGEST_LEN,
+	    CROM_DIGEST_LEN)) {
+		dbg("cromfs: inode %zu failed integrity check\n", ino);
+		cm->checked[ino] = CROM_BAD;
+		return DERR(-EIO);
+	}
+	cm->checked[ino] = CROM_GOOD;
+	return 0;
+}
+
+/*
+ * Mount file system.
+ */
+static int
+cromfs_mount(struct mount *mp, int flags, const void *data)
+{
+	struct crom_super sb;
+	struct crom_mount *cm;
+	uint64_t dev_size;
+	const char *meta;
+	phys *p;
+	ssize_t r;
+	int err;
+
+	/* Read super block */
+	if ((r = kpread(mp->m_devfd, &sb, sizeof sb, 0)) < 0)
+		return r;
+	if (r != sizeof sb || sb.magic != CROM_MAGIC ||
+	    sb.version != CROM_VERSION || sb.block_shift < CROM_MIN_SHIFT ||
+	    sb.block_shift > CROM_MAX_SHIFT || sb.names_size % 4) {
+		cfsdbg("cromfs_mount: invalid image\n");
+		return DERR(-EINVAL);
+	}
+	const uint64_t digests_len = sb.flags & CROM_SHA256 ?
+	    (uint64_t)sb.ninodes * CROM_DIGEST_LEN : 0;
+	const uint64_t meta_len = sizeof sb +
+	    (uint64_t)sb.ninodes * sizeof(struct crom_inode) +
+	    (uint64_t)sb.ndirents * sizeof(struct crom_dirent) +
+	    sb.names_size + ((uint64_t)sb.nblocks + 1) * sizeof(uint32_t) +
+	    digests_len;
+	if (meta_len > sb.size)
+		return DERR(-EINVAL);
+	if (kioctl(mp->m_devfd, BLKGETSIZE64, &dev_size) < 0)
+		dev_size = 0;
+	if (dev_size && sb.size > dev_size) {
+		cfsdbg("cromfs_mount: image larger than device\n");
+		return DERR(-EINVAL);
+	}
+
+	if (!(cm = malloc(sizeof *cm)))
+		return DERR(-ENOMEM);
+	*cm = (struct crom_mount){
+		.fd = mp->m_devfd,
+		.meta_len = meta_len,
+		.bsize = 1UL << sb.block_shift,
+		.sb = sb,
+	};
+	mutex_init(&cm->lock);
+	if (digests_len && !(cm->checked = calloc(sb.ninodes, 1))) {
+		crom_free(cm);
+		return DERR(-ENOMEM);
+	}
+
+	/* Use image in place if device is memory resident and large enough */
+	if (!dev_size || kioctl(mp->m_devfd, DIOCXIPADDR, &cm->xip) < 0)
+		cm->xip = NULL;
+	if (cm->xip)
+		meta = cm->xip;
+	else {
+		if (!(cm->meta = malloc(meta_len)) ||
+		    !(p = page_alloc(cm->bsize, MA_NORMAL, &cromfs_id))) {
+			crom_free(cm);
+			return DERR(-ENOMEM);
+		}
+		cm->buf = phys_to_virt(p);
+		if ((r = kpread(mp->m_devfd, cm->meta, meta_len, 0)) !=
+		    (ssize_t)meta_len) {
+			crom_free(cm);
+			return r < 0 ? r : DERR(-EIO);
+		}
+		meta = cm->meta;
+	}
+	cm->inodes = (const struct crom_inode *)(meta + sizeof sb);
+	cm->dirents = (const struct crom_dirent *)(cm->inodes + sb.ninodes);
+	cm->names = (const char *)(cm->dirents + sb.ndirents);
+	cm->index = (const uint32_t *)(cm->names + sb.names_size);
+	if (digests_len)
+		cm->digests = (const uint8_t *)(cm->index + sb.nblocks + 1);
+
+	if ((err = crom_check(cm)) < 0) {
+		crom_free(cm);
+		return err;
+	}
+
+	cfsdbg("cromfs_mount: %u inodes, %u blocks\n", sb.ninodes, sb.nblocks);
+	mp->m_data = cm;
+	mp->m_root->v_data = (void *)&cm->inodes[0];
+	mp->m_flags |= MS_RDONLY;
+	return 0;
+}
+
+/*
+ * Unmount file system.
+ */
+static int
+cromfs_umount(struct mount *mp)
+{
+	crom_free(mp->m_data);
+	mp->m_data = NULL;
+	return 0;
+}
+
+/*
+ * Lookup vnode for the specified file/directory.
+ */
+static int
+cromfs_lookup(struct vnode *dvp, const char *name, size_t name_len,
+    struct vnode *vp)
+{
+	const struct crom_mount *cm = vp->v_mount->m_data;
+	const struct crom_inode *dip = dvp->v_data;
+	size_t lo = dip->data, hi = dip->data + dip->size;
+
+	cfsdbg("cromfs_lookup: name=(%zu):%s\n", name_len, name);
+
+	/* entries are sorted by name */
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const struct crom_dirent *d = &cm->dirents[mid];
+		int c = memcmp(name, cm->names + d->name, MIN(name_len,
+		    d->namelen));
+		if (!c)
+			c = (name_len > d->namelen) - (name_len < d->namelen);
+		if (c < 0)
+			hi = mid;
+		else if (c > 0)
+			lo = mid + 1;
+		else {
+			const struct crom_inode *ip = &cm->inodes[d->ino];
+			vp->v_data = (void *)ip;
+			vp->v_mode = ip->mode;
+			vp->v_size = S_ISDIR(ip->mode) ? 0 : ip->size;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static ssize_t
+cromfs_read(struct file *fp, void *buf, size_t size, off_t offset)
+{
+	const struct vnode *vp = fp->f_vnode;
+	struct crom_mount *cm = vp->v_mount->m_data;
+	const struct crom_inode *ip = vp->v_data;
+	struct crom_cache *c;
+	ssize_t r = 0;
+
+	if (!S_ISREG(ip->mode) && !S_ISLNK(ip->mode))
+		return -EINVAL;
+
+	/* Check if current file position is already end of file. */
+	if (offset >= ip->size)
+		return 0;
+
+	/* Get the actual read size. */
+	if (ip->size - offset < size)
+		size = ip->size - offset;
+
+	mutex_lock(&cm->lock);
+	if ((r = crom_verify(cm, ip)) < 0)
+		goto out;
+
+	/* Uncompressed data is read directly */
+	if (ip->flags & CROM_XIP) {
+		mutex_unlock(&cm->lock);
+		return kpread(cm->fd, buf, size, ip->data + offset);
+	}
+
+	for (size_t t = 0; t < size;) {
+		const off_t pos = offset + t;
+		const size_t blk = pos >> cm->sb.block_shift;
+		const size_t off = pos & (cm->bsize - 1);
+		const size_t n = MIN(size - t, cm->bsize - off);
+		const size_t len = MIN(cm->bsize, (size_t)(ip->size - (pos - off)));
+		const uint32_t b = ip->data + blk;
+		char *const p = (char *)buf + t;
+
+		if ((c = crom_cached(cm, b)))
+			memcpy(p, c->data + off, n);
+		else if (n == len) {
+			/* whole block, no need to cache it */
+			if ((r = crom_decompress(cm, b, p, len)) < 0)
+				goto out;
+		} else {
+			if ((r = crom_fill(cm, b, len, &c)) < 0)
+				goto out;
+			memcpy(p, c->data + off, n);
+		}
+		t += n;
+	}
+	r = size;
+out:
+	mutex_unlock(&cm->lock);
+	return r;
+}
+
+static ssize_t
+cromfs_read_iov(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	return for_each_iov(fp, iov, count, offset, cromfs_read);
+}
+
+/*
+ * Get address of file data for execute in place.
+ */
+static int
+cromfs_xip(struct vnode *vp, off_t off, size_t len, void **addr)
+{
+	struct crom_mount *cm = vp->v_mount->m_data;
+	const struct crom_inode *ip = vp->v_data;
+	int err;
+
+	if (!cm->xip || !(ip->flags & CROM_XIP))
+		return -ENOTSUP;
+
+	/* Mapping may round file size up to page boundary */
+	if (off < 0 || off >= vp->v_size ||
+	    (off_t)len > ((vp->v_size + PAGE_MASK) & ~(off_t)PAGE_MASK) - off)
+		return -EINVAL;
+
+	mutex_lock(&cm->lock);
+	err = crom_verify(cm, ip);
+	mutex_unlock(&cm->lock);
+	if (err < 0)
+		return err;
+
+	*addr = (char *)cm->xip + ip->data + off;
+	return 0;
+}
+
+static int
+cromfs_readdir(struct file *fp, struct dirent *buf, size_t len)
+{
+	const struct crom_mount *cm = fp->f_vnode->v_mount->m_data;
+	const struct crom_inode *dip = fp->f_vnode->v_data;
+	size_t remain = len;
+
+	if (fp->f_offset == 0) {
+		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, "."))
+			goto out;
+		++fp->f_offset;
+	}
+
+	if (fp->f_offset == 1) {
+		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, ".."))
+			goto out;
+		++fp->f_offset;
+	}
+
+	for (size_t i = fp->f_offset - 2; i < dip->size; ++i) {
+		const struct crom_dirent *d = &cm->dirents[dip->data + i];
+		if (dirbuf_add(&buf, &remain, d->ino, fp->f_offset,
+		    IFTODT(cm->inodes[d->ino].mode), cm->names + d->name))
+			goto out;
+		++fp->f_offset;
+	}
+
+out:
+	return len - remain;
+}
+
+/*
+ * vnode operations
+ */
+const struct vnops cromfs_vnops = {
+	.vop_open = (vnop_open_fn)vop_nullop,
+	.vop_close = (vnop_close_fn)vop_nullop,
+	.vop_read = cromfs_read_iov,
+	.vop_write = (vnop_write_fn)vop_nullop,
+	.vop_seek = (vnop_seek_fn)vop_nullop,
+	.vop_ioctl = (vnop_ioctl_fn)vop_einval,
+	.vop_poll = (vnop_poll_fn)vop_pollready,
+	.vop_fsync = (vnop_fsync_fn)vop_nullop,
+	.vop_readdir = cromfs_readdir,
+	.vop_lookup = cromfs_lookup,
+	.vop_mknod = (vnop_mknod_fn)vop_einval,
+	.vop_unlink = (vnop_unlink_fn)vop_einval,
+	.vop_rename = (vnop_rename_fn)vop_einval,
+	.vop_getattr = (vnop_getattr_fn)vop_nullop,
+	.vop_setattr = (vnop_setattr_fn)vop_nullop,
+	.vop_inactive = (vnop_inactive_fn)vop_nullop,
+	.vop_truncate = (vnop_truncate_fn)vop_nullop,
+	.vop_xip = cromfs_xip,
+};
+
+/*
+ * File system operations
+ */
+static const struct vfsops cromfs_vfsops = {
+	.vfs_init = (vfsop_init_fn)vfs_nullop,
+	.vfs_mount = cromfs_mount,
+	.vfs_umount = cromfs_umount,
+	.vfs_sync = (vfsop_sync_fn)vfs_nullop,
+	.vfs_vget = (vfsop_vget_fn)vfs_nullop,
+	.vfs_statfs = (vfsop_statfs_fn)vfs_nullop,
+	.vfs_vnops = &cromfs_vnops,
+	.vfs_flags = VFSF_PCACHE | VFSF_NCACHE,
+};
+
+REGISTER_FILESYSTEM(cromfs);
@@ -50,6 +50,7 @@
 #include <fs/mount.h>
 #include <fs/util.h>
 #include <fs/vnode.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,6 +71,7 @@ static ssize_t devfs_read(struct file *, const struct iovec *, size_t, off_t);
 static ssize_t devfs_write(struct file *, const struct iovec *, size_t, off_t);
 static int devfs_seek (struct file *, off_t, int);
 static int devfs_ioctl(struct file *, u_long, void *);
+static int devfs_poll(struct file *, struct poll_table *);
 static int devfs_readdir(struct file *, struct dirent *, size_t);
 static int devfs_lookup(struct vnode *, const char *, size_t, struct vnode *);
 
@@ -83,6 +85,7 @@ static const struct vnops devfs_vnops = {
 	.vop_write = devfs_write,
 	.vop_seek = devfs_seek,
 	.vop_ioctl = devfs_ioctl,
+	.vop_poll = devfs_poll,
 	.vop_fsync = ((vnop_fsync_fn)vop_nullop),
 	.vop_readdir = devfs_readdir,
 	.vop_lookup = devfs_lookup,
@@ -93,6 +96,7 @@ static const struct vnops devfs_vnops = {
 	.vop_setattr = ((vnop_setattr_fn)vop_nullop),
 	.vop_inactive = ((vnop_inactive_fn)vop_nullop),
 	.vop_truncate = ((vnop_truncate_fn)vop_nullop),
+	.vop_xip = ((vnop_xip_fn)vop_einval),
 };
 
 /*
@@ -297,6 +301,34 @@ devfs_ioctl(struct file *fp, u_long cmd, void *arg)
 	return r;
 }
 
+static int
+devfs_poll(struct file *fp, struct poll_table *pt)
+{
+	struct device *dev = fp->f_vnode->v_data;
+
+	/*
+	 * Device may have been destroyed.
+	 */
+	if (!dev)
+		return POLLERR | POLLHUP;
+
+	/*
+	 * Devices without a poll routine never block.
+	 */
+	if (!dev->devio->poll)
+		return vop_pollready();
+
+	++dev->busy;
+	vn_unlock(fp->f_vnode);
+
+	int r = (*dev->devio->poll)(fp, pt);
+
+	vn_lock(fp->f_vnode);
+	--dev->busy;
+
+	return r;
+}
+
 static int
 devfs_readdir(struct file *fp, struct dirent *buf, size_t len)
 {
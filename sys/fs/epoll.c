@@ -0,0 +1,610 @@
+/*
+ * epoll.c - scalable I/O event notification
+ *
+ * Each descriptor registered on an epoll instance has an epitem attached to
+ * the poll queue of the target object. When the object notifies its queue the
+ * item is moved onto the instance's ready list, so epoll_wait only polls
+ * descriptors which may have become ready rather than the whole interest
+ * list.
+ *
+ * Level triggered items are requeued after being reported so that they are
+ * polled again by the next wait. Edge triggered items are only requeued by a
+ * notification. One shot items are disabled after being reported until
+ * rearmed by EPOLL_CTL_MOD.
+ *
+ * Items are keyed by file descriptor. Each file keeps a list of the items
+ * watching it and detaches them when it is released. An item whose file has
+ * been released or whose descriptor now refers to a different file is
+ * removed when next polled.
+ */
+#include "poll.h"
+
+#include "vfs.h"
+#include <compiler.h>
+#include <debug.h>
+#include <device.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <kernel.h>
+#include <list.h>
+#include <sch.h>
+#include <sig.h>
+#include <stdlib.h>
+#include <sync.h>
+#include <sys/epoll.h>
+#include <task.h>
+#include <timer.h>
+#include <vm.h>
+
+/*
+ * Flags which are not events
+ */
+#define EP_FLAGS (EPOLLET | EPOLLONESHOT | EPOLLWAKEUP | EPOLLEXCLUSIVE)
+
+struct epoll;
+
+/*
+ * epitem - descriptor registered on an epoll instance
+ */
+struct epitem {
+	struct list link;		/* linkage on interest list */
+	struct list rdlink;		/* linkage on ready list */
+	bool ready;			/* item is on ready list */
+	struct poll_entry pe;		/* registration on target poll queue */
+	struct poll_table pt;		/* for registering pe */
+	struct epoll *ep;		/* epoll instance */
+	int fd;				/* target file descriptor */
+	struct file *fp;		/* target file, NULL once released */
+	struct epitem *fnext;		/* next item watching target file */
+	struct epoll_event event;	/* requested events & user data */
+};
+
+/*
+ * epoll - epoll instance
+ */
+struct epoll {
+	struct mutex lock;		/* protects interest list */
+	struct list items;		/* interest list */
+	struct spinlock rdlock;		/* protects ready list */
+	struct list ready;		/* items which may be ready */
+	struct event event;		/* epoll_wait sleeps on this event */
+	struct pollq pollq;		/* pollers of this epoll instance */
+};
+
+static const struct devio epoll_io;
+
+/*
+ * Protects item file pointers and the item lists of files
+ */
+static struct spinlock ep_file_lock;
+
+/*
+ * ep_ready - put item on ready list
+ *
+ * Interrupt safe.
+ */
+static void
+ep_ready(struct epitem *item)
+{
+	struct epoll *ep = item->ep;
+
+	const int s = spinlock_lock_irq_disable(&ep->rdlock);
+	if (!item->ready) {
+		item->ready = true;
+		list_insert(list_last(&ep->ready), &item->rdlink);
+	}
+	sch_wakeup(&ep->event, 0);
+	spinlock_unlock_irq_restore(&ep->rdlock, s);
+}
+
+/*
+ * ep_notify - readiness of target object may have changed
+ *
+ * Called with poll lock held.
+ */
+static void
+ep_notify(struct poll_entry *pe)
+{
+	struct epitem *item = list_entry(pe, struct epitem, pe);
+
+	/* disabled one shot item */
+	if (!(read_once(&item->event.events) & ~EP_FLAGS))
+		return;
+
+	ep_ready(item);
+	pollq_notify_locked(&item->ep->pollq);
+}
+
+/*
+ * ep_queue - register item on target poll queue
+ */
+static void
+ep_queue(struct poll_table *pt, struct pollq *q)
+{
+	struct epitem *item = list_entry(pt, struct epitem, pt);
+
+	/* each file may register on at most one queue */
+	if (item->pe.q)
+		return;
+
+	poll_entry_attach(&item->pe, q);
+}
+
+/*
+ * ep_poll - get readiness of item's file
+ *
+ * Returns -EBADF if the file has been released or the descriptor now refers
+ * to a different file. A released file is never seen again by the item so a
+ * new file allocated at the same address is not mistaken for it.
+ */
+static int
+ep_poll(struct epitem *item)
+{
+	struct file *fp = NULL;
+	int r;
+
+	if ((r = fs_poll(item->fd, &fp, NULL)) < 0)
+		return r;
+	if (fp != read_once(&item->fp))
+		return -EBADF;
+	return r;
+}
+
+/*
+ * ep_find - find item by file descriptor
+ *
+ * Must be called with epoll instance locked.
+ */
+static struct epitem *
+ep_find(struct epoll *ep, int fd)
+{
+	struct epitem *item;
+
+	list_for_each_entry(item, &ep->items, link) {
+		if (item->fd == fd)
+			return item;
+	}
+	return NULL;
+}
+
+/*
+ * ep_remove - remove item from epoll instance
+ *
+ * Must be called with epoll instance locked.
+ */
+static void
+ep_remove(struct epoll *ep, struct epitem *item)
+{
+	int s = spinlock_lock_irq_disable(&ep_file_lock);
+	if (item->fp) {
+		struct epitem **pp = &item->fp->f_epitems;
+		while (*pp != item)
+			pp = &(*pp)->fnext;
+		*pp = item->fnext;
+	}
+	spinlock_unlock_irq_restore(&ep_file_lock, s);
+
+	poll_entry_detach(&item->pe);
+
+	s = spinlock_lock_irq_disable(&ep->rdlock);
+	if (item->ready)
+		list_remove(&item->rdlink);
+	spinlock_unlock_irq_restore(&ep->rdlock, s);
+
+	list_remove(&item->link);
+	free(item);
+}
+
+/*
+ * ep_insert - add descriptor to epoll instance
+ *
+ * Must be called with epoll instance locked.
+ */
+static int
+ep_insert(struct epoll *ep, int fd, const struct epoll_event *event)
+{
+	int r;
+	struct file *fp;
+	struct epitem *item;
+
+	if (!(item = malloc(sizeof *item)))
+		return DERR(-ENOMEM);
+
+	/* hold file so that it can't be released before item is linked */
+	if ((fp = fs_fget(fd)) > (struct file *)-4096UL) {
+		free(item);
+		return (int)fp;
+	}
+
+	*item = (struct epitem){
+		.pe.notify = ep_notify,
+		.pt.queue = ep_queue,
+		.ep = ep,
+		.fd = fd,
+		.fp = fp,
+		.event = *event,
+	};
+
+	if ((r = fs_poll(fd, &item->fp, &item->pt)) < 0) {
+		poll_entry_detach(&item->pe);
+		free(item);
+		fs_fput(fp);
+		return r;
+	}
+
+	const int s = spinlock_lock_irq_disable(&ep_file_lock);
+	item->fnext = fp->f_epitems;
+	fp->f_epitems = item;
+	spinlock_unlock_irq_restore(&ep_file_lock, s);
+
+	list_insert(&ep->items, &item->link);
+	if (r & item->event.events)
+		ep_ready(item);
+
+	fs_fput(fp);
+	return 0;
+}
+
+/*
+ * ep_modify - modify events for descriptor on epoll instance
+ *
+ * Must be called with epoll instance locked.
+ */
+static int
+ep_modify(struct epoll *ep, struct epitem *item,
+    const struct epoll_event *event)
+{
+	int r;
+
+	write_once(&item->event.events, event->events);
+	item->event.data = event->data;
+
+	if ((r = ep_poll(item)) < 0) {
+		if (r == -EBADF) {
+			ep_remove(ep, item);
+			return DERR(-ENOENT);
+		}
+		return r;
+	}
+
+	if (r & item->event.events)
+		ep_ready(item);
+
+	return 0;
+}
+
+/*
+ * ep_scan - report ready items
+ *
+ * Returns number of events stored or -ve error code.
+ */
+static int
+ep_scan(struct epoll *ep, struct epoll_event *evs, int maxevents)
+{
+	int r, n = 0;
+	struct list txlist;
+	struct epitem *item, *tmp;
+
+	if ((r = mutex_lock_interruptible(&ep->lock)) < 0)
+		return r;
+
+	/* take ready list, items remain marked ready until polled */
+	list_init(&txlist);
+	int s = spinlock_lock_irq_disable(&ep->rdlock);
+	list_for_each_entry_safe(item, tmp, &ep->ready, rdlink) {
+		list_remove(&item->rdlink);
+		list_insert(list_last(&txlist), &item->rdlink);
+	}
+	spinlock_unlock_irq_restore(&ep->rdlock, s);
+
+	while (n < maxevents && !list_empty(&txlist)) {
+		item = list_entry(list_first(&txlist), struct epitem, rdlink);
+
+		/* notifications from here on requeue the item */
+		s = spinlock_lock_irq_disable(&ep->rdlock);
+		list_remove(&item->rdlink);
+		item->ready = false;
+		spinlock_unlock_irq_restore(&ep->rdlock, s);
+
+		if ((r = ep_poll(item)) < 0) {
+			if (r == -EBADF) {
+				ep_remove(ep, item);
+				continue;
+			}
+			ep_ready(item);
+			break;
+		}
+
+		const uint32_t revents = r & item->event.events;
+		if (!revents)
+			continue;
+
+		evs[n++] = (struct epoll_event){
+			.events = revents,
+			.data = item->event.data,
+		};
+
+		if (item->event.events & EPOLLONESHOT)
+			write_once(&item->event.events,
+			    item->event.events & EP_FLAGS);
+		else if (!(item->event.events & EPOLLET))
+			ep_ready(item);
+	}
+
+	/* return unprocessed items to ready list */
+	s = spinlock_lock_irq_disable(&ep->rdlock);
+	list_for_each_entry_safe(item, tmp, &txlist, rdlink) {
+		list_remove(&item->rdlink);
+		list_insert(list_last(&ep->ready), &item->rdlink);
+	}
+	spinlock_unlock_irq_restore(&ep->rdlock, s);
+
+	mutex_unlock(&ep->lock);
+
+	return n ?: r < 0 ? r : 0;
+}
+
+/*
+ * ep_wait - wait for events on epoll instance
+ *
+ * Timeout is relative, NULL waits forever.
+ */
+static int
+ep_wait(struct epoll *ep, struct epoll_event *evs, int maxevents,
+    const uint_fast64_t *timeout)
+{
+	int n, err;
+	bool expired = false;
+	const uint_fast64_t deadline = timeout ?
+	    timer_monotonic() + *timeout : 0;
+
+	for (;;) {
+		if ((n = ep_scan(ep, evs, maxevents)) != 0 || expired)
+			break;
+
+		uint_fast64_t nsec = 0;
+		if (timeout) {
+			const uint_fast64_t now = timer_monotonic();
+			if (now >= deadline)
+				break;
+			nsec = deadline - now;
+		}
+
+		/* sleep unless items became ready during scan */
+		const int s = spinlock_lock_irq_disable(&ep->rdlock);
+		if (!list_empty(&ep->ready)) {
+			spinlock_unlock_irq_restore(&ep->rdlock, s);
+			continue;
+		}
+		err = sch_prepare_sleep(&ep->event, nsec);
+		spinlock_unlock_irq_restore(&ep->rdlock, s);
+		if (!err)
+			err = sch_continue_sleep();
+		if (err == -ETIMEDOUT)
+			expired = true;
+		else if (err < 0) {
+			n = err;
+			break;
+		}
+	}
+
+	/* epoll_wait is never restarted after a signal handler */
+	return n == -EINTR ? -EINTR_NORESTART : n;
+}
+
+/*
+ * epoll_release - detach epoll items from file being released
+ *
+ * Called when the last reference to a file is dropped. The items are
+ * removed from their instances when next polled.
+ */
+void
+epoll_release(struct file *fp)
+{
+	const int s = spinlock_lock_irq_disable(&ep_file_lock);
+	for (struct epitem *item = fp->f_epitems; item; item = item->fnext) {
+		poll_entry_detach(&item->pe);
+		write_once(&item->fp, NULL);
+		ep_ready(item);
+	}
+	fp->f_epitems = NULL;
+	spinlock_unlock_irq_restore(&ep_file_lock, s);
+}
+
+/*
+ * epoll_close - destroy epoll instance
+ */
+static int
+epoll_close(struct file *fp)
+{
+	struct epoll *ep = fp->f_data;
+	struct epitem *item, *tmp;
+
+	mutex_lock(&ep->lock);
+	list_for_each_entry_safe(item, tmp, &ep->items, link)
+		ep_remove(ep, item);
+	mutex_unlock(&ep->lock);
+
+	pollq_destroy(&ep->pollq);
+	free(ep);
+	return 0;
+}
+
+/*
+ * epoll_poll - get epoll instance readiness
+ */
+static int
+epoll_poll(struct file *fp, struct poll_table *pt)
+{
+	struct epoll *ep = fp->f_data;
+
+	/* REVISIT: nested epoll instances are not supported */
+	if (pt && pt->queue == ep_queue)
+		return DERR(-EINVAL);
+
+	poll_wait(&ep->pollq, pt);
+
+	return list_empty(&ep->ready) ? 0 : POLLIN | POLLRDNORM;
+}
+
+static const struct devio epoll_io = {
+	.close = epoll_close,
+	.poll = epoll_poll,
+};
+
+/*
+ * Syscalls
+ */
+int
+sc_epoll_create(int size)
+{
+	if (size <= 0)
+		return DERR(-EINVAL);
+	return sc_epoll_create1(0);
+}
+
+int
+sc_epoll_create1(int flags)
+{
+	int fd;
+	struct epoll *ep;
+
+	if (flags & ~EPOLL_CLOEXEC)
+		return DERR(-EINVAL);
+
+	if (!(ep = malloc(sizeof *ep)))
+		return DERR(-ENOMEM);
+
+	mutex_init(&ep->lock);
+	list_init(&ep->items);
+	spinlock_init(&ep->rdlock);
+	list_init(&ep->ready);
+	event_init(&ep->event, "epoll", ev_IO);
+	pollq_init(&ep->pollq);
+
+	if ((fd = anon_open(&epoll_io, ep, flags & O_CLOEXEC)) < 0)
+		free(ep);
+
+	return fd;
+}
+
+int
+sc_epoll_ctl(int epfd, int op, int fd, struct epoll_event *uevent)
+{
+	int r;
+	struct file *fp;
+	struct epitem *item;
+	struct epoll_event event;
+
+	if (op != EPOLL_CTL_DEL) {
+		if ((r = vm_read(task_cur()->as, &event, uevent,
+		    sizeof event)) < 0)
+			return r;
+		/* errors and hangups are always reported */
+		event.events |= EPOLLERR | EPOLLHUP;
+	}
+
+	if (fd == epfd)
+		return DERR(-EINVAL);
+
+	if ((fp = anon_fget(epfd, &epoll_io)) > (struct file *)-4096UL)
+		return (int)fp;
+	struct epoll *ep = fp->f_data;
+
+	if ((r = mutex_lock_interruptible(&ep->lock)) < 0)
+		goto out;
+
+	item = ep_find(ep, fd);
+
+	/* drop item if descriptor has been closed or reused */
+	if (item && ep_poll(item) == -EBADF) {
+		ep_remove(ep, item);
+		item = NULL;
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		r = item ? DERR(-EEXIST) : ep_insert(ep, fd, &event);
+		break;
+	case EPOLL_CTL_MOD:
+		r = item ? ep_modify(ep, item, &event) : DERR(-ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		if (item)
+			ep_remove(ep, item);
+		r = item ? 0 : DERR(-ENOENT);
+		break;
+	default:
+		r = DERR(-EINVAL);
+		break;
+	}
+
+	mutex_unlock(&ep->lock);
+out:
+	fs_fput(fp);
+	return r;
+}
+
+int
+sc_epoll_pwait(int epfd, struct epoll_event *uevents, int maxevents,
+    int timeout, const k_sigset_t *umask, size_t masksize)
+{
+	int r;
+	struct file *fp;
+	k_sigset_t mask, old;
+
+	if (maxevents <= 0)
+		return DERR(-EINVAL);
+	if (umask) {
+		if (masksize != sizeof mask)
+			return DERR(-EINVAL);
+		if ((r = vm_read(task_cur()->as, &mask, umask,
+		    sizeof mask)) < 0)
+			return r;
+	}
+
+	/* at most one event per file descriptor */
+	if (maxevents > ARRAY_SIZE(task_cur()->file))
+		maxevents = ARRAY_SIZE(task_cur()->file);
+
+	struct epoll_event *evs;
+	if (!(evs = malloc(maxevents * sizeof *evs)))
+		return DERR(-ENOMEM);
+
+	if ((fp = anon_fget(epfd, &epoll_io)) > (struct file *)-4096UL) {
+		r = (int)fp;
+		goto out;
+	}
+
+	const uint_fast64_t nsec = timeout * 1000000ULL;
+
+	/* a signal interrupting the wait is handled before mask is restored */
+	if (umask)
+		old = sig_replace(&mask);
+	r = ep_wait(fp->f_data, evs, maxevents, timeout >= 0 ? &nsec : NULL);
+	if (umask)
+		sig_restore_deferred(&old);
+
+	fs_fput(fp);
+
+	if (r > 0) {
+		ssize_t err;
+		if ((err = vm_write(task_cur()->as, evs, uevents,
+		    r * sizeof *evs)) < 0)
+			r = err;
+	}
+
+out:
+	free(evs);
+	return r;
+}
+
+int
+sc_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout)
+{
+	return sc_epoll_pwait(epfd, events, maxevents, timeout, NULL, 0);
+}
@@ -0,0 +1,241 @@
+/*
+ * eventfd.c - event counters which notify via a file descriptor
+ */
+#include "poll.h"
+
+#include "vfs.h"
+#include <access.h>
+#include <debug.h>
+#include <device.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <kernel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sync.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <wait.h>
+
+#define EFD_MAX (UINT64_MAX - 1)
+
+/*
+ * eventfd
+ */
+struct eventfd {
+	struct spinlock lock;		/* protects count */
+	uint64_t count;			/* counter value */
+	bool semaphore;			/* EFD_SEMAPHORE */
+	struct event event;		/* readers & writers sleep on this event */
+	struct pollq pollq;		/* pollers */
+};
+
+/*
+ * efd_readable - test if eventfd can be read
+ */
+static bool
+efd_readable(struct eventfd *efd)
+{
+	spinlock_lock(&efd->lock);
+	const bool r = efd->count > 0;
+	spinlock_unlock(&efd->lock);
+	return r;
+}
+
+/*
+ * efd_writable - test if value can be added to eventfd
+ */
+static bool
+efd_writable(struct eventfd *efd, uint64_t value)
+{
+	spinlock_lock(&efd->lock);
+	const bool r = value <= EFD_MAX - efd->count;
+	spinlock_unlock(&efd->lock);
+	return r;
+}
+
+/*
+ * efd_changed - counter changed, wake sleepers and pollers
+ */
+static void
+efd_changed(struct eventfd *efd)
+{
+	sch_wakeup(&efd->event, 0);
+	pollq_notify(&efd->pollq);
+}
+
+/*
+ * efd_read - read counter value
+ */
+static ssize_t
+efd_read(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	struct eventfd *efd = fp->f_data;
+	uint64_t value = 0;
+
+	if (!count || iov->iov_len < sizeof value)
+		return DERR(-EINVAL);
+
+	/*
+	 * REVISIT: the u_access* mechanism is broken for iov, so if
+	 * _any_ usage of u_access_suspend() it must be unconditional
+	 * so u_access_resume() can guarantee pointers are still
+	 * valid
+	 */
+	bool ua = u_access_suspend();
+	int rc = 0;
+	for (;;) {
+		spinlock_lock(&efd->lock);
+		if (efd->count) {
+			value = efd->semaphore ? 1 : efd->count;
+			efd->count -= value;
+		}
+		spinlock_unlock(&efd->lock);
+		if (value)
+			break;
+		if (fp->f_flags & O_NONBLOCK) {
+			rc = -EAGAIN;
+			break;
+		}
+		rc = wait_event_interruptible(efd->event, efd_readable(efd));
+		if (rc < 0)
+			break;
+	}
+
+	if (value)
+		efd_changed(efd);
+
+	int r = u_access_resume(ua, iov->iov_base, sizeof value, PROT_WRITE);
+	if (r < 0)
+		return r;
+	if (rc < 0)
+		return rc;
+
+	memcpy(iov->iov_base, &value, sizeof value);
+	return sizeof value;
+}
+
+/*
+ * efd_write - add to counter value
+ */
+static ssize_t
+efd_write(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	struct eventfd *efd = fp->f_data;
+	uint64_t value;
+
+	if (!count || iov->iov_len < sizeof value)
+		return DERR(-EINVAL);
+
+	bool ua = u_access_suspend();
+	int r = u_access_resume(ua, iov->iov_base, sizeof value, PROT_READ);
+	if (r < 0)
+		return r;
+	memcpy(&value, iov->iov_base, sizeof value);
+	if (value == UINT64_MAX)
+		return DERR(-EINVAL);
+
+	for (;;) {
+		spinlock_lock(&efd->lock);
+		const bool ok = value <= EFD_MAX - efd->count;
+		if (ok)
+			efd->count += value;
+		spinlock_unlock(&efd->lock);
+		if (ok)
+			break;
+		if (fp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		r = wait_event_interruptible(efd->event,
+		    efd_writable(efd, value));
+		if (r < 0)
+			return r;
+	}
+
+	if (value)
+		efd_changed(efd);
+
+	return sizeof value;
+}
+
+/*
+ * efd_poll - get eventfd readiness
+ */
+static int
+efd_poll(struct file *fp, struct poll_table *pt)
+{
+	struct eventfd *efd = fp->f_data;
+	int events = 0;
+
+	poll_wait(&efd->pollq, pt);
+
+	spinlock_lock(&efd->lock);
+	if (efd->count > 0)
+		events |= POLLIN | POLLRDNORM;
+	if (efd->count < EFD_MAX)
+		events |= POLLOUT | POLLWRNORM;
+	spinlock_unlock(&efd->lock);
+
+	return events;
+}
+
+/*
+ * efd_close - destroy eventfd
+ */
+static int
+efd_close(struct file *fp)
+{
+	struct eventfd *efd = fp->f_data;
+
+	pollq_destroy(&efd->pollq);
+	free(efd);
+	return 0;
+}
+
+static const struct devio efd_io = {
+	.close = efd_close,
+	.read = efd_read,
+	.write = efd_write,
+	.poll = efd_poll,
+};
+
+/*
+ * Syscalls
+ */
+int
+sc_eventfd2(unsigned initval, int flags)
+{
+	int fd;
+	struct eventfd *efd;
+
+	if (flags & ~(EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE))
+		return DERR(-EINVAL);
+
+	if (!(efd = malloc(sizeof *efd)))
+		return DERR(-ENOMEM);
+
+	*efd = (struct eventfd){
+		.count = initval,
+		.semaphore = flags & EFD_SEMAPHORE,
+	};
+	spinlock_init(&efd->lock);
+	event_init(&efd->event, "eventfd", ev_IO);
+	pollq_init(&efd->pollq);
+
+	if ((fd = anon_open(&efd_io, efd,
+	    flags & (O_CLOEXEC | O_NONBLOCK))) < 0)
+		free(efd);
+
+	return fd;
+}
+
+int
+sc_eventfd(unsigned initval)
+{
+	return sc_eventfd2(initval, 0);
+}
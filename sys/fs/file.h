@@ -32,6 +32,7 @@
 
 #include <sys/types.h>
 
+struct epitem;
 struct vnode;
 
 /*
@@ -43,6 +44,7 @@ struct file {
 	off_t		f_offset;	/* current position in file */
 	void		*f_data;	/* per-handle data for drivers */
 	struct vnode	*f_vnode;	/* vnode */
+	struct epitem	*f_epitems;	/* epoll items watching this file */
 };
 
 #endif /* !file_h */
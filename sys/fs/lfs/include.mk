@@ -0,0 +1,9 @@
+#
+# Log-structured file system
+#
+
+SOURCES += \
+    fs/lfs/log.c \
+    fs/lfs/node.c \
+    fs/lfs/vfsops.c \
+    fs/lfs/vnops.c \
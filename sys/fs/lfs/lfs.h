@@ -0,0 +1,219 @@
+#ifndef lfs_h
+#define lfs_h
+
+/*
+ * lfs.h - log-structured file system
+ */
+
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sync.h>
+#include <sys/types.h>
+
+#define lfsdbg(...)
+
+/*
+ * On-disk format
+ *
+ * The device is divided into segments. The first segment holds two
+ * checkpoint blocks, the others hold the log. The log is a chain of
+ * batches, each written by a single sequential write:
+ *
+ *	| batch header | records ... | data blocks ... |
+ *
+ * A batch is only valid if it has the expected sequence number and its
+ * checksum matches, so a batch torn by power failure is ignored together
+ * with anything that follows it. Each batch header gives the address of the
+ * next batch.
+ *
+ * A checkpoint names the first batch of a complete copy of the file system
+ * metadata. Mount replays the records of every valid batch from there on.
+ * Data is never overwritten in place and a segment is only reused once none
+ * of its blocks are referenced and it is older than the latest checkpoint.
+ */
+#define LFS_MAGIC	0x3153464c	/* checkpoint magic, "LFS1" */
+#define LFS_BATCH_MAGIC	0x4853464c	/* batch magic, "LFSH" */
+#define LFS_VERSION	1
+#define LFS_BSIZE	4096		/* block size */
+#define LFS_HDR_BLOCKS	2		/* maximum header blocks in a batch */
+#define LFS_DATA_BLOCKS	16		/* maximum data blocks in a batch */
+#define LFS_MIN_SEG	32		/* minimum blocks per segment */
+#define LFS_MIN_SEGS	8		/* minimum number of segments */
+#define LFS_MAX_SEGS	4096		/* segments are enlarged to stay below */
+#define LFS_PENDING	0x80000000	/* map entry is a batch slot */
+#define LFS_ROOT_INO	1		/* inode number of root directory */
+#define LFS_BUCKETS	64		/* size of hash tables */
+
+/*
+ * Checkpoint block
+ */
+struct lfs_super {
+	uint32_t	 magic;
+	uint32_t	 sum;		/* checksum of block with sum zero */
+	uint64_t	 seq;		/* sequence number of first batch */
+	uint32_t	 start;		/* block address of first batch */
+	uint32_t	 version;	/* format version */
+	uint32_t	 bsize;		/* block size */
+	uint32_t	 seg_blocks;	/* blocks per segment */
+	uint32_t	 nsegs;		/* number of segments */
+};
+
+/*
+ * Batch header
+ */
+struct lfs_batch {
+	uint32_t	 magic;
+	uint32_t	 sum;		/* checksum of batch with sum zero */
+	uint64_t	 seq;		/* sequence number */
+	uint32_t	 nblocks;	/* blocks in batch */
+	uint32_t	 hblocks;	/* header blocks in batch */
+	uint32_t	 next;		/* block address of next batch */
+	uint32_t	 reclen;	/* bytes of records after header */
+};
+
+/*
+ * Records follow the batch header and are padded to 8 bytes. Records are
+ * replayed in order.
+ */
+enum {
+	LFS_R_NODE = 1,			/* create, move or rename node */
+	LFS_R_SIZE,			/* set file size */
+	LFS_R_UNLINK,			/* remove node */
+	LFS_R_TRUNC,			/* free all file data */
+	LFS_R_MAP,			/* set block addresses */
+};
+
+struct lfs_rec {
+	uint16_t	 type;
+	uint16_t	 len;		/* record length including padding */
+	uint32_t	 ino;		/* inode number */
+};
+
+struct lfs_rec_node {
+	struct lfs_rec	 r;
+	uint32_t	 parent;	/* inode number of parent */
+	uint32_t	 mode;
+	uint64_t	 size;
+	char		 name[];	/* not terminated */
+};
+
+struct lfs_rec_size {
+	struct lfs_rec	 r;
+	uint64_t	 size;
+};
+
+struct lfs_rec_map {
+	struct lfs_rec	 r;
+	uint32_t	 first;		/* first file block */
+	uint32_t	 addr[];	/* block addresses, 0 for hole */
+};
+
+#define LFS_REC_LEN(n)	  (((n) + 7) & ~(size_t)7)
+#define LFS_NODE_LEN(n)	  LFS_REC_LEN(sizeof(struct lfs_rec_node) + (n))
+#define LFS_MAP_LEN(n)	  LFS_REC_LEN(sizeof(struct lfs_rec_map) + (n) * 4)
+#define LFS_MAP_MAX	  256		/* maximum addresses in map record */
+
+/*
+ * In-memory node, all nodes are kept in memory while mounted
+ */
+struct lfs_node {
+	struct list	 ln_link;	/* link on lm_nodes */
+	struct list	 ln_ihash;	/* link on inode number hash chain */
+	struct list	 ln_nhash;	/* link on name hash chain */
+	struct list	 ln_sibling;	/* link on parent's ln_children */
+	struct list	 ln_children;	/* child nodes */
+	struct list	 ln_dirty;	/* link on lm_dirty if size not logged */
+	struct lfs_node	*ln_parent;	/* parent directory */
+	uint32_t	 ln_ino;	/* inode number */
+	uint32_t	 ln_pino;	/* parent inode number during replay */
+	mode_t		 ln_mode;	/* node mode */
+	off_t		 ln_size;	/* file size */
+	char		*ln_name;	/* name (null-terminated) */
+	size_t		 ln_namelen;	/* length of name */
+	uint32_t	*ln_map;	/* address of each file block, 0 for hole */
+	size_t		 ln_nmap;	/* number of entries in ln_map */
+};
+
+/*
+ * Segment usage
+ */
+struct lfs_seg {
+	uint64_t	 ls_seq;	/* last batch written to segment */
+	uint32_t	 ls_live;	/* referenced data blocks */
+	bool		 ls_trimmed;	/* discarded since last written */
+};
+
+/*
+ * Data block waiting in the batch buffer
+ */
+struct lfs_slot {
+	struct lfs_node	*ls_node;	/* owner, NULL if freed */
+	uint32_t	 ls_idx;	/* file block index */
+};
+
+/*
+ * Mounted file system
+ */
+struct lfs_mount {
+	struct mutex	 lm_lock;	/* protects everything below */
+	struct list	 lm_link;	/* link on lfs_mounts */
+	int		 lm_fd;		/* device */
+	uint32_t	 lm_seg_blocks;	/* blocks per segment */
+	uint32_t	 lm_nsegs;	/* number of segments */
+	uint32_t	 lm_capacity;	/* data blocks available to files */
+	struct lfs_seg	*lm_segs;	/* segment usage */
+	uint32_t	 lm_alloc;	/* last segment allocated */
+	uint32_t	 lm_head;	/* block address of next batch */
+	uint64_t	 lm_seq;	/* sequence number of next batch */
+	uint64_t	 lm_cp_seq;	/* first batch after latest checkpoint */
+	int		 lm_cp_slot;	/* checkpoint block last written */
+	unsigned	 lm_cp_segs;	/* segments started since checkpoint */
+	bool		 lm_check;	/* segment started since maintenance */
+	bool		 lm_gc;		/* checkpoint or cleaning in progress */
+	uint32_t	 lm_nlive;	/* referenced data blocks */
+	uint32_t	 lm_next_ino;	/* next inode number */
+	char		*lm_buf;	/* header blocks followed by data slots */
+	size_t		 lm_reclen;	/* bytes of records in batch */
+	size_t		 lm_nslots;	/* data slots in batch */
+	size_t		 lm_ndirty;	/* nodes on lm_dirty */
+	struct lfs_slot	 lm_slots[LFS_DATA_BLOCKS];
+	uint_fast64_t	 lm_dirty_time;	/* time batch became dirty, 0 if clean */
+	struct list	 lm_dirty;	/* nodes with unlogged size */
+	struct lfs_node	*lm_root;	/* root directory */
+	struct list	 lm_nodes;	/* all nodes */
+	struct list	 lm_ihash[LFS_BUCKETS];
+	struct list	 lm_nhash[LFS_BUCKETS];
+};
+
+/* node.c */
+struct lfs_node *lfs_node_alloc(struct lfs_mount *, uint32_t, const char *,
+				size_t, mode_t);
+void		 lfs_node_free(struct lfs_mount *, struct lfs_node *);
+void		 lfs_node_link(struct lfs_mount *, struct lfs_node *,
+			       struct lfs_node *);
+void		 lfs_node_unlink(struct lfs_node *);
+int		 lfs_node_rename(struct lfs_node *, const char *, size_t);
+struct lfs_node *lfs_node_find(struct lfs_mount *, uint32_t);
+struct lfs_node *lfs_node_lookup(struct lfs_mount *, struct lfs_node *,
+				 const char *, size_t);
+int		 lfs_node_reserve(struct lfs_node *, size_t);
+
+/* log.c */
+int		 lfs_log_mount(struct lfs_mount *, bool);
+void		 lfs_log_unmount(struct lfs_mount *);
+void		*lfs_log(struct lfs_mount *, int, uint32_t, size_t);
+void		 lfs_log_node(struct lfs_mount *, struct lfs_node *);
+int		 lfs_room(struct lfs_mount *, size_t, size_t);
+int		 lfs_flush(struct lfs_mount *);
+int		 lfs_checkpoint(struct lfs_mount *);
+void		 lfs_maintain(struct lfs_mount *);
+char		*lfs_block(struct lfs_mount *, struct lfs_node *, size_t, bool,
+			   int *);
+char		*lfs_slot_data(struct lfs_mount *, uint32_t);
+void		 lfs_free_data(struct lfs_mount *, struct lfs_node *);
+uint32_t	 lfs_free_blocks(struct lfs_mount *);
+
+extern const struct vnops lfs_vnops;
+
+#endif /* !lfs_h */
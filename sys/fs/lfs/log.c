@@ -0,0 +1,1025 @@
+/*
+ * log.c - log, checkpoint and cleaner for log-structured file system.
+ */
+
+#include "lfs.h"
+
+#include <debug.h>
+#include <errno.h>
+#include <fs.h>
+#include <jhash3.h>
+#include <kernel.h>
+#include <linux/fs.h>
+#include <page.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <timer.h>
+
+/*
+ * Writes are collected in a batch buffer: metadata records are appended to
+ * the header blocks and file blocks are copied into data slots. When the
+ * batch is full, synced or old it is written to the head of the log with a
+ * single sequential write and the block maps are pointed at the new copies.
+ *
+ * A new segment is discarded when the log moves into it so that the device
+ * can erase it ahead of time. The cleaner copies live blocks out of mostly
+ * dead segments once free segments run low.
+ */
+#define LFS_BUF_SIZE	((LFS_HDR_BLOCKS + LFS_DATA_BLOCKS) * LFS_BSIZE)
+
+/*
+ * Page ownership identifier for LFS
+ */
+static char lfs_id;
+
+static int lfs_write_batch(struct lfs_mount *, bool);
+static int lfs_do_checkpoint(struct lfs_mount *);
+
+/*
+ * lfs_seg_of - get segment number of block address
+ */
+static uint32_t
+lfs_seg_of(const struct lfs_mount *lm, uint32_t a)
+{
+	return a / lm->lm_seg_blocks;
+}
+
+/*
+ * lfs_seg_end - get block address after end of segment containing 'a'
+ */
+static uint32_t
+lfs_seg_end(const struct lfs_mount *lm, uint32_t a)
+{
+	return (lfs_seg_of(lm, a) + 1) * lm->lm_seg_blocks;
+}
+
+/*
+ * lfs_valid_addr - check that block address is within the log
+ */
+static bool
+lfs_valid_addr(const struct lfs_mount *lm, uint32_t a)
+{
+	return a >= lm->lm_seg_blocks && a < lm->lm_nsegs * lm->lm_seg_blocks;
+}
+
+/*
+ * lfs_slot - get data slot in batch buffer
+ */
+static char *
+lfs_slot(struct lfs_mount *lm, size_t slot)
+{
+	return lm->lm_buf + (LFS_HDR_BLOCKS + slot) * LFS_BSIZE;
+}
+
+/*
+ * lfs_checksum - checksum header blocks followed by data blocks
+ */
+static uint32_t
+lfs_checksum(const void *hdr, size_t hlen, const void *data, size_t dlen)
+{
+	return jhash(data, dlen, jhash(hdr, hlen, 0));
+}
+
+/*
+ * lfs_io - transfer whole blocks to or from device
+ */
+static int
+lfs_io(struct lfs_mount *lm, void *buf, uint32_t a, size_t n, bool write)
+{
+	const size_t len = n * LFS_BSIZE;
+	const off_t off = (off_t)a * LFS_BSIZE;
+	ssize_t r;
+
+	r = write ? kpwrite(lm->lm_fd, buf, len, off)
+		  : kpread(lm->lm_fd, buf, len, off);
+	if (r < 0)
+		return r;
+	if ((size_t)r != len)
+		return DERR(-EIO);
+	return 0;
+}
+
+/*
+ * lfs_discard - tell device that segment contents are no longer needed
+ */
+static void
+lfs_discard(struct lfs_mount *lm, uint32_t seg)
+{
+	uint64_t range[2] = {
+		(uint64_t)seg * lm->lm_seg_blocks * LFS_BSIZE,
+		(uint64_t)lm->lm_seg_blocks * LFS_BSIZE,
+	};
+
+	/* discard is only a hint, not all devices support it */
+	kioctl(lm->lm_fd, BLKDISCARD, range);
+	lm->lm_segs[seg].ls_trimmed = true;
+}
+
+/*
+ * lfs_seg_free - check if segment can be reused
+ *
+ * A segment written since the latest checkpoint may still be needed to
+ * replay the log even if none of its blocks are referenced.
+ */
+static bool
+lfs_seg_free(const struct lfs_mount *lm, uint32_t seg)
+{
+	return !lm->lm_segs[seg].ls_live &&
+	    lm->lm_segs[seg].ls_seq < lm->lm_cp_seq;
+}
+
+/*
+ * lfs_nfree - count free segments
+ */
+static uint32_t
+lfs_nfree(const struct lfs_mount *lm)
+{
+	uint32_t n = 0;
+
+	for (uint32_t s = 1; s < lm->lm_nsegs; ++s)
+		n += lfs_seg_free(lm, s);
+	return n;
+}
+
+/*
+ * lfs_alloc_seg - allocate a free segment
+ *
+ * Segments are allocated round robin to spread wear across the device.
+ */
+static int
+lfs_alloc_seg(struct lfs_mount *lm, uint32_t *segp)
+{
+	uint32_t s = lm->lm_alloc;
+
+	for (uint32_t i = 1; i < lm->lm_nsegs; ++i) {
+		if (++s >= lm->lm_nsegs)
+			s = 1;
+		if (lfs_seg_free(lm, s)) {
+			lm->lm_alloc = *segp = s;
+			return 0;
+		}
+	}
+	return DERR(-ENOSPC);
+}
+
+/*
+ * lfs_reserve - free segments needed to checkpoint and clean
+ */
+static uint32_t
+lfs_reserve(const struct lfs_mount *lm)
+{
+	const size_t space = LFS_HDR_BLOCKS * LFS_BSIZE -
+	    sizeof(struct lfs_batch);
+	const struct lfs_node *np;
+	size_t len = 0;
+
+	list_for_each_entry(np, &lm->lm_nodes, ln_link) {
+		len += LFS_NODE_LEN(np->ln_namelen) +
+		    LFS_MAP_LEN(np->ln_nmap) +
+		    np->ln_nmap / LFS_MAP_MAX * LFS_MAP_LEN(0);
+	}
+
+	/* records are not split so assume batches are only half full */
+	const size_t blocks = (div_ceil(len, space / 2) + 1) * LFS_HDR_BLOCKS;
+	return div_ceil(blocks, lm->lm_seg_blocks - 2) + 2;
+}
+
+/*
+ * lfs_mark_dirty - note that batch holds unwritten changes
+ */
+static void
+lfs_mark_dirty(struct lfs_mount *lm)
+{
+	if (!lm->lm_dirty_time)
+		lm->lm_dirty_time = timer_monotonic() ?: 1;
+}
+
+/*
+ * lfs_batch_empty - check if batch holds nothing to write
+ */
+static bool
+lfs_batch_empty(const struct lfs_mount *lm)
+{
+	return !lm->lm_reclen && !lm->lm_nslots && !lm->lm_ndirty;
+}
+
+/*
+ * lfs_run_end - find end of run of consecutive file blocks starting at slot
+ */
+static size_t
+lfs_run_end(const struct lfs_mount *lm, size_t i)
+{
+	const struct lfs_slot *s = lm->lm_slots;
+	size_t j = i + 1;
+
+	while (j < lm->lm_nslots && j - i < LFS_MAP_MAX &&
+	    s[j].ls_node == s[i].ls_node &&
+	    s[j].ls_idx == s[j - 1].ls_idx + 1)
+		++j;
+	return j;
+}
+
+/*
+ * lfs_write_batch - write batch to head of log
+ *
+ * If 'skip' is set the log moves to a new segment even if the batch is
+ * empty. On failure the batch is left intact.
+ */
+static int
+lfs_write_batch(struct lfs_mount *lm, bool skip)
+{
+	struct lfs_batch *h = (struct lfs_batch *)lm->lm_buf;
+	char *const rec = (char *)(h + 1);
+	const uint32_t head = lm->lm_head;
+	struct lfs_node *np;
+	size_t len = lm->lm_reclen, maplen = 0, n = 0;
+	uint32_t next, seg = 0;
+	ssize_t r;
+	int err;
+
+	if (!skip && lfs_batch_empty(lm))
+		return 0;
+
+	/* squeeze out slots of freed blocks */
+	for (size_t i = 0; i < lm->lm_nslots; ++i) {
+		const struct lfs_slot s = lm->lm_slots[i];
+		if (!s.ls_node)
+			continue;
+		if (i != n) {
+			memcpy(lfs_slot(lm, n), lfs_slot(lm, i), LFS_BSIZE);
+			lm->lm_slots[n] = s;
+			s.ls_node->ln_map[s.ls_idx] = LFS_PENDING | n;
+		}
+		++n;
+	}
+	lm->lm_nslots = n;
+
+	/* log size of files written */
+	list_for_each_entry(np, &lm->lm_dirty, ln_dirty) {
+		struct lfs_rec_size *s = (struct lfs_rec_size *)(rec + len);
+		*s = (struct lfs_rec_size){
+			.r = {LFS_R_SIZE, sizeof *s, np->ln_ino},
+			.size = np->ln_size,
+		};
+		len += sizeof *s;
+	}
+
+	/* log block addresses, data follows header blocks */
+	for (size_t i = 0, j; i < n; i = j) {
+		j = lfs_run_end(lm, i);
+		maplen += LFS_MAP_LEN(j - i);
+	}
+	const size_t hblocks = div_ceil(sizeof *h + len + maplen, LFS_BSIZE);
+	for (size_t i = 0, j; i < n; i = j) {
+		j = lfs_run_end(lm, i);
+		struct lfs_rec_map *m = (struct lfs_rec_map *)(rec + len);
+		memset(m, 0, LFS_MAP_LEN(j - i));
+		m->r = (struct lfs_rec){LFS_R_MAP, LFS_MAP_LEN(j - i),
+		    lm->lm_slots[i].ls_node->ln_ino};
+		m->first = lm->lm_slots[i].ls_idx;
+		for (size_t k = i; k < j; ++k)
+			m->addr[k - i] = head + hblocks + k;
+		len += LFS_MAP_LEN(j - i);
+	}
+	memset(rec + len, 0, hblocks * LFS_BSIZE - sizeof *h - len);
+
+	/* start a new segment if there's no room for another batch */
+	const uint32_t end = head + hblocks + n;
+	next = end;
+	if (skip || lfs_seg_end(lm, head) - end < 2) {
+		if ((err = lfs_alloc_seg(lm, &seg)) < 0)
+			return err;
+		next = seg * lm->lm_seg_blocks;
+	}
+
+	*h = (struct lfs_batch){
+		.magic = LFS_BATCH_MAGIC,
+		.seq = lm->lm_seq,
+		.nblocks = hblocks + n,
+		.hblocks = hblocks,
+		.next = next,
+		.reclen = len,
+	};
+	h->sum = lfs_checksum(h, hblocks * LFS_BSIZE, lfs_slot(lm, 0),
+	    n * LFS_BSIZE);
+
+	const struct iovec iov[] = {
+		{h, hblocks * LFS_BSIZE},
+		{lfs_slot(lm, 0), n * LFS_BSIZE},
+	};
+	r = kpwritev(lm->lm_fd, iov, n ? 2 : 1, (off_t)head * LFS_BSIZE);
+	if (r != (ssize_t)((hblocks + n) * LFS_BSIZE)) {
+		lfsdbg("batch %llu write failed %zd\n",
+		    (unsigned long long)lm->lm_seq, r);
+		return r < 0 ? r : DERR(-EIO);
+	}
+
+	/* data now lives in the log */
+	for (size_t i = 0; i < n; ++i) {
+		const struct lfs_slot *s = &lm->lm_slots[i];
+		s->ls_node->ln_map[s->ls_idx] = head + hblocks + i;
+	}
+	struct lfs_seg *sp = &lm->lm_segs[lfs_seg_of(lm, head)];
+	sp->ls_live += n;
+	sp->ls_seq = lm->lm_seq;
+	sp->ls_trimmed = false;
+	lm->lm_nlive += n;
+	while (!list_empty(&lm->lm_dirty)) {
+		np = list_entry(list_first(&lm->lm_dirty), struct lfs_node,
+		    ln_dirty);
+		list_remove(&np->ln_dirty);
+		list_init(&np->ln_dirty);
+	}
+	lm->lm_ndirty = 0;
+	lm->lm_reclen = 0;
+	lm->lm_nslots = 0;
+	lm->lm_dirty_time = 0;
+	++lm->lm_seq;
+	lm->lm_head = next;
+
+	if (seg) {
+		lm->lm_segs[seg].ls_seq = lm->lm_seq;
+		if (!lm->lm_segs[seg].ls_trimmed)
+			lfs_discard(lm, seg);
+		++lm->lm_cp_segs;
+		lm->lm_check = true;
+	}
+	return 0;
+}
+
+/*
+ * lfs_log - append record to batch
+ *
+ * Space must have been reserved by lfs_room.
+ */
+void *
+lfs_log(struct lfs_mount *lm, int type, uint32_t ino, size_t len)
+{
+	struct lfs_rec *r = (struct lfs_rec *)(lm->lm_buf +
+	    sizeof(struct lfs_batch) + lm->lm_reclen);
+
+	memset(r, 0, len);
+	*r = (struct lfs_rec){type, len, ino};
+	lm->lm_reclen += len;
+	lfs_mark_dirty(lm);
+	return r;
+}
+
+/*
+ * lfs_log_node - log name, parent, mode and size of node
+ */
+void
+lfs_log_node(struct lfs_mount *lm, struct lfs_node *np)
+{
+	struct lfs_rec_node *r = lfs_log(lm, LFS_R_NODE, np->ln_ino,
+	    LFS_NODE_LEN(np->ln_namelen));
+
+	r->parent = np->ln_parent->ln_ino;
+	r->mode = np->ln_mode;
+	r->size = np->ln_size;
+	memcpy(r->name, np->ln_name, np->ln_namelen);
+}
+
+/*
+ * lfs_room - make room in batch for 'reclen' bytes of records and 'slots'
+ * new data blocks, writing the batch if necessary
+ *
+ * Writing the batch moves data blocks, so block map entries must be looked
+ * up again if lm_seq changes.
+ */
+int
+lfs_room(struct lfs_mount *lm, size_t reclen, size_t slots)
+{
+	int err;
+
+	if (lm->lm_check && !lm->lm_gc)
+		lfs_maintain(lm);
+
+	for (int tries = 0;; ++tries) {
+		const size_t n = lm->lm_nslots + slots;
+		const size_t len = sizeof(struct lfs_batch) + lm->lm_reclen +
+		    reclen + lm->lm_ndirty * sizeof(struct lfs_rec_size) +
+		    n * LFS_MAP_LEN(1);
+		const size_t hblocks = div_ceil(len, LFS_BSIZE);
+		if (hblocks <= LFS_HDR_BLOCKS && n <= LFS_DATA_BLOCKS &&
+		    lm->lm_head + hblocks + n <= lfs_seg_end(lm, lm->lm_head))
+			return 0;
+		if (tries == 2)
+			return DERR(-EINVAL);
+
+		/* an empty batch doesn't fit at the end of this segment */
+		if ((err = lfs_write_batch(lm, lfs_batch_empty(lm))) < 0)
+			return err;
+	}
+}
+
+/*
+ * lfs_flush - write batch to log
+ */
+int
+lfs_flush(struct lfs_mount *lm)
+{
+	return lfs_write_batch(lm, false);
+}
+
+/*
+ * lfs_do_checkpoint - write a copy of all metadata and point a checkpoint
+ * block at it
+ *
+ * Once the checkpoint block has been written older batches are no longer
+ * needed for replay.
+ */
+static int
+lfs_do_checkpoint(struct lfs_mount *lm)
+{
+	struct lfs_node *np;
+	int err;
+
+	if ((err = lfs_flush(lm)) < 0)
+		return err;
+
+	const uint32_t start = lm->lm_head;
+	const uint64_t seq = lm->lm_seq;
+
+	list_for_each_entry(np, &lm->lm_nodes, ln_link) {
+		if (np == lm->lm_root)
+			continue;
+		if ((err = lfs_room(lm, LFS_NODE_LEN(np->ln_namelen), 0)) < 0)
+			return err;
+		lfs_log_node(lm, np);
+		for (size_t i = 0, n = 1; i < np->ln_nmap; i += n) {
+			if (!np->ln_map[i]) {
+				n = 1;
+				continue;
+			}
+			for (n = 1; i + n < np->ln_nmap && np->ln_map[i + n] &&
+			    n < LFS_MAP_MAX; ++n)
+				;
+			if ((err = lfs_room(lm, LFS_MAP_LEN(n), 0)) < 0)
+				return err;
+			struct lfs_rec_map *m = lfs_log(lm, LFS_R_MAP,
+			    np->ln_ino, LFS_MAP_LEN(n));
+			m->first = i;
+			memcpy(m->addr, np->ln_map + i, n * sizeof *m->addr);
+		}
+	}
+	if ((err = lfs_flush(lm)) < 0)
+		return err;
+
+	/* batch buffer is empty, use it to write the checkpoint block */
+	struct lfs_super *sb = (struct lfs_super *)lm->lm_buf;
+	memset(sb, 0, LFS_BSIZE);
+	*sb = (struct lfs_super){
+		.magic = LFS_MAGIC,
+		.seq = seq,
+		.start = start,
+		.version = LFS_VERSION,
+		.bsize = LFS_BSIZE,
+		.seg_blocks = lm->lm_seg_blocks,
+		.nsegs = lm->lm_nsegs,
+	};
+	sb->sum = jhash(sb, LFS_BSIZE, 0);
+	if ((err = lfs_io(lm, sb, !lm->lm_cp_slot, 1, true)) < 0)
+		return err;
+	lm->lm_cp_slot = !lm->lm_cp_slot;
+	lm->lm_cp_seq = seq;
+	lm->lm_cp_segs = 0;
+	lfsdbg("checkpoint at %u seq %llu\n", start, (unsigned long long)seq);
+	return 0;
+}
+
+/*
+ * lfs_checkpoint - write checkpoint
+ */
+int
+lfs_checkpoint(struct lfs_mount *lm)
+{
+	const bool gc = lm->lm_gc;
+	int err;
+
+	lm->lm_gc = true;
+	err = lfs_do_checkpoint(lm);
+	lm->lm_gc = gc;
+	return err;
+}
+
+/*
+ * lfs_clean - move live blocks out of segment
+ */
+static int
+lfs_clean(struct lfs_mount *lm, uint32_t seg)
+{
+	struct lfs_node *np;
+	int err;
+
+	lfsdbg("clean segment %u, %u live\n", seg, lm->lm_segs[seg].ls_live);
+	list_for_each_entry(np, &lm->lm_nodes, ln_link) {
+		for (size_t i = 0; i < np->ln_nmap; ++i) {
+			const uint32_t a = np->ln_map[i];
+			if (!a || a & LFS_PENDING || lfs_seg_of(lm, a) != seg)
+				continue;
+			if (!lfs_block(lm, np, i, true, &err))
+				return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * lfs_gc - clean segments until enough are free
+ */
+static int
+lfs_gc(struct lfs_mount *lm)
+{
+	const uint32_t need = lfs_reserve(lm);
+	const uint32_t head = lfs_seg_of(lm, lm->lm_head);
+	int err = 0;
+
+	lm->lm_gc = true;
+
+	/* segments emptied since the checkpoint are freed by the next */
+	for (uint32_t s = 1; s < lm->lm_nsegs; ++s) {
+		if (s != head && !lm->lm_segs[s].ls_live &&
+		    lm->lm_segs[s].ls_seq >= lm->lm_cp_seq) {
+			if ((err = lfs_do_checkpoint(lm)) < 0)
+				goto out;
+			break;
+		}
+	}
+
+	/* clean emptiest segments first */
+	for (uint32_t i = 0; i < lm->lm_nsegs && lfs_nfree(lm) <= need; ++i) {
+		uint32_t victim = 0;
+		for (uint32_t s = 1; s < lm->lm_nsegs; ++s) {
+			const struct lfs_seg *sp = &lm->lm_segs[s];
+			if (!sp->ls_live || sp->ls_seq >= lm->lm_cp_seq)
+				continue;
+			if (!victim || sp->ls_live < lm->lm_segs[victim].ls_live)
+				victim = s;
+		}
+
+		/* moving blocks must gain space */
+		const uint32_t live = victim ? lm->lm_segs[victim].ls_live : 0;
+		if (!victim || live + div_ceil(live, LFS_DATA_BLOCKS) *
+		    LFS_HDR_BLOCKS + 2 > lm->lm_seg_blocks)
+			break;
+		if ((err = lfs_clean(lm, victim)) < 0)
+			break;
+	}
+
+out:
+	lm->lm_gc = false;
+	return err;
+}
+
+/*
+ * lfs_maintain - checkpoint and clean when needed
+ */
+void
+lfs_maintain(struct lfs_mount *lm)
+{
+	int err = 0;
+
+	if (lm->lm_gc)
+		return;
+	lm->lm_check = false;
+
+	/* bound the amount of log to replay on mount */
+	if (lm->lm_cp_segs >= MAX(2, lm->lm_nsegs / 8))
+		err = lfs_checkpoint(lm);
+	if (!err && lfs_nfree(lm) <= lfs_reserve(lm))
+		err = lfs_gc(lm);
+	if (err < 0)
+		dbg("lfs: maintenance failed %d\n", err);
+}
+
+/*
+ * lfs_block - get writable copy of file block 'idx' in batch buffer
+ *
+ * If 'fill' is set the current contents of the block are read, otherwise
+ * the block is zeroed. The copy is only valid until lm_seq changes.
+ */
+char *
+lfs_block(struct lfs_mount *lm, struct lfs_node *np, size_t idx, bool fill,
+    int *errp)
+{
+	int err;
+
+	for (;;) {
+		const uint32_t a = idx < np->ln_nmap ? np->ln_map[idx] : 0;
+		const bool dirty = !list_empty(&np->ln_dirty);
+		const uint64_t seq = lm->lm_seq;
+
+		if (a & LFS_PENDING && dirty)
+			return lfs_slot(lm, a & ~LFS_PENDING);
+
+		/* new blocks must not eat into space needed by cleaner */
+		if (!a && !lm->lm_gc &&
+		    lm->lm_nlive + lm->lm_nslots >= lm->lm_capacity) {
+			err = -ENOSPC;
+			goto fail;
+		}
+		if ((err = lfs_room(lm, dirty ? 0 : sizeof(struct lfs_rec_size),
+		    a & LFS_PENDING ? 0 : 1)) < 0)
+			goto fail;
+		if (lm->lm_seq != seq)
+			continue;
+		if ((err = lfs_node_reserve(np, idx + 1)) < 0)
+			goto fail;
+
+		if (!dirty) {
+			list_insert(&lm->lm_dirty, &np->ln_dirty);
+			++lm->lm_ndirty;
+		}
+		lfs_mark_dirty(lm);
+		if (a & LFS_PENDING)
+			return lfs_slot(lm, a & ~LFS_PENDING);
+
+		const size_t slot = lm->lm_nslots;
+		char *p = lfs_slot(lm, slot);
+		if (fill && a) {
+			if ((err = lfs_io(lm, p, a, 1, false)) < 0)
+				goto fail;
+		} else
+			memset(p, 0, LFS_BSIZE);
+		if (a) {
+			--lm->lm_segs[lfs_seg_of(lm, a)].ls_live;
+			--lm->lm_nlive;
+		}
+		lm->lm_slots[slot] = (struct lfs_slot){np, idx};
+		++lm->lm_nslots;
+		np->ln_map[idx] = LFS_PENDING | slot;
+		return p;
+	}
+
+fail:
+	*errp = err;
+	return NULL;
+}
+
+/*
+ * lfs_slot_data - get data of pending block map entry
+ */
+char *
+lfs_slot_data(struct lfs_mount *lm, uint32_t a)
+{
+	return lfs_slot(lm, a & ~LFS_PENDING);
+}
+
+/*
+ * lfs_free_data - free all file data
+ */
+void
+lfs_free_data(struct lfs_mount *lm, struct lfs_node *np)
+{
+	for (size_t i = 0; i < np->ln_nmap; ++i) {
+		const uint32_t a = np->ln_map[i];
+		if (a & LFS_PENDING)
+			lm->lm_slots[a & ~LFS_PENDING].ls_node = NULL;
+		else if (a) {
+			--lm->lm_segs[lfs_seg_of(lm, a)].ls_live;
+			--lm->lm_nlive;
+		}
+	}
+	free(np->ln_map);
+	np->ln_map = NULL;
+	np->ln_nmap = 0;
+	np->ln_size = 0;
+	if (!list_empty(&np->ln_dirty)) {
+		list_remove(&np->ln_dirty);
+		list_init(&np->ln_dirty);
+		--lm->lm_ndirty;
+	}
+}
+
+/*
+ * lfs_free_blocks - data blocks available to files
+ */
+uint32_t
+lfs_free_blocks(struct lfs_mount *lm)
+{
+	const uint32_t used = lm->lm_nlive + lm->lm_nslots;
+
+	return used < lm->lm_capacity ? lm->lm_capacity - used : 0;
+}
+
+/*
+ * lfs_alloc_segs - allocate segment usage table
+ */
+static int
+lfs_alloc_segs(struct lfs_mount *lm)
+{
+	if (!(lm->lm_segs = calloc(lm->lm_nsegs, sizeof *lm->lm_segs)))
+		return DERR(-ENOMEM);
+
+	/* reserve space for checkpoints, cleaning and batch headers */
+	lm->lm_capacity = (uint64_t)(lm->lm_nsegs - 4) * lm->lm_seg_blocks *
+	    LFS_DATA_BLOCKS / (LFS_DATA_BLOCKS + LFS_HDR_BLOCKS);
+	return 0;
+}
+
+/*
+ * lfs_super_valid - check checkpoint block
+ */
+static bool
+lfs_super_valid(struct lfs_super *sb, uint64_t size)
+{
+	const uint32_t sum = sb->sum;
+	bool ok;
+
+	if (sb->magic != LFS_MAGIC || sb->version != LFS_VERSION ||
+	    sb->bsize != LFS_BSIZE || sb->seg_blocks < LFS_MIN_SEG ||
+	    sb->nsegs < LFS_MIN_SEGS ||
+	    (uint64_t)sb->nsegs * sb->seg_blocks * LFS_BSIZE > size ||
+	    (uint64_t)sb->nsegs * sb->seg_blocks >= LFS_PENDING ||
+	    sb->start < sb->seg_blocks ||
+	    sb->start >= sb->nsegs * sb->seg_blocks)
+		return false;
+	sb->sum = 0;
+	ok = jhash(sb, LFS_BSIZE, 0) == sum;
+	sb->sum = sum;
+	return ok;
+}
+
+/*
+ * lfs_blank - check if buffer is erased
+ */
+static bool
+lfs_blank(const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (buf[i] != buf[0] || (buf[0] && buf[0] != (char)0xff))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * lfs_format - create an empty file system
+ */
+static int
+lfs_format(struct lfs_mount *lm, uint64_t size)
+{
+	const uint64_t blocks = size / LFS_BSIZE;
+	uint32_t seg_blocks = LFS_MIN_SEG;
+	unsigned erase;
+	int err;
+
+	/* segments should cover whole erase blocks */
+	if (kioctl(lm->lm_fd, BLKIOMIN, &erase) == 0 && erase > LFS_BSIZE)
+		seg_blocks = MAX(seg_blocks, erase / LFS_BSIZE);
+	while (blocks / seg_blocks > LFS_MAX_SEGS)
+		seg_blocks *= 2;
+	if (blocks / seg_blocks < LFS_MIN_SEGS || blocks >= LFS_PENDING)
+		return DERR(-EINVAL);
+
+	lm->lm_seg_blocks = seg_blocks;
+	lm->lm_nsegs = blocks / seg_blocks;
+	if ((err = lfs_alloc_segs(lm)) < 0)
+		return err;
+	for (uint32_t s = 1; s < lm->lm_nsegs; ++s)
+		lfs_discard(lm, s);
+
+	lm->lm_head = seg_blocks;
+	lm->lm_seq = 1;
+	lm->lm_cp_seq = 1;
+	lm->lm_cp_slot = 1;
+	lm->lm_alloc = 1;
+	lm->lm_segs[1].ls_seq = 1;
+	info("lfs: formatting %u segments of %u KiB\n", lm->lm_nsegs,
+	    seg_blocks * (LFS_BSIZE / 1024));
+	return lfs_checkpoint(lm);
+}
+
+/*
+ * lfs_apply - apply records of a batch during replay
+ *
+ * Records for nodes which no longer exist are ignored.
+ */
+static int
+lfs_apply(struct lfs_mount *lm, const char *p, size_t len)
+{
+	struct lfs_node *np;
+	int err;
+
+	while (len) {
+		const struct lfs_rec *r = (const struct lfs_rec *)p;
+		if (len < sizeof *r || r->len < sizeof *r || r->len > len ||
+		    r->len & 7)
+			return DERR(-EIO);
+		np = lfs_node_find(lm, r->ino);
+
+		switch (r->type) {
+		case LFS_R_NODE: {
+			const struct lfs_rec_node *n = (const void *)r;
+			if (r->len < sizeof *n || r->ino == LFS_ROOT_INO)
+				return DERR(-EIO);
+			const size_t namelen = strnlen(n->name,
+			    r->len - sizeof *n);
+			if (!np) {
+				if (!(np = lfs_node_alloc(lm, r->ino, n->name,
+				    namelen, n->mode)))
+					return DERR(-ENOMEM);
+			} else if ((err = lfs_node_rename(np, n->name,
+			    namelen)) < 0)
+				return err;
+			np->ln_mode = n->mode;
+			np->ln_pino = n->parent;
+			np->ln_size = n->size;
+			break;
+		}
+		case LFS_R_SIZE:
+			if (np && r->len >= sizeof(struct lfs_rec_size))
+				np->ln_size = ((const struct lfs_rec_size *)r)->size;
+			break;
+		case LFS_R_UNLINK:
+			if (np && np != lm->lm_root)
+				lfs_node_free(lm, np);
+			break;
+		case LFS_R_TRUNC:
+			if (np)
+				lfs_free_data(lm, np);
+			break;
+		case LFS_R_MAP: {
+			const struct lfs_rec_map *m = (const void *)r;
+			if (!np || r->len < sizeof *m)
+				break;
+			const size_t nblocks = div_ceil(np->ln_size, LFS_BSIZE);
+			const size_t n = (r->len - sizeof *m) / sizeof *m->addr;
+			for (size_t i = 0; i < n; ++i) {
+				const uint32_t a = m->addr[i];
+				const size_t idx = (size_t)m->first + i;
+				if (!lfs_valid_addr(lm, a) || idx >= nblocks)
+					continue;
+				if ((err = lfs_node_reserve(np, idx + 1)) < 0)
+					return err;
+				const uint32_t old = np->ln_map[idx];
+				if (old) {
+					--lm->lm_segs[lfs_seg_of(lm, old)].ls_live;
+					--lm->lm_nlive;
+				}
+				np->ln_map[idx] = a;
+				++lm->lm_segs[lfs_seg_of(lm, a)].ls_live;
+				++lm->lm_nlive;
+			}
+			break;
+		}
+		default:
+			return DERR(-EIO);
+		}
+		p += r->len;
+		len -= r->len;
+	}
+	return 0;
+}
+
+/*
+ * lfs_replay - replay log from checkpoint
+ *
+ * Replay stops at the first batch which is missing, torn or stale. That is
+ * where the next batch will be written.
+ */
+static int
+lfs_replay(struct lfs_mount *lm, uint32_t pos, uint64_t seq)
+{
+	struct lfs_batch *h = (struct lfs_batch *)lm->lm_buf;
+	char *const data = lfs_slot(lm, 0);
+	int err;
+
+	for (;;) {
+		if ((err = lfs_io(lm, h, pos, 1, false)) < 0)
+			return err;
+		const uint32_t room = lfs_seg_end(lm, pos) - pos;
+		if (h->magic != LFS_BATCH_MAGIC || h->seq != seq ||
+		    !h->hblocks || h->hblocks > LFS_HDR_BLOCKS ||
+		    h->nblocks < h->hblocks ||
+		    h->nblocks - h->hblocks > LFS_DATA_BLOCKS ||
+		    h->nblocks > room ||
+		    h->reclen > h->hblocks * LFS_BSIZE - sizeof *h ||
+		    !lfs_valid_addr(lm, h->next) ||
+		    lfs_seg_end(lm, h->next) - h->next < 2)
+			break;
+		const size_t n = h->nblocks - h->hblocks;
+		if (h->hblocks > 1 && (err = lfs_io(lm, (char *)h + LFS_BSIZE,
+		    pos + 1, h->hblocks - 1, false)) < 0)
+			return err;
+		if (n && (err = lfs_io(lm, data, pos + h->hblocks, n,
+		    false)) < 0)
+			return err;
+		const uint32_t sum = h->sum;
+		h->sum = 0;
+		if (lfs_checksum(h, h->hblocks * LFS_BSIZE, data,
+		    n * LFS_BSIZE) != sum)
+			break;
+		if ((err = lfs_apply(lm, (const char *)(h + 1),
+		    h->reclen)) < 0)
+			return err;
+		lm->lm_segs[lfs_seg_of(lm, pos)].ls_seq = seq;
+		pos = h->next;
+		++seq;
+	}
+
+	lfsdbg("replayed to %u seq %llu\n", pos, (unsigned long long)seq);
+	lm->lm_head = pos;
+	lm->lm_seq = seq;
+	lm->lm_alloc = lfs_seg_of(lm, pos);
+	lm->lm_segs[lfs_seg_of(lm, pos)].ls_seq = seq;
+	return 0;
+}
+
+/*
+ * lfs_link_nodes - link replayed nodes into directory tree
+ */
+static void
+lfs_link_nodes(struct lfs_mount *lm)
+{
+	struct lfs_node *np, *tmp, *dnp;
+	bool again = true;
+
+	/* drop nodes whose directory is gone, and then their children */
+	while (again) {
+		again = false;
+		list_for_each_entry_safe(np, tmp, &lm->lm_nodes, ln_link) {
+			if (np == lm->lm_root)
+				continue;
+			dnp = lfs_node_find(lm, np->ln_pino);
+			if (!dnp || !S_ISDIR(dnp->ln_mode)) {
+				dbg("lfs: dropping orphan %u\n", np->ln_ino);
+				lfs_node_free(lm, np);
+				again = true;
+			}
+		}
+	}
+
+	list_for_each_entry(np, &lm->lm_nodes, ln_link) {
+		if (np != lm->lm_root)
+			lfs_node_link(lm, lfs_node_find(lm, np->ln_pino), np);
+	}
+}
+
+/*
+ * lfs_log_mount - load file system from device
+ *
+ * A device which is completely erased is formatted unless mounting read
+ * only.
+ */
+int
+lfs_log_mount(struct lfs_mount *lm, bool rdonly)
+{
+	struct lfs_super *sb = NULL;
+	uint64_t size;
+	phys *p;
+	int err;
+
+	if (LFS_BSIZE % PAGE_SIZE)
+		return DERR(-EINVAL);
+	if ((err = kioctl(lm->lm_fd, BLKGETSIZE64, &size)) < 0)
+		return err;
+	if (!(p = page_alloc(LFS_BUF_SIZE, MA_NORMAL, &lfs_id)))
+		return DERR(-ENOMEM);
+	lm->lm_buf = phys_to_virt(p);
+
+	if ((err = lfs_io(lm, lm->lm_buf, 0, 2, false)) < 0)
+		return err;
+	for (int i = 0; i < 2; ++i) {
+		struct lfs_super *s =
+		    (struct lfs_super *)(lm->lm_buf + i * LFS_BSIZE);
+		if (!lfs_super_valid(s, size) || (sb && s->seq <= sb->seq))
+			continue;
+		sb = s;
+		lm->lm_cp_slot = i;
+	}
+
+	if (!sb) {
+		if (rdonly || !lfs_blank(lm->lm_buf, 2 * LFS_BSIZE))
+			return DERR(-EINVAL);
+		return lfs_format(lm, size);
+	}
+
+	const uint32_t start = sb->start;
+	lm->lm_seg_blocks = sb->seg_blocks;
+	lm->lm_nsegs = sb->nsegs;
+	lm->lm_cp_seq = sb->seq;
+	if ((err = lfs_alloc_segs(lm)) < 0)
+		return err;
+	if ((err = lfs_replay(lm, start, lm->lm_cp_seq)) < 0)
+		return err;
+	lfs_link_nodes(lm);
+	return 0;
+}
+
+/*
+ * lfs_log_unmount - release log state
+ */
+void
+lfs_log_unmount(struct lfs_mount *lm)
+{
+	if (lm->lm_buf)
+		page_free(virt_to_phys(lm->lm_buf), LFS_BUF_SIZE, &lfs_id);
+	free(lm->lm_segs);
+	lm->lm_buf = NULL;
+	lm->lm_segs = NULL;
+}
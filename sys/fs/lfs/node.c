@@ -0,0 +1,182 @@
+/*
+ * node.c - in-memory nodes for log-structured file system.
+ */
+
+#include "lfs.h"
+
+#include <debug.h>
+#include <errno.h>
+#include <jhash3.h>
+#include <kernel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/*
+ * lfs_ihash - get hash chain for an inode number
+ */
+static struct list *
+lfs_ihash(struct lfs_mount *lm, uint32_t ino)
+{
+	return &lm->lm_ihash[ino & (LFS_BUCKETS - 1)];
+}
+
+/*
+ * lfs_nhash - get hash chain for a name in a directory
+ */
+static struct list *
+lfs_nhash(struct lfs_mount *lm, uint32_t dino, const char *name, size_t len)
+{
+	return &lm->lm_nhash[jhash_2words(jhash(name, len, 0), dino) &
+	    (LFS_BUCKETS - 1)];
+}
+
+/*
+ * lfs_node_alloc - allocate an unlinked node
+ */
+struct lfs_node *
+lfs_node_alloc(struct lfs_mount *lm, uint32_t ino, const char *name,
+    size_t len, mode_t mode)
+{
+	struct lfs_node *np;
+	char *ln_name;
+
+	if (!(np = malloc(sizeof *np)))
+		return NULL;
+	if (!(ln_name = malloc(len + 1))) {
+		free(np);
+		return NULL;
+	}
+	memcpy(ln_name, name, len);
+	ln_name[len] = 0;
+	*np = (struct lfs_node){
+		.ln_ino = ino,
+		.ln_mode = mode,
+		.ln_name = ln_name,
+		.ln_namelen = len,
+	};
+	list_init(&np->ln_children);
+	list_init(&np->ln_sibling);
+	list_init(&np->ln_nhash);
+	list_init(&np->ln_dirty);
+	list_insert(&lm->lm_nodes, &np->ln_link);
+	list_insert(lfs_ihash(lm, ino), &np->ln_ihash);
+	if (ino >= lm->lm_next_ino)
+		lm->lm_next_ino = ino + 1;
+	return np;
+}
+
+/*
+ * lfs_node_free - release node and its data
+ */
+void
+lfs_node_free(struct lfs_mount *lm, struct lfs_node *np)
+{
+	lfs_free_data(lm, np);
+	lfs_node_unlink(np);
+	list_remove(&np->ln_link);
+	list_remove(&np->ln_ihash);
+	free(np->ln_map);
+	free(np->ln_name);
+	free(np);
+}
+
+/*
+ * lfs_node_link - link node into directory
+ */
+void
+lfs_node_link(struct lfs_mount *lm, struct lfs_node *dnp,
+    struct lfs_node *np)
+{
+	np->ln_parent = dnp;
+	list_insert(list_last(&dnp->ln_children), &np->ln_sibling);
+	list_insert(lfs_nhash(lm, dnp->ln_ino, np->ln_name, np->ln_namelen),
+	    &np->ln_nhash);
+}
+
+/*
+ * lfs_node_unlink - unlink node from its directory
+ */
+void
+lfs_node_unlink(struct lfs_node *np)
+{
+	list_remove(&np->ln_sibling);
+	list_remove(&np->ln_nhash);
+	list_init(&np->ln_sibling);
+	list_init(&np->ln_nhash);
+	np->ln_parent = NULL;
+}
+
+/*
+ * lfs_node_rename - change name of unlinked node
+ */
+int
+lfs_node_rename(struct lfs_node *np, const char *name, size_t len)
+{
+	char *tmp;
+
+	if (len > np->ln_namelen) {
+		if (!(tmp = malloc(len + 1)))
+			return DERR(-ENOMEM);
+		free(np->ln_name);
+		np->ln_name = tmp;
+	}
+	memcpy(np->ln_name, name, len);
+	np->ln_name[len] = 0;
+	np->ln_namelen = len;
+	return 0;
+}
+
+/*
+ * lfs_node_find - find node by inode number
+ */
+struct lfs_node *
+lfs_node_find(struct lfs_mount *lm, uint32_t ino)
+{
+	struct lfs_node *np;
+
+	list_for_each_entry(np, lfs_ihash(lm, ino), ln_ihash) {
+		if (np->ln_ino == ino)
+			return np;
+	}
+	return NULL;
+}
+
+/*
+ * lfs_node_lookup - find node by name in directory
+ */
+struct lfs_node *
+lfs_node_lookup(struct lfs_mount *lm, struct lfs_node *dnp, const char *name,
+    size_t len)
+{
+	struct lfs_node *np;
+
+	list_for_each_entry(np, lfs_nhash(lm, dnp->ln_ino, name, len),
+	    ln_nhash) {
+		if (np->ln_parent == dnp && np->ln_namelen == len &&
+		    !memcmp(np->ln_name, name, len))
+			return np;
+	}
+	return NULL;
+}
+
+/*
+ * lfs_node_reserve - make sure block map covers 'n' blocks
+ */
+int
+lfs_node_reserve(struct lfs_node *np, size_t n)
+{
+	uint32_t *map;
+
+	if (n <= np->ln_nmap)
+		return 0;
+
+	/* grow geometrically so that appends are amortised O(1) */
+	n = MAX(n, np->ln_nmap * 2);
+	if (!(map = realloc(np->ln_map, n * sizeof *map)))
+		return DERR(-ENOMEM);
+	memset(map + np->ln_nmap, 0, (n - np->ln_nmap) * sizeof *map);
+	np->ln_map = map;
+	np->ln_nmap = n;
+	return 0;
+}
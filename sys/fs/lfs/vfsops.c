@@ -0,0 +1,201 @@
+/*
+ * vfsops.c - vfs operations for log-structured file system.
+ */
+
+#include "lfs.h"
+
+#include <debug.h>
+#include <errno.h>
+#include <fs/mount.h>
+#include <fs/vnode.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <thread.h>
+#include <timer.h>
+
+/*
+ * Batches are written back once they have been dirty for this long
+ */
+#define LFS_WRITEBACK	5000000000ULL
+
+static struct list lfs_mounts;		/* writable lfs mounts */
+static struct mutex lfs_mounts_lock;	/* protects lfs_mounts */
+static struct thread *lfs_thread;	/* write back thread */
+
+/*
+ * lfs_writeback - write back old batches and do maintenance
+ */
+static void
+lfs_writeback(void *arg)
+{
+	struct lfs_mount *lm;
+
+	for (;;) {
+		timer_delay(LFS_WRITEBACK / 2);
+		mutex_lock(&lfs_mounts_lock);
+		list_for_each_entry(lm, &lfs_mounts, lm_link) {
+			mutex_lock(&lm->lm_lock);
+			if (lm->lm_dirty_time && timer_monotonic() -
+			    lm->lm_dirty_time >= LFS_WRITEBACK)
+				lfs_flush(lm);
+			if (lm->lm_check)
+				lfs_maintain(lm);
+			mutex_unlock(&lm->lm_lock);
+		}
+		mutex_unlock(&lfs_mounts_lock);
+	}
+}
+
+/*
+ * lfs_release - free all in-memory state
+ */
+static void
+lfs_release(struct lfs_mount *lm)
+{
+	struct lfs_node *np, *tmp;
+
+	list_for_each_entry_safe(np, tmp, &lm->lm_nodes, ln_link)
+		lfs_node_free(lm, np);
+	lfs_log_unmount(lm);
+	free(lm);
+}
+
+static int
+lfs_init(void)
+{
+	list_init(&lfs_mounts);
+	mutex_init(&lfs_mounts_lock);
+	return 0;
+}
+
+/*
+ * Mount a file system.
+ *
+ * The device is formatted if it is completely erased.
+ */
+static int
+lfs_mount(struct mount *mp, int flags, const void *data)
+{
+	const bool rdonly = mp->m_flags & MS_RDONLY;
+	struct lfs_mount *lm;
+	int err;
+
+	if (mp->m_devfd < 0)
+		return DERR(-ENODEV);
+	if (!(lm = malloc(sizeof *lm)))
+		return DERR(-ENOMEM);
+	*lm = (struct lfs_mount){
+		.lm_fd = mp->m_devfd,
+		.lm_next_ino = LFS_ROOT_INO + 1,
+	};
+	mutex_init(&lm->lm_lock);
+	list_init(&lm->lm_dirty);
+	list_init(&lm->lm_nodes);
+	for (size_t i = 0; i < LFS_BUCKETS; ++i) {
+		list_init(&lm->lm_ihash[i]);
+		list_init(&lm->lm_nhash[i]);
+	}
+
+	if (!(lm->lm_root = lfs_node_alloc(lm, LFS_ROOT_INO, "", 0,
+	    S_IFDIR | 0777))) {
+		free(lm);
+		return DERR(-ENOMEM);
+	}
+	if ((err = lfs_log_mount(lm, rdonly)) < 0) {
+		lfs_release(lm);
+		return err;
+	}
+
+	if (!rdonly) {
+		mutex_lock(&lfs_mounts_lock);
+		if (!lfs_thread && !(lfs_thread = kthread_create(lfs_writeback,
+		    NULL, PRI_KERN_LOW, "lfs", MA_NORMAL))) {
+			mutex_unlock(&lfs_mounts_lock);
+			lfs_release(lm);
+			return DERR(-ENOMEM);
+		}
+		list_insert(&lfs_mounts, &lm->lm_link);
+		mutex_unlock(&lfs_mounts_lock);
+	}
+
+	mp->m_data = lm;
+	mp->m_root->v_data = lm->lm_root;
+	return 0;
+}
+
+/*
+ * Unmount a file system.
+ *
+ * A checkpoint is written so that the next mount has no log to replay.
+ */
+static int
+lfs_umount(struct mount *mp)
+{
+	struct lfs_mount *lm = mp->m_data;
+	int err;
+
+	if (mp->m_flags & MS_RDONLY) {
+		lfs_release(lm);
+		return 0;
+	}
+
+	mutex_lock(&lfs_mounts_lock);
+	mutex_lock(&lm->lm_lock);
+	if ((err = lfs_checkpoint(lm)) == 0)
+		list_remove(&lm->lm_link);
+	mutex_unlock(&lm->lm_lock);
+	mutex_unlock(&lfs_mounts_lock);
+	if (err < 0)
+		return err;
+	lfs_release(lm);
+	return 0;
+}
+
+static int
+lfs_sync(struct mount *mp)
+{
+	struct lfs_mount *lm = mp->m_data;
+	int err;
+
+	mutex_lock(&lm->lm_lock);
+	err = lfs_flush(lm);
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static int
+lfs_statfs(struct mount *mp, struct statfs *sf)
+{
+	struct lfs_mount *lm = mp->m_data;
+
+	mutex_lock(&lm->lm_lock);
+	*sf = (struct statfs){
+		.f_type = LFS_MAGIC,
+		.f_bsize = LFS_BSIZE,
+		.f_blocks = lm->lm_capacity,
+		.f_bfree = lfs_free_blocks(lm),
+		.f_bavail = lfs_free_blocks(lm),
+		.f_namelen = NAME_MAX,
+		.f_frsize = LFS_BSIZE,
+	};
+	mutex_unlock(&lm->lm_lock);
+	return 0;
+}
+
+/*
+ * File system operations
+ */
+static const struct vfsops lfs_vfsops = {
+	.vfs_init = lfs_init,
+	.vfs_mount = lfs_mount,
+	.vfs_umount = lfs_umount,
+	.vfs_sync = lfs_sync,
+	.vfs_vget = ((vfsop_vget_fn)vfs_nullop),
+	.vfs_statfs = lfs_statfs,
+	.vfs_vnops = &lfs_vnops,
+	.vfs_flags = VFSF_PCACHE | VFSF_NCACHE,
+};
+
+REGISTER_FILESYSTEM(lfs);
@@ -0,0 +1,339 @@
+/*
+ * vnops.c - vnode operations for log-structured file system.
+ */
+
+#include "lfs.h"
+
+#include <debug.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <fs/mount.h>
+#include <fs/util.h>
+#include <fs/vnode.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+static ssize_t lfs_read_iov(struct file *, const struct iovec *, size_t, off_t);
+static ssize_t lfs_write_iov(struct file *, const struct iovec *, size_t, off_t);
+static int lfs_fsync(struct file *);
+static int lfs_readdir(struct file *, struct dirent *, size_t);
+static int lfs_lookup(struct vnode *, const char *, size_t, struct vnode *);
+static int lfs_mknod(struct vnode *, const char *, size_t, int, mode_t);
+static int lfs_unlink(struct vnode *, struct vnode *);
+static int lfs_rename(struct vnode *, struct vnode *, struct vnode *, struct vnode *, const char *, size_t);
+static int lfs_truncate(struct vnode *);
+
+/*
+ * vnode operations
+ */
+const struct vnops lfs_vnops = {
+	.vop_open = ((vnop_open_fn)vop_nullop),
+	.vop_close = ((vnop_close_fn)vop_nullop),
+	.vop_read = lfs_read_iov,
+	.vop_write = lfs_write_iov,
+	.vop_seek = ((vnop_seek_fn)vop_nullop),
+	.vop_ioctl = ((vnop_ioctl_fn)vop_einval),
+	.vop_poll = ((vnop_poll_fn)vop_pollready),
+	.vop_fsync = lfs_fsync,
+	.vop_readdir = lfs_readdir,
+	.vop_lookup = lfs_lookup,
+	.vop_mknod = lfs_mknod,
+	.vop_unlink = lfs_unlink,
+	.vop_rename = lfs_rename,
+	.vop_getattr = ((vnop_getattr_fn)vop_nullop),
+	.vop_setattr = ((vnop_setattr_fn)vop_nullop),
+	.vop_inactive = ((vnop_inactive_fn)vop_nullop),
+	.vop_truncate = lfs_truncate,
+	.vop_xip = ((vnop_xip_fn)vop_einval),
+};
+
+static int
+lfs_lookup(struct vnode *dvp, const char *name, size_t len, struct vnode *vp)
+{
+	struct lfs_mount *lm = dvp->v_mount->m_data;
+	struct lfs_node *np;
+
+	if (*name == '\0')
+		return -ENOENT;
+
+	mutex_lock(&lm->lm_lock);
+	np = lfs_node_lookup(lm, dvp->v_data, name, len);
+	mutex_unlock(&lm->lm_lock);
+	if (!np)
+		return -ENOENT;
+	vp->v_data = np;
+	vp->v_mode = np->ln_mode;
+	vp->v_size = np->ln_size;
+	return 0;
+}
+
+static int
+lfs_mknod(struct vnode *dvp, const char *name, size_t len, int flags,
+    mode_t mode)
+{
+	struct lfs_mount *lm = dvp->v_mount->m_data;
+	struct lfs_node *np;
+	int err;
+
+	lfsdbg("create (%zu):%s in %s\n", len, name, dvp->v_path);
+
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+
+	mutex_lock(&lm->lm_lock);
+	if ((err = lfs_room(lm, LFS_NODE_LEN(len), 0)) < 0)
+		goto out;
+	if (!(np = lfs_node_alloc(lm, lm->lm_next_ino, name, len, mode))) {
+		err = DERR(-ENOMEM);
+		goto out;
+	}
+	lfs_node_link(lm, dvp->v_data, np);
+	lfs_log_node(lm, np);
+out:
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static int
+lfs_unlink(struct vnode *dvp, struct vnode *vp)
+{
+	struct lfs_mount *lm = vp->v_mount->m_data;
+	struct lfs_node *np = vp->v_data;
+	int err;
+
+	lfsdbg("unlink %s in %s\n", vp->v_path, dvp->v_path);
+
+	if (!list_empty(&np->ln_children))
+		return -ENOTEMPTY;
+
+	mutex_lock(&lm->lm_lock);
+	if ((err = lfs_room(lm, sizeof(struct lfs_rec), 0)) == 0) {
+		lfs_log(lm, LFS_R_UNLINK, np->ln_ino, sizeof(struct lfs_rec));
+		lfs_node_free(lm, np);
+		vp->v_size = 0;
+	}
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static int
+lfs_rename(struct vnode *dvp1, struct vnode *vp1, struct vnode *dvp2,
+    struct vnode *vp2, const char *name, size_t len)
+{
+	struct lfs_mount *lm = vp1->v_mount->m_data;
+	struct lfs_node *np = vp1->v_data, *tnp = vp2 ? vp2->v_data : NULL;
+	size_t reclen = LFS_NODE_LEN(len);
+	int err;
+
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	if (tnp && !list_empty(&tnp->ln_children))
+		return -ENOTEMPTY;
+
+	mutex_lock(&lm->lm_lock);
+	if (tnp)
+		reclen += sizeof(struct lfs_rec);
+	if ((err = lfs_room(lm, reclen, 0)) < 0)
+		goto out;
+
+	/* change name first as it's the only step which can fail */
+	lfs_node_unlink(np);
+	if ((err = lfs_node_rename(np, name, len)) < 0) {
+		lfs_node_link(lm, dvp1->v_data, np);
+		goto out;
+	}
+	if (tnp) {
+		lfs_log(lm, LFS_R_UNLINK, tnp->ln_ino, sizeof(struct lfs_rec));
+		lfs_node_free(lm, tnp);
+	}
+	lfs_node_link(lm, dvp2->v_data, np);
+	lfs_log_node(lm, np);
+out:
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static int
+lfs_truncate(struct vnode *vp)
+{
+	struct lfs_mount *lm = vp->v_mount->m_data;
+	struct lfs_node *np = vp->v_data;
+	int err = 0;
+
+	lfsdbg("truncate %s\n", vp->v_path);
+
+	mutex_lock(&lm->lm_lock);
+	if (np->ln_size || np->ln_nmap) {
+		if ((err = lfs_room(lm, sizeof(struct lfs_rec), 0)) == 0) {
+			lfs_log(lm, LFS_R_TRUNC, np->ln_ino,
+			    sizeof(struct lfs_rec));
+			lfs_free_data(lm, np);
+		}
+	}
+	if (!err)
+		vp->v_size = 0;
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static ssize_t
+lfs_read(struct file *fp, void *buf, size_t size, off_t offset)
+{
+	struct vnode *vp = fp->f_vnode;
+	struct lfs_mount *lm = vp->v_mount->m_data;
+	struct lfs_node *np = vp->v_data;
+	ssize_t r = 0;
+
+	if (!S_ISREG(vp->v_mode) && !S_ISLNK(vp->v_mode))
+		return -EINVAL;
+
+	mutex_lock(&lm->lm_lock);
+	if (offset >= np->ln_size)
+		goto out;
+	if (np->ln_size - offset < (off_t)size)
+		size = np->ln_size - offset;
+
+	for (size_t t = 0; t < size;) {
+		const size_t i = (offset + t) / LFS_BSIZE;
+		const size_t off = (offset + t) % LFS_BSIZE;
+		const uint32_t a = i < np->ln_nmap ? np->ln_map[i] : 0;
+		char *const p = (char *)buf + t;
+		size_t n = MIN(size - t, LFS_BSIZE - off);
+
+		if (!a)
+			memset(p, 0, n);	/* hole */
+		else if (a & LFS_PENDING)
+			memcpy(p, lfs_slot_data(lm, a) + off, n);
+		else {
+			/* read consecutive blocks in one request */
+			for (size_t k = 1; t + n < size && i + k < np->ln_nmap &&
+			    np->ln_map[i + k] == a + k; ++k)
+				n += MIN(size - t - n, LFS_BSIZE);
+			if ((r = kpread(lm->lm_fd, p, n,
+			    (off_t)a * LFS_BSIZE + off)) != (ssize_t)n) {
+				if (r >= 0)
+					r = DERR(-EIO);
+				goto out;
+			}
+		}
+		t += n;
+	}
+	r = size;
+out:
+	mutex_unlock(&lm->lm_lock);
+	return r;
+}
+
+static ssize_t
+lfs_read_iov(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	return for_each_iov(fp, iov, count, offset, lfs_read);
+}
+
+static ssize_t
+lfs_write(struct file *fp, void *buf, size_t size, off_t offset)
+{
+	struct vnode *vp = fp->f_vnode;
+	struct lfs_mount *lm = vp->v_mount->m_data;
+	struct lfs_node *np = vp->v_data;
+	size_t t = 0;
+	int err = 0;
+
+	if (!S_ISREG(vp->v_mode) && !S_ISLNK(vp->v_mode))
+		return -EINVAL;
+
+	mutex_lock(&lm->lm_lock);
+	while (t < size) {
+		const size_t i = (offset + t) / LFS_BSIZE;
+		const size_t off = (offset + t) % LFS_BSIZE;
+		const size_t n = MIN(size - t, LFS_BSIZE - off);
+		char *p;
+
+		/* keep existing data unless the whole block is overwritten */
+		if (!(p = lfs_block(lm, np, i, n != LFS_BSIZE, &err)))
+			break;
+		memcpy(p + off, (char *)buf + t, n);
+		t += n;
+
+		/* size must be current before the batch is next written */
+		if (offset + (off_t)t > np->ln_size) {
+			np->ln_size = offset + t;
+			vp->v_size = np->ln_size;
+		}
+	}
+	mutex_unlock(&lm->lm_lock);
+	return t ? (ssize_t)t : err;
+}
+
+static ssize_t
+lfs_write_iov(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	return for_each_iov(fp, iov, count, offset, lfs_write);
+}
+
+/*
+ * Write batch so that everything written so far survives power loss.
+ */
+static int
+lfs_fsync(struct file *fp)
+{
+	struct lfs_mount *lm = fp->f_vnode->v_mount->m_data;
+	int err;
+
+	mutex_lock(&lm->lm_lock);
+	err = lfs_flush(lm);
+	mutex_unlock(&lm->lm_lock);
+	return err;
+}
+
+static int
+lfs_readdir(struct file *fp, struct dirent *buf, size_t len)
+{
+	struct lfs_mount *lm = fp->f_vnode->v_mount->m_data;
+	struct lfs_node *dnp = fp->f_vnode->v_data;
+	size_t remain = len;
+	struct list *n;
+
+	if (fp->f_offset == 0) {
+		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, "."))
+			goto out;
+		++fp->f_offset;
+	}
+
+	if (fp->f_offset == 1) {
+		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, ".."))
+			goto out;
+		++fp->f_offset;
+	}
+
+	mutex_lock(&lm->lm_lock);
+	n = list_first(&dnp->ln_children);
+	for (off_t i = 0; i != (fp->f_offset - 2); i++) {
+		if (list_end(&dnp->ln_children, n))
+			goto unlock;
+		n = list_next(n);
+	}
+
+	for (; !list_end(&dnp->ln_children, n); n = list_next(n)) {
+		const struct lfs_node *np =
+		    list_entry(n, struct lfs_node, ln_sibling);
+		if (dirbuf_add(&buf, &remain, np->ln_ino, fp->f_offset,
+		    IFTODT(np->ln_mode), np->ln_name))
+			break;
+		++fp->f_offset;
+	}
+unlock:
+	mutex_unlock(&lm->lm_lock);
+
+out:
+	if (remain != len)
+		return len - remain;
+
+	return -ENOENT;
+}
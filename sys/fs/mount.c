@@ -292,6 +292,9 @@ umount2(const char *path, int flags)
 		return -EINVAL;
 	}
 
+	/* release unused vnodes which keep file system busy */
+	vn_flush(vp->v_mount);
+
 	if ((err = mutex_lock_interruptible(&mount_mutex)))
 		goto out;
 
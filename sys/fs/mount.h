@@ -46,8 +46,13 @@ struct vfsops {
 	vfsop_vget_fn	     vfs_vget;
 	vfsop_statfs_fn	     vfs_statfs;
 	const struct vnops  *vfs_vnops;
+	unsigned	     vfs_flags;
 };
 
+/* flags for vfsops */
+#define VFSF_PCACHE	0x0001		/* cache file data in page cache */
+#define VFSF_NCACHE	0x0002		/* cache failed lookups */
+
 /*
  * VFS interface
  */
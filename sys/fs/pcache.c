@@ -0,0 +1,699 @@
+/*
+ * pcache.c - page cache for regular file data
+ *
+ * Regular file data on file systems which set VFSF_PCACHE is cached in
+ * extents of physically contiguous pages. Each vnode keeps its extents in
+ * offset order on v_pages and extents never overlap.
+ *
+ * read() is served from the cache, write() goes through to the file system
+ * and updates any cached pages, and read-only shared or executable mappings
+ * map cache pages directly. All three therefore see the same data. Mappings
+ * of the same file range by different processes share one copy of the pages,
+ * counted by 'mapped'. Cache mappings can never be made writable, so other
+ * private mappings get their own copy which can.
+ *
+ * Extents which are not in use by a transfer or a mapping can be reclaimed
+ * by the page allocator when memory is low. Reclaim may run with kmem locks
+ * held, so it only frees pages and leaves the extent descriptors on a list
+ * to be freed by the next page cache operation.
+ *
+ * The vnode lock serialises filling the cache for a vnode. pcache_lock
+ * protects extent lists, the lru list and extent counts.
+ */
+
+#include "pcache.h"
+
+#include "mount.h"
+#include "vnode.h"
+#include <assert.h>
+#include <debug.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <kernel.h>
+#include <kmem.h>
+#include <list.h>
+#include <page.h>
+#include <string.h>
+#include <sync.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#define FILL_MAX	(16 * PAGE_SIZE)	/* maximum extent filled by read */
+
+/*
+ * Cached file data
+ */
+struct extent {
+	struct list	 link;		/* link on v_pages in offset order */
+	struct list	 lru;		/* link on pcache_lru or pcache_reaped */
+	off_t		 off;		/* file offset */
+	size_t		 len;		/* length in bytes, multiple of pages */
+	phys		*pages;		/* cached data */
+	unsigned	 users;		/* transfers in progress */
+	unsigned	 mapped;	/* pages mapped into address spaces */
+};
+
+static struct kmem_cache *extent_cache;
+static struct spinlock pcache_lock;
+static struct list pcache_lru = LIST_INIT(pcache_lru);
+static struct list pcache_reaped = LIST_INIT(pcache_reaped);
+
+/*
+ * Page ownership identifier for page cache
+ */
+static char pcache_id;
+
+/*
+ * ext_data - get address of data for file offset 'off' in extent
+ */
+static char *
+ext_data(const struct extent *e, off_t off)
+{
+	assert(off >= e->off && off <= e->off + (off_t)e->len);
+	return (char *)phys_to_virt(e->pages) + (off - e->off);
+}
+
+/*
+ * ext_overlaps - test if extent overlaps file range
+ */
+static bool
+ext_overlaps(const struct extent *e, off_t off, size_t len)
+{
+	return e->off < off + (off_t)len && off < e->off + (off_t)e->len;
+}
+
+/*
+ * ext_find - find extent containing file offset 'off'
+ *
+ * If there is no such extent the offset of the next extent, or -1, is
+ * returned in 'next'. Must be called with pcache_lock held.
+ */
+static struct extent *
+ext_find(struct vnode *vp, off_t off, off_t *next)
+{
+	struct extent *e;
+
+	list_for_each_entry(e, &vp->v_pages, link) {
+		if (e->off + (off_t)e->len <= off)
+			continue;
+		if (e->off <= off)
+			return e;
+		*next = e->off;
+		return NULL;
+	}
+	*next = -1;
+	return NULL;
+}
+
+/*
+ * ext_insert - insert extent into vnode extent list
+ *
+ * Must be called with pcache_lock held.
+ */
+static void
+ext_insert(struct vnode *vp, struct extent *e)
+{
+	struct extent *n;
+
+	list_for_each_entry(n, &vp->v_pages, link) {
+		if (n->off > e->off)
+			break;
+	}
+	list_insert(list_prev(&n->link), &e->link);
+	list_insert(&pcache_lru, &e->lru);
+}
+
+/*
+ * ext_remove - remove extent from cache
+ *
+ * The extent is moved to 'l' to be freed after pcache_lock is released.
+ */
+static void
+ext_remove(struct extent *e, struct list *l)
+{
+	assert(!e->users && !e->mapped);
+
+	list_remove(&e->link);
+	list_remove(&e->lru);
+	list_insert(l, &e->lru);
+}
+
+/*
+ * ext_free_list - free list of removed extents
+ */
+static void
+ext_free_list(struct list *l)
+{
+	while (!list_empty(l)) {
+		struct extent *e = list_entry(list_first(l), struct extent, lru);
+		list_remove(&e->lru);
+		if (e->pages)
+			page_free(e->pages, e->len, &pcache_id);
+		kmem_cache_free(extent_cache, e);
+	}
+}
+
+/*
+ * ext_fill - read file data into a new extent
+ *
+ * The extent is returned with a user reference and is not yet in the cache.
+ */
+static int
+ext_fill(struct vnode *vp, off_t off, size_t len, struct extent **ep)
+{
+	struct extent *e;
+	phys *p;
+	ssize_t r;
+
+	if (!(e = kmem_cache_alloc(extent_cache)))
+		return DERR(-ENOMEM);
+	if (!(p = page_alloc(len, MA_NORMAL, &pcache_id))) {
+		kmem_cache_free(extent_cache, e);
+		return -ENOMEM;
+	}
+
+	/* read from dummy file */
+	struct file f = {
+		.f_flags = O_RDONLY,
+		.f_count = 1,
+		.f_vnode = vp,
+	};
+	struct iovec iov = {
+		.iov_base = phys_to_virt(p),
+		.iov_len = len,
+	};
+	if ((r = VOP_READ(&f, &iov, 1, off)) < 0) {
+		page_free(p, len, &pcache_id);
+		kmem_cache_free(extent_cache, e);
+		return r;
+	}
+	memset((char *)iov.iov_base + r, 0, len - r);
+
+	*e = (struct extent){
+		.off = off,
+		.len = len,
+		.pages = p,
+		.users = 1,
+	};
+	*ep = e;
+	return 0;
+}
+
+/*
+ * reap - free descriptors of reclaimed extents
+ */
+static void
+reap(void)
+{
+	struct list l = LIST_INIT(l);
+
+	spinlock_lock(&pcache_lock);
+	while (!list_empty(&pcache_reaped))
+		list_insert(&l, list_remove(list_first(&pcache_reaped)));
+	spinlock_unlock(&pcache_lock);
+
+	ext_free_list(&l);
+}
+
+/*
+ * put - release user reference to extent
+ */
+static void
+put(struct extent *e)
+{
+	spinlock_lock(&pcache_lock);
+	assert(e->users);
+	--e->users;
+	spinlock_unlock(&pcache_lock);
+}
+
+/*
+ * copy_to_iov - copy data to iov, advancing iov
+ */
+static void
+copy_to_iov(const struct iovec **iov, size_t *iov_off, const char *buf,
+    size_t len)
+{
+	while (len) {
+		const size_t cp = MIN(len, (*iov)->iov_len - *iov_off);
+		memcpy((char *)(*iov)->iov_base + *iov_off, buf, cp);
+		buf += cp;
+		len -= cp;
+		*iov_off += cp;
+		if (*iov_off == (*iov)->iov_len) {
+			++*iov;
+			*iov_off = 0;
+		}
+	}
+}
+
+/*
+ * copy_from_iov - copy data from iov starting 'skip' bytes in
+ */
+static void
+copy_from_iov(const struct iovec *iov, size_t skip, char *buf, size_t len)
+{
+	for (; skip >= iov->iov_len; ++iov)
+		skip -= iov->iov_len;
+	while (len) {
+		const size_t cp = MIN(len, iov->iov_len - skip);
+		memcpy(buf, (char *)iov->iov_base + skip, cp);
+		buf += cp;
+		len -= cp;
+		skip = 0;
+		++iov;
+	}
+}
+
+/*
+ * read_direct - read bypassing the cache
+ */
+static ssize_t
+read_direct(struct file *fp, const struct iovec *iov, size_t iov_off,
+    size_t len, off_t off)
+{
+	ssize_t total = 0;
+
+	while (len) {
+		struct iovec v = {
+			.iov_base = (char *)iov->iov_base + iov_off,
+			.iov_len = MIN(len, iov->iov_len - iov_off),
+		};
+		const ssize_t r = VOP_READ(fp, &v, 1, off);
+		if (r < 0)
+			return total ? total : r;
+		total += r;
+		if ((size_t)r != v.iov_len)
+			break;
+		len -= r;
+		off += r;
+		++iov;
+		iov_off = 0;
+	}
+	return total;
+}
+
+/*
+ * pcache_init - initialise page cache
+ */
+void
+pcache_init(void)
+{
+	spinlock_init(&pcache_lock);
+	if (!(extent_cache = kmem_cache_create("pcache", sizeof(struct extent),
+	    MA_NORMAL)))
+		panic("pcache_init");
+}
+
+/*
+ * pcache_enabled - test if vnode data is cached
+ */
+bool
+pcache_enabled(const struct vnode *vp)
+{
+	return vp->v_mount && vp->v_mount->m_op->vfs_flags & VFSF_PCACHE &&
+	    S_ISREG(vp->v_mode);
+}
+
+/*
+ * get - find or fill extent containing 'offset' and take a user reference
+ *
+ * Fills at most 'len' bytes rounded up to pages. Returns -ENOMEM if there is
+ * no memory for the cache.
+ */
+static int
+get(struct vnode *vp, off_t offset, size_t len, struct extent **ep)
+{
+	struct extent *e;
+	off_t next;
+
+	spinlock_lock(&pcache_lock);
+	if ((e = ext_find(vp, offset, &next))) {
+		++e->users;
+		list_remove(&e->lru);
+		list_insert(&pcache_lru, &e->lru);
+	}
+	spinlock_unlock(&pcache_lock);
+
+	if (!e) {
+		/* fill from start of page up to the next extent */
+		const off_t start = offset & ~(off_t)PAGE_MASK;
+		off_t end = MIN(offset + (off_t)len + PAGE_MASK,
+		    start + FILL_MAX) & ~(off_t)PAGE_MASK;
+		if (next != -1 && next < end)
+			end = next;
+		int r = ext_fill(vp, start, end - start, &e);
+		if (r == -ENOMEM && end - start > PAGE_SIZE)
+			r = ext_fill(vp, start, PAGE_SIZE, &e);
+		if (r < 0)
+			return r;
+		spinlock_lock(&pcache_lock);
+		ext_insert(vp, e);
+		spinlock_unlock(&pcache_lock);
+	}
+
+	*ep = e;
+	return 0;
+}
+
+/*
+ * pcache_read - read file data through cache
+ *
+ * Must be called with vnode locked.
+ */
+ssize_t
+pcache_read(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	struct vnode *vp = fp->f_vnode;
+	size_t iov_off = 0;
+	ssize_t total = 0;
+	size_t len = 0;
+
+	reap();
+
+	/* total length truncated to file size */
+	if (offset >= vp->v_size)
+		return 0;
+	for (size_t i = 0; i < count; ++i)
+		len += iov[i].iov_len;
+	len = MIN(len, (size_t)(vp->v_size - offset));
+
+	while (len) {
+		struct extent *e;
+		int r;
+
+		if ((r = get(vp, offset, len, &e)) == -ENOMEM) {
+			/* no memory for cache, read directly */
+			r = read_direct(fp, iov, iov_off, len, offset);
+			if (r < 0)
+				return total ? total : r;
+			return total + r;
+		}
+		if (r < 0)
+			return total ? total : r;
+
+		const size_t n = MIN(len, (size_t)(e->off + e->len - offset));
+		copy_to_iov(&iov, &iov_off, ext_data(e, offset), n);
+		put(e);
+		offset += n;
+		len -= n;
+		total += n;
+	}
+
+	return total;
+}
+
+/*
+ * pcache_splice - pass cached file data to fn without copying
+ *
+ * fn is called with the cached data of each extent in the range and returns
+ * the number of bytes it consumed. Returns -ENOMEM if nothing could be
+ * cached, in which case the caller should read the file.
+ *
+ * Must be called with vnode locked.
+ */
+ssize_t
+pcache_splice(struct vnode *vp, off_t offset, size_t len, splice_fn fn,
+    void *arg)
+{
+	ssize_t total = 0;
+
+	reap();
+
+	/* length truncated to file size */
+	if (offset >= vp->v_size)
+		return 0;
+	len = MIN(len, (size_t)(vp->v_size - offset));
+
+	while (len) {
+		struct extent *e;
+		int r;
+
+		if ((r = get(vp, offset, len, &e)) < 0)
+			return total ? total : r;
+
+		const size_t n = MIN(len, (size_t)(e->off + e->len - offset));
+		const ssize_t c = fn(arg, ext_data(e, offset), n);
+		put(e);
+		if (c < 0)
+			return total ? total : c;
+		offset += c;
+		len -= c;
+		total += c;
+		if ((size_t)c < n)
+			break;
+	}
+
+	return total;
+}
+
+/*
+ * pcache_write - update cache after 'len' bytes were written at 'offset'
+ *
+ * Must be called with vnode locked.
+ */
+void
+pcache_write(struct vnode *vp, const struct iovec *iov, size_t count,
+    off_t offset, size_t len)
+{
+	struct extent *e;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry(e, &vp->v_pages, link) {
+		if (e->off >= offset + (off_t)len)
+			break;
+		if (!ext_overlaps(e, offset, len))
+			continue;
+		const off_t start = MAX(e->off, offset);
+		const off_t end = MIN(e->off + (off_t)e->len,
+		    offset + (off_t)len);
+
+		/* extent cannot be removed while it has users */
+		++e->users;
+		spinlock_unlock(&pcache_lock);
+		copy_from_iov(iov, start - offset, ext_data(e, start),
+		    end - start);
+		spinlock_lock(&pcache_lock);
+		--e->users;
+	}
+	spinlock_unlock(&pcache_lock);
+}
+
+/*
+ * pcache_truncate - discard cached data after file is truncated to zero
+ *
+ * Mapped pages can't be discarded so they are zeroed. Must be called with
+ * vnode locked.
+ */
+void
+pcache_truncate(struct vnode *vp)
+{
+	struct list l = LIST_INIT(l);
+	struct extent *e, *tmp;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry_safe(e, tmp, &vp->v_pages, link) {
+		if (e->mapped)
+			memset(phys_to_virt(e->pages), 0, e->len);
+		else
+			ext_remove(e, &l);
+	}
+	spinlock_unlock(&pcache_lock);
+
+	ext_free_list(&l);
+}
+
+/*
+ * pcache_purge - discard all cached data for vnode
+ */
+void
+pcache_purge(struct vnode *vp)
+{
+	struct list l = LIST_INIT(l);
+
+	spinlock_lock(&pcache_lock);
+	while (!list_empty(&vp->v_pages))
+		ext_remove(list_entry(list_first(&vp->v_pages),
+		    struct extent, link), &l);
+	spinlock_unlock(&pcache_lock);
+
+	ext_free_list(&l);
+}
+
+/*
+ * pcache_map - get cache pages for a read-only mapping
+ *
+ * Returns NULL if the range can't be mapped from the cache, in which case
+ * the caller should make a private copy of the data.
+ */
+phys *
+pcache_map(struct vnode *vp, off_t off, size_t len)
+{
+	struct list l = LIST_INIT(l);
+	struct extent *e, *n, *tmp;
+	phys *p = NULL;
+	off_t next;
+
+	assert(!(off & PAGE_MASK) && !(len & PAGE_MASK));
+
+	vn_lock(vp);
+	if (!pcache_enabled(vp))
+		goto out;
+	reap();
+
+	/* share existing extent */
+	spinlock_lock(&pcache_lock);
+	if ((e = ext_find(vp, off, &next)) &&
+	    e->off + e->len >= off + len) {
+		e->mapped += len / PAGE_SIZE;
+		p = virt_to_phys(ext_data(e, off));
+		spinlock_unlock(&pcache_lock);
+		goto out;
+	}
+
+	/* extents overlapping the range must be idle to be replaced */
+	list_for_each_entry(e, &vp->v_pages, link) {
+		if (ext_overlaps(e, off, len) && (e->users || e->mapped)) {
+			spinlock_unlock(&pcache_lock);
+			goto out;
+		}
+	}
+	spinlock_unlock(&pcache_lock);
+
+	if (ext_fill(vp, off, len, &e) < 0)
+		goto out;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry_safe(n, tmp, &vp->v_pages, link) {
+		if (ext_overlaps(n, off, len))
+			ext_remove(n, &l);
+	}
+	e->users = 0;
+	e->mapped = len / PAGE_SIZE;
+	ext_insert(vp, e);
+	p = e->pages;
+	spinlock_unlock(&pcache_lock);
+
+	ext_free_list(&l);
+
+out:
+	vn_unlock(vp);
+	return p;
+}
+
+/*
+ * pcache_unmap - release cache pages mapped by pcache_map
+ *
+ * 'addr' is the physical address returned by pcache_map. Returns false if
+ * the pages are not cache pages.
+ */
+bool
+pcache_unmap(struct vnode *vp, void *addr, size_t len)
+{
+	struct extent *e;
+	bool found = false;
+
+	if (!pcache_enabled(vp))
+		return false;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry(e, &vp->v_pages, link) {
+		const char *d = (const char *)e->pages;
+		if ((char *)addr < d || (char *)addr >= d + e->len)
+			continue;
+		assert((char *)addr + len <= d + e->len);
+		assert(e->mapped >= len / PAGE_SIZE);
+		e->mapped -= len / PAGE_SIZE;
+		found = true;
+		break;
+	}
+	spinlock_unlock(&pcache_lock);
+
+	return found;
+}
+
+/*
+ * pcache_owns - test if address is in a cache page of vnode
+ */
+bool
+pcache_owns(struct vnode *vp, const void *addr)
+{
+	struct extent *e;
+	bool found = false;
+
+	if (!pcache_enabled(vp))
+		return false;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry(e, &vp->v_pages, link) {
+		const char *d = (const char *)e->pages;
+		if ((const char *)addr >= d && (const char *)addr < d + e->len) {
+			found = true;
+			break;
+		}
+	}
+	spinlock_unlock(&pcache_lock);
+
+	return found;
+}
+
+/*
+ * pcache_evict - free idle cache pages in address range
+ *
+ * Used to make room for a fixed mapping once the cache pages previously
+ * mapped there have been unmapped. Extents still in use are left alone.
+ */
+void
+pcache_evict(struct vnode *vp, const void *addr, size_t len)
+{
+	struct list l = LIST_INIT(l);
+	struct extent *e, *tmp;
+	const char *a = addr;
+
+	if (!pcache_enabled(vp))
+		return;
+
+	spinlock_lock(&pcache_lock);
+	list_for_each_entry_safe(e, tmp, &vp->v_pages, link) {
+		const char *d = (const char *)e->pages;
+		if (d < a + len && a < d + e->len && !e->users && !e->mapped)
+			ext_remove(e, &l);
+	}
+	spinlock_unlock(&pcache_lock);
+
+	ext_free_list(&l);
+}
+
+/*
+ * pcache_reclaim - free unused cache pages
+ *
+ * Called by the page allocator when memory is low. Frees least recently used
+ * extents until at least 'len' bytes have been freed. Returns number of bytes
+ * freed.
+ */
+size_t
+pcache_reclaim(size_t len)
+{
+	size_t freed = 0;
+
+	spinlock_lock(&pcache_lock);
+	for (struct list *n = list_last(&pcache_lru), *prev;
+	    freed < len && !list_end(&pcache_lru, n); n = prev) {
+		prev = list_prev(n);
+		struct extent *e = list_entry(n, struct extent, lru);
+		if (e->users || e->mapped)
+			continue;
+		list_remove(&e->link);
+		list_remove(&e->lru);
+		page_free(e->pages, e->len, &pcache_id);
+		e->pages = NULL;
+		freed += e->len;
+		list_insert(&pcache_reaped, &e->lru);
+	}
+	spinlock_unlock(&pcache_lock);
+
+	return freed;
+}
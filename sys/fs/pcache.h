@@ -0,0 +1,21 @@
+#ifndef fs_pcache_h
+#define fs_pcache_h
+
+#include "vfs.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct file;
+struct iovec;
+struct vnode;
+
+void	pcache_init(void);
+bool	pcache_enabled(const struct vnode *);
+ssize_t	pcache_read(struct file *, const struct iovec *, size_t, off_t);
+void	pcache_write(struct vnode *, const struct iovec *, size_t, off_t,
+		     size_t);
+void	pcache_truncate(struct vnode *);
+void	pcache_purge(struct vnode *);
+ssize_t	pcache_splice(struct vnode *, off_t, size_t, splice_fn, void *);
+
+#endif
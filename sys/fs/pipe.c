@@ -1,6 +1,7 @@
 #include "pipe.h"
 
 #include "file.h"
+#include "poll.h"
 #include "vnode.h"
 #include <assert.h>
 #include <debug.h>
@@ -9,10 +10,12 @@
 #include <kernel.h>
 #include <limits.h>
 #include <page.h>
+#include <poll.h>
 #include <sig.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sync.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <task.h>
 
@@ -34,6 +37,8 @@
 
 static_assert(PIPE_BUF == 4096, "");
 
+#define PIPE_SIZE_MAX	(64 * 1024)	/* maximum pipe buffer size */
+
 #define pdbg(...)
 
 /*
@@ -46,10 +51,12 @@ static char pipe_id;
  */
 struct pipe_data {
 	struct cond  cond;	    /* condition variable for this pipe */
+	struct pollq pollq;	    /* pollers waiting on this pipe */
 	size_t	     read_fds;	    /* number of fd open for reading */
 	size_t	     write_fds;	    /* number of fd open for writing */
 	size_t	     wr;	    /* write bytes */
 	size_t	     rd;	    /* read bytes */
+	size_t	     size;	    /* buffer size, power of 2 */
 	void	    *buf;	    /* pipe data buffer */
 };
 
@@ -74,10 +81,12 @@ pipe_alloc(struct file *fp)
 		return -ENOMEM;
 	}
 	cond_init(&p->cond);
+	pollq_init(&p->pollq);
 	p->read_fds = 0;
 	p->write_fds = 0;
 	p->wr = 0;
 	p->rd = 0;
+	p->size = PIPE_BUF;
 	p->buf = phys_to_virt(b);
 
 	vp->v_pipe = p;
@@ -93,7 +102,8 @@ pipe_free(struct file *fp)
 	struct vnode *vp = fp->f_vnode;
 	struct pipe_data *p = vp->v_pipe;
 
-	page_free(virt_to_phys(p->buf), PIPE_BUF, &pipe_id);
+	pollq_destroy(&p->pollq);
+	page_free(virt_to_phys(p->buf), p->size, &pipe_id);
 	free(p);
 }
 
@@ -147,12 +157,16 @@ pipe_close(struct file *fp)
 
 	switch (fp->f_flags & O_ACCMODE) {
 	case O_RDONLY:
-		if (--p->read_fds == 0)
+		if (--p->read_fds == 0) {
 			cond_signal(&p->cond); /* wake blocked write */
+			pollq_notify(&p->pollq);
+		}
 		break;
 	case O_WRONLY:
-		if (--p->write_fds == 0)
+		if (--p->write_fds == 0) {
 			cond_signal(&p->cond); /* wake blocked read */
+			pollq_notify(&p->pollq);
+		}
 		break;
 	}
 
@@ -163,10 +177,14 @@ pipe_close(struct file *fp)
 }
 
 /*
- * pipe_read
+ * pipe_splice_read - pass data in pipe to fn without copying
+ *
+ * fn is called with contiguous regions of the pipe buffer and returns the
+ * number of bytes it consumed. Data is left in the pipe if peek is set.
  */
 ssize_t
-pipe_read(struct file *fp, void *buf, size_t size, off_t offset)
+pipe_splice_read(struct file *fp, size_t size, unsigned flags, bool peek,
+    splice_fn fn, void *arg)
 {
 	int err = 0;
 	size_t read = 0;	/* bytes read so far */
@@ -176,16 +194,18 @@ pipe_read(struct file *fp, void *buf, size_t size, off_t offset)
 		return DERR(-EINVAL);
 
 	struct pipe_data *p = vp->v_pipe;
+	size_t rd = p->rd;
 
 	while (size != 0) {
-		size_t avail = p->wr - p->rd;
+		size_t avail = p->wr - rd;
 		pdbg("read: %d, %d remaining\n", read, size);
 		if (avail == 0) {
 			if (p->write_fds == 0)
 				break; /* no writers: EOF */
 			if (read > 0)
 				break; /* data read, return */
-			if (fp->f_flags & O_NONBLOCK) {
+			if (fp->f_flags & O_NONBLOCK ||
+			    flags & SPLICE_F_NONBLOCK) {
 				err = -EAGAIN;
 				break;
 			}
@@ -195,37 +215,50 @@ pipe_read(struct file *fp, void *buf, size_t size, off_t offset)
 			err = cond_wait_interruptible(&p->cond, &vp->v_lock);
 			if (err)
 				break;
+			rd = p->rd;
 			continue; /* validate data available */
-		} else if (avail == PIPE_BUF) {
+		} else if (avail == p->size && !peek) {
 			pdbg("read: full, signal\n");
 			/* notify write: will have space when we unlock the mutex */
 			cond_signal(&p->cond);
+			pollq_notify(&p->pollq);
 		}
 
 		/* offset into circular buf */
-		size_t off = p->rd & (PIPE_BUF - 1);
+		size_t off = rd & (p->size - 1);
 
 		/* contiguous data available to end of curcular buffer */
-		if (avail > PIPE_BUF - off)
-			avail = PIPE_BUF - off;
+		if (avail > p->size - off)
+			avail = p->size - off;
 
 		size_t len = (size < avail) ? size : avail;
 		pdbg("read: off %d len %d avail %d\n", off, len, avail);
-		memcpy(buf, p->buf + off, len);
-		p->rd += len;
-		read += len;
-		size -= len;
-		buf = (char *)buf + len;
+		const ssize_t r = fn(arg, p->buf + off, len);
+		if (r < 0) {
+			err = r;
+			break;
+		}
+		rd += r;
+		if (!peek)
+			p->rd = rd;
+		read += r;
+		size -= r;
+		if ((size_t)r < len)
+			break; /* consumer is full */
 	}
 
 	return (read > 0) ? (ssize_t)read : err;
 }
 
 /*
- * pipe_write
+ * pipe_splice_write - let fn fill pipe without copying
+ *
+ * fn is called with contiguous free regions of the pipe buffer and returns
+ * the number of bytes it stored.
  */
 ssize_t
-pipe_write(struct file *fp, void *buf, size_t size, off_t offset)
+pipe_splice_write(struct file *fp, size_t size, unsigned flags,
+    splice_fn fn, void *arg)
 {
 	int err = 0;
 	size_t written = 0;	/* bytes written so far */
@@ -242,10 +275,11 @@ pipe_write(struct file *fp, void *buf, size_t size, off_t offset)
 			err = -EPIPE;
 			break;
 		}
-		size_t free = PIPE_BUF - (p->wr - p->rd);
+		size_t free = p->size - (p->wr - p->rd);
 		pdbg("written: %d, %d remaining\n", written, size);
 		if (free == 0) {
-			if (fp->f_flags & O_NONBLOCK) {
+			if (fp->f_flags & O_NONBLOCK ||
+			    flags & SPLICE_F_NONBLOCK) {
 				err = -EAGAIN;
 				break;
 			}
@@ -256,25 +290,213 @@ pipe_write(struct file *fp, void *buf, size_t size, off_t offset)
 			if (err)
 				break;
 			continue; /* calculate free again */
-		} else if (free == PIPE_BUF) {
+		} else if (free == p->size) {
 			pdbg("write: empty, signal\n");
 			/* notify read: will have data when we unlock the mutex */
 			cond_signal(&p->cond);
+			pollq_notify(&p->pollq);
 		}
 
 		/* offset into circular buf */
-		size_t off = p->wr & (PIPE_BUF - 1);
-		if (free > PIPE_BUF - off)
-			free = PIPE_BUF - off; /* space wrapped in buffer */
+		size_t off = p->wr & (p->size - 1);
+		if (free > p->size - off)
+			free = p->size - off; /* space wrapped in buffer */
 
 		size_t len = (size < free) ? size : free;
 		pdbg("write: off %d len %d free %d\n", off, len, free);
-		memcpy(p->buf + off, buf, len);
-		p->wr += len;
-		written += len;
-		size -= len;
-		buf = (char *)buf + len;
+		const ssize_t r = fn(arg, p->buf + off, len);
+		if (r < 0) {
+			err = r;
+			break;
+		}
+		p->wr += r;
+		written += r;
+		size -= r;
+		if ((size_t)r < len)
+			break; /* producer is empty */
 	}
 
 	return (written > 0) ? (ssize_t)written : err;
 }
+
+/*
+ * pipe_ready - check if read or write would make progress without waiting
+ *
+ * A pipe with no peer is ready as the transfer fails immediately. Pipe must
+ * be locked.
+ */
+bool
+pipe_ready(struct file *fp, bool write)
+{
+	const struct pipe_data *p = fp->f_vnode->v_pipe;
+
+	if (write)
+		return !p->read_fds || p->wr - p->rd < p->size;
+	return !p->write_fds || p->wr != p->rd;
+}
+
+/*
+ * pipe_wait - wait until read or write would make progress
+ *
+ * Pipe must be locked.
+ */
+int
+pipe_wait(struct file *fp, bool write)
+{
+	struct vnode *vp = fp->f_vnode;
+	struct pipe_data *p = vp->v_pipe;
+	int err;
+
+	while (!pipe_ready(fp, write)) {
+		if (fp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if ((err = cond_wait_interruptible(&p->cond, &vp->v_lock)))
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * copy_out - copy pipe data to buffer
+ */
+static ssize_t
+copy_out(void *arg, void *buf, size_t len)
+{
+	char **dst = arg;
+
+	memcpy(*dst, buf, len);
+	*dst += len;
+	return len;
+}
+
+/*
+ * copy_in - copy buffer to pipe
+ */
+static ssize_t
+copy_in(void *arg, void *buf, size_t len)
+{
+	const char **src = arg;
+
+	memcpy(buf, *src, len);
+	*src += len;
+	return len;
+}
+
+/*
+ * pipe_read
+ */
+ssize_t
+pipe_read(struct file *fp, void *buf, size_t size, off_t offset)
+{
+	return pipe_splice_read(fp, size, 0, false, copy_out, &buf);
+}
+
+/*
+ * pipe_write
+ */
+ssize_t
+pipe_write(struct file *fp, void *buf, size_t size, off_t offset)
+{
+	return pipe_splice_write(fp, size, 0, copy_in, &buf);
+}
+
+/*
+ * pipe_poll
+ */
+int
+pipe_poll(struct file *fp, struct poll_table *pt)
+{
+	int events = 0;
+	struct vnode *vp = fp->f_vnode;
+
+	if (!S_ISFIFO(vp->v_mode))
+		return DERR(-EINVAL);
+
+	struct pipe_data *p = vp->v_pipe;
+
+	poll_wait(&p->pollq, pt);
+
+	switch (fp->f_flags & O_ACCMODE) {
+	case O_RDONLY:
+		if (p->wr != p->rd)
+			events |= POLLIN | POLLRDNORM;
+		if (p->write_fds == 0)
+			events |= POLLHUP;
+		break;
+	case O_WRONLY:
+		if (p->wr - p->rd != p->size)
+			events |= POLLOUT | POLLWRNORM;
+		if (p->read_fds == 0)
+			events |= POLLERR;
+		break;
+	}
+
+	return events;
+}
+
+/*
+ * pipe_get_size - get pipe buffer size
+ */
+int
+pipe_get_size(struct file *fp)
+{
+	struct vnode *vp = fp->f_vnode;
+
+	if (!S_ISFIFO(vp->v_mode))
+		return DERR(-EBADF);
+
+	struct pipe_data *p = vp->v_pipe;
+
+	return p->size;
+}
+
+/*
+ * pipe_set_size - resize pipe buffer
+ *
+ * The size is rounded up to a power of 2 no smaller than PIPE_BUF. Data in
+ * the pipe is moved to the new buffer. Returns the new size.
+ */
+int
+pipe_set_size(struct file *fp, long arg)
+{
+	struct vnode *vp = fp->f_vnode;
+
+	if (!S_ISFIFO(vp->v_mode))
+		return DERR(-EBADF);
+	if (arg < 0)
+		return DERR(-EINVAL);
+	if (arg > PIPE_SIZE_MAX)
+		return DERR(-EPERM);
+
+	struct pipe_data *p = vp->v_pipe;
+	const size_t size = MAX((size_t)1 << ceil_log2(MAX(arg, 1)),
+	    (size_t)MAX(PIPE_BUF, PAGE_SIZE));
+	const size_t used = p->wr - p->rd;
+
+	if (size == p->size)
+		return size;
+	if (used > size)
+		return DERR(-EBUSY);
+
+	phys *b;
+	if (!(b = page_alloc(size, MA_NORMAL, &pipe_id)))
+		return DERR(-ENOMEM);
+
+	/* copy data to start of new buffer */
+	const size_t off = p->rd & (p->size - 1);
+	const size_t len = MIN(used, p->size - off);
+	memcpy(phys_to_virt(b), p->buf + off, len);
+	memcpy(phys_to_virt(b) + len, p->buf, used - len);
+
+	page_free(virt_to_phys(p->buf), p->size, &pipe_id);
+	p->buf = phys_to_virt(b);
+	p->size = size;
+	p->rd = 0;
+	p->wr = used;
+
+	/* notify write: may have more space */
+	cond_signal(&p->cond);
+	pollq_notify(&p->pollq);
+
+	return size;
+}
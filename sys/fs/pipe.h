@@ -1,13 +1,24 @@
 #ifndef fs_pipe_h
 #define fs_pipe_h
 
+#include "vfs.h"
+#include <stdbool.h>
 #include <sys/types.h>
 
 struct file;
+struct poll_table;
 
 int	pipe_open(struct file *, int, mode_t);
 int	pipe_close(struct file *);
 ssize_t	pipe_read(struct file *, void *, size_t, off_t);
 ssize_t	pipe_write(struct file *, void *, size_t, off_t);
+int	pipe_poll(struct file *, struct poll_table *);
+int	pipe_get_size(struct file *);
+int	pipe_set_size(struct file *, long);
+ssize_t	pipe_splice_read(struct file *, size_t, unsigned, bool, splice_fn,
+			 void *);
+ssize_t	pipe_splice_write(struct file *, size_t, unsigned, splice_fn, void *);
+bool	pipe_ready(struct file *, bool);
+int	pipe_wait(struct file *, bool);
 
 #endif
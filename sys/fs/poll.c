@@ -0,0 +1,581 @@
+/*
+ * poll.c - poll, ppoll, select & pselect
+ */
+#include "poll.h"
+
+#include "vfs.h"
+#include <access.h>
+#include <assert.h>
+#include <compiler.h>
+#include <debug.h>
+#include <errno.h>
+#include <event.h>
+#include <fs.h>
+#include <kernel.h>
+#include <poll.h>
+#include <sch.h>
+#include <sig.h>
+#include <stdlib.h>
+#include <sync.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <task.h>
+#include <thread.h>
+#include <time32.h>
+#include <timer.h>
+#include <vm.h>
+
+/*
+ * select works on 32 bit descriptor sets as no larger descriptor can be valid
+ */
+static_assert(ARRAY_SIZE(((struct task *)0)->file) <= 32, "");
+
+/*
+ * poller_entry - registration of a poll or select call on a pollq
+ */
+struct poller_entry {
+	struct poll_entry pe;
+	struct poller *p;
+};
+
+/*
+ * poller - state for one poll or select call
+ */
+struct poller {
+	struct poll_table pt;
+	struct event event;		/* poller sleeps on this event */
+	bool triggered;			/* readiness may have changed */
+	size_t count;			/* number of entries in use */
+	size_t size;			/* number of entries allocated */
+	struct poller_entry *ent;	/* registrations */
+};
+
+static struct spinlock poll_lock;	/* REVISIT: may need init for SMP */
+
+/*
+ * pollq_init - initialise poll queue
+ */
+void
+pollq_init(struct pollq *q)
+{
+	list_init(&q->pollers);
+}
+
+/*
+ * pollq_notify_locked - notify pollers that readiness may have changed
+ *
+ * For use by notify routines which are called with the poll lock held.
+ */
+void
+pollq_notify_locked(struct pollq *q)
+{
+	struct poll_entry *e, *n;
+
+	list_for_each_entry_safe(e, n, &q->pollers, link)
+		e->notify(e);
+}
+
+/*
+ * pollq_notify - notify pollers that readiness may have changed
+ *
+ * Interrupt safe.
+ */
+void
+pollq_notify(struct pollq *q)
+{
+	const int s = spinlock_lock_irq_disable(&poll_lock);
+	pollq_notify_locked(q);
+	spinlock_unlock_irq_restore(&poll_lock, s);
+}
+
+/*
+ * pollq_destroy - detach all pollers from a poll queue
+ *
+ * Must be called before the memory holding the queue is freed. Pollers are
+ * notified so that they can rescan.
+ */
+void
+pollq_destroy(struct pollq *q)
+{
+	const int s = spinlock_lock_irq_disable(&poll_lock);
+	while (!list_empty(&q->pollers)) {
+		struct poll_entry *e = list_entry(list_first(&q->pollers),
+		    struct poll_entry, link);
+		list_remove(&e->link);
+		e->q = NULL;
+		e->notify(e);
+	}
+	spinlock_unlock_irq_restore(&poll_lock, s);
+}
+
+/*
+ * poll_wait - register poller on poll queue
+ *
+ * Called from poll routines. pt is NULL if the poller is already registered.
+ */
+void
+poll_wait(struct pollq *q, struct poll_table *pt)
+{
+	if (pt)
+		pt->queue(pt, q);
+}
+
+/*
+ * poll_entry_attach - attach poll entry to poll queue
+ */
+void
+poll_entry_attach(struct poll_entry *e, struct pollq *q)
+{
+	const int s = spinlock_lock_irq_disable(&poll_lock);
+	e->q = q;
+	list_insert(&q->pollers, &e->link);
+	spinlock_unlock_irq_restore(&poll_lock, s);
+}
+
+/*
+ * poll_entry_detach - detach poll entry from its poll queue
+ *
+ * The notify routine will not be called once this returns.
+ */
+void
+poll_entry_detach(struct poll_entry *e)
+{
+	const int s = spinlock_lock_irq_disable(&poll_lock);
+	if (e->q)
+		list_remove(&e->link);
+	e->q = NULL;
+	spinlock_unlock_irq_restore(&poll_lock, s);
+}
+
+/*
+ * poller_notify - readiness of a polled object may have changed
+ */
+static void
+poller_notify(struct poll_entry *pe)
+{
+	struct poller *p = list_entry(pe, struct poller_entry, pe)->p;
+	p->triggered = true;
+	sch_wakeup(&p->event, 0);
+}
+
+/*
+ * poller_queue - register poller on poll queue
+ *
+ * Each file may register on at most one queue.
+ */
+static void
+poller_queue(struct poll_table *pt, struct pollq *q)
+{
+	struct poller *p = list_entry(pt, struct poller, pt);
+
+	assert(p->count < p->size);
+	if (p->count == p->size)
+		return;
+
+	struct poller_entry *e = &p->ent[p->count++];
+	e->pe.notify = poller_notify;
+	e->p = p;
+	poll_entry_attach(&e->pe, q);
+}
+
+/*
+ * poller_release - remove poller from all poll queues
+ */
+static void
+poller_release(struct poller *p)
+{
+	for (size_t i = 0; i < p->count; ++i)
+		poll_entry_detach(&p->ent[i].pe);
+}
+
+/*
+ * poll_scan - get readiness of all descriptors
+ *
+ * Returns number of ready descriptors or -ve error code.
+ */
+static int
+poll_scan(struct pollfd *fds, nfds_t nfds, struct poll_table *pt)
+{
+	int n = 0;
+
+	for (nfds_t i = 0; i < nfds; ++i) {
+		struct pollfd *p = &fds[i];
+		p->revents = 0;
+		if (p->fd < 0)
+			continue;
+		int r = fs_poll(p->fd, NULL, pt);
+		if (r == -EBADF)
+			r = POLLNVAL;
+		else if (r < 0)
+			return r;
+		p->revents = r & (p->events | POLLERR | POLLHUP | POLLNVAL);
+		if (p->revents)
+			++n;
+	}
+	return n;
+}
+
+/*
+ * do_poll - wait for events on file descriptors
+ *
+ * fds must be in kernel memory. Timeout is relative, NULL waits forever.
+ */
+static int
+do_poll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts)
+{
+	int n, err;
+	uint_fast64_t deadline = 0;
+
+	if (ts) {
+		if (ts->tv_sec < 0 || ts->tv_nsec < 0 ||
+		    ts->tv_nsec >= 1000000000)
+			return DERR(-EINVAL);
+		deadline = timer_monotonic() + ts_to_ns(ts);
+	}
+
+	struct poller p = {
+		.pt.queue = poller_queue,
+		.size = nfds,
+	};
+	event_init(&p.event, "poll", ev_IO);
+	if (nfds && !(p.ent = malloc(nfds * sizeof *p.ent)))
+		return DERR(-ENOMEM);
+
+	struct poll_table *reg = &p.pt;
+	bool timeout = false;
+	for (;;) {
+		p.triggered = false;
+
+		/* register on first scan only, entries remain until release */
+		if ((n = poll_scan(fds, nfds, reg)) != 0 || timeout)
+			break;
+		reg = NULL;
+
+		uint_fast64_t nsec = 0;
+		if (ts) {
+			const uint_fast64_t now = timer_monotonic();
+			if (now >= deadline)
+				break;
+			nsec = deadline - now;
+		}
+
+		/* sleep unless readiness changed during scan */
+		const int s = spinlock_lock_irq_disable(&poll_lock);
+		if (p.triggered) {
+			spinlock_unlock_irq_restore(&poll_lock, s);
+			continue;
+		}
+		err = sch_prepare_sleep(&p.event, nsec);
+		spinlock_unlock_irq_restore(&poll_lock, s);
+		if (!err)
+			err = sch_continue_sleep();
+		if (err == -ETIMEDOUT)
+			timeout = true;
+		else if (err < 0) {
+			n = err;
+			break;
+		}
+	}
+
+	poller_release(&p);
+	free(p.ent);
+
+	/* poll & select are never restarted after a signal handler */
+	return n == -EINTR ? -EINTR_NORESTART : n;
+}
+
+/*
+ * poll_user - poll on userspace pollfd array with optional signal mask
+ */
+static int
+poll_user(struct pollfd *ufds, nfds_t nfds, const struct timespec *ts,
+    const k_sigset_t *umask, size_t masksize)
+{
+	int ret;
+	k_sigset_t mask, old;
+
+	if (nfds > ARRAY_SIZE(task_cur()->file))
+		return DERR(-EINVAL);
+	if (umask) {
+		if (masksize != sizeof mask)
+			return DERR(-EINVAL);
+		if ((ret = vm_read(task_cur()->as, &mask, umask,
+		    sizeof mask)) < 0)
+			return ret;
+	}
+
+	const size_t size = nfds * sizeof(struct pollfd);
+	struct pollfd *fds = NULL;
+	if (nfds && !(fds = malloc(size)))
+		return DERR(-ENOMEM);
+	if (nfds && (ret = vm_read(task_cur()->as, fds, ufds, size)) < 0)
+		goto out;
+
+	/* a signal interrupting the wait is handled before mask is restored */
+	if (umask)
+		old = sig_replace(&mask);
+	ret = do_poll(fds, nfds, ts);
+	if (umask)
+		sig_restore_deferred(&old);
+	if (ret < 0)
+		goto out;
+
+	int err;
+	if ((err = u_access_begin()) < 0) {
+		ret = err;
+		goto out;
+	}
+	if (!u_access_ok(ufds, size, PROT_WRITE))
+		ret = DERR(-EFAULT);
+	else for (nfds_t i = 0; i < nfds; ++i)
+		ufds[i].revents = fds[i].revents;
+	u_access_end();
+
+out:
+	free(fds);
+	return ret;
+}
+
+/*
+ * select_copyin - copy descriptor set from userspace
+ *
+ * Only the first word of the set can refer to valid descriptors.
+ */
+static int
+select_copyin(int n, const fd_set *uset, uint32_t *set)
+{
+	int err;
+	uint32_t w;
+
+	*set = 0;
+	if (!uset)
+		return 0;
+	for (int i = 0; i < n; i += 32) {
+		if ((err = vm_read(task_cur()->as, &w,
+		    (const uint32_t *)uset + i / 32, sizeof w)) < 0)
+			return err;
+		if (n - i < 32)
+			w &= (1UL << (n - i)) - 1;
+		if (!i)
+			*set = w;
+		else if (w)
+			return DERR(-EBADF);
+	}
+	return 0;
+}
+
+/*
+ * select_copyout - copy descriptor set to userspace
+ */
+static int
+select_copyout(int n, fd_set *uset, uint32_t set)
+{
+	int err;
+
+	if (!uset)
+		return 0;
+	if ((err = u_access_begin()) < 0)
+		return err;
+	uint32_t *w = (uint32_t *)uset;
+	const size_t words = (n + 31) / 32;
+	if (!u_access_ok(w, words * sizeof *w, PROT_WRITE))
+		err = DERR(-EFAULT);
+	else for (size_t i = 0; i < words; ++i)
+		w[i] = i ? 0 : set;
+	u_access_end();
+	return err;
+}
+
+/*
+ * select_user - select on userspace descriptor sets with optional signal
+ *		 mask
+ */
+static int
+select_user(int n, fd_set *uin, fd_set *uout, fd_set *uex,
+    const struct timespec *ts, const k_sigset_t *umask, size_t masksize)
+{
+	int ret;
+	uint32_t in, out, ex;
+	k_sigset_t mask, old;
+
+	if (n < 0)
+		return DERR(-EINVAL);
+	if (n > FD_SETSIZE)
+		n = FD_SETSIZE;
+	if ((ret = select_copyin(n, uin, &in)) < 0 ||
+	    (ret = select_copyin(n, uout, &out)) < 0 ||
+	    (ret = select_copyin(n, uex, &ex)) < 0)
+		return ret;
+	if (umask) {
+		if (masksize != sizeof mask)
+			return DERR(-EINVAL);
+		if ((ret = vm_read(task_cur()->as, &mask, umask,
+		    sizeof mask)) < 0)
+			return ret;
+	}
+
+	/* convert descriptor sets to pollfd array */
+	const uint32_t all = in | out | ex;
+	const nfds_t nfds = __builtin_popcount(all);
+	struct pollfd *fds = NULL;
+	if (nfds && !(fds = malloc(nfds * sizeof *fds)))
+		return DERR(-ENOMEM);
+	for (nfds_t i = 0, fd = 0; i < nfds; ++fd) {
+		const uint32_t bit = 1UL << fd;
+		if (!(all & bit))
+			continue;
+		fds[i++] = (struct pollfd){
+			.fd = fd,
+			.events = (in & bit ? POLLIN : 0) |
+				  (out & bit ? POLLOUT : 0) |
+				  (ex & bit ? POLLPRI : 0),
+		};
+	}
+
+	if (umask)
+		old = sig_replace(&mask);
+	ret = do_poll(fds, nfds, ts);
+	if (umask)
+		sig_restore_deferred(&old);
+	if (ret < 0)
+		goto out;
+
+	/* convert results back to descriptor sets */
+	uint32_t rin = 0, rout = 0, rex = 0;
+	ret = 0;
+	for (nfds_t i = 0; i < nfds; ++i) {
+		const uint32_t bit = 1UL << fds[i].fd;
+		const short r = fds[i].revents;
+		if (r & POLLNVAL) {
+			ret = DERR(-EBADF);
+			goto out;
+		}
+		if (in & bit && r & (POLLIN | POLLHUP | POLLERR)) {
+			rin |= bit;
+			++ret;
+		}
+		if (out & bit && r & (POLLOUT | POLLERR)) {
+			rout |= bit;
+			++ret;
+		}
+		if (ex & bit && r & POLLPRI) {
+			rex |= bit;
+			++ret;
+		}
+	}
+
+	int err;
+	if ((err = select_copyout(n, uin, rin)) < 0 ||
+	    (err = select_copyout(n, uout, rout)) < 0 ||
+	    (err = select_copyout(n, uex, rex)) < 0)
+		ret = err;
+
+out:
+	free(fds);
+	return ret;
+}
+
+/*
+ * pselect_sigmask - read pselect6 signal mask argument from userspace
+ */
+static int
+pselect_sigmask(const void *data, const k_sigset_t **mask, size_t *size)
+{
+	int err;
+	struct {
+		const k_sigset_t *ss;
+		size_t ss_len;
+	} d;
+
+	*mask = NULL;
+	*size = 0;
+	if (!data)
+		return 0;
+	if ((err = vm_read(task_cur()->as, &d, data, sizeof d)) < 0)
+		return err;
+	*mask = d.ss;
+	*size = d.ss_len;
+	return 0;
+}
+
+/*
+ * Syscalls
+ */
+int
+sc_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct timespec ts;
+	if (timeout >= 0)
+		ns_to_ts(timeout * 1000000ULL, &ts);
+	return poll_user(fds, nfds, timeout >= 0 ? &ts : NULL, NULL, 0);
+}
+
+int
+sc_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *uts,
+    const k_sigset_t *mask, size_t size)
+{
+	int err;
+	struct timespec ts;
+	if (uts && (err = vm_read(task_cur()->as, &ts, uts, sizeof ts)) < 0)
+		return err;
+	return poll_user(fds, nfds, uts ? &ts : NULL, mask, size);
+}
+
+int
+sc_ppoll_time32(struct pollfd *fds, nfds_t nfds,
+    const struct timespec32 *uts, const k_sigset_t *mask, size_t size)
+{
+	int err;
+	struct timespec32 ts32;
+	if (uts && (err = vm_read(task_cur()->as, &ts32, uts,
+	    sizeof ts32)) < 0)
+		return err;
+	const struct timespec ts = {ts32.tv_sec, ts32.tv_nsec};
+	return poll_user(fds, nfds, uts ? &ts : NULL, mask, size);
+}
+
+int
+sc_pselect6(int n, fd_set *in, fd_set *out, fd_set *ex,
+    const struct timespec *uts, const void *data)
+{
+	int err;
+	size_t size;
+	struct timespec ts;
+	const k_sigset_t *mask;
+	if (uts && (err = vm_read(task_cur()->as, &ts, uts, sizeof ts)) < 0)
+		return err;
+	if ((err = pselect_sigmask(data, &mask, &size)) < 0)
+		return err;
+	return select_user(n, in, out, ex, uts ? &ts : NULL, mask, size);
+}
+
+int
+sc_pselect6_time32(int n, fd_set *in, fd_set *out, fd_set *ex,
+    const struct timespec32 *uts, const void *data)
+{
+	int err;
+	size_t size;
+	struct timespec32 ts32;
+	const k_sigset_t *mask;
+	if (uts && (err = vm_read(task_cur()->as, &ts32, uts,
+	    sizeof ts32)) < 0)
+		return err;
+	if ((err = pselect_sigmask(data, &mask, &size)) < 0)
+		return err;
+	const struct timespec ts = {ts32.tv_sec, ts32.tv_nsec};
+	return select_user(n, in, out, ex, uts ? &ts : NULL, mask, size);
+}
+
+int
+sc_select(int n, fd_set *in, fd_set *out, fd_set *ex,
+    struct timeval32 *utv)
+{
+	int err;
+	struct timeval32 tv;
+	if (utv && (err = vm_read(task_cur()->as, &tv, utv, sizeof tv)) < 0)
+		return err;
+	if (utv && (tv.tv_usec < 0 || tv.tv_usec >= 1000000))
+		return DERR(-EINVAL);
+	const struct timespec ts = {tv.tv_sec, tv.tv_usec * 1000};
+	return select_user(n, in, out, ex, utv ? &ts : NULL, NULL, 0);
+}
@@ -0,0 +1,60 @@
+#ifndef fs_poll_h
+#define fs_poll_h
+
+/*
+ * Readiness notification for poll, select & epoll
+ *
+ * Objects which can block on read or write embed a pollq. The object's poll
+ * routine calls poll_wait to register interest then returns its current
+ * readiness as a POLL* event mask. When readiness may have changed the object
+ * calls pollq_notify which calls the notify routine of every poll_entry
+ * attached to the queue.
+ */
+
+#include <list.h>
+
+struct poll_entry;
+struct pollq;
+
+/*
+ * pollq - queue of pollers interested in an object
+ */
+struct pollq {
+	struct list pollers;
+};
+
+/*
+ * poll_entry - registration of a poller on a pollq
+ *
+ * notify is called with interrupts disabled, possibly from interrupt context.
+ */
+struct poll_entry {
+	struct list link;		/* linkage on pollq */
+	struct pollq *q;		/* queue, NULL once detached */
+	void (*notify)(struct poll_entry *);
+};
+
+/*
+ * poll_table - passed to poll routines by pollers wishing to register
+ */
+struct poll_table {
+	void (*queue)(struct poll_table *, struct pollq *);
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+void	pollq_init(struct pollq *);
+void	pollq_notify(struct pollq *);
+void	pollq_notify_locked(struct pollq *);
+void	pollq_destroy(struct pollq *);
+void	poll_wait(struct pollq *, struct poll_table *);
+void	poll_entry_attach(struct poll_entry *, struct pollq *);
+void	poll_entry_detach(struct poll_entry *);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif
+
+#endif /* !fs_poll_h */
@@ -30,25 +30,27 @@
 #ifndef ramfs_h
 #define ramfs_h
 
+#include <list.h>
 #include <sys/types.h>
 
 #define rfsdbg(...)
 
-/*
- * File/directory node for RAMFS
- */
 struct ramfs_node {
-	struct ramfs_node   *rn_next;	    /* next node in the same directory */
-	struct ramfs_node   *rn_child;	    /* first child node */
+	struct list	     rn_link;	    /* link on parent's rn_children */
+	struct list	     rn_hash;	    /* link on name hash chain */
+	struct ramfs_node   *rn_parent;	    /* parent directory */
+	struct list	     rn_children;   /* child nodes */
 	mode_t		     rn_mode;	    /* node mode */
 	char		    *rn_name;	    /* name (null-terminated) */
 	size_t		     rn_namelen;    /* length of name not including terminator */
 	size_t		     rn_size;	    /* file size */
-	char		    *rn_buf;	    /* buffer to the file data */
-	size_t		     rn_bufsize;    /* allocated buffer size */
+	char		   **rn_pages;	    /* file data pages, NULL for holes */
+	size_t		     rn_npages;	    /* number of entries in rn_pages */
+	size_t		     rn_small;	    /* size of small first block, 0 if page */
 };
 
 struct ramfs_node *ramfs_allocate_node(const char *, size_t, mode_t);
+int ramfs_init(void);
 extern const struct vnops ramfs_vnops;
 
 #endif /* !ramfs_h */
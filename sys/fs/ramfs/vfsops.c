@@ -67,13 +67,14 @@ ramfs_umount(struct mount *mp)
  * File system operations
  */
 static const struct vfsops ramfs_vfsops = {
-	.vfs_init = ((vfsop_init_fn)vfs_nullop),
+	.vfs_init = ramfs_init,
 	.vfs_mount = ramfs_mount,
 	.vfs_umount = ramfs_umount,
 	.vfs_sync = ((vfsop_sync_fn)vfs_nullop),
 	.vfs_vget = ((vfsop_vget_fn)vfs_nullop),
 	.vfs_statfs = ((vfsop_statfs_fn)vfs_nullop),
 	.vfs_vnops = &ramfs_vnops,
+	.vfs_flags = VFSF_NCACHE,
 };
 
 REGISTER_FILESYSTEM(ramfs);
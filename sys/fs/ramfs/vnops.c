@@ -33,17 +33,22 @@
 
 #include "ramfs.h"
 
+#include <debug.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fs/file.h>
 #include <fs/util.h>
 #include <fs/vnode.h>
+#include <jhash3.h>
 #include <kernel.h>
+#include <kmem.h>
 #include <limits.h>
 #include <page.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sync.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 
 /*
@@ -51,10 +56,30 @@
  */
 static char ramfs_id;
 
+/*
+ * Cache for node allocation
+ */
+static struct kmem_cache *ramfs_node_cache;
+
+/*
+ * Directory entries are hashed by parent node and name
+ */
+#define RAMFS_BUCKETS 64		/* size of name hash table */
+static struct list ramfs_table[RAMFS_BUCKETS];
+static struct mutex ramfs_mutex;	/* protects ramfs_table */
+
+/*
+ * File data is kept in pages indexed by rn_pages. Pages which have never
+ * been written are holes which read as zero and use no memory. Data beyond
+ * the end of file in allocated pages is always zero.
+ *
+ * Files no larger than SMALL_MAX keep their data in a malloc'd block in
+ * place of the first page to save memory.
+ */
+#define SMALL_MAX (PAGE_SIZE / 2)
+
 /*
  * TODO: ramfs cleanup
- * - use hash map?
- * - use kernel list.h instead of self-rolled
  * - don't duplicate tests guaranteed by vfs
  */
 
@@ -77,6 +102,7 @@ const struct vnops ramfs_vnops = {
 	.vop_write = ramfs_write_iov,
 	.vop_seek = ((vnop_seek_fn)vop_nullop),
 	.vop_ioctl = ((vnop_ioctl_fn)vop_einval),
+	.vop_poll = ((vnop_poll_fn)vop_pollready),
 	.vop_fsync = ((vnop_fsync_fn)vop_nullop),
 	.vop_readdir = ramfs_readdir,
 	.vop_lookup = ramfs_lookup,
@@ -87,6 +113,7 @@ const struct vnops ramfs_vnops = {
 	.vop_setattr = ((vnop_setattr_fn)vop_nullop),
 	.vop_inactive = ((vnop_inactive_fn)vop_nullop),
 	.vop_truncate = ramfs_truncate,
+	.vop_xip = ((vnop_xip_fn)vop_einval),
 };
 
 struct ramfs_node *
@@ -95,10 +122,10 @@ ramfs_allocate_node(const char *name, size_t name_len, mode_t mode)
 	char *rn_name;
 	struct ramfs_node *np;
 
-	if (!(np = malloc(sizeof(struct ramfs_node))))
+	if (!(np = kmem_cache_alloc(ramfs_node_cache)))
 		return NULL;
 	if (!(rn_name = malloc(name_len + 1))) {
-		free(np);
+		kmem_cache_free(ramfs_node_cache, np);
 		return NULL;
 	}
 
@@ -109,6 +136,7 @@ ramfs_allocate_node(const char *name, size_t name_len, mode_t mode)
 		.rn_name = rn_name,
 		.rn_mode = mode,
 	};
+	list_init(&np->rn_children);
 
 	return np;
 }
@@ -117,48 +145,184 @@ void
 ramfs_free_node(struct ramfs_node *np)
 {
 	free(np->rn_name);
-	free(np);
+	kmem_cache_free(ramfs_node_cache, np);
+}
+
+int
+ramfs_init(void)
+{
+	if (!(ramfs_node_cache = kmem_cache_create("ramfs_node",
+	    sizeof(struct ramfs_node), MA_NORMAL)))
+		panic("ramfs_init");
+	mutex_init(&ramfs_mutex);
+	for (size_t i = 0; i < RAMFS_BUCKETS; i++)
+		list_init(&ramfs_table[i]);
+	return 0;
+}
+
+/*
+ * ramfs_hash - get hash chain for a name in a directory
+ */
+static struct list *
+ramfs_hash(const struct ramfs_node *dnp, const char *name, size_t len)
+{
+	return &ramfs_table[jhash_2words(jhash(name, len, 0),
+	    (uint32_t)(uintptr_t)dnp) & (RAMFS_BUCKETS - 1)];
+}
+
+static void
+ramfs_hash_insert(struct ramfs_node *np)
+{
+	mutex_lock(&ramfs_mutex);
+	list_insert(ramfs_hash(np->rn_parent, np->rn_name, np->rn_namelen),
+	    &np->rn_hash);
+	mutex_unlock(&ramfs_mutex);
+}
+
+static void
+ramfs_hash_remove(struct ramfs_node *np)
+{
+	mutex_lock(&ramfs_mutex);
+	list_remove(&np->rn_hash);
+	mutex_unlock(&ramfs_mutex);
+}
+
+/*
+ * ramfs_reserve - make sure page array covers 'n' pages
+ */
+static int
+ramfs_reserve(struct ramfs_node *np, size_t n)
+{
+	char **pages;
+
+	if (n <= np->rn_npages)
+		return 0;
+
+	/* grow geometrically so that appends are amortised O(1) */
+	n = MAX(n, np->rn_npages * 2);
+	if (!(pages = realloc(np->rn_pages, n * sizeof *pages)))
+		return -ENOMEM;
+	memset(pages + np->rn_npages, 0,
+	    (n - np->rn_npages) * sizeof *pages);
+	np->rn_pages = pages;
+	np->rn_npages = n;
+	return 0;
+}
+
+/*
+ * ramfs_free_pages - free data pages from 'first' up to 'last'
+ */
+static void
+ramfs_free_pages(struct ramfs_node *np, size_t first, size_t last)
+{
+	for (size_t i = first; i < MIN(last, np->rn_npages); ++i) {
+		if (!np->rn_pages[i])
+			continue;
+		if (i == 0 && np->rn_small) {
+			free(np->rn_pages[i]);
+			np->rn_small = 0;
+		} else
+			page_free(virt_to_phys(np->rn_pages[i]), PAGE_SIZE,
+			    &ramfs_id);
+		np->rn_pages[i] = NULL;
+	}
+}
+
+/*
+ * ramfs_free_data - free all file data
+ */
+static void
+ramfs_free_data(struct ramfs_node *np)
+{
+	ramfs_free_pages(np, 0, np->rn_npages);
+	free(np->rn_pages);
+	np->rn_pages = NULL;
+	np->rn_npages = 0;
+	np->rn_size = 0;
+}
+
+/*
+ * ramfs_grow_small - grow small block to hold 'size' bytes
+ */
+static int
+ramfs_grow_small(struct ramfs_node *np, size_t size)
+{
+	char *buf;
+
+	if (size <= np->rn_small)
+		return 0;
+	if (ramfs_reserve(np, 1) < 0)
+		return -ENOMEM;
+
+	/* try not to fragment malloc too much */
+	size = ALIGNn(size, 32);
+	if (!(buf = realloc(np->rn_pages[0], size)))
+		return -ENOSPC;
+	np->rn_pages[0] = buf;
+	np->rn_small = size;
+	return 0;
+}
+
+/*
+ * ramfs_alloc_pages - allocate any holes in pages covering [start, end)
+ */
+static int
+ramfs_alloc_pages(struct ramfs_node *np, size_t start, size_t end)
+{
+	phys *p;
+	const size_t first = start / PAGE_SIZE;
+	const size_t last = PAGE_ALIGN(end) / PAGE_SIZE;
+
+	if (ramfs_reserve(np, last) < 0)
+		return -ENOMEM;
+
+	/* move small block to a page */
+	if (np->rn_small) {
+		if (!(p = page_alloc(PAGE_SIZE, MA_NORMAL, &ramfs_id)))
+			return -ENOSPC;
+		char *const buf = phys_to_virt(p);
+		memcpy(buf, np->rn_pages[0], np->rn_size);
+		memset(buf + np->rn_size, 0, PAGE_SIZE - np->rn_size);
+		free(np->rn_pages[0]);
+		np->rn_pages[0] = buf;
+		np->rn_small = 0;
+	}
+
+	for (size_t i = first; i < last; ++i) {
+		if (np->rn_pages[i])
+			continue;
+		if (!(p = page_alloc(PAGE_SIZE, MA_NORMAL, &ramfs_id)))
+			return -ENOSPC;
+		np->rn_pages[i] = memset(phys_to_virt(p), 0, PAGE_SIZE);
+	}
+	return 0;
 }
 
 static struct ramfs_node *
 ramfs_add_node(struct ramfs_node *dnp, const char *name, size_t name_len, mode_t mode)
 {
-	struct ramfs_node *np, *prev;
+	struct ramfs_node *np;
 
 	if (!(np = ramfs_allocate_node(name, name_len, mode)))
 		return NULL;
 
 	/* Link to the directory list */
-	if (dnp->rn_child == NULL) {
-		dnp->rn_child = np;
-	} else {
-		prev = dnp->rn_child;
-		while (prev->rn_next != NULL)
-			prev = prev->rn_next;
-		prev->rn_next = np;
-	}
+	np->rn_parent = dnp;
+	list_insert(list_last(&dnp->rn_children), &np->rn_link);
+	ramfs_hash_insert(np);
 	return np;
 }
 
 static int
 ramfs_remove_node(struct ramfs_node *dnp, struct ramfs_node *np)
 {
-	struct ramfs_node *prev;
-
-	if (dnp->rn_child == NULL)
+	if (np->rn_parent != dnp)
 		return -ENOENT;
 
 	/* Unlink from the directory list */
-	if (dnp->rn_child == np) {
-		dnp->rn_child = np->rn_next;
-	} else {
-		for (prev = dnp->rn_child; prev->rn_next != np;
-		     prev = prev->rn_next) {
-			if (prev->rn_next == NULL)
-				return -ENOENT;
-		}
-		prev->rn_next = np->rn_next;
-	}
+	ramfs_hash_remove(np);
+	list_remove(&np->rn_link);
+	ramfs_free_data(np);
 	ramfs_free_node(np);
 	return 0;
 }
@@ -168,17 +332,15 @@ ramfs_rename_node(struct ramfs_node *np, const char *name, size_t name_len)
 {
 	char *tmp;
 
-	if (name_len <= np->rn_namelen) {
-		/* Reuse current name buffer */
-		strlcpy(np->rn_name, name, np->rn_namelen + 1);
-	} else {
+	if (name_len > np->rn_namelen) {
 		/* Expand name buffer */
 		if (!(tmp = malloc(name_len + 1)))
 			return -ENOMEM;
-		strlcpy(tmp, name, name_len + 1);
 		free(np->rn_name);
 		np->rn_name = tmp;
 	}
+	memcpy(np->rn_name, name, name_len);
+	np->rn_name[name_len] = 0;
 	np->rn_namelen = name_len;
 	return 0;
 }
@@ -194,13 +356,15 @@ ramfs_lookup(struct vnode *dvp, const char *name, size_t name_len, struct vnode
 		return -ENOENT;
 
 	found = 0;
-	for (np = dnp->rn_child; np != NULL; np = np->rn_next) {
-		if (np->rn_namelen == name_len &&
+	mutex_lock(&ramfs_mutex);
+	list_for_each_entry(np, ramfs_hash(dnp, name, name_len), rn_hash) {
+		if (np->rn_parent == dnp && np->rn_namelen == name_len &&
 		    memcmp(name, np->rn_name, name_len) == 0) {
 			found = 1;
 			break;
 		}
 	}
+	mutex_unlock(&ramfs_mutex);
 	if (found == 0)
 		return -ENOENT;
 	vp->v_data = np;
@@ -220,15 +384,9 @@ ramfs_unlink(struct vnode *dvp, struct vnode *vp)
 
 	np = vp->v_data;
 
-	if (np->rn_child)
+	if (!list_empty(&np->rn_children))
 		return -ENOTEMPTY;
 
-	if (np->rn_buf != NULL) {
-		page_free(virt_to_phys(np->rn_buf), np->rn_bufsize, &ramfs_id);
-		np->rn_buf = NULL; /* incase remove_node fails */
-		np->rn_bufsize = 0;
-		np->rn_size = 0;
-	}
 	vp->v_size = 0;
 	return ramfs_remove_node(dvp->v_data, np);
 }
@@ -240,12 +398,7 @@ ramfs_truncate(struct vnode *vp)
 	struct ramfs_node *np = vp->v_data;
 
 	rfsdbg("truncate %s\n", vp->v_path);
-	if (np->rn_buf != NULL) {
-		page_free(virt_to_phys(np->rn_buf), np->rn_bufsize, &ramfs_id);
-		np->rn_buf = NULL;
-		np->rn_bufsize = 0;
-		np->rn_size = 0;
-	}
+	ramfs_free_data(np);
 	vp->v_size = 0;
 	return 0;
 }
@@ -282,7 +435,16 @@ ramfs_read(struct file *fp, void *buf, size_t size, off_t offset)
 	if (vp->v_size - offset < size)
 		size = vp->v_size - offset;
 
-	memcpy(buf, np->rn_buf + offset, size);
+	for (size_t t = 0; t < size;) {
+		const size_t i = (offset + t) / PAGE_SIZE;
+		const size_t off = (offset + t) % PAGE_SIZE;
+		const size_t n = MIN(size - t, PAGE_SIZE - off);
+		if (i < np->rn_npages && np->rn_pages[i])
+			memcpy((char *)buf + t, np->rn_pages[i] + off, n);
+		else
+			memset((char *)buf + t, 0, n);	/* hole */
+		t += n;
+	}
 
 	return size;
 }
@@ -294,75 +456,45 @@ ramfs_read_iov(struct file *fp, const struct iovec *iov, size_t count,
 	return for_each_iov(fp, iov, count, offset, ramfs_read);
 }
 
-static int
-ramfs_grow(struct ramfs_node *np, off_t new_size)
-{
-	void *new_buf = NULL;
-
-	if (new_size <= np->rn_bufsize)
-		return 0;
-
-	/*
-	 * We allocate small files using malloc. Once a file grows to more
-	 * than half a page in size we switch to using page_alloc.
-	 */
-	if (new_size > PAGE_SIZE / 2) {
-		new_size = PAGE_ALIGN(new_size);
-		phys *const p = page_alloc(new_size, MA_NORMAL, &ramfs_id);
-		if (!p)
-			return -1;
-		new_buf = phys_to_virt(p);
-	} else {
-		/* try not to fragment malloc too much */
-		new_size = ALIGNn(new_size, 32);
-		new_buf = malloc(new_size);
-		if (!new_buf)
-			return -1;
-	}
-
-	/* copy file data to new buffer */
-	if (np->rn_size != 0)
-		memcpy(new_buf, np->rn_buf, np->rn_size);
-
-	/* free old buffer */
-	if (np->rn_buf) {
-		if (np->rn_bufsize > PAGE_SIZE / 2)
-			page_free(virt_to_phys(np->rn_buf), np->rn_bufsize,
-				  &ramfs_id);
-		else
-			free(np->rn_buf);
-	}
-
-	np->rn_buf = new_buf;
-	np->rn_bufsize = new_size;
-
-	return 0;
-}
-
 static ssize_t
 ramfs_write(struct file *fp, void *buf, size_t size, off_t offset)
 {
 	struct ramfs_node *np = fp->f_vnode->v_data;
 	struct vnode *vp = fp->f_vnode;
+	const size_t end = offset + size;
+	int err;
 
 	if (!S_ISREG(vp->v_mode) && !S_ISLNK(vp->v_mode))
 		return -EINVAL;
 
-	/* Check if the file position exceeds the end of file. */
-	if (offset + size > vp->v_size) {
-		/* Expand the file size before writing to it */
-		const off_t end_pos = offset + size;
-		if (ramfs_grow(np, end_pos) < 0)
-			return -EIO;
+	if (size == 0)
+		return 0;
+
+	if (end <= SMALL_MAX && np->rn_size <= SMALL_MAX &&
+	    (np->rn_small || !np->rn_npages || !np->rn_pages[0])) {
+		/* small file */
+		if ((err = ramfs_grow_small(np, end)) < 0)
+			return err;
 
 		/* zero sparse file data */
-		if (vp->v_size < offset)
-			memset(np->rn_buf + vp->v_size, 0, offset - vp->v_size);
+		if (np->rn_size < (size_t)offset)
+			memset(np->rn_pages[0] + np->rn_size, 0,
+			    offset - np->rn_size);
+	} else if ((err = ramfs_alloc_pages(np, offset, end)) < 0)
+		return err;
+
+	for (size_t t = 0; t < size;) {
+		const size_t i = (offset + t) / PAGE_SIZE;
+		const size_t off = (offset + t) % PAGE_SIZE;
+		const size_t n = MIN(size - t, PAGE_SIZE - off);
+		memcpy(np->rn_pages[i] + off, (char *)buf + t, n);
+		t += n;
+	}
 
-		np->rn_size = end_pos;
-		vp->v_size = end_pos;
+	if (end > np->rn_size) {
+		np->rn_size = end;
+		vp->v_size = end;
 	}
-	memcpy(np->rn_buf + offset, buf, size);
 	return size;
 }
 
@@ -377,7 +509,7 @@ static int
 ramfs_rename(struct vnode *dvp1, struct vnode *vp1, struct vnode *dvp2,
     struct vnode *vp2, const char *name, size_t name_len)
 {
-	struct ramfs_node *np, *old_np;
+	struct ramfs_node *np = vp1->v_data;
 	int err;
 
 	if (vp2) {
@@ -386,27 +518,22 @@ ramfs_rename(struct vnode *dvp1, struct vnode *vp1, struct vnode *dvp2,
 		if (err)
 			return err;
 	}
-	/* Same directory ? */
-	if (dvp1 == dvp2) {
-		/* Change the name of existing file */
-		err = ramfs_rename_node(vp1->v_data, name, name_len);
-		if (err)
-			return err;
-	} else {
-		/* Create new file or directory */
-		old_np = vp1->v_data;
-		if (!(np = ramfs_add_node(dvp2->v_data, name, name_len, vp1->v_mode)))
-			return -ENOMEM;
 
-		if (S_ISREG(vp1->v_mode)) {
-			/* Copy file data */
-			np->rn_buf = old_np->rn_buf;
-			np->rn_size = old_np->rn_size;
-			np->rn_bufsize = old_np->rn_bufsize;
-		}
-		/* Remove source file */
-		ramfs_remove_node(dvp1->v_data, vp1->v_data);
+	/* Change the name of existing node */
+	ramfs_hash_remove(np);
+	if ((err = ramfs_rename_node(np, name, name_len))) {
+		ramfs_hash_insert(np);
+		return err;
+	}
+
+	/* Move node to new directory */
+	if (dvp1 != dvp2) {
+		list_remove(&np->rn_link);
+		np->rn_parent = dvp2->v_data;
+		list_insert(list_last(&np->rn_parent->rn_children),
+		    &np->rn_link);
 	}
+	ramfs_hash_insert(np);
 	return 0;
 }
 
@@ -418,7 +545,7 @@ ramfs_readdir(struct file *fp, struct dirent *buf, size_t len)
 {
 	size_t remain = len;
 	struct ramfs_node *dnp = fp->f_vnode->v_data;
-	struct ramfs_node *np;
+	struct list *n;
 
 	if (fp->f_offset == 0) {
 		if (dirbuf_add(&buf, &remain, 0, fp->f_offset, DT_DIR, "."))
@@ -432,22 +559,20 @@ ramfs_readdir(struct file *fp, struct dirent *buf, size_t len)
 		++fp->f_offset;
 	}
 
-	np = dnp->rn_child;
-	if (np == NULL)
-		goto out;
-
+	n = list_first(&dnp->rn_children);
 	for (off_t i = 0; i != (fp->f_offset - 2); i++) {
-		np = np->rn_next;
-		if (np == NULL)
+		if (list_end(&dnp->rn_children, n))
 			goto out;
+		n = list_next(n);
 	}
 
-	while (np != NULL) {
+	for (; !list_end(&dnp->rn_children, n); n = list_next(n)) {
+		const struct ramfs_node *np =
+		    list_entry(n, struct ramfs_node, rn_link);
 		if (dirbuf_add(&buf, &remain, 0, fp->f_offset,
 		    IFTODT(np->rn_mode), np->rn_name))
 			goto out;
 		++fp->f_offset;
-		np = np->rn_next;
 	}
 
 out:
@@ -456,4 +581,3 @@ out:
 
 	return -ENOENT;
 }
-
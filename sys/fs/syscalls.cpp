@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/statfs.h>
 #include <sys/uio.h>
 #include <task.h>
@@ -27,12 +28,15 @@
  * do_iov - copy iov from userspace into kernel, verify all pointers are sane
  * then call through to filesystem routine.
  *
+ * Large iov arrays are passed to fn in batches with offset advanced by the
+ * length of each batch.
+ *
  * iov_base == nullptr is valid from userspace. Strip these out here and only
  * pass valid pointers through.
  */
+template<typename F>
 static ssize_t
-do_iov(int fd, const iovec *uiov, int count, off_t offset,
-    ssize_t (*fn)(int fd, const iovec *, int, off_t), int prot)
+do_iov(int fd, const iovec *uiov, int count, off_t offset, F fn, int prot)
 {
 	if ((count < 0) || (count > IOV_MAX))
 		return DERR(-EINVAL);
@@ -271,6 +275,14 @@ sc_ioctl(int fd, int request, void *argp)
 			dir = _IOC_WRITE;
 			size = sizeof(int);
 			break;
+		case BLKRAGET:
+			dir = _IOC_READ;
+			size = sizeof(long);
+			break;
+		case BLKIOMIN:
+			dir = _IOC_READ;
+			size = sizeof(unsigned);
+			break;
 		}
 	}
 
@@ -570,6 +582,30 @@ sc_readlinkat(int dirfd, const char *path, char *buf, size_t len)
 	return readlinkat(dirfd, path, buf, len);
 }
 
+ssize_t
+sc_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	interruptible_lock l(u_access_lock);
+	if (auto r = l.lock(); r < 0)
+		return r;
+	if (offset && !u_access_ok(offset, sizeof(*offset), PROT_WRITE))
+		return DERR(-EFAULT);
+	return sendfile(out_fd, in_fd, offset, count);
+}
+
+ssize_t
+sc_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+    unsigned flags)
+{
+	interruptible_lock l(u_access_lock);
+	if (auto r = l.lock(); r < 0)
+		return r;
+	if ((off_in && !u_access_ok(off_in, sizeof(*off_in), PROT_WRITE)) ||
+	    (off_out && !u_access_ok(off_out, sizeof(*off_out), PROT_WRITE)))
+		return DERR(-EFAULT);
+	return splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
 static ssize_t
 do_readv(int fd, const struct iovec *iov, int count, off_t offset)
 {
@@ -623,6 +659,18 @@ sc_write(int fd, const void *buf, size_t len)
 	return write(fd, buf, len);
 }
 
+ssize_t
+sc_vmsplice(int fd, const struct iovec *iov, size_t count, unsigned flags)
+{
+	if (count > IOV_MAX)
+		return DERR(-EINVAL);
+	/* do_iov advances the offset after each batch, pass flags separately */
+	return do_iov(fd, iov, count, 0,
+	    [flags](int fd, const iovec *iov, int count, off_t) {
+		return vmsplice(fd, iov, count, flags);
+	    }, PROT_READ);
+}
+
 static ssize_t
 do_writev(int fd, const struct iovec *iov, int count, off_t offset)
 {
@@ -0,0 +1,399 @@
+/*
+ * timerfd.c - timers which notify via a file descriptor
+ *
+ * Expirations are counted lazily from the expiry time and interval, the kernel
+ * timer only wakes readers and pollers.
+ */
+#include "poll.h"
+
+#include "vfs.h"
+#include <access.h>
+#include <debug.h>
+#include <device.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <fs/file.h>
+#include <kernel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sync.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <task.h>
+#include <time.h>
+#include <time32.h>
+#include <timer.h>
+#include <vm.h>
+#include <wait.h>
+
+/*
+ * timerfd
+ */
+struct timerfd {
+	struct spinlock lock;		/* protects expire & interval */
+	struct timer timer;		/* wakes readers on expiry */
+	int clock;			/* clock for absolute times */
+	uint_fast64_t expire;		/* next unread expiry, 0 if disarmed */
+	uint_fast64_t interval;		/* reload interval, 0 if one shot */
+	struct event event;		/* readers sleep on this event */
+	struct pollq pollq;		/* pollers */
+};
+
+static const struct devio timerfd_io;
+
+/*
+ * tfd_remain - get time until next expiry
+ *
+ * Must be called with timerfd locked.
+ */
+static uint_fast64_t
+tfd_remain(const struct timerfd *tfd, uint_fast64_t now)
+{
+	if (!tfd->expire)
+		return 0;
+	if (now < tfd->expire)
+		return tfd->expire - now;
+	if (!tfd->interval)
+		return 0;
+	return tfd->interval - (now - tfd->expire) % tfd->interval;
+}
+
+/*
+ * tfd_ticks - consume expirations
+ *
+ * Must be called with timerfd locked.
+ */
+static uint64_t
+tfd_ticks(struct timerfd *tfd, uint_fast64_t now)
+{
+	if (!tfd->expire || now < tfd->expire)
+		return 0;
+	if (!tfd->interval) {
+		tfd->expire = 0;
+		return 1;
+	}
+	const uint64_t ticks = 1 + (now - tfd->expire) / tfd->interval;
+	tfd->expire += ticks * tfd->interval;
+	return ticks;
+}
+
+/*
+ * tfd_expired - test if timer has expired
+ */
+static bool
+tfd_expired(struct timerfd *tfd)
+{
+	spinlock_lock(&tfd->lock);
+	const bool r = tfd->expire && timer_monotonic() >= tfd->expire;
+	spinlock_unlock(&tfd->lock);
+	return r;
+}
+
+/*
+ * tfd_timeout - kernel timer expired
+ *
+ * Called from timer thread.
+ */
+static void
+tfd_timeout(void *arg)
+{
+	struct timerfd *tfd = arg;
+
+	sch_wakeup(&tfd->event, 0);
+	pollq_notify(&tfd->pollq);
+}
+
+/*
+ * tfd_settime - arm or disarm timer
+ */
+static int
+tfd_settime(struct timerfd *tfd, int flags, uint_fast64_t value,
+    uint_fast64_t interval, uint_fast64_t *ovalue, uint_fast64_t *ointerval)
+{
+	if (flags & ~TFD_TIMER_ABSTIME)
+		return DERR(-EINVAL);
+
+	spinlock_lock(&tfd->lock);
+
+	const uint_fast64_t now = timer_monotonic();
+	*ovalue = tfd_remain(tfd, now);
+	*ointerval = tfd->interval;
+
+	timer_stop(&tfd->timer);
+	tfd->expire = 0;
+	tfd->interval = 0;
+
+	if (value) {
+		/* REVISIT: absolute realtime timers do not follow clock changes */
+		uint_fast64_t nsec = value;
+		if (flags & TFD_TIMER_ABSTIME) {
+			const uint_fast64_t base = tfd->clock == CLOCK_REALTIME
+			    ? timer_realtime() : now;
+			nsec = value > base ? value - base : 0;
+		}
+		tfd->expire = now + nsec;
+		tfd->interval = interval;
+		timer_callout(&tfd->timer, nsec ?: 1, interval, tfd_timeout,
+		    tfd);
+	}
+
+	spinlock_unlock(&tfd->lock);
+
+	/* readiness may have changed */
+	sch_wakeup(&tfd->event, 0);
+	pollq_notify(&tfd->pollq);
+
+	return 0;
+}
+
+/*
+ * tfd_gettime - get timer state
+ */
+static void
+tfd_gettime(struct timerfd *tfd, uint_fast64_t *value,
+    uint_fast64_t *interval)
+{
+	spinlock_lock(&tfd->lock);
+	*value = tfd_remain(tfd, timer_monotonic());
+	*interval = tfd->interval;
+	spinlock_unlock(&tfd->lock);
+}
+
+/*
+ * timerfd_read - read number of expirations
+ */
+static ssize_t
+timerfd_read(struct file *fp, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	struct timerfd *tfd = fp->f_data;
+	uint64_t ticks;
+
+	if (!count || iov->iov_len < sizeof ticks)
+		return DERR(-EINVAL);
+
+	/*
+	 * REVISIT: the u_access* mechanism is broken for iov, so if
+	 * _any_ usage of u_access_suspend() it must be unconditional
+	 * so u_access_resume() can guarantee pointers are still
+	 * valid
+	 */
+	bool ua = u_access_suspend();
+	int rc = 0;
+	for (;;) {
+		spinlock_lock(&tfd->lock);
+		ticks = tfd_ticks(tfd, timer_monotonic());
+		spinlock_unlock(&tfd->lock);
+		if (ticks)
+			break;
+		if (fp->f_flags & O_NONBLOCK) {
+			rc = -EAGAIN;
+			break;
+		}
+		rc = wait_event_interruptible(tfd->event, tfd_expired(tfd));
+		if (rc < 0)
+			break;
+	}
+
+	int r = u_access_resume(ua, iov->iov_base, sizeof ticks, PROT_WRITE);
+	if (r < 0)
+		return r;
+	if (rc < 0)
+		return rc;
+
+	memcpy(iov->iov_base, &ticks, sizeof ticks);
+	return sizeof ticks;
+}
+
+/*
+ * timerfd_poll - get timerfd readiness
+ */
+static int
+timerfd_poll(struct file *fp, struct poll_table *pt)
+{
+	struct timerfd *tfd = fp->f_data;
+
+	poll_wait(&tfd->pollq, pt);
+
+	return tfd_expired(tfd) ? POLLIN | POLLRDNORM : 0;
+}
+
+/*
+ * timerfd_close - destroy timerfd
+ */
+static int
+timerfd_close(struct file *fp)
+{
+	struct timerfd *tfd = fp->f_data;
+
+	timer_stop(&tfd->timer);
+	pollq_destroy(&tfd->pollq);
+	free(tfd);
+	return 0;
+}
+
+static const struct devio timerfd_io = {
+	.close = timerfd_close,
+	.read = timerfd_read,
+	.poll = timerfd_poll,
+};
+
+/*
+ * its_to_ns - convert itimerspec to nanoseconds
+ */
+static int
+its_to_ns(const struct timespec *value, const struct timespec *interval,
+    uint_fast64_t *nvalue, uint_fast64_t *ninterval)
+{
+	if (value->tv_sec < 0 || value->tv_nsec < 0 ||
+	    value->tv_nsec >= 1000000000 ||
+	    interval->tv_sec < 0 || interval->tv_nsec < 0 ||
+	    interval->tv_nsec >= 1000000000)
+		return DERR(-EINVAL);
+	*nvalue = ts_to_ns(value);
+	*ninterval = ts_to_ns(interval);
+	return 0;
+}
+
+/*
+ * Syscalls
+ */
+int
+sc_timerfd_create(int clockid, int flags)
+{
+	int fd;
+	struct timerfd *tfd;
+
+	switch (clockid) {
+	case CLOCK_REALTIME:
+	case CLOCK_MONOTONIC:
+	case CLOCK_BOOTTIME:
+		break;
+	default:
+		return DERR(-EINVAL);
+	}
+
+	if (flags & ~(TFD_CLOEXEC | TFD_NONBLOCK))
+		return DERR(-EINVAL);
+
+	if (!(tfd = malloc(sizeof *tfd)))
+		return DERR(-ENOMEM);
+
+	*tfd = (struct timerfd){
+		.clock = clockid,
+	};
+	spinlock_init(&tfd->lock);
+	event_init(&tfd->event, "timerfd", ev_IO);
+	pollq_init(&tfd->pollq);
+
+	if ((fd = anon_open(&timerfd_io, tfd, flags)) < 0)
+		free(tfd);
+
+	return fd;
+}
+
+int
+sc_timerfd_gettime(int fd, struct itimerspec *ucur)
+{
+	int r;
+	struct file *fp;
+	struct itimerspec cur;
+	uint_fast64_t value, interval;
+
+	if ((fp = anon_fget(fd, &timerfd_io)) > (struct file *)-4096UL)
+		return (int)fp;
+	tfd_gettime(fp->f_data, &value, &interval);
+	fs_fput(fp);
+
+	ns_to_ts(value, &cur.it_value);
+	ns_to_ts(interval, &cur.it_interval);
+	if ((r = vm_write(task_cur()->as, &cur, ucur, sizeof cur)) < 0)
+		return r;
+	return 0;
+}
+
+int
+sc_timerfd_gettime32(int fd, struct itimerspec32 *ucur)
+{
+	int r;
+	struct file *fp;
+	struct itimerspec32 cur;
+	uint_fast64_t value, interval;
+
+	if ((fp = anon_fget(fd, &timerfd_io)) > (struct file *)-4096UL)
+		return (int)fp;
+	tfd_gettime(fp->f_data, &value, &interval);
+	fs_fput(fp);
+
+	ns_to_ts32(value, &cur.it_value);
+	ns_to_ts32(interval, &cur.it_interval);
+	if ((r = vm_write(task_cur()->as, &cur, ucur, sizeof cur)) < 0)
+		return r;
+	return 0;
+}
+
+int
+sc_timerfd_settime(int fd, int flags, const struct itimerspec *unew,
+    struct itimerspec *uold)
+{
+	int r;
+	struct file *fp;
+	struct itimerspec new, old;
+	uint_fast64_t value, interval, ovalue, ointerval;
+
+	if ((r = vm_read(task_cur()->as, &new, unew, sizeof new)) < 0)
+		return r;
+	if ((r = its_to_ns(&new.it_value, &new.it_interval, &value,
+	    &interval)) < 0)
+		return r;
+
+	if ((fp = anon_fget(fd, &timerfd_io)) > (struct file *)-4096UL)
+		return (int)fp;
+	r = tfd_settime(fp->f_data, flags, value, interval, &ovalue,
+	    &ointerval);
+	fs_fput(fp);
+	if (r < 0 || !uold)
+		return r;
+
+	ns_to_ts(ovalue, &old.it_value);
+	ns_to_ts(ointerval, &old.it_interval);
+	if ((r = vm_write(task_cur()->as, &old, uold, sizeof old)) < 0)
+		return r;
+	return 0;
+}
+
+int
+sc_timerfd_settime32(int fd, int flags, const struct itimerspec32 *unew,
+    struct itimerspec32 *uold)
+{
+	int r;
+	struct file *fp;
+	struct itimerspec32 new32, old;
+	uint_fast64_t value, interval, ovalue, ointerval;
+
+	if ((r = vm_read(task_cur()->as, &new32, unew, sizeof new32)) < 0)
+		return r;
+	const struct timespec v = {new32.it_value.tv_sec,
+				   new32.it_value.tv_nsec};
+	const struct timespec i = {new32.it_interval.tv_sec,
+				   new32.it_interval.tv_nsec};
+	if ((r = its_to_ns(&v, &i, &value, &interval)) < 0)
+		return r;
+
+	if ((fp = anon_fget(fd, &timerfd_io)) > (struct file *)-4096UL)
+		return (int)fp;
+	r = tfd_settime(fp->f_data, flags, value, interval, &ovalue,
+	    &ointerval);
+	fs_fput(fp);
+	if (r < 0 || !uold)
+		return r;
+
+	ns_to_ts32(ovalue, &old.it_value);
+	ns_to_ts32(ointerval, &old.it_interval);
+	if ((r = vm_write(task_cur()->as, &old, uold, sizeof old)) < 0)
+		return r;
+	return 0;
+}
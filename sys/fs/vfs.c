@@ -10,6 +10,7 @@
 #include "debug.h"
 #include "file.h"
 #include "mount.h"
+#include "pcache.h"
 #include "pipe.h"
 #include "util.h"
 #include "vnode.h"
@@ -18,18 +19,21 @@
 #include <assert.h>
 #include <compiler.h>
 #include <debug.h>
+#include <device.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <kernel.h>
 #include <limits.h>
 #include <page.h>
+#include <poll.h>
 #include <sch.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sync.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/uio.h>
 #include <task.h>
 #include <thread.h>
@@ -227,6 +231,17 @@ flags_allow_read(int flags)
 	return !(flags & O_WRONLY);
 }
 
+/*
+ * anon_io - get devio of anonymous vnode, NULL if vnode is not anonymous
+ */
+static const struct devio *
+anon_io(const struct vnode *vp)
+{
+	if (vp->v_mount || S_ISFIFO(vp->v_mode))
+		return NULL;
+	return vp->v_data;
+}
+
 /*
  * mount_readonly - Check if vnode mount is read only
  */
@@ -401,6 +416,12 @@ lookup_v(struct vnode *vp, const char *path, struct vnode **vpp,
 		len = strchrnul(path, '/') - path;
 
 		if ((child = vn_lookup(vp, path, len))) {
+			/* cached lookup failure */
+			if (child->v_flags & VNEGATIVE) {
+				vput(child);
+				err = -ENOENT;
+				break;
+			}
 			/* vnode already active */
 			vput(vp);
 			vp = child;
@@ -415,6 +436,12 @@ lookup_v(struct vnode *vp, const char *path, struct vnode **vpp,
 			goto out;
 		}
 		if ((err = VOP_LOOKUP(vp, path, len, child))) {
+			/* remember failure if file system allows it */
+			if (err == -ENOENT &&
+			    vp->v_mount->m_op->vfs_flags & VFSF_NCACHE)
+				child->v_flags |= VNEGATIVE;
+			else
+				vn_hide(child);
 			vput(child);
 			if (err == -ENOENT)
 				break;
@@ -603,6 +630,7 @@ fs_openfp(struct task *t, const int dirfd, const char *path, int flags,
 			/* try to create */
 			if ((err = VOP_MKNOD(vp, node, node_len, flags, mode)))
 				goto out;
+			vn_invalidate(vp, node, node_len);
 			/* lookup newly created file */
 			if ((err = lookup_v(vp, node, &nvp, NULL, NULL, flags, 0))) {
 				vput(vp);
@@ -651,6 +679,8 @@ fs_openfp(struct task *t, const int dirfd, const char *path, int flags,
 		/* try to truncate */
 		if ((err = VOP_TRUNCATE(vp)))
 			goto out;
+		if (pcache_enabled(vp))
+			pcache_truncate(vp);
 	}
 
 	/* create file structure */
@@ -726,8 +756,14 @@ fs_closefp(struct file *fp)
 		return 0;
 	}
 
+	if (fp->f_epitems)
+		epoll_release(fp);
+
+	const struct devio *io;
 	if (S_ISFIFO(vp->v_mode))
 		err = pipe_close(fp);
+	else if ((io = anon_io(vp)))
+		err = io->close ? io->close(fp) : 0;
 	else
 		err = VOP_CLOSE(fp);
 
@@ -773,6 +809,7 @@ fs_init(void)
 {
 	mount_init();
 	vnode_init();
+	pcache_init();
 	semaphore_init(&exit_sem);
 
 	kthread_create(&fs_thread, NULL, PRI_KERN_HIGH, "fs", MA_NORMAL);
@@ -1121,6 +1158,39 @@ vn_close(struct vnode *vp)
 	vput(vp);
 }
 
+/*
+ * fs_fget - get referenced file from file descriptor
+ *
+ * Returned file is not locked and remains valid until released by fs_fput
+ * even if the file descriptor is closed.
+ *
+ * Returns -ve error code on failure, valid file pointer otherwise.
+ */
+struct file *
+fs_fget(int fd)
+{
+	struct file *fp;
+
+	if ((fp = task_file_interruptible(task_cur(), fd)) > (struct file *)-4096UL)
+		return fp;
+
+	vref(fp->f_vnode);
+	fp->f_count++;
+	vn_unlock(fp->f_vnode);
+
+	return fp;
+}
+
+/*
+ * fs_fput - release file returned by fs_fget
+ */
+void
+fs_fput(struct file *fp)
+{
+	vn_lock(fp->f_vnode);
+	fs_closefp(fp);
+}
+
 /*
  * mknod
  */
@@ -1175,6 +1245,8 @@ mknodat(int dirfd, const char *path, mode_t mode, dev_t dev)
 	default:
 		err = DERR(-ENOTSUP);
 	}
+	if (!err)
+		vn_invalidate(vp, node, node_len);
 
 out:
 	vput(vp);
@@ -1212,7 +1284,7 @@ lseek(int fd, off_t off, int whence)
 
 	struct vnode *vp = fp->f_vnode;
 
-	if (S_ISFIFO(vp->v_mode)) {
+	if (S_ISFIFO(vp->v_mode) || anon_io(vp)) {
 		err = DERR(-ESPIPE);
 		goto out;
 	}
@@ -1261,38 +1333,39 @@ out:
 }
 
 /*
- * read
+ * fp_readv - read from file with vnode locked
+ *
+ * Anonymous files are read with a file reference held instead, see do_readv.
  */
 static ssize_t
-do_readv(struct file *fp, const struct iovec *iov, int count, off_t offset,
-    bool update_offset)
+fp_readv(struct file *fp, const struct iovec *iov, int count, off_t offset)
 {
 	ssize_t res;
 	struct vnode *vp = fp->f_vnode;
-
-	vdbgsys("readv: fp=%p iov=%p count=%d offset=%lld\n",
-	    fp, iov, count, offset);
-
-	if (!flags_allow_read(fp->f_flags)) {
-		/* no read permissions */
-		res = DERR(-EPERM);
-		goto out;
-	}
+	const struct devio *io;
 
 	switch (IFTODT(vp->v_mode)) {
 	case DT_FIFO:
 		res = for_each_iov(fp, iov, count, offset, pipe_read);
 		break;
 	case DT_CHR:
-		update_offset = false;
 	case DT_BLK:
 	case DT_REG:
-		res = VOP_READ(fp, iov, count, offset);
+		if (pcache_enabled(vp))
+			res = pcache_read(fp, iov, count, offset);
+		else
+			res = VOP_READ(fp, iov, count, offset);
 		break;
 	case DT_DIR:
 		res = -EISDIR;
 		break;
 	case DT_UNKNOWN:
+		if ((io = anon_io(vp)) && io->read) {
+			res = io->read(fp, iov, count, offset);
+			break;
+		}
+		res = -EINVAL;
+		break;
 	case DT_LNK:
 	case DT_SOCK:
 	case DT_WHT:
@@ -1301,7 +1374,60 @@ do_readv(struct file *fp, const struct iovec *iov, int count, off_t offset,
 		break;
 	}
 
-	if (update_offset && res > 0)
+	return res;
+}
+
+/*
+ * fp_has_offset - check if file transfers use the file offset
+ */
+static bool
+fp_has_offset(const struct file *fp)
+{
+	switch (IFTODT(fp->f_vnode->v_mode)) {
+	case DT_CHR:
+	case DT_UNKNOWN:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/*
+ * read
+ */
+static ssize_t
+do_readv(struct file *fp, const struct iovec *iov, int count, off_t offset,
+    bool update_offset)
+{
+	ssize_t res;
+	struct vnode *vp = fp->f_vnode;
+
+	vdbgsys("readv: fp=%p iov=%p count=%d offset=%lld\n",
+	    fp, iov, count, offset);
+
+	if (!flags_allow_read(fp->f_flags)) {
+		/* no read permissions */
+		res = DERR(-EPERM);
+		goto out;
+	}
+
+	/*
+	 * Anonymous files such as eventfd sleep until another thread acts on
+	 * the same file, which needs the vnode lock to do so. Hold a file
+	 * reference rather than the lock while they run.
+	 */
+	if (anon_io(vp)) {
+		vref(vp);
+		++fp->f_count;
+		vn_unlock(vp);
+		res = fp_readv(fp, iov, count, offset);
+		fs_fput(fp);
+		return res;
+	}
+
+	res = fp_readv(fp, iov, count, offset);
+
+	if (update_offset && res > 0 && fp_has_offset(fp))
 		fp->f_offset += res;
 
 out:
@@ -1405,45 +1531,56 @@ vn_preadv(struct vnode *vp, const struct iovec *iov, int count, off_t offset)
 }
 
 /*
- * write
+ * vn_xip - get address of file data for execute in place
+ *
+ * Returns NULL if file data is not directly addressable.
+ */
+void *
+vn_xip(struct vnode *vp, off_t offset, size_t len)
+{
+	void *addr;
+
+	if (!vp->v_mount || !S_ISREG(vp->v_mode))
+		return NULL;
+	if (VOP_XIP(vp, offset, len, &addr) < 0)
+		return NULL;
+	return addr;
+}
+
+/*
+ * fp_writev - write to file with vnode locked
+ *
+ * Anonymous files are written with a file reference held instead, see
+ * do_writev.
  */
 static ssize_t
-do_writev(struct file *fp, const struct iovec *iov, int count, off_t offset,
-    bool update_offset)
+fp_writev(struct file *fp, const struct iovec *iov, int count, off_t offset)
 {
 	ssize_t res;
 	struct vnode *vp = fp->f_vnode;
-
-	/* console driver calls write.. */
-#if !defined(CONFIG_CONSOLE)
-	 vdbgsys("writev: fp=%p iov=%p count=%d, offset=%lld\n",
-	     fp, iov, count, offset);
-#endif
-
-	if (count < 0) {
-		res = DERR(-EINVAL);
-		goto out;
-	}
-
-	if (!flags_allow_write(fp->f_flags)) {
-		res = DERR(-EPERM);
-		goto out;
-	}
+	const struct devio *io;
 
 	switch (IFTODT(vp->v_mode)) {
 	case DT_FIFO:
 		res = for_each_iov(fp, iov, count, offset, pipe_write);
 		break;
 	case DT_CHR:
-		update_offset = false;
 	case DT_BLK:
 	case DT_REG:
 		res = VOP_WRITE(fp, iov, count, offset);
+		if (res > 0 && pcache_enabled(vp))
+			pcache_write(vp, iov, count, offset, res);
 		break;
 	case DT_DIR:
 		res = -EISDIR;
 		break;
 	case DT_UNKNOWN:
+		if ((io = anon_io(vp)) && io->write) {
+			res = io->write(fp, iov, count, offset);
+			break;
+		}
+		res = -EINVAL;
+		break;
 	case DT_LNK:
 	case DT_SOCK:
 	case DT_WHT:
@@ -1452,7 +1589,48 @@ do_writev(struct file *fp, const struct iovec *iov, int count, off_t offset,
 		break;
 	}
 
-	if (update_offset && res > 0)
+	return res;
+}
+
+/*
+ * write
+ */
+static ssize_t
+do_writev(struct file *fp, const struct iovec *iov, int count, off_t offset,
+    bool update_offset)
+{
+	ssize_t res;
+	struct vnode *vp = fp->f_vnode;
+
+	/* console driver calls write.. */
+#if !defined(CONFIG_CONSOLE)
+	 vdbgsys("writev: fp=%p iov=%p count=%d, offset=%lld\n",
+	     fp, iov, count, offset);
+#endif
+
+	if (count < 0) {
+		res = DERR(-EINVAL);
+		goto out;
+	}
+
+	if (!flags_allow_write(fp->f_flags)) {
+		res = DERR(-EPERM);
+		goto out;
+	}
+
+	/* anonymous files run without the vnode lock, see do_readv */
+	if (anon_io(vp)) {
+		vref(vp);
+		++fp->f_count;
+		vn_unlock(vp);
+		res = fp_writev(fp, iov, count, offset);
+		fs_fput(fp);
+		return res;
+	}
+
+	res = fp_writev(fp, iov, count, offset);
+
+	if (update_offset && res > 0 && fp_has_offset(fp))
 		fp->f_offset = offset + res;
 
 out:
@@ -1537,6 +1715,416 @@ kpwritev(int fd, const struct iovec *iov, int count, off_t offset)
 	return do_writev(fp, iov, count, offset, update_offset);
 }
 
+/*
+ * sendfile, splice & tee
+ *
+ * Data moves between files without passing through user space. Pipe
+ * buffers are handed to the other end directly, as is file data which is
+ * executable in place or held in the page cache. Other file to file
+ * transfers go through a kernel bounce page.
+ */
+
+/*
+ * Other end of a splice
+ */
+struct splice_end {
+	struct file *fp;
+	off_t *off;		/* file offset, NULL if not used */
+	unsigned flags;		/* SPLICE_F_* */
+};
+
+/*
+ * splice_copy - copy buffer into pipe
+ */
+static ssize_t
+splice_copy(void *arg, void *buf, size_t len)
+{
+	const char **src = arg;
+
+	memcpy(buf, *src, len);
+	*src += len;
+	return len;
+}
+
+/*
+ * splice_to - write buffer to other end
+ */
+static ssize_t
+splice_to(void *arg, void *buf, size_t len)
+{
+	struct splice_end *e = arg;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	ssize_t r;
+
+	if (S_ISFIFO(e->fp->f_vnode->v_mode))
+		return pipe_splice_write(e->fp, len, e->flags, splice_copy,
+		    &buf);
+	if ((r = fp_writev(e->fp, &iov, 1, e->off ? *e->off : 0)) > 0 &&
+	    e->off)
+		*e->off += r;
+	return r;
+}
+
+/*
+ * splice_from - read from other end into buffer
+ */
+static ssize_t
+splice_from(void *arg, void *buf, size_t len)
+{
+	struct splice_end *e = arg;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	ssize_t r;
+
+	if ((r = fp_readv(e->fp, &iov, 1, e->off ? *e->off : 0)) > 0 &&
+	    e->off)
+		*e->off += r;
+	return r;
+}
+
+/*
+ * splice_bounce - transfer from seekable file through a bounce page
+ */
+static ssize_t
+splice_bounce(struct splice_end *in, struct splice_end *out, size_t len)
+{
+	phys *p;
+	ssize_t r, w, total = 0;
+
+	if (!(p = page_alloc(PAGE_SIZE, MA_NORMAL, &vfs_id)))
+		return DERR(-ENOMEM);
+
+	while (len) {
+		if ((r = splice_from(in, phys_to_virt(p),
+		    MIN(len, PAGE_SIZE))) <= 0) {
+			if (!total)
+				total = r;
+			break;
+		}
+		if ((w = splice_to(out, phys_to_virt(p), r)) < 0) {
+			*in->off -= r;
+			if (!total)
+				total = w;
+			break;
+		}
+		total += w;
+		len -= w;
+		/* unread what couldn't be written */
+		if (w < r) {
+			*in->off -= r - w;
+			break;
+		}
+	}
+
+	page_free(p, PAGE_SIZE, &vfs_id);
+	return total;
+}
+
+/*
+ * do_splice - move up to 'len' bytes from fin to fout
+ *
+ * Both vnodes must be locked and flags must include SPLICE_F_NONBLOCK, see
+ * splice_wait. The offsets are only used for files which have one.
+ */
+static ssize_t
+do_splice(struct file *fin, off_t *in_off, struct file *fout, off_t *out_off,
+    size_t len, unsigned flags)
+{
+	struct vnode *vin = fin->f_vnode;
+	struct splice_end in = {
+		.fp = fin,
+		.off = fp_has_offset(fin) ? in_off : NULL,
+		.flags = flags,
+	};
+	struct splice_end out = {
+		.fp = fout,
+		.off = fp_has_offset(fout) ? out_off : NULL,
+		.flags = flags,
+	};
+	ssize_t r;
+	void *addr;
+
+	if (!flags_allow_read(fin->f_flags) ||
+	    !flags_allow_write(fout->f_flags))
+		return DERR(-EBADF);
+
+	/* anonymous files may sleep, which splice must not do while locked */
+	if (anon_io(vin) || anon_io(fout->f_vnode))
+		return DERR(-EINVAL);
+
+	/* pipes hand their buffer to the other end */
+	if (S_ISFIFO(vin->v_mode))
+		return pipe_splice_read(fin, len, flags, false, splice_to, &out);
+	if (S_ISFIFO(fout->f_vnode->v_mode))
+		return pipe_splice_write(fout, len, flags, splice_from, &in);
+
+	/* file to file needs a source which can be read again */
+	if (!S_ISREG(vin->v_mode) && !S_ISBLK(vin->v_mode))
+		return DERR(-EINVAL);
+
+	if (S_ISREG(vin->v_mode)) {
+		if (*in_off >= vin->v_size)
+			return 0;
+		if ((off_t)len > vin->v_size - *in_off)
+			len = vin->v_size - *in_off;
+
+		/* pass file data in place */
+		r = -ENOMEM;
+		if ((addr = vn_xip(vin, *in_off, len)))
+			r = splice_to(&out, addr, len);
+		else if (pcache_enabled(vin))
+			r = pcache_splice(vin, *in_off, len, splice_to, &out);
+		if (r > 0)
+			*in_off += r;
+		if (r != -ENOMEM)
+			return r;
+	}
+
+	return splice_bounce(&in, &out, len);
+}
+
+/*
+ * lock_file_pair - get file pointers for two descriptors and lock them.
+ *
+ * The vnodes are locked in address order so that transfers running in
+ * opposite directions can't deadlock. Transfers must not sleep while both
+ * are locked, see splice_wait.
+ */
+static int
+lock_file_pair(struct task *t, int fd1, struct file **fp1, int fd2,
+    struct file **fp2)
+{
+	int err;
+	struct vnode *v1, *v2;
+
+	if (fd1 < 0 || fd2 < 0)
+		return DERR(-EBADF);
+	if ((err = task_lock_interruptible(t)))
+		return err;
+	*fp1 = task_getfp_unlocked(t, fd1);
+	*fp2 = task_getfp_unlocked(t, fd2);
+	if (!*fp1 || !*fp2) {
+		err = DERR(-EBADF);
+		goto out;
+	}
+	v1 = (*fp1)->f_vnode;
+	v2 = (*fp2)->f_vnode;
+	if (v1 == v2) {
+		err = DERR(-EINVAL);
+		goto out;
+	}
+	if (v1 > v2) {
+		struct vnode *tmp = v1;
+		v1 = v2;
+		v2 = tmp;
+	}
+	if ((err = vn_lock_interruptible(v1)))
+		goto out;
+	if ((err = vn_lock_interruptible(v2)))
+		vn_unlock(v1);
+
+out:
+	task_unlock(t);
+	return err;
+}
+
+/*
+ * splice_wait - wait for pipe which stopped a transfer
+ *
+ * Transfers run with both vnodes locked and access pipes with
+ * SPLICE_F_NONBLOCK, as sleeping on one end with the other locked could
+ * deadlock against a transfer in the opposite direction and would stall
+ * everyone else using the other end. When a transfer would block both
+ * vnodes are unlocked and we wait on the pipe alone.
+ *
+ * Called with both vnodes locked, returns with both unlocked. Returns 0 if
+ * the transfer should be retried or -EAGAIN if neither end is a pipe which
+ * would block.
+ */
+static int
+splice_wait(struct file *fin, struct file *fout)
+{
+	struct file *fp, *other;
+	bool write;
+	int err;
+
+	if (S_ISFIFO(fin->f_vnode->v_mode) && !pipe_ready(fin, false)) {
+		fp = fin;
+		other = fout;
+		write = false;
+	} else if (S_ISFIFO(fout->f_vnode->v_mode) && !pipe_ready(fout, true)) {
+		fp = fout;
+		other = fin;
+		write = true;
+	} else {
+		vn_unlock(fin->f_vnode);
+		vn_unlock(fout->f_vnode);
+		return -EAGAIN;
+	}
+
+	/* descriptor may be closed while we wait */
+	vref(fp->f_vnode);
+	fp->f_count++;
+	vn_unlock(other->f_vnode);
+	err = pipe_wait(fp, write);
+	fs_closefp(fp);
+	return err;
+}
+
+ssize_t
+sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	int err;
+	ssize_t res;
+	struct file *fin, *fout;
+
+	vdbgsys("sendfile: out_fd=%d in_fd=%d offset=%p count=%zu\n",
+	    out_fd, in_fd, offset, count);
+
+	for (;;) {
+		if ((err = lock_file_pair(task_cur(), in_fd, &fin, out_fd,
+		    &fout)))
+			return err;
+
+		if (offset && *offset < 0)
+			res = DERR(-EINVAL);
+		else
+			res = do_splice(fin, offset ? offset : &fin->f_offset,
+			    fout, &fout->f_offset, count, SPLICE_F_NONBLOCK);
+		if (res != -EAGAIN)
+			break;
+		if ((err = splice_wait(fin, fout)) < 0)
+			return err;
+	}
+
+	vn_unlock(fin->f_vnode);
+	vn_unlock(fout->f_vnode);
+	return res;
+}
+
+ssize_t
+splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+    unsigned flags)
+{
+	int err;
+	ssize_t res;
+	struct file *fin, *fout;
+
+	vdbgsys("splice: fd_in=%d off_in=%p fd_out=%d off_out=%p len=%zu "
+	    "flags=%x\n", fd_in, off_in, fd_out, off_out, len, flags);
+
+	for (;;) {
+		if ((err = lock_file_pair(task_cur(), fd_in, &fin, fd_out,
+		    &fout)))
+			return err;
+
+		const bool in_pipe = S_ISFIFO(fin->f_vnode->v_mode);
+		const bool out_pipe = S_ISFIFO(fout->f_vnode->v_mode);
+
+		if (!in_pipe && !out_pipe)
+			res = DERR(-EINVAL);
+		else if ((in_pipe && off_in) || (out_pipe && off_out))
+			res = DERR(-ESPIPE);
+		else if ((off_in && *off_in < 0) || (off_out && *off_out < 0))
+			res = DERR(-EINVAL);
+		else
+			res = do_splice(fin, off_in ? off_in : &fin->f_offset,
+			    fout, off_out ? off_out : &fout->f_offset, len,
+			    flags | SPLICE_F_NONBLOCK);
+		if (res != -EAGAIN || flags & SPLICE_F_NONBLOCK)
+			break;
+		if ((err = splice_wait(fin, fout)) < 0)
+			return err;
+	}
+
+	vn_unlock(fin->f_vnode);
+	vn_unlock(fout->f_vnode);
+	return res;
+}
+
+ssize_t
+tee(int fd_in, int fd_out, size_t len, unsigned flags)
+{
+	int err;
+	ssize_t res;
+	struct file *fin, *fout;
+
+	vdbgsys("tee: fd_in=%d fd_out=%d len=%zu flags=%x\n",
+	    fd_in, fd_out, len, flags);
+
+	for (;;) {
+		if ((err = lock_file_pair(task_cur(), fd_in, &fin, fd_out,
+		    &fout)))
+			return err;
+
+		struct splice_end out = {
+			.fp = fout,
+			.flags = flags | SPLICE_F_NONBLOCK,
+		};
+
+		if (!S_ISFIFO(fin->f_vnode->v_mode) ||
+		    !S_ISFIFO(fout->f_vnode->v_mode))
+			res = DERR(-EINVAL);
+		else if (!flags_allow_read(fin->f_flags) ||
+		    !flags_allow_write(fout->f_flags))
+			res = DERR(-EBADF);
+		else
+			res = pipe_splice_read(fin, len, out.flags, true,
+			    splice_to, &out);
+		if (res != -EAGAIN || flags & SPLICE_F_NONBLOCK)
+			break;
+		if ((err = splice_wait(fin, fout)) < 0)
+			return err;
+	}
+
+	vn_unlock(fin->f_vnode);
+	vn_unlock(fout->f_vnode);
+	return res;
+}
+
+/*
+ * vmsplice - write user memory to pipe
+ *
+ * Pages can't be detached from a nommu address space, so the data is copied
+ * straight into the pipe buffer. SPLICE_F_GIFT is ignored.
+ */
+ssize_t
+vmsplice(int fd, const struct iovec *iov, size_t count, unsigned flags)
+{
+	struct file *fp;
+	ssize_t res = 0, r;
+
+	vdbgsys("vmsplice: fd=%d iov=%p count=%zu flags=%x\n",
+	    fd, iov, count, flags);
+
+	if ((fp = task_file_interruptible(task_cur(), fd)) > (struct file *)-4096UL)
+		return (ssize_t)fp;
+
+	if (!S_ISFIFO(fp->f_vnode->v_mode) || !flags_allow_write(fp->f_flags))
+		res = DERR(-EBADF);
+	else for (size_t i = 0; i < count; ++i) {
+		const void *buf = iov[i].iov_base;
+		r = pipe_splice_write(fp, iov[i].iov_len, flags, splice_copy,
+		    &buf);
+		if (r < 0) {
+			if (!res)
+				res = r;
+			break;
+		}
+		res += r;
+		if ((size_t)r < iov[i].iov_len)
+			break;
+	}
+
+	vn_unlock(fp->f_vnode);
+	return res;
+}
+
 /*
  * ioctl
  */
@@ -1555,7 +2143,10 @@ do_ioctl(struct task *t, int fd, int request, va_list ap)
 	if ((fp = task_file_interruptible(t, fd)) > (struct file *)-4096UL)
 		return (int)fp;
 
-	if (!fp->f_vnode->v_mount)
+	const struct devio *io;
+	if ((io = anon_io(fp->f_vnode)))
+		err = io->ioctl ? io->ioctl(fp, request, arg) : -ENOTTY;
+	else if (!fp->f_vnode->v_mount)
 		err = -ENOSYS; /* pipe */
 	else
 		err = VOP_IOCTL(fp, request, arg);
@@ -1590,6 +2181,44 @@ kioctl(int fd, int request, ...)
 	return ret;
 }
 
+/*
+ * fs_poll - get readiness of file descriptor
+ *
+ * Registers pt on the file's poll queue if pt is not NULL.
+ *
+ * If fpp is not NULL and *fpp is NULL, *fpp is set to the file referred to by
+ * fd. If *fpp is not NULL -EBADF is returned unless fd still refers to *fpp.
+ *
+ * Returns POLL* event mask or -ve error code.
+ */
+int
+fs_poll(int fd, struct file **fpp, struct poll_table *pt)
+{
+	int ret;
+	struct file *fp;
+	const struct devio *io;
+
+	if ((fp = task_file_interruptible(task_cur(), fd)) > (struct file *)-4096UL)
+		return (int)fp;
+
+	if (fpp && *fpp && *fpp != fp)
+		ret = -EBADF;
+	else if (IFTODT(fp->f_vnode->v_mode) == DT_FIFO)
+		ret = pipe_poll(fp, pt);
+	else if ((io = anon_io(fp->f_vnode)))
+		ret = io->poll ? io->poll(fp, pt) : POLLNVAL;
+	else if (fp->f_vnode->v_mount)
+		ret = VOP_POLL(fp, pt);
+	else
+		ret = POLLNVAL;
+
+	if (fpp && ret >= 0)
+		*fpp = fp;
+
+	vn_unlock(fp->f_vnode);
+	return ret;
+}
+
 /*
  * fsync
  */
@@ -1609,6 +2238,11 @@ fsync(int fd)
 		return DERR(-EBADF);
 	}
 
+	if (!fp->f_vnode->v_mount) {
+		vn_unlock(fp->f_vnode);
+		return DERR(-EINVAL);
+	}
+
 	err = VOP_FSYNC(fp);
 
 	vn_unlock(fp->f_vnode);
@@ -1723,7 +2357,8 @@ mkdirat(int dirfd, const char *path, mode_t mode)
 	mode &= ~S_IFMT;
 	mode |= S_IFDIR;
 
-	err = VOP_MKNOD(vp, node, node_len, 0, mode);
+	if (!(err = VOP_MKNOD(vp, node, node_len, 0, mode)))
+		vn_invalidate(vp, node, node_len);
 
 out:
 	vput(vp);
@@ -2026,7 +2661,8 @@ unlinkat(int dirfd, const char *path, int flags)
 	vn_lock(dvp);
 	vn_lock(vp);
 
-	if (vp->v_refcnt > 1) {
+	/* references held by unused children don't count */
+	if (vp->v_refcnt - vp->v_cached > 1) {
 		vput(vp);
 		vput(dvp);
 		return DERR(-EBUSY);
@@ -2034,8 +2670,10 @@ unlinkat(int dirfd, const char *path, int flags)
 
 	if ((err = VOP_UNLINK(dvp, vp)))
 		vput(vp);
-	else
+	else {
+		vn_purge(vp);
 		vgone(vp);
+	}
 
 	vput(dvp);
 	return err;
@@ -2117,6 +2755,12 @@ fcntl(int fd, int cmd, ...)
 	case F_SETFL:
 		fp->f_flags = arg;
 		break;
+	case F_GETPIPE_SZ:
+		ret = pipe_get_size(fp);
+		break;
+	case F_SETPIPE_SZ:
+		ret = pipe_set_size(fp, arg);
+		break;
 	default:
 		ret = DERR(-ENOSYS);
 		break;
@@ -2276,6 +2920,98 @@ pipe(int fd[2])
 	return pipe2(fd, 0);
 }
 
+/*
+ * anon_open - open an anonymous file
+ *
+ * Anonymous files have no name and do not belong to a filesystem. File
+ * operations are passed to io and data is stored in the file's f_data.
+ *
+ * On failure the caller retains ownership of data.
+ *
+ * Returns file descriptor or -ve error code.
+ */
+int
+anon_open(const struct devio *io, void *data, int flags)
+{
+	struct task *t = task_cur();
+	struct file *fp;
+	struct vnode *vp;
+	int r, fd;
+
+	if ((flags & (O_CLOEXEC | O_NONBLOCK)) != flags)
+		return DERR(-EINVAL);
+
+	if ((r = task_lock_interruptible(t)))
+		return r;
+
+	/* reserve fd */
+	if ((fd = task_newfd(t, 0)) < 0) {
+		task_unlock(t);
+		return DERR(-EMFILE);
+	}
+	t->file[fd] = FP_RESERVED;
+
+	task_unlock(t);
+
+	/* create vnode */
+	if (!(vp = vget_anon(io))) {
+		r = DERR(-ENOMEM);
+		goto out0;
+	}
+
+	/* create file structure */
+	if (!(fp = malloc(sizeof(struct file)))) {
+		r = DERR(-ENOMEM);
+		goto out1;
+	}
+
+	*fp = (struct file){
+		.f_flags = O_RDWR | (flags & ~O_CLOEXEC),
+		.f_count = 1,
+		.f_data = data,
+		.f_vnode = vp,
+	};
+	vn_unlock(vp);
+
+	const uintptr_t cloexec = flags & O_CLOEXEC ? FF_CLOEXEC : 0;
+	task_lock(t);
+	t->file[fd] = (uintptr_t)fp | cloexec;
+	task_unlock(t);
+	return fd;
+
+out1:
+	vput(vp);
+out0:
+	task_lock(t);
+	t->file[fd] = 0;
+	task_unlock(t);
+	return r;
+}
+
+/*
+ * anon_fget - get referenced anonymous file from file descriptor
+ *
+ * Fails with -EINVAL if fd does not refer to an anonymous file using io.
+ * Returned file must be released with fs_fput.
+ *
+ * Returns -ve error code on failure, valid file pointer otherwise.
+ */
+struct file *
+anon_fget(int fd, const struct devio *io)
+{
+	struct file *fp;
+
+	if ((fp = fs_fget(fd)) > (struct file *)-4096UL)
+		return fp;
+
+	if (anon_io(fp->f_vnode) != io) {
+		fs_fput(fp);
+		return (struct file *)DERR(-EINVAL);
+	}
+
+	return fp;
+}
+
 /*
  * symlink
  */
@@ -2313,6 +3049,7 @@ symlinkat(const char *target, int dirfd, const char *path)
 	/* create node for link */
 	if ((err = VOP_MKNOD(dvp, node, node_len, 0, S_IFLNK)))
 		goto out;
+	vn_invalidate(dvp, node, node_len);
 
 	/* open link for writing */
 	f.f_flags = 1;
@@ -2475,7 +3212,8 @@ renameat(int fromdirfd, const char *from, int todirfd, const char *to)
 
 	/* this file system doesn't have a proper inode abstraction
 	   so this is broken but necessary */
-	if (fvp->v_refcnt > 1 || (tvp && tvp->v_refcnt > 1)) {
+	if (fvp->v_refcnt - fvp->v_cached > 1 ||
+	    (tvp && tvp->v_refcnt - tvp->v_cached > 1)) {
 		err = DERR(-EBUSY);
 		goto out;
 	}
@@ -2486,7 +3224,17 @@ renameat(int fromdirfd, const char *from, int todirfd, const char *to)
 		goto out;
 	}
 
-	err = VOP_RENAME(fdvp, fvp, tdvp, tvp, node, node_len);
+	if ((err = VOP_RENAME(fdvp, fvp, tdvp, tvp, node, node_len)))
+		goto out;
+
+	/* forget lookups of old names */
+	vn_hide(fvp);
+	vn_purge(fvp);
+	if (tvp) {
+		vn_hide(tvp);
+		vn_purge(tvp);
+	} else
+		vn_invalidate(tdvp, node, node_len);
 
 out:
 	vput(fvp);
@@ -31,11 +31,21 @@
 #define vfs_h
 
 #include <stddef.h>
+#include <sys/types.h>
 
+struct devio;
+struct file;
 struct mount;
+struct poll_table;
 struct task;
 struct vnode;
 
+/*
+ * Splice callback, passed a buffer of 'len' bytes. Returns the number of
+ * bytes consumed or produced, or a negative error.
+ */
+typedef ssize_t (*splice_fn)(void *, void *, size_t);
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -46,6 +56,12 @@ int	 lookup_t_dir(struct task *, int, const char *, struct vnode **,
 		      const char **, size_t *, int);
 int	 lookup_t_noexist(struct task *, int, const char *, struct vnode **,
 			  const char **, size_t *, int);
+int	 fs_poll(int, struct file **, struct poll_table *);
+struct file *fs_fget(int);
+void	 fs_fput(struct file *);
+int	 anon_open(const struct devio *, void *, int);
+struct file *anon_fget(int, const struct devio *);
+void	 epoll_release(struct file *);
 
 void	 vnode_init(void);
 void	 mount_init(void);
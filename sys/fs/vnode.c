@@ -35,6 +35,7 @@
 
 #include "debug.h"
 #include "mount.h"
+#include "pcache.h"
 #include "pipe.h"
 #include "vfs.h"
 #include <assert.h>
@@ -42,6 +43,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <jhash3.h>
+#include <kmem.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
@@ -61,13 +64,33 @@
  * vref       +1	*		 *
  */
 
-#define VNODE_BUCKETS 128		/* size of vnode hash table */
+#define VNODE_BUCKETS 32		/* initial size of vnode hash table */
+#define VNODE_UNUSED_MAX 64		/* maximum number of unused vnodes */
 
 /*
  * vnode table.
- * All active (opened) vnodes are stored on this hash table.
+ * All active (opened) and unused vnodes are stored on this hash table. The
+ * table doubles in size when it holds more than two vnodes per bucket.
  */
-static struct list vnode_table[VNODE_BUCKETS];
+static struct list *vnode_table;
+static size_t vnode_buckets;
+static size_t vnode_count;
+
+/*
+ * Unused vnodes, most recently used first.
+ *
+ * A vnode is unused when its reference count reaches 0. It stays on the
+ * hash table so that a later lookup can find it without asking the file
+ * system, and keeps its reference on its parent which is counted in the
+ * parent's v_cached. Negative vnodes record names which do not exist.
+ */
+static struct list vnode_unused = LIST_INIT(vnode_unused);
+static size_t vnode_unused_count;
+
+/*
+ * Cache for vnode allocation.
+ */
+static struct kmem_cache *vnode_cache;
 
 /*
  * Global lock to access vnode table.
@@ -81,11 +104,138 @@ static struct mutex vnode_mutex;
 /*
  * vn_hash - Get the hash value for a vnode from its parent and name.
  */
-static unsigned
+static uint32_t
 vn_hash(struct vnode *parent, const char *name, size_t len)
 {
-	return jhash_2words(jhash(name, len, 0), (uint32_t)parent) &
-	    (VNODE_BUCKETS - 1);
+	return jhash_2words(jhash(name, len, 0), (uint32_t)parent);
+}
+
+/*
+ * vn_bucket - Get the hash bucket for a vnode from its parent and name.
+ *
+ * Must be called with vnode_mutex held.
+ */
+static struct list *
+vn_bucket(struct vnode *parent, const char *name, size_t len)
+{
+	return &vnode_table[vn_hash(parent, name, len) & (vnode_buckets - 1)];
+}
+
+/*
+ * vn_grow - Double the size of the vnode table.
+ *
+ * The current table is kept if memory is short.
+ */
+static void
+vn_grow(void)
+{
+	struct list *table;
+	struct vnode *vp, *tmp;
+	const size_t buckets = vnode_buckets * 2;
+
+	if (!(table = malloc(buckets * sizeof(*table))))
+		return;
+	for (size_t i = 0; i < buckets; i++)
+		list_init(&table[i]);
+	for (size_t i = 0; i < vnode_buckets; i++) {
+		list_for_each_entry_safe(vp, tmp, &vnode_table[i], v_link) {
+			const uint32_t h = vn_hash(vp->v_parent, vp->v_name,
+			    strlen(vp->v_name));
+			list_insert(&table[h & (buckets - 1)], &vp->v_link);
+		}
+	}
+	free(vnode_table);
+	vnode_table = table;
+	vnode_buckets = buckets;
+}
+
+/*
+ * vn_unhash - Remove an unused vnode from the vnode table.
+ *
+ * Must be called with vnode_mutex held.
+ */
+static void
+vn_unhash(struct vnode *vp)
+{
+	assert(vp->v_refcnt == 0);
+
+	list_remove(&vp->v_link);
+	--vnode_count;
+	list_remove(&vp->v_lru);
+	--vnode_unused_count;
+	--vp->v_parent->v_cached;
+}
+
+/*
+ * vn_unused - Handle a vnode whose reference count has reached 0.
+ *
+ * Named vnodes are moved to the unused list, other vnodes are removed from
+ * the vnode table. Returns a vnode to free or NULL.
+ *
+ * Must be called with vnode_mutex held.
+ */
+static struct vnode *
+vn_unused(struct vnode *vp)
+{
+	struct vnode *evict;
+
+	assert(vp->v_refcnt == 0);
+
+	/* root and hidden vnodes can't be found by vn_lookup */
+	if (!vp->v_mount || !vp->v_parent ||
+	    (vp->v_flags & (VROOT | VHIDDEN))) {
+		/* unnamed vnodes (pipes) are not in hash table */
+		if (vp->v_name) {
+			list_remove(&vp->v_link);
+			--vnode_count;
+		}
+		return vp;
+	}
+
+	list_insert(&vnode_unused, &vp->v_lru);
+	++vp->v_parent->v_cached;
+	if (++vnode_unused_count <= VNODE_UNUSED_MAX)
+		return NULL;
+	evict = list_entry(list_last(&vnode_unused), struct vnode, v_lru);
+	vn_unhash(evict);
+	return evict;
+}
+
+/*
+ * vn_free - Release a vnode which is no longer on the vnode table.
+ *
+ * The parent reference is dropped without locking the parent as the caller
+ * may hold unrelated vnode locks.
+ */
+static void
+vn_free(struct vnode *vp)
+{
+	struct vnode *pvp;
+
+	while (vp) {
+		pvp = vp->v_parent;
+
+		/* wait for vput to drop the lock */
+		mutex_lock(&vp->v_lock);
+		/* deallocate fs specific vnode data */
+		if (vp->v_mount) {
+			pcache_purge(vp);
+			VOP_INACTIVE(vp);
+			vfs_unbusy(vp->v_mount);
+		}
+		mutex_unlock(&vp->v_lock);
+		assert(mutex_owner(&vp->v_lock) == NULL);
+		free(vp->v_name);
+		kmem_cache_free(vnode_cache, vp);
+
+		if (!pvp)
+			break;
+
+		/* release parent */
+		mutex_lock(&vnode_mutex);
+		vp = --pvp->v_refcnt ? NULL : vn_unused(pvp);
+		mutex_unlock(&vnode_mutex);
+	}
 }
 
 /*
@@ -132,17 +282,20 @@ vn_lookup(struct vnode *parent, const char *name, size_t len)
 
 	vdbgvn("vn_lookup: parent=%p name=%s len=%zu\n", parent, name, len);
 
-	head = &vnode_table[vn_hash(parent, name, len)];
-
 	mutex_lock(&vnode_mutex);
+	head = vn_bucket(parent, name, len);
 	for (n = list_first(head); n != head; n = list_next(n)) {
 		vp = list_entry(n, struct vnode, v_link);
 		if (vp->v_parent == parent &&
 		    !strncmp(vp->v_name, name, len) &&
 		    !vp->v_name[len] &&
-		    vp->v_refcnt > 0 &&
 		    !(vp->v_flags & VHIDDEN)) {
-			vp->v_refcnt++;
+			if (vp->v_refcnt++ == 0) {
+				/* take vnode off unused list */
+				list_remove(&vp->v_lru);
+				--vnode_unused_count;
+				--parent->v_cached;
+			}
 			mutex_unlock(&vnode_mutex);
 			vn_lock(vp);
 			return vp;
@@ -206,17 +359,16 @@ vget(struct mount *mount, struct vnode *parent, const char *name, size_t len)
 {
 	char *v_name;
 	int err;
-	struct list *head;
 	struct vnode *vp;
 
 	assert(len < PATH_MAX);
 
 	vdbgvn("vget: parent=%p name=%s len=%zu\n", parent, name, len);
 
-	if (!(vp = malloc(sizeof(struct vnode))))
+	if (!(vp = kmem_cache_alloc(vnode_cache)))
 		return NULL;
 	if (!(v_name = malloc(len + 1))) {
-		free(vp);
+		kmem_cache_free(vnode_cache, vp);
 		return NULL;
 	}
 
@@ -230,20 +382,21 @@ vget(struct mount *mount, struct vnode *parent, const char *name, size_t len)
 	};
 
 	mutex_init(&vp->v_lock);
+	list_init(&vp->v_pages);
 
 	/* allocate fs specific data for vnode  */
 	if ((err = VFS_VGET(vp)) != 0) {
 		free(vp->v_name);
-		free(vp);
+		kmem_cache_free(vnode_cache, vp);
 		return NULL;
 	}
 	vfs_busy(vp->v_mount);
 	vn_lock(vp);
 
-	head = &vnode_table[vn_hash(parent, name, len)];
-
 	mutex_lock(&vnode_mutex);
-	list_insert(head, &vp->v_link);
+	list_insert(vn_bucket(parent, name, len), &vp->v_link);
+	if (++vnode_count > vnode_buckets * 2)
+		vn_grow();
 	mutex_unlock(&vnode_mutex);
 
 	/* reference parent */
@@ -263,7 +416,7 @@ vget_pipe(void)
 {
 	struct vnode *vp;
 
-	if (!(vp = malloc(sizeof(struct vnode))))
+	if (!(vp = kmem_cache_alloc(vnode_cache)))
 		return NULL;
 
 	*vp = (struct vnode) {
@@ -278,14 +431,44 @@ vget_pipe(void)
 	return vp;
 }
 
+/*
+ * Allocate an anonymous vnode.
+ *
+ * Anonymous vnodes have no name or filesystem, v_data holds the devio used
+ * for file operations.
+ */
+struct vnode *
+vget_anon(const struct devio *io)
+{
+	struct vnode *vp;
+
+	if (!(vp = kmem_cache_alloc(vnode_cache)))
+		return NULL;
+
+	*vp = (struct vnode) {
+		.v_refcnt = 1,
+		.v_data = (void *)io,
+	};
+
+	mutex_init(&vp->v_lock);
+
+	vn_lock(vp);
+
+	return vp;
+}
+
 /*
  * Unlock vnode and decrement its reference count.
  *
- * Releases vnode if reference count reaches 0.
+ * When the reference count reaches 0 a named vnode is moved to the unused
+ * list, evicting the least recently used vnode if the list is full. Other
+ * vnodes are released.
  */
 void
 vput(struct vnode *vp)
 {
+	struct vnode *release;
+
 	vdbgvn("vput: vp=%p v_refcnt=%u v_name=%s\n",
 	    vp, vp->v_refcnt, vp->v_name);
 
@@ -293,8 +476,6 @@ vput(struct vnode *vp)
 	assert(vp->v_refcnt > 0);
 	assert(mutex_owner(&vp->v_lock) == thread_cur());
 
-	struct vnode *pvp = vp->v_parent;
-
 	mutex_lock(&vnode_mutex);
 	--vp->v_refcnt;
 	if (vp->v_refcnt > 0) {
@@ -302,26 +483,11 @@ vput(struct vnode *vp)
 		vn_unlock(vp);
 		return;
 	}
-	/* unnamed vnodes (pipes) are not in hash table */
-	if (vp->v_name)
-		list_remove(&vp->v_link);
+	release = vn_unused(vp);
 	mutex_unlock(&vnode_mutex);
-
-	/* deallocate fs specific vnode data */
-	if (vp->v_mount) {
-		VOP_INACTIVE(vp);
-		vfs_unbusy(vp->v_mount);
-	}
 	mutex_unlock(&vp->v_lock);
-	assert(mutex_owner(&vp->v_lock) == NULL);
-	free(vp->v_name);
-	free(vp);
 
-	/* release parent */
-	if (pvp) {
-		vn_lock(pvp);
-		vput(pvp);
-	}
+	vn_free(release);
 }
 
 /*
@@ -347,6 +513,7 @@ void
 vgone(struct vnode *vp)
 {
 	assert(vp->v_refcnt == 1);
+	assert(vp->v_cached == 0);
 	assert(mutex_owner(&vp->v_lock) == thread_cur());
 
 	vdbgvn("vgone: vp=%p v_refcnt=%u v_name=%s\n",
@@ -361,13 +528,111 @@ vgone(struct vnode *vp)
 
 	mutex_lock(&vnode_mutex);
 	list_remove(&vp->v_link);
+	--vnode_count;
 	mutex_unlock(&vnode_mutex);
 
+	pcache_purge(vp);
 	vfs_unbusy(vp->v_mount);
 	mutex_unlock(&vp->v_lock);
 	assert(mutex_owner(&vp->v_lock) == NULL);
 	free(vp->v_name);
-	free(vp);
+	kmem_cache_free(vnode_cache, vp);
+}
+
+/*
+ * vn_invalidate - forget that a name does not exist.
+ *
+ * Called with dvp locked after a name has been created in directory dvp.
+ * vnode_mutex protects the flags of negative vnodes.
+ */
+void
+vn_invalidate(struct vnode *dvp, const char *name, size_t len)
+{
+	struct vnode *vp, *evict = NULL;
+
+	assert(mutex_owner(&dvp->v_lock) == thread_cur());
+
+	mutex_lock(&vnode_mutex);
+	list_for_each_entry(vp, vn_bucket(dvp, name, len), v_link) {
+		if (vp->v_parent != dvp ||
+		    strncmp(vp->v_name, name, len) ||
+		    vp->v_name[len] ||
+		    (vp->v_flags & (VHIDDEN | VNEGATIVE)) != VNEGATIVE)
+			continue;
+		/* a referenced vnode is released by its last vput */
+		if (vp->v_refcnt == 0) {
+			vn_unhash(vp);
+			evict = vp;
+		} else
+			vp->v_flags |= VHIDDEN;
+		break;
+	}
+	mutex_unlock(&vnode_mutex);
+
+	if (evict)
+		vn_free(evict);
+}
+
+/*
+ * vn_below - check if vp is below directory dvp.
+ */
+static bool
+vn_below(const struct vnode *vp, const struct vnode *dvp)
+{
+	while ((vp = vp->v_parent))
+		if (vp == dvp)
+			return true;
+	return false;
+}
+
+/*
+ * vn_evict - release unused vnodes on mount point mp or below dvp.
+ */
+static void
+vn_evict(const struct mount *mp, const struct vnode *dvp)
+{
+	struct list l;
+	struct vnode *vp, *tmp;
+	bool found;
+
+	/* releasing a vnode can leave its parent unused */
+	do {
+		list_init(&l);
+		mutex_lock(&vnode_mutex);
+		list_for_each_entry_safe(vp, tmp, &vnode_unused, v_lru) {
+			if (mp ? vp->v_mount != mp : !vn_below(vp, dvp))
+				continue;
+			vn_unhash(vp);
+			list_insert(&l, &vp->v_lru);
+		}
+		mutex_unlock(&vnode_mutex);
+
+		found = !list_empty(&l);
+		list_for_each_entry_safe(vp, tmp, &l, v_lru)
+			vn_free(vp);
+	} while (found);
+}
+
+/*
+ * vn_purge - release unused vnodes below directory dvp.
+ *
+ * Called with dvp locked when dvp is removed or renamed.
+ */
+void
+vn_purge(struct vnode *dvp)
+{
+	assert(mutex_owner(&dvp->v_lock) == thread_cur());
+
+	vn_evict(NULL, dvp);
+}
+
+/*
+ * vn_flush - release all unused vnodes on mount point mp.
+ */
+void
+vn_flush(struct mount *mp)
+{
+	vn_evict(mp, NULL);
 }
 
 /*
@@ -393,7 +658,7 @@ vnode_type(mode_t mode)
 void
 vnode_dump(void)
 {
-	int i;
+	size_t i;
 	struct list *head, *n;
 	struct vnode *vp;
 
@@ -403,7 +668,7 @@ vnode_dump(void)
 	info(" vnode      parent     mount      type refcnt blkno    data       name\n");
 	info(" ---------- ---------- ---------- ---- ------ -------- ---------- ----------\n");
 
-	for (i = 0; i < VNODE_BUCKETS; i++) {
+	for (i = 0; i < vnode_buckets; i++) {
 		head = &vnode_table[i];
 		for (n = list_first(head); n != head; n = list_next(n)) {
 			vp = list_entry(n, struct vnode, v_link);
@@ -428,10 +693,25 @@ vop_einval(void)
 	return -EINVAL;
 }
 
+/*
+ * vop_pollready - file never blocks on read or write
+ */
+int
+vop_pollready(void)
+{
+	return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+}
+
 void
 vnode_init(void)
 {
+	if (!(vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode),
+	    MA_NORMAL)))
+		panic("vnode_init");
 	mutex_init(&vnode_mutex);
+	if (!(vnode_table = malloc(VNODE_BUCKETS * sizeof(*vnode_table))))
+		panic("vnode_init");
+	vnode_buckets = VNODE_BUCKETS;
 	for (size_t i = 0; i < VNODE_BUCKETS; i++)
 		list_init(&vnode_table[i]);
 }
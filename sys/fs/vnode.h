@@ -33,9 +33,11 @@
 #include <list.h>
 #include <sync.h>
 
+struct devio;
 struct dirent;
 struct file;
 struct iovec;
+struct poll_table;
 struct stat;
 
 /*
@@ -44,9 +46,11 @@ struct stat;
  */
 struct vnode {
 	struct list	 v_link;	/* link for hash map */
+	struct list	 v_lru;		/* link for unused list */
 	struct mount	*v_mount;	/* mounted vfs pointer */
 	struct vnode	*v_parent;	/* pointer to parent vnode */
 	unsigned	 v_refcnt;	/* reference count */
+	unsigned	 v_cached;	/* references held by unused children */
 	short		 v_flags;	/* vnode flag */
 	mode_t		 v_mode;	/* file mode */
 	off_t		 v_size;	/* file size */
@@ -55,11 +59,13 @@ struct vnode {
 	char		*v_name;	/* name of node */
 	void		*v_data;	/* private data for fs */
 	void		*v_pipe;	/* pipe data */
+	struct list	 v_pages;	/* page cache extents */
 };
 
 /* flags for vnode */
 #define VROOT		0x0001		/* root of its file system */
 #define VHIDDEN		0x0002		/* vnode hidden */
+#define VNEGATIVE	0x0004		/* name does not exist */
 
 /*
  * Vnode attribute
@@ -85,6 +91,7 @@ typedef	ssize_t (*vnop_read_fn)	(struct file *, const struct iovec *, size_t, of
 typedef	ssize_t (*vnop_write_fn)(struct file *, const struct iovec *, size_t, off_t);
 typedef	int (*vnop_seek_fn)	(struct file *, off_t, int);
 typedef	int (*vnop_ioctl_fn)	(struct file *, u_long, void *);
+typedef	int (*vnop_poll_fn)	(struct file *, struct poll_table *);
 typedef	int (*vnop_fsync_fn)	(struct file *);
 typedef	int (*vnop_readdir_fn)	(struct file *, struct dirent *, size_t);
 typedef	int (*vnop_lookup_fn)	(struct vnode *, const char *, size_t, struct vnode *);
@@ -95,6 +102,7 @@ typedef	int (*vnop_getattr_fn)	(struct vnode *, struct vattr *);
 typedef	int (*vnop_setattr_fn)	(struct vnode *, struct vattr *);
 typedef	int (*vnop_inactive_fn)	(struct vnode *);
 typedef	int (*vnop_truncate_fn)	(struct vnode *);
+typedef	int (*vnop_xip_fn)	(struct vnode *, off_t, size_t, void **);
 
 struct vnops {
 	vnop_open_fn	    vop_open;
@@ -103,6 +111,7 @@ struct vnops {
 	vnop_write_fn	    vop_write;
 	vnop_seek_fn	    vop_seek;
 	vnop_ioctl_fn	    vop_ioctl;
+	vnop_poll_fn	    vop_poll;
 	vnop_fsync_fn	    vop_fsync;
 	vnop_readdir_fn	    vop_readdir;
 	vnop_lookup_fn	    vop_lookup;
@@ -113,6 +122,7 @@ struct vnops {
 	vnop_setattr_fn	    vop_setattr;
 	vnop_inactive_fn    vop_inactive;
 	vnop_truncate_fn    vop_truncate;
+	vnop_xip_fn	    vop_xip;
 };
 
 /*
@@ -124,6 +134,7 @@ struct vnops {
 #define VOP_WRITE(FP, I, C, O)	    ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_write)(FP, I, C, O)
 #define VOP_SEEK(FP, OFF, WHENCE)   ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_seek)(FP, OFF, WHENCE)
 #define VOP_IOCTL(FP, C, A)	    ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_ioctl)(FP, C, A)
+#define VOP_POLL(FP, PT)	    ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_poll)(FP, PT)
 #define VOP_FSYNC(FP)		    ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_fsync)(FP)
 #define VOP_READDIR(FP, B, L)	    ((FP)->f_vnode->v_mount->m_op->vfs_vnops->vop_readdir)(FP, B, L)
 #define VOP_LOOKUP(DVP, N, L, VP)   ((DVP)->v_mount->m_op->vfs_vnops->vop_lookup)(DVP, N, L, VP)
@@ -134,6 +145,7 @@ struct vnops {
 #define VOP_SETATTR(VP, VAP)	    ((VP)->v_mount->m_op->vfs_vnops->vop_setattr)(VP, VAP)
 #define VOP_INACTIVE(VP)	    ((VP)->v_mount->m_op->vfs_vnops->vop_inactive)(VP)
 #define VOP_TRUNCATE(VP)	    ((VP)->v_mount->m_op->vfs_vnops->vop_truncate)(VP)
+#define VOP_XIP(VP, OFF, L, A)	    ((VP)->v_mount->m_op->vfs_vnops->vop_xip)(VP, OFF, L, A)
 
 #if defined(__cplusplus)
 extern "C" {
@@ -144,12 +156,14 @@ extern "C" {
  */
 int vop_nullop(void);
 int vop_einval(void);
+int vop_pollready(void);
 
 /*
  * vnode cache interface
  */
 struct vnode	*vget(struct mount *, struct vnode *, const char *, size_t);
 struct vnode	*vget_pipe(void);
+struct vnode	*vget_anon(const struct devio *);
 struct vnode	*vn_lookup(struct vnode *, const char *, size_t);
 int		 vn_lock_interruptible(struct vnode *);
 void		 vn_lock(struct vnode *);
@@ -160,6 +174,9 @@ int		 vn_stat(struct vnode *, struct stat *);
 void		 vput(struct vnode *);
 void		 vref(struct vnode *);
 void		 vgone(struct vnode *);
+void		 vn_invalidate(struct vnode *, const char *, size_t);
+void		 vn_purge(struct vnode *);
+void		 vn_flush(struct mount *);
 
 #if defined(__cplusplus)
 }
@@ -99,6 +99,8 @@ void		machine_poweroff(void);
 void		machine_suspend(void);
 noreturn void	machine_panic(void);
 void		arch_schedule(void);
+bool		arch_cycles_init(void);
+uint32_t	arch_cycles(void);
 void		arch_backtrace(struct thread *);
 bool		arch_check_elfhdr(const Elf32_Ehdr *);
 unsigned	arch_elf_hwcap(void);
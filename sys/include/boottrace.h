@@ -0,0 +1,45 @@
+#ifndef boottrace_h
+#define boottrace_h
+
+#include <conf/config.h>
+
+/*
+ * Boot time tracing
+ *
+ * Each traced step of kernel initialisation records its start and end time.
+ * Steps may nest. The resulting timeline is logged and can be read from
+ * /dev/boottrace once boot has completed.
+ *
+ * Tracing is only compiled in if CONFIG_BOOTTRACE is set.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(CONFIG_BOOTTRACE)
+void	boottrace_init(void);
+int	boottrace_begin(const char *);
+void	boottrace_end(int);
+void	boottrace_done(void);
+#else
+static inline void boottrace_init(void) { }
+static inline int boottrace_begin(const char *name) { return 0; }
+static inline void boottrace_end(int step) { }
+static inline void boottrace_done(void) { }
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*
+ * BOOTTRACE - trace call to initialisation function returning void
+ */
+#define BOOTTRACE(fn, ...) ({ \
+	const int bt_step = boottrace_begin(#fn); \
+	fn(__VA_ARGS__); \
+	boottrace_end(bt_step); \
+})
+
+#endif /* !boottrace_h */
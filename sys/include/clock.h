@@ -1,6 +1,8 @@
 #ifndef clock_h
 #define clock_h
 
+#include <conf/config.h>
+
 /*
  * Generic interface to clock drivers
  */
@@ -10,6 +12,11 @@ extern "C" {
 #endif
 
 unsigned long clock_ns_since_tick(void);
+#if defined(CONFIG_TICKLESS)
+void clock_idle(unsigned);
+void clock_wake(void);
+unsigned clock_ticks(void);
+#endif
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -32,10 +32,12 @@
 
 #include <list.h>
 #include <stdbool.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 
 struct file;
 struct iovec;
+struct poll_table;
 
 /*
  * Device flags
@@ -45,6 +47,12 @@ struct iovec;
 #define DF_RDONLY	0x00000004      /* read only device */
 #define DF_REM		0x00000008      /* removable device */
 
+/*
+ * Device ioctls
+ */
+#define DIOCXIPADDR	_IOR('D', 0, void *)	/* get directly addressable
+						   memory for execute in place */
+
 /*
  * Device I/O table
  */
@@ -55,6 +63,7 @@ struct devio {
 	ssize_t	(*write)(struct file *, const struct iovec *, size_t, off_t);
 	int	(*seek)(struct file *, off_t, int);
 	int	(*ioctl)(struct file *, u_long, void *);
+	int	(*poll)(struct file *, struct poll_table *);
 };
 
 /*
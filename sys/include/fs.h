@@ -1,17 +1,26 @@
 #ifndef fs_h
 #define fs_h
 
+#include <poll.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <types.h>
 
 struct dirent;
+struct epoll_event;
 struct file;
 struct iovec;
+struct itimerspec32;
+struct itimerspec;
 struct stat;
 struct statfs;
 struct statx;
 struct task;
+struct timespec32;
+struct timespec;
+struct timeval32;
 
 #if defined(__cplusplus)
 extern "C" {
@@ -54,8 +63,18 @@ void	      vn_reference(struct vnode *);
 void	      vn_close(struct vnode *);
 ssize_t	      vn_pread(struct vnode *, void *, size_t, off_t);
 ssize_t	      vn_preadv(struct vnode *, const struct iovec *, int, off_t);
+void	     *vn_xip(struct vnode *, off_t, size_t);
 char	     *vn_name(struct vnode *);
 
+/*
+ * Page cache interface for memory management.
+ */
+phys	     *pcache_map(struct vnode *, off_t, size_t);
+bool	      pcache_unmap(struct vnode *, void *, size_t);
+bool	      pcache_owns(struct vnode *, const void *);
+void	      pcache_evict(struct vnode *, const void *, size_t);
+size_t	      pcache_reclaim(size_t);
+
 /*
  * Syscalls
  */
@@ -63,6 +82,14 @@ int	sc_access(const char *, int);
 int	sc_chdir(const char*);
 int	sc_chmod(const char *, mode_t);
 int	sc_chown(const char *, uid_t, gid_t);
+int	sc_epoll_create(int);
+int	sc_epoll_create1(int);
+int	sc_epoll_ctl(int, int, int, struct epoll_event *);
+int	sc_epoll_pwait(int, struct epoll_event *, int, int, const k_sigset_t *,
+		       size_t);
+int	sc_epoll_wait(int, struct epoll_event *, int, int);
+int	sc_eventfd(unsigned);
+int	sc_eventfd2(unsigned, int);
 int	sc_faccessat(int, const char *, int, int);
 int	sc_fchmodat(int, const char *, mode_t, int);
 int	sc_fchownat(int, const char *, uid_t, gid_t, int);
@@ -85,15 +112,32 @@ int	sc_open(const char *, int, int);
 int	sc_openat(int, const char*, int, int);
 int	sc_pipe(int [2]);
 int	sc_pipe2(int [2], int);
+int	sc_poll(struct pollfd *, nfds_t, int);
+int	sc_ppoll(struct pollfd *, nfds_t, const struct timespec *,
+		 const k_sigset_t *, size_t);
+int	sc_ppoll_time32(struct pollfd *, nfds_t, const struct timespec32 *,
+			const k_sigset_t *, size_t);
+int	sc_pselect6(int, fd_set *, fd_set *, fd_set *, const struct timespec *,
+		    const void *);
+int	sc_pselect6_time32(int, fd_set *, fd_set *, fd_set *,
+			   const struct timespec32 *, const void *);
 int	sc_rename(const char*, const char*);
 int	sc_renameat(int, const char*, int, const char*);
 int	sc_rmdir(const char*);
+int	sc_select(int, fd_set *, fd_set *, fd_set *, struct timeval32 *);
 int	sc_stat(const char *, struct stat *);
 int	sc_statfs(const char *, size_t, struct statfs *);
 int	sc_statx(int, const char *, int, unsigned, struct statx *);
 int	sc_symlink(const char*, const char*);
 int	sc_symlinkat(const char*, int, const char*);
 int	sc_sync(void);
+int	sc_timerfd_create(int, int);
+int	sc_timerfd_gettime(int, struct itimerspec *);
+int	sc_timerfd_gettime32(int, struct itimerspec32 *);
+int	sc_timerfd_settime(int, int, const struct itimerspec *,
+			   struct itimerspec *);
+int	sc_timerfd_settime32(int, int, const struct itimerspec32 *,
+			     struct itimerspec32 *);
 int	sc_umount2(const char *, int);
 int	sc_unlink(const char *);
 int	sc_unlinkat(int, const char *, int);
@@ -104,6 +148,9 @@ ssize_t	sc_read(int, void *, size_t);
 ssize_t	sc_readlink(const char *, char *, size_t);
 ssize_t	sc_readlinkat(int, const char *, char *, size_t);
 ssize_t	sc_readv(int, const struct iovec *, int);
+ssize_t	sc_sendfile(int, int, off_t *, size_t);
+ssize_t	sc_splice(int, off_t *, int, off_t *, size_t, unsigned);
+ssize_t	sc_vmsplice(int, const struct iovec *, size_t, unsigned);
 ssize_t	sc_write(int, const void *, size_t);
 ssize_t	sc_writev(int, const struct iovec *, int);
 
@@ -17,27 +17,18 @@ struct task;
 #define FUTEX_CLOCK_REALTIME	0x100
 #define FUTEX_OP_MASK		~(FUTEX_PRIVATE | FUTEX_CLOCK_REALTIME)
 
+#define FUTEX_TID_MASK		0x3fffffff
 #define FUTEX_OWNER_DIED	0x40000000
 #define FUTEX_WAITERS           0x80000000
 
-/*
- * futex state stored on task
- */
-struct futexes {
-	union {
-		char storage[12];
-		unsigned align;
-	};
-};
-
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
 int futex(struct task *, int *, int, int, void *, int *);
 int sc_futex(int *, int, int, void *, int *);
-void futexes_init(struct futexes *);
-void futexes_destroy(struct futexes *);
+void futexes_destroy(struct task *);
+void futex_init(void);
 
 #if defined(__cplusplus)
 }
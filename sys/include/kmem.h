@@ -32,6 +32,7 @@
 
 #include <types.h>
 
+struct kmem_cache;
 struct task;
 
 #if defined(__cplusplus)
@@ -44,6 +45,12 @@ void	kmem_init(void);
 void	kmem_check(void);
 void	kmem_dump(void);
 
+struct kmem_cache *kmem_cache_create(const char *, size_t, long mem_attr);
+void	kmem_cache_destroy(struct kmem_cache *);
+void   *kmem_cache_alloc(struct kmem_cache *);
+void	kmem_cache_free(struct kmem_cache *, void *);
+void	kmem_cache_dump(void);
+
 #if defined(__cplusplus)
 } /* extern "C" */
 #endif
@@ -30,11 +30,12 @@
 #ifndef sch_h
 #define sch_h
 
+#include <event.h>
+#include <list.h>
 #include <queue.h>
 #include <stdbool.h>
 #include <stdint.h>
 
-struct event;
 struct thread;
 
 /*
@@ -47,6 +48,15 @@ struct dpc {
 	void	       *arg;		/* Argument to pass */
 };
 
+/*
+ * Priority inheritance lock state
+ */
+struct pi {
+	struct thread  *owner;		/* owner if lock has waiters */
+	struct list	link;		/* linkage on owner's pi_held list */
+	struct event	event;		/* event for waiters */
+};
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -69,6 +79,7 @@ void	        sch_suspend(struct thread *);
 void	        sch_resume(struct thread *);
 void	        sch_suspend_resume(struct thread *, struct thread *);
 void	        sch_elapse(uint_fast32_t);
+uint32_t	sch_timeleft(void);
 void	        sch_start(struct thread *);
 void	        sch_stop(struct thread *);
 bool		sch_testexit(void);
@@ -79,6 +90,10 @@ int		sch_getprio(struct thread *);
 void		sch_setprio(struct thread *, int, int);
 int		sch_getpolicy(struct thread *);
 int		sch_setpolicy(struct thread *, int);
+void		sch_pi_init(struct pi *, const char *);
+int		sch_pi_prepare_sleep(struct pi *, struct thread *, uint_fast64_t);
+struct thread  *sch_pi_wakeone(struct pi *);
+bool		sch_pi_waiting(const struct pi *);
 void	        sch_dpc(struct dpc *, void (*)(void *), void *);
 void	        sch_dump(void);
 void	        sch_init(void);
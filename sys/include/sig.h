@@ -22,7 +22,9 @@ int	    sig_task(struct task *, int);
 void	    sig_thread(struct thread *, int);
 bool	    sig_unblocked_pending(struct thread *);
 k_sigset_t  sig_block_all(void);
+k_sigset_t  sig_replace(const k_sigset_t *);
 void	    sig_restore(const k_sigset_t *);
+void	    sig_restore_deferred(const k_sigset_t *);
 void	    sig_exec(struct task *);
 void	    sig_wait(void);
 int	    sig_deliver(int);
@@ -54,7 +54,7 @@ struct cond {
 
 struct mutex {
 	union {
-		char storage[28];
+		char storage[40];
 		unsigned align;
 	};
 };
@@ -174,6 +174,12 @@ public:
 		return 0;
 	}
 
+	int
+	wait_for(std::unique_lock<mutex> &m, uint_fast64_t nsec)
+	{
+		return cond_timedwait(&c_, m.mutex()->native_handle(), nsec);
+	}
+
 	int
 	wait_interruptible(std::unique_lock<mutex> &m)
 	{
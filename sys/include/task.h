@@ -49,7 +49,6 @@ struct task {
 	int		suscnt;		    /* suspend counter */
 	unsigned	capability;	    /* security permission flag */
 	struct task    *parent;		    /* parent task */
-	struct futexes	futexes;	    /* futex state for task */
 	struct itimer	itimer_prof;	    /* interval timer ITIMER_PROF */
 	struct itimer	itimer_virtual;	    /* interval timer ITIMER_VIRTUAL */
 	struct timer	itimer_real;	    /* interval timer ITIMER_REAL */
@@ -115,7 +114,6 @@ int	        task_resume(struct task *);
 int	        task_path(struct task *, const char *);
 bool	        task_capable(unsigned);
 bool	        task_access(struct task *);
-struct futexes *task_futexes(struct task *);
 void		task_dump(void);
 void		task_init(void);
 
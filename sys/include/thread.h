@@ -38,6 +38,7 @@
 
 struct as;
 struct mutex;
+struct pi;
 struct task;
 
 /*
@@ -57,9 +58,14 @@ struct thread {
 	uint_fast64_t	time;		/* total running time (nanoseconds) */
 	struct event   *slpevt;		/* sleep event */
 	int		slpret;		/* sleep result code */
+	struct pi      *pi_wait;	/* priority inheritance lock waiting on */
+	struct list	pi_held;	/* contended priority inheritance locks */
+	int		refs;		/* references preventing reaping */
 	struct timer	timeout;	/* thread timer */
 	k_sigset_t	sig_pending;	/* bitmap of pending signals */
 	k_sigset_t	sig_blocked;	/* bitmap of blocked signals */
+	k_sigset_t	sig_saved;	/* mask to restore after signal delivery */
+	bool		sig_restore_saved; /* sig_saved is valid */
 	void           *kstack;		/* base address of kernel stack */
 	int	       *clear_child_tid;/* clear & futex_wake this on exit */
 	struct context	ctx;		/* machine specific context */
@@ -108,6 +114,8 @@ int	        thread_createfor(struct task *, struct as *, struct thread **,
 int	        thread_name(struct thread *, const char *);
 int		thread_id(struct thread *);
 struct thread  *thread_find(int);
+bool		thread_ref(struct thread *);
+void		thread_unref(struct thread *);
 void	        thread_terminate(struct thread *);
 void		thread_zombie(struct thread *);
 noreturn void	thread_idle(void);
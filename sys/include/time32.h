@@ -9,6 +9,16 @@ struct timespec32 {
 	int32_t tv_nsec;
 };
 
+struct timeval32 {
+	int32_t tv_sec;
+	int32_t tv_usec;
+};
+
+struct itimerspec32 {
+	struct timespec32 it_interval;
+	struct timespec32 it_value;
+};
+
 /*
  * kernel itimerval uses native 'long' types except for x32
  */
@@ -40,8 +40,11 @@ struct timespec;
 struct timeval;
 
 struct timer {
-	struct list	link;		/* linkage on timer chain */
-	int		active;		/* true if active */
+	struct timer   *child;		/* first child in timer heap */
+	struct timer   *next;		/* next sibling in timer heap */
+	struct timer   *prev;		/* previous sibling or parent in timer heap */
+	struct list	link;		/* linkage on expired timer list */
+	int		active;		/* TMR_* state, 0 if inactive */
 	uint_fast64_t	expire;		/* expire time (nsec) */
 	uint_fast64_t	interval;	/* time interval (nsec) */
 	void	      (*func)(void *);	/* function to call */
@@ -70,6 +73,7 @@ void	      timer_redirect(struct timer *, void (*)(void *), void *);
 void	      timer_stop(struct timer *);
 uint_fast64_t timer_delay(uint_fast64_t);
 void	      timer_tick(int);
+void	      timer_idle(void);
 uint_fast64_t timer_monotonic(void);
 uint_fast64_t timer_monotonic_coarse(void);
 int	      timer_realtime_set(uint_fast64_t);
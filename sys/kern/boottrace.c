@@ -0,0 +1,257 @@
+/*
+ * boottrace.c - boot time tracing
+ */
+
+/**
+ * General design:
+ *
+ * Each step records the monotonic time and, if the CPU has one, the cycle
+ * counter when it begins and ends. Much of kernel initialisation runs before
+ * the clock driver has been started so monotonic time reads zero for these
+ * steps. Once boot has completed the cycle counter rate is measured against
+ * monotonic time and used to place the early steps on the same timeline.
+ * If there is no cycle counter early steps are reported with unknown time.
+ * The cycle counter is 32 bits wide so this assumes it does not wrap between
+ * the clock starting and boot completing.
+ *
+ * Boot runs on a single thread so no locking is required while tracing.
+ *
+ * The timeline is reported in a machine readable format, one step per line:
+ *
+ *	start_ns duration_ns cycles depth source name
+ *
+ * where 'start_ns' is relative to the first traced step, 'cycles' is the
+ * duration in CPU cycles (0 if unknown), 'depth' is the nesting depth and
+ * 'source' is one of 'clock', 'cycles' or 'none' giving where the times came
+ * from.
+ */
+
+#include <boottrace.h>
+
+#include <arch.h>
+#include <debug.h>
+#include <device.h>
+#include <fs.h>
+#include <fs/util.h>
+#include <kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <timer.h>
+
+#define BOOTTRACE_STEPS	64		/* maximum number of traced steps */
+#define BOOTTRACE_LINE	80		/* maximum length of report line */
+#define BOOTTRACE_SLOW	5		/* steps to list in summary */
+
+/*
+ * Point in time
+ */
+struct stamp {
+	uint_fast64_t	 ns;		/* monotonic time, 0 before clock */
+	uint32_t	 cycles;	/* cycle counter */
+};
+
+/*
+ * Traced step
+ */
+struct step {
+	const char	*name;
+	int		 depth;
+	struct stamp	 begin;
+	struct stamp	 end;
+};
+
+static struct step steps[BOOTTRACE_STEPS];
+static size_t nsteps;
+static int depth;
+static bool have_cycles;
+static char *report;		/* formatted timeline */
+static size_t report_len;
+
+/*
+ * Get current time
+ */
+static struct stamp
+now(void)
+{
+	return (struct stamp){
+		.ns = timer_monotonic(),
+		.cycles = have_cycles ? arch_cycles() : 0,
+	};
+}
+
+/*
+ * Convert stamp to nanoseconds, returns false if unknown
+ *
+ * Stamps taken before the clock started are converted using the cycle
+ * counter rate measured between 'ref' and 'last'.
+ */
+static bool
+stamp_ns(const struct stamp *s, const struct stamp *ref,
+    const struct stamp *last, int64_t *ns)
+{
+	if (s->ns) {
+		*ns = s->ns;
+		return true;
+	}
+	if (!ref)
+		return false;
+	const uint32_t dc = last->cycles - ref->cycles;
+	const int64_t dns = last->ns - ref->ns;
+	if (!dc || dns <= 0)
+		return false;
+	/* early stamps are before ref so this is negative */
+	*ns = ref->ns - (int64_t)(ref->cycles - s->cycles) * dns / dc;
+	return true;
+}
+
+/*
+ * Read formatted timeline
+ */
+static ssize_t
+boottrace_read(struct file *file, void *buf, size_t len, off_t offset)
+{
+	if (offset >= (off_t)report_len)
+		return 0;
+	if (report_len - offset < len)
+		len = report_len - offset;
+	memcpy(buf, report + offset, len);
+	return len;
+}
+
+static ssize_t
+boottrace_read_iov(struct file *file, const struct iovec *iov, size_t count,
+    off_t offset)
+{
+	return for_each_iov(file, iov, count, offset, boottrace_read);
+}
+
+/*
+ * Device I/O table
+ */
+static struct devio io = {
+	.read = boottrace_read_iov,
+};
+
+/*
+ * Start tracing, must be called before any step begins
+ */
+void
+boottrace_init(void)
+{
+	have_cycles = arch_cycles_init();
+}
+
+/*
+ * Begin traced step, returns step number for boottrace_end
+ */
+int
+boottrace_begin(const char *name)
+{
+	const int d = depth++;
+	if (nsteps == BOOTTRACE_STEPS)
+		return -1;
+	struct step *s = &steps[nsteps];
+	s->name = name;
+	s->depth = d;
+	s->begin = now();
+	return nsteps++;
+}
+
+/*
+ * End traced step
+ */
+void
+boottrace_end(int step)
+{
+	--depth;
+	if (step < 0)
+		return;
+	steps[step].end = now();
+}
+
+/*
+ * Finish tracing, log the timeline and create /dev/boottrace
+ */
+void
+boottrace_done(void)
+{
+	const struct stamp last = now();
+	const struct stamp *ref = NULL;
+	int64_t origin = 0;
+	struct {
+		size_t step;
+		int64_t ns;
+	} slow[BOOTTRACE_SLOW] = {};
+
+	if (!nsteps)
+		return;
+
+	/* first stamp taken with clock running calibrates cycle counter */
+	if (have_cycles) {
+		for (size_t i = 0; i < nsteps && !ref; ++i) {
+			if (steps[i].begin.ns)
+				ref = &steps[i].begin;
+			else if (steps[i].end.ns)
+				ref = &steps[i].end;
+		}
+	}
+	if (!stamp_ns(&steps[0].begin, ref, &last, &origin))
+		origin = 0;
+
+	const size_t size = (nsteps + 1) * BOOTTRACE_LINE;
+	if (!(report = malloc(size)))
+		return;
+	report_len = snprintf(report, size,
+	    "# start_ns duration_ns cycles depth source name\n");
+
+	for (size_t i = 0; i < nsteps; ++i) {
+		const struct step *s = &steps[i];
+		const char *source = s->begin.ns ? "clock" : "cycles";
+		int64_t begin, end;
+
+		if (!stamp_ns(&s->begin, ref, &last, &begin)) {
+			source = "none";
+			begin = origin;
+		}
+		if (!stamp_ns(&s->end, ref, &last, &end))
+			end = begin;
+		const int64_t ns = end - begin;
+		const uint32_t cycles = s->end.cycles - s->begin.cycles;
+
+		int n = snprintf(report + report_len, size - report_len,
+		    "%lld %lld %lu %d %s %s\n", (long long)(begin - origin),
+		    (long long)ns, (unsigned long)cycles, s->depth, source,
+		    s->name);
+		if (n < 0)
+			break;
+		syslog_printf(LOG_DEBUG, "boottrace: %s", report + report_len);
+		report_len = MIN(report_len + n, size - 1);
+
+		/* summary lists the slowest steps with no nested steps */
+		if (i + 1 < nsteps && steps[i + 1].depth > s->depth)
+			continue;
+		for (size_t j = 0; j < BOOTTRACE_SLOW; ++j) {
+			if (ns <= slow[j].ns)
+				continue;
+			memmove(&slow[j + 1], &slow[j],
+			    (BOOTTRACE_SLOW - j - 1) * sizeof *slow);
+			slow[j].step = i;
+			slow[j].ns = ns;
+			break;
+		}
+	}
+
+	int64_t total;
+	if (!stamp_ns(&last, ref, &last, &total))
+		total = origin;
+	info("boottrace: %lld us from first step to init\n",
+	    (long long)(total - origin) / 1000);
+	for (size_t j = 0; j < BOOTTRACE_SLOW && slow[j].ns; ++j)
+		info("boottrace:   %6lld us %s\n", (long long)slow[j].ns / 1000,
+		    steps[slow[j].step].name);
+
+	if (!device_create(&io, "boottrace", DF_CHR, NULL))
+		dbg("boottrace: failed to create device\n");
+}
@@ -8,6 +8,7 @@
 #include <debug.h>
 #include <elf.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fs.h>
 #include <kernel.h>
 #include <mmap.h>
@@ -36,6 +37,9 @@ ph_flags_to_prot(const Phdr *ph)
 
 /*
  * elf_load - load an elf file, attempt to execute in place.
+ *
+ * Text executes in place if the file is on directly addressable storage and
+ * the text segment is linked at the address of its file data.
  */
 int
 elf_load(struct as *a, int fd, void (**entry)(void), unsigned auxv[AUX_CNT],
@@ -120,42 +124,76 @@ elf_load(struct as *a, int fd, void (**entry)(void), unsigned auxv[AUX_CNT],
 	const intptr_t data_end = PAGE_ALIGN(data_ph.p_vaddr + data_ph.p_memsz);
 	const size_t data_size = data_end - data_start;
 
+	const bool dyn = eh.e_type == ET_DYN;
+
+	/* text linked at its address in directly addressable storage can
+	 * execute in place, only data needs memory */
+	bool xip = false;
+	struct vnode *vn;
+	if (!dyn && !(text_ph.p_flags & PF_W) && (vn = vn_open(fd, O_RDONLY))) {
+		xip = vn_xip(vn, text_ph.p_offset, text_end - text_start) ==
+		    (void *)text_start;
+		vn_close(vn);
+	}
+
 	/* expect data to be after text */
-	if (data_start < text_end)
+	if (!xip && data_start < text_end)
 		return DERR(-ENOEXEC);
 
-	const bool dyn = eh.e_type == ET_DYN;
 	const size_t image_sz = data_end - text_start;
+	const size_t text_sz = text_end - text_start;
 	int flags = MAP_PRIVATE | (dyn ? 0 : MAP_FIXED);
 	void *base, *text, *data;
+	bool mapped = false;
+
+	/* position independent text can map the file's page cache pages rather
+	 * than a private copy if the memory where its data must go is free */
+	if (dyn && !(text_ph.p_flags & PF_W) && (text = mmapfor(a, NULL,
+	    text_sz, ph_flags_to_prot(&text_ph), MAP_PRIVATE, fd,
+	    text_ph.p_offset, MA_NORMAL)) <= (void*)-4096UL) {
+		data = mmapfor(a, text + data_start - text_start, data_size,
+		    ph_flags_to_prot(&data_ph), MAP_PRIVATE | MAP_FIXED, fd,
+		    PAGE_TRUNC(data_ph.p_offset), MA_NORMAL);
+		if (data <= (void*)-4096UL) {
+			base = text;
+			mapped = true;
+		} else if ((err = munmapfor(a, text, text_sz)) < 0)
+			return err;
+	}
 
-	/* create a mapping covering the program image */
-	if ((base = mmapfor(a, (void *)text_start, image_sz, PROT_NONE,
-	    flags | MAP_ANONYMOUS, -1, 0, MA_NORMAL)) > (void*)-4096UL)
-		return (int)base;
-
-	flags |= MAP_FIXED;
-
-	/* map text */
-	if ((text = mmapfor(a, base, text_end - text_start,
-	    ph_flags_to_prot(&text_ph), flags, fd, text_ph.p_offset,
-	    MA_NORMAL)) > (void*)-4096UL)
-		return (int)text;
-
-	/* offset data if text-to-data offset must be maintained */
-	void *const data_vaddr = data_start + (dyn ? base : 0);
-
-	/* map data */
-	if ((data = mmapfor(a, data_vaddr, data_size,
-	    ph_flags_to_prot(&data_ph), flags, fd, PAGE_TRUNC(data_ph.p_offset),
-	    MA_NORMAL)) > (void*)-4096UL)
-		return (int)data;
+	if (!mapped) {
+		/* create a mapping covering the program image */
+		if (xip)
+			base = (void *)text_start;
+		else if ((base = mmapfor(a, (void *)text_start, image_sz,
+		    PROT_NONE, flags | MAP_ANONYMOUS, -1, 0,
+		    MA_NORMAL)) > (void*)-4096UL)
+			return (int)base;
+
+		flags |= MAP_FIXED;
+
+		/* map text */
+		if ((text = mmapfor(a, base, text_sz,
+		    ph_flags_to_prot(&text_ph), flags, fd, text_ph.p_offset,
+		    MA_NORMAL)) > (void*)-4096UL)
+			return (int)text;
+
+		/* offset data if text-to-data offset must be maintained */
+		void *const data_vaddr = data_start + (dyn ? base : 0);
+
+		/* map data */
+		if ((data = mmapfor(a, data_vaddr, data_size,
+		    ph_flags_to_prot(&data_ph), flags, fd,
+		    PAGE_TRUNC(data_ph.p_offset), MA_NORMAL)) > (void*)-4096UL)
+			return (int)data;
+
+		/* unmap any text-to-data hole */
+		if (!xip && (err = munmapfor(a, (void *)text_end,
+		    data_start - text_end)) < 0)
+			return err;
+	}
 	vm_init_brk(a, dyn ? data + data_size : (void*)data_end);
 
-	/* unmap any text-to-data hole */
-	if ((err = munmapfor(a, (void *)text_end, data_start - text_end)) < 0)
-		return err;
-
 	/* map stack with optional guard page */
 	const size_t stack_size = PAGE_ALIGN(stack_ph.p_memsz);
 #if defined(CONFIG_MMU) || defined(CONFIG_MPU)
@@ -29,6 +29,7 @@
 
 #include <arch.h>
 #include <bootargs.h>
+#include <boottrace.h>
 #include <debug.h>
 #include <dev/null/null.h>
 #include <dev/zero/zero.h>
@@ -36,6 +37,7 @@
 #include <exec.h>
 #include <fcntl.h>
 #include <fs.h>
+#include <futex.h>
 #include <irq.h>
 #include <kmem.h>
 #include <sch.h>
@@ -63,8 +65,10 @@ boot_thread(void *arg);
 void
 kernel_main(phys *archive_addr, long archive_size, long machdep0, long machdep1)
 {
+	boottrace_init();
+
 #if defined(CONFIG_EARLY_CONSOLE)
-	early_console_init();
+	BOOTTRACE(early_console_init);
 #endif
 	info("Apex " VERSION_STRING " for " CONFIG_MACHINE_NAME "\n");
 
@@ -76,29 +80,32 @@ kernel_main(phys *archive_addr, long archive_size, long machdep0, long machdep1)
 	/*
 	 * Do machine dependent initialisation.
 	 */
-	machine_init(&args);
+	BOOTTRACE(machine_init, &args);
 
 	/*
 	 * Initialise memory managers.
 	 */
-	kmem_init();
+	BOOTTRACE(kmem_init);
 
 	/*
 	 * Run c++ global constructors.
 	 */
+	const int ctors = boottrace_begin("constructors");
 	extern void (*__init_array_start[1])(void), (*__init_array_end[1])(void);
 	for (void (**p)(void) = __init_array_start; p != __init_array_end; ++p)
 		(*p)();
+	boottrace_end(ctors);
 
 	/*
 	 * Initialise kernel core.
 	 */
-	irq_init();
-	vm_init();
-	task_init();
-	thread_init();
-	sch_init();
-	timer_init();
+	BOOTTRACE(irq_init);
+	BOOTTRACE(vm_init);
+	BOOTTRACE(task_init);
+	BOOTTRACE(thread_init);
+	BOOTTRACE(sch_init);
+	BOOTTRACE(timer_init);
+	BOOTTRACE(futex_init);
 
 	/*
 	 * Create boot thread then run idle loop.
@@ -158,26 +165,31 @@ static void
 boot_thread(void *arg)
 {
 	struct bootargs *args = arg;
+	int step;
 
 	/*
 	 * Initialise filesystem.
 	 */
-	fs_init();
+	BOOTTRACE(fs_init);
+	step = boottrace_begin("mount /");
 	if (mount(NULL, "/", "ramfs", 0, NULL) < 0)
 		panic("failed to create root file system");
-	fs_kinit();
+	boottrace_end(step);
+	BOOTTRACE(fs_kinit);
+	step = boottrace_begin("mount /dev");
 	if (mkdir("/dev", 0) < 0)
 		panic("failed to create /dev directory");
 	if (mount(NULL, "/dev", "devfs", 0, NULL) < 0)
 		panic("failed to mount /dev");
+	boottrace_end(step);
 
 	/*
 	 * Initialise drivers.
 	 */
-	null_init();
-	zero_init();
-	kmsg_init();
-	machine_driver_init(args);
+	BOOTTRACE(null_init);
+	BOOTTRACE(zero_init);
+	BOOTTRACE(kmsg_init);
+	BOOTTRACE(machine_driver_init, args);
 
 	/*
 	 * Create boot directory.
@@ -188,13 +200,16 @@ boot_thread(void *arg)
 	/*
 	 * Mount /boot file system according to config options.
 	 */
+	step = boottrace_begin("mount /boot");
 	if (mount(CONFIG_BOOTDEV, "/boot", CONFIG_BOOTFS, 0, NULL) < 0)
 		panic("failed to mount /boot");
+	boottrace_end(step);
 
 	/*
 	 * Run init process.
 	 */
-	run_init();
+	BOOTTRACE(run_init);
+	boottrace_done();
 
 	/*
 	 * Terminate boot thread.
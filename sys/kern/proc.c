@@ -205,7 +205,7 @@ again:
 				list_remove(&task->link);
 				sch_unlock();
 				fs_exit(task);
-				futexes_destroy(task_futexes(task));
+				futexes_destroy(task);
 				as_modify_begin(task->as);
 				as_destroy(task->as);
 				task->magic = 0;
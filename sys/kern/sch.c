@@ -76,12 +76,21 @@
  *      If the thread releases CPU by itself, it is put on the
  *      tail of the run queue.
  *
+ * Locks built on struct pi implement priority inheritance. A thread blocked
+ * on such a lock lends its priority to the lock owner, and along the chain of
+ * owners if the owner is itself blocked on a priority inheritance lock.
+ *
  * There are following three types of scheduling policies.
  *
  *  - SCHED_FIFO   First in-first-out
  *  - SCHED_RR     Round robin (SCHED_FIFO + timeslice)
  *  - SCHED_OTHER  Another scheduling (not supported)
  *
+ * The run queue is an array of FIFO queues, one per priority level, and a
+ * two level bitmap of non-empty queues. Finding the highest priority runnable
+ * thread takes two count leading zeros operations, so enqueue, dequeue and
+ * runq_top() run in constant time regardless of the number of threads.
+ *
  * TODO: look at combining resched & locks into single atomic?
  */
 
@@ -112,7 +121,11 @@
 #define DPC_FREE	0x4470463f	/* 'DpF?' */
 #define DPC_PENDING	0x4470503f	/* 'DpP?' */
 
-static struct queue	runq;		/* run queue */
+#define RUNQ_WORDS ((PRI_MIN + 32) / 32)
+
+static struct queue	runq[PRI_MIN + 1];	/* run queue for each priority */
+static uint32_t		runq_map[RUNQ_WORDS];	/* non-empty run queues */
+static uint32_t		runq_summary;		/* non-zero words in runq_map */
 static struct queue	dpcq;		/* DPC queue */
 static struct event	dpc_event;	/* event for DPC */
 
@@ -122,6 +135,33 @@ __attribute__((used)) __fast_data struct thread *active_thread = &idle_thread;
 __fast_bss static int resched;
 __fast_bss static int locks;
 
+/*
+ * Mark run queue for priority as non-empty.
+ */
+static void
+runq_mark(int prio)
+{
+	assert(!interrupt_enabled());
+
+	runq_map[prio / 32] |= 0x80000000 >> (prio % 32);
+	runq_summary |= 0x80000000 >> (prio / 32);
+}
+
+/*
+ * Mark run queue for priority as empty if it has no more threads.
+ */
+static void
+runq_unmark(int prio)
+{
+	assert(!interrupt_enabled());
+
+	if (!queue_empty(&runq[prio]))
+		return;
+	runq_map[prio / 32] &= ~(0x80000000 >> (prio % 32));
+	if (!runq_map[prio / 32])
+		runq_summary &= ~(0x80000000 >> (prio / 32));
+}
+
 /*
  * Return priority of highest-priority runnable thread.
  */
@@ -130,11 +170,11 @@ runq_top(void)
 {
 	assert(!interrupt_enabled());
 
-	if (queue_empty(&runq))
+	if (!runq_summary)
 		return PRI_MIN + 1;
 
-	struct thread *th = queue_entry(queue_first(&runq), struct thread, link);
-	return th->prio;
+	const int w = __builtin_clz(runq_summary);
+	return w * 32 + __builtin_clz(runq_map[w]);
 }
 
 /*
@@ -157,15 +197,8 @@ runq_enqueue(struct thread *th)
 	assert(!interrupt_enabled());
 	assert(thread_runnable(th));
 
-	struct queue *q = queue_first(&runq);
-	while (!queue_end(&runq, q)) {
-		struct thread *qth = queue_entry(q, struct thread, link);
-		if (th->prio < qth->prio)
-			break;
-		q = queue_next(q);
-	}
-
-	queue_insert(queue_prev(q), &th->link);
+	enqueue(&runq[th->prio], &th->link);
+	runq_mark(th->prio);
 
 	/* it is only preemption when resched is not pending */
 	if (th->prio < active_thread->prio && resched == 0)
@@ -181,15 +214,8 @@ runq_insert(struct thread *th)
 {
 	assert(!interrupt_enabled());
 
-	struct queue *q = queue_first(&runq);
-	while (!queue_end(&runq, q)) {
-		struct thread *qth = queue_entry(q, struct thread, link);
-		if (th->prio <= qth->prio)
-			break;
-		q = queue_next(q);
-	}
-
-	queue_insert(queue_prev(q), &th->link);
+	queue_insert(&runq[th->prio], &th->link);
+	runq_mark(th->prio);
 }
 
 /*
@@ -200,11 +226,11 @@ static struct thread *
 runq_dequeue(void)
 {
 	assert(!interrupt_enabled());
+	assert(runq_summary);
 
-	struct thread *th;
-
-	th = queue_entry(queue_first(&runq), struct thread, link);
-	queue_remove(&th->link);
+	const int prio = runq_top();
+	struct thread *th = queue_entry(dequeue(&runq[prio]), struct thread, link);
+	runq_unmark(prio);
 	return th;
 }
 
@@ -217,6 +243,116 @@ runq_remove(struct thread *th)
 	assert(!interrupt_enabled());
 
 	queue_remove(&th->link);
+	runq_unmark(th->prio);
+}
+
+/*
+ * Change current priority of a thread, adjusting its run queue position.
+ */
+static void
+setprio(struct thread *th, int prio)
+{
+	assert(!interrupt_enabled());
+
+	if (th == active_thread) {
+		/*
+		 * If we change the current thread's priority
+		 * it may be preempted.
+		 */
+		th->prio = prio;
+		/* it is only preemption when resched is not pending */
+		if (prio > runq_top() && resched == 0)
+			resched = RESCHED_PREEMPT;
+	} else if (thread_runnable(th)) {
+		/*
+		 * Update the thread priority and adjust
+		 * the run queue position for new priority.
+		 */
+		runq_remove(th);
+		th->prio = prio;
+		runq_enqueue(th);
+	} else
+		th->prio = prio;
+}
+
+/*
+ * Return the highest priority of any thread waiting on a priority
+ * inheritance lock held by th.
+ */
+static int
+pi_inherited(const struct thread *th)
+{
+	assert(!interrupt_enabled());
+
+	int prio = PRI_MIN + 1;
+	struct pi *pi;
+	list_for_each_entry(pi, &th->pi_held, link) {
+		const struct queue *q = queue_first(&pi->event.sleepq);
+		while (!queue_end(&pi->event.sleepq, q)) {
+			const struct thread *w = queue_entry(q, struct thread, link);
+			if (w->prio < prio)
+				prio = w->prio;
+			q = queue_next(q);
+		}
+	}
+	return prio;
+}
+
+/*
+ * Recompute the priority of th and every lock owner it is blocked behind.
+ */
+static void
+pi_update(struct thread *th)
+{
+	assert(!interrupt_enabled());
+
+	while (th) {
+		int prio = pi_inherited(th);
+		if (th->baseprio < prio)
+			prio = th->baseprio;
+		if (prio == th->prio)
+			return;
+		setprio(th, prio);
+		th = th->pi_wait ? th->pi_wait->owner : NULL;
+	}
+}
+
+/*
+ * Set or clear the owner of a priority inheritance lock.
+ */
+static void
+pi_set_owner(struct pi *pi, struct thread *owner)
+{
+	assert(!interrupt_enabled());
+
+	if (pi->owner == owner)
+		return;
+	if (pi->owner)
+		list_remove(&pi->link);
+	pi->owner = owner;
+	if (owner)
+		list_insert(&owner->pi_held, &pi->link);
+}
+
+/*
+ * Thread is no longer blocked on a priority inheritance lock.
+ *
+ * The owner stops inheriting through the lock once the last waiter has gone.
+ * Returns the lock owner which may need its priority recomputed.
+ */
+static struct thread *
+pi_unblock(struct thread *th)
+{
+	assert(!interrupt_enabled());
+
+	struct pi *pi = th->pi_wait;
+	if (!pi)
+		return NULL;
+	th->pi_wait = NULL;
+	struct thread *owner = pi->owner;
+	if (!event_waiting(&pi->event))
+		pi_set_owner(pi, NULL);
+	return owner;
 }
 
 /*
@@ -309,6 +445,9 @@ sch_switch(void)
 		assert(!prev->spinlock_locks);
 		assert(!prev->rwlock_locks);
 #endif
+		while (!list_empty(&prev->pi_held))
+			pi_set_owner(list_entry(list_first(&prev->pi_held),
+			    struct pi, link), NULL);
 		sch_wakeup(&prev->task->thread_event, 0);
 		list_remove(&prev->task_link);
 		thread_zombie(prev);
@@ -358,6 +497,7 @@ sch_wakeup(struct event *evt, int result)
 		th->slpevt = NULL;
 		th->state &= ~TH_SLEEP;
 		timer_stop(&th->timeout);
+		pi_update(pi_unblock(th));
 		if (th != active_thread)
 			runq_enqueue(th);
 		++n;
@@ -402,7 +542,8 @@ sch_wakeone(struct event *evt)
 		top->slpevt = NULL;
 		top->state &= ~TH_SLEEP;
 		timer_stop(&top->timeout);
-		if (th != active_thread)
+		pi_update(pi_unblock(top));
+		if (top != active_thread)
 			runq_enqueue(top);
 	}
 	if (top)
@@ -534,6 +675,7 @@ sch_unsleep(struct thread *th, int result)
 		th->slpevt = NULL;
 		th->state &= ~TH_SLEEP;
 		timer_stop(&th->timeout);
+		pi_update(pi_unblock(th));
 		if (th != active_thread) {
 			runq_enqueue(th);
 			schedule();
@@ -653,9 +795,11 @@ sch_elapse(uint_fast32_t nsec)
 		if (active_thread->timeleft <= 0) {
 			/*
 			 * The quantum is up.
-			 * Give the thread another.
+			 * Give the thread another. We may be more than one
+			 * quantum late if ticks were skipped while idle.
 			 */
-			active_thread->timeleft += QUANTUM;
+			active_thread->timeleft = QUANTUM +
+			    active_thread->timeleft % QUANTUM;
 
 			/*
 			 * If there are other threads of equal or higher
@@ -670,6 +814,21 @@ sch_elapse(uint_fast32_t nsec)
 	irq_restore(s);
 }
 
+/*
+ * sch_timeleft - nanoseconds until the active thread's quantum expires.
+ *
+ * Returns UINT32_MAX if the active thread is not round robin scheduled.
+ */
+uint32_t
+sch_timeleft(void)
+{
+	assert(!interrupt_enabled());
+
+	if (active_thread->policy != SCHED_RR)
+		return UINT32_MAX;
+	return active_thread->timeleft > 0 ? active_thread->timeleft : 0;
+}
+
 /*
  * Set up stuff for thread scheduling.
  */
@@ -681,6 +840,7 @@ sch_start(struct thread *th)
 	th->prio = PRI_DEFAULT;
 	th->baseprio = PRI_DEFAULT;
 	th->timeleft = QUANTUM;
+	list_init(&th->pi_held);
 }
 
 /*
@@ -783,35 +943,96 @@ sch_getprio(struct thread *th)
  *
  * The rescheduling flag is set if the priority is
  * higher (less than) than the currently running thread.
+ *
+ * A thread never drops below the priority inherited from
+ * waiters on priority inheritance locks it holds.
  */
 void
 sch_setprio(struct thread *th, int baseprio, int prio)
 {
 	int s = irq_disable();
 	th->baseprio = baseprio;
-	if (th == active_thread) {
-		/*
-		 * If we change the current thread's priority
-		 * it may be preempted.
-		 */
-		th->prio = prio;
-		/* it is only preemption when resched is not pending */
-		if (prio > runq_top() && resched == 0)
-			resched = RESCHED_PREEMPT;
-	} else {
-		if (thread_runnable(th)) {
-			/*
-			 * Update the thread priority and adjust
-			 * the run queue position for new priority.
-			 */
-			runq_remove(th);
-			th->prio = prio;
-			runq_enqueue(th);
-		} else
-			th->prio = prio;
+	const int inherited = pi_inherited(th);
+	setprio(th, inherited < prio ? inherited : prio);
+	if (th->pi_wait)
+		pi_update(th->pi_wait->owner);
+	schedule();
+	irq_restore(s);
+}
+
+/*
+ * sch_pi_init - initialise priority inheritance lock state.
+ */
+void
+sch_pi_init(struct pi *pi, const char *name)
+{
+	pi->owner = NULL;
+	event_init(&pi->event, name, ev_LOCK);
+}
+
+/*
+ * sch_pi_prepare_sleep - prepare to sleep on a priority inheritance lock
+ *
+ * The lock owner, and any owners it is blocked behind, inherit the priority
+ * of the active thread while it waits.
+ *
+ * On success, must be followed by sch_continue_sleep or sch_cancel_sleep.
+ */
+int
+sch_pi_prepare_sleep(struct pi *pi, struct thread *owner, uint_fast64_t nsec)
+{
+	assert(owner);
+	assert(owner != active_thread);
+
+	const int s = irq_disable();
+	int err;
+	/* owner exited, its held locks have already been released */
+	if (owner->state & TH_ZOMBIE) {
+		irq_restore(s);
+		return -ESRCH;
+	}
+	if ((err = sch_prepare_sleep(&pi->event, nsec)) < 0) {
+		irq_restore(s);
+		return err;
+	}
+	pi_set_owner(pi, owner);
+	active_thread->pi_wait = pi;
+	pi_update(owner);
+	irq_restore(s);
+	return 0;
+}
+
+/*
+ * sch_pi_wakeone - hand a priority inheritance lock to the highest
+ * priority waiter.
+ *
+ * The previous owner drops any priority it inherited through this lock.
+ * Returns the new owner or NULL if there are no waiters.
+ */
+struct thread *
+sch_pi_wakeone(struct pi *pi)
+{
+	const int s = irq_disable();
+	struct thread *prev = pi->owner;
+	pi_set_owner(pi, NULL);
+	struct thread *th = sch_wakeone(&pi->event);
+	if (th && event_waiting(&pi->event)) {
+		pi_set_owner(pi, th);
+		pi_update(th);
 	}
+	pi_update(prev);
 	schedule();
 	irq_restore(s);
+	return th;
+}
+
+/*
+ * sch_pi_waiting - check if any thread is waiting on lock
+ */
+bool
+sch_pi_waiting(const struct pi *pi)
+{
+	return event_waiting(&pi->event);
 }
 
 int
@@ -921,11 +1142,13 @@ sch_dump(void)
 	info("==============\n");
 	info(" thread      th         pri\n");
 	info(" ----------- ---------- ---\n");
-	struct queue *q = queue_first(&runq);
-	while (!queue_end(&runq, q)) {
-		struct thread *th = queue_entry(q, struct thread, link);
-		info(" %11s %p %3d\n", th->name, th, th->prio);
-		q = queue_next(q);
+	for (int prio = 0; prio <= PRI_MIN; ++prio) {
+		struct queue *q = queue_first(&runq[prio]);
+		while (!queue_end(&runq[prio], q)) {
+			struct thread *th = queue_entry(q, struct thread, link);
+			info(" %11s %p %3d\n", th->name, th, th->prio);
+			q = queue_next(q);
+		}
 	}
 }
 
@@ -937,7 +1160,8 @@ sch_init(void)
 {
 	struct thread *th;
 
-	queue_init(&runq);
+	for (int prio = 0; prio <= PRI_MIN; ++prio)
+		queue_init(&runq[prio]);
 	queue_init(&dpcq);
 	event_init(&dpc_event, "dpc", ev_SLEEP);
 
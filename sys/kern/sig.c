@@ -371,6 +371,22 @@ sig_block_all()
 	return old;
 }
 
+/*
+ * sig_replace - replace signal mask for thread, return old signal mask
+ */
+k_sigset_t
+sig_replace(const k_sigset_t *mask)
+{
+	sch_lock();
+	const k_sigset_t old = thread_cur()->sig_blocked;
+	thread_cur()->sig_blocked = *mask;
+	/* SIGSTOP and SIGKILL cannot be blocked */
+	ksigdelset(&thread_cur()->sig_blocked, SIGSTOP);
+	ksigdelset(&thread_cur()->sig_blocked, SIGKILL);
+	sch_unlock();
+	return old;
+}
+
 /*
  * sig_restore - restore signal mask
  */
@@ -389,6 +405,29 @@ sig_restore(const k_sigset_t *old)
 	sch_unlock();
 }
 
+/*
+ * sig_restore_deferred - restore signal mask after signal delivery
+ *
+ * If a signal which is unblocked by the current mask is pending it is
+ * delivered first and the old mask is restored when the handler returns.
+ * Used by syscalls which replace the signal mask while they wait.
+ */
+void
+sig_restore_deferred(const k_sigset_t *old)
+{
+	struct thread *th = thread_cur();
+	sch_lock();
+	if (sig_unblocked_pending(th)) {
+		th->sig_saved = *old;
+		th->sig_restore_saved = true;
+	} else {
+		th->sig_blocked = *old;
+		if (sig_unblocked_pending(th))
+			sch_signal(th);
+	}
+	sch_unlock();
+}
+
 /*
  * Adjust signal handlers after exec call
  */
@@ -493,12 +532,17 @@ sig_deliver_slowpath(k_sigset_t pending, int rval)
 			};
 		}
 
-		/* setup context to run signal handler */
-		if (!context_set_signal(&th->ctx, &th->sig_blocked, handler,
+		/*
+		 * Setup context to run signal handler. If the mask was
+		 * replaced by a syscall sigreturn restores the saved mask.
+		 */
+		if (!context_set_signal(&th->ctx, th->sig_restore_saved ?
+		    &th->sig_saved : &th->sig_blocked, handler,
 		    sig_restorer(task, sig), sig, info ? &si : 0, rval)) {
 			dbg("Signal setup failed. Terminate.\n");
 			goto fatal;
 		}
+		th->sig_restore_saved = false;
 
 		/* adjust blocked signal mask */
 		ksigorset(&th->sig_blocked, &th->sig_blocked, sig_mask(task, sig));
@@ -567,6 +611,13 @@ fatal:
 	}
 
 out:
+	/* no handler ran, restore mask saved by sig_restore_deferred */
+	if (th->sig_restore_saved) {
+		th->sig_blocked = th->sig_saved;
+		th->sig_restore_saved = false;
+		if (sig_unblocked_pending(th))
+			sch_signal(th);
+	}
 	sch_unlock();
 	return rval;
 }
@@ -580,7 +631,7 @@ sig_deliver(int rval)
 	/*
 	 * Any pending signals?
 	 */
-	if (!ksigisemptyset(&pending))
+	if (!ksigisemptyset(&pending) || th->sig_restore_saved)
 		rval = sig_deliver_slowpath(pending, rval);
 
 	/*
@@ -3,6 +3,7 @@
 #include <clone.h>
 #include <debug.h>
 #include <exec.h>
+#include <fcntl.h>
 #include <fs.h>
 #include <futex.h>
 #include <mmap.h>
@@ -50,6 +51,7 @@
  */
 __fast_rodata const void *const
 syscall_table[SYSCALL_TABLE_SIZE] = {
+	[SYS__newselect] = sc_select,
 	[SYS_access] = sc_access,
 	[SYS_brk] = sc_brk,
 	[SYS_chdir] = sc_chdir,
@@ -64,6 +66,13 @@ syscall_table[SYSCALL_TABLE_SIZE] = {
 	[SYS_close] = close,
 	[SYS_dup2] = dup2,
 	[SYS_dup] = dup,
+	[SYS_epoll_create1] = sc_epoll_create1,
+	[SYS_epoll_create] = sc_epoll_create,
+	[SYS_epoll_ctl] = sc_epoll_ctl,
+	[SYS_epoll_pwait] = sc_epoll_pwait,
+	[SYS_epoll_wait] = sc_epoll_wait,
+	[SYS_eventfd2] = sc_eventfd2,
+	[SYS_eventfd] = sc_eventfd,
 	[SYS_execve] = sc_execve,
 	[SYS_exit] = sc_exit,
 	[SYS_exit_group] = sc_exit_group,
@@ -107,9 +116,14 @@ syscall_table[SYSCALL_TABLE_SIZE] = {
 	[SYS_openat] = sc_openat,
 	[SYS_pipe2] = sc_pipe2,
 	[SYS_pipe] = sc_pipe,
+	[SYS_poll] = sc_poll,
+	[SYS_ppoll] = sc_ppoll_time32,
+	[SYS_ppoll_time64] = sc_ppoll,
 	[SYS_prctl] = prctl,
 	[SYS_pread64] = sc_pread,
 	[SYS_preadv] = sc_preadv,
+	[SYS_pselect6] = sc_pselect6_time32,
+	[SYS_pselect6_time64] = sc_pselect6,
 	[SYS_pwrite64] = sc_pwrite,
 	[SYS_pwritev] = sc_pwritev,
 	[SYS_read] = sc_read,
@@ -134,6 +148,7 @@ syscall_table[SYSCALL_TABLE_SIZE] = {
 	[SYS_setpgid] = setpgid,
 	[SYS_setsid] = setsid,
 	[SYS_sigreturn] = sc_sigreturn,
+	[SYS_splice] = sc_splice,
 	[SYS_stat64] = sc_stat,
 	[SYS_statfs64] = sc_statfs,
 	[SYS_statx] = sc_statx,			    /* stub */
@@ -141,7 +156,13 @@ syscall_table[SYSCALL_TABLE_SIZE] = {
 	[SYS_symlinkat] = sc_symlinkat,
 	[SYS_sync] = sc_sync,
 	[SYS_syslog] = sc_syslog,
+	[SYS_tee] = tee,
 	[SYS_tgkill] = sc_tgkill,
+	[SYS_timerfd_create] = sc_timerfd_create,
+	[SYS_timerfd_gettime64] = sc_timerfd_gettime,
+	[SYS_timerfd_gettime] = sc_timerfd_gettime32,
+	[SYS_timerfd_settime64] = sc_timerfd_settime,
+	[SYS_timerfd_settime] = sc_timerfd_settime32,
 	[SYS_tkill] = sc_tkill,
 	[SYS_umask] = umask,
 	[SYS_umount2] = sc_umount2,
@@ -150,12 +171,15 @@ syscall_table[SYSCALL_TABLE_SIZE] = {
 	[SYS_unlinkat] = sc_unlinkat,
 	[SYS_utimensat] = sc_utimensat,		    /* no time support in FS */
 	[SYS_vfork] = sc_vfork,
+	[SYS_vmsplice] = sc_vmsplice,
 	[SYS_wait4] = sc_wait4,
 	[SYS_write] = sc_write,
 	[SYS_writev] = sc_writev,
 #if UINTPTR_MAX == 0xffffffff
 	[SYS__llseek] = sc_llseek,
+	[SYS_sendfile64] = sc_sendfile,
 #else
 	[SYS_lseek] = lseek,
+	[SYS_sendfile] = sc_sendfile,
 #endif
 };
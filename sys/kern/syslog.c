@@ -11,8 +11,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fs/file.h>
+#include <fs/poll.h>
 #include <fs/util.h>
 #include <kernel.h>
+#include <poll.h>
 #include <stdalign.h>
 #include <stdarg.h>
 #include <stdatomic.h>
@@ -54,6 +56,7 @@ static struct ent *tail = (struct ent *)log;
 static struct ent *clear_ent = (struct ent *)log;
 
 static struct event log_wait;
+static struct pollq log_pollq;
 static struct spinlock lock;	/* REVISIT: may need init for SMP */
 static struct kmsg_output {
 	long seq;
@@ -224,8 +227,10 @@ syslog_end(struct ent *entry, long seq, int priority)
 	if (fn)
 		fn();
 
-	if (log_wait.sleepq.next) /* event initialised */
+	if (log_wait.sleepq.next) { /* event initialised */
 		sch_wakeup(&log_wait, 0);
+		pollq_notify(&log_pollq);
+	}
 }
 
 /*
@@ -522,6 +527,21 @@ kmsg_read(struct file *file, void *buf, size_t len, off_t offset)
 	return kmsg_format(buf, len, kmsg);
 }
 
+static int
+kmsg_poll(struct file *file, struct poll_table *pt)
+{
+	struct kmsg_output *kmsg = file->f_data;
+	if (!kmsg)
+		return -EBADF;
+
+	poll_wait(&log_pollq, pt);
+
+	int events = POLLOUT | POLLWRNORM;
+	if ((log_last_seq - kmsg->seq) >= 0) /* seq can rollover */
+		events |= POLLIN | POLLRDNORM;
+	return events;
+}
+
 static ssize_t
 kmsg_read_iov(struct file *file, const struct iovec *iov, size_t count,
     off_t offset)
@@ -633,6 +653,7 @@ static struct devio kmsg_io = {
 	.read = kmsg_read_iov,
 	.write = kmsg_write_iov,
 	.seek = kmsg_seek,
+	.poll = kmsg_poll,
 };
 
 /*
@@ -641,6 +662,7 @@ static struct devio kmsg_io = {
 void
 kmsg_init(void)
 {
+	pollq_init(&log_pollq);
 	event_init(&log_wait, "kmsg_wait", ev_IO);
 
 	/* Create device object */
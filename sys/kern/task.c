@@ -202,7 +202,6 @@ task_create(struct task *parent, int vm_option, struct task **child)
 	task->capability = parent->capability;
 	task->parent = parent;
 	list_init(&task->threads);
-	futexes_init(&task->futexes);
 	task->pgid = parent->pgid;
 	task->sid = parent->sid;
 	task->state = PS_RUN;
@@ -392,12 +391,6 @@ task_access(struct task *task)
 	    task_capable(CAP_TASK);
 }
 
-struct futexes *
-task_futexes(struct task *t)
-{
-	return &t->futexes;
-}
-
 void
 task_dump(void)
 {
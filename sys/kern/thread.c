@@ -68,6 +68,7 @@
 __fast_bss struct thread idle_thread;
 __fast_data static struct list zombie_list = LIST_INIT(zombie_list);
 static struct spinlock zombie_lock;
+static struct kmem_cache *thread_cache;
 
 /*
  * Allocate a new thread and attach a kernel stack to it.
@@ -79,11 +80,11 @@ thread_alloc(long mem_attr)
 	struct thread *th;
 	phys *stack;
 
-	if ((th = kmem_alloc(sizeof(*th), MA_FAST)) == NULL)
+	if ((th = kmem_cache_alloc(thread_cache)) == NULL)
 		return NULL;
 
 	if ((stack = page_alloc(CONFIG_KSTACK_SIZE, mem_attr, th)) == NULL) {
-		kmem_free(th);
+		kmem_cache_free(thread_cache, th);
 		return NULL;
 	}
 	memset(th, 0, sizeof(*th));
@@ -107,7 +108,7 @@ thread_free(struct thread *th)
 	th->magic = 0;
 	context_free(&th->ctx);
 	page_free(virt_to_phys(th->kstack), CONFIG_KSTACK_SIZE, th);
-	kmem_free(th);
+	kmem_cache_free(thread_cache, th);
 }
 
 /*
@@ -117,14 +118,20 @@ static void
 thread_reap_zombies()
 {
 	int s = spinlock_lock_irq_disable(&zombie_lock);
-	while (!list_empty(&zombie_list)) {
-		struct thread *th = list_entry(list_first(&zombie_list),
-			struct thread, task_link);
+	struct list *n = list_first(&zombie_list);
+	while (!list_end(&zombie_list, n)) {
+		struct thread *th = list_entry(n, struct thread, task_link);
+		/* referenced zombies are freed once released */
+		if (th->refs) {
+			n = list_next(n);
+			continue;
+		}
 		list_remove(&th->task_link);
 		spinlock_unlock_irq_restore(&zombie_lock, s);
 		assert(th->state & TH_ZOMBIE);
 		thread_free(th);
 		s = spinlock_lock_irq_disable(&zombie_lock);
+		n = list_first(&zombie_list);
 	}
 	spinlock_unlock_irq_restore(&zombie_lock, s);
 }
@@ -262,6 +269,35 @@ thread_find(int id)
 	return th;
 }
 
+/*
+ * Take a reference to a thread
+ *
+ * A referenced thread is not freed if it exits. Returns false if the thread
+ * is invalid or has already exited.
+ */
+bool
+thread_ref(struct thread *th)
+{
+	const int s = spinlock_lock_irq_disable(&zombie_lock);
+	const bool ok = thread_valid(th) && !(th->state & TH_ZOMBIE);
+	if (ok)
+		++th->refs;
+	spinlock_unlock_irq_restore(&zombie_lock, s);
+	return ok;
+}
+
+/*
+ * Release a reference taken by thread_ref
+ */
+void
+thread_unref(struct thread *th)
+{
+	const int s = spinlock_lock_irq_disable(&zombie_lock);
+	assert(th->refs > 0);
+	--th->refs;
+	spinlock_unlock_irq_restore(&zombie_lock, s);
+}
+
 /*
  * Idle thread.
  *
@@ -275,7 +311,11 @@ noreturn void
 thread_idle(void)
 {
 	for (;;) {
+#if defined(CONFIG_TICKLESS)
+		timer_idle();
+#else
 		machine_idle();
+#endif
 		sch_yield();
 	}
 }
@@ -405,6 +445,7 @@ thread_init(void)
 	idle_thread.policy = SCHED_FIFO;
 	idle_thread.prio = PRI_IDLE;
 	idle_thread.baseprio = PRI_IDLE;
+	list_init(&idle_thread.pi_held);
 	strcpy(idle_thread.name, "idle");
 	context_init_idle(&idle_thread.ctx, __stack_start + (int)__stack_size);
 	list_insert(&kern_task.threads, &idle_thread.task_link);
@@ -419,4 +460,7 @@ thread_init(void)
 #endif
 	thread_check();
 	spinlock_init(&zombie_lock);
+	if (!(thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+	    MA_FAST)))
+		panic("thread_init");
 }
@@ -30,6 +30,11 @@
 /*
  * timer.c - kernel timer services.
  *
+ * Active timers are kept in a pairing heap ordered by expiry time. Insert is
+ * O(1), finding the next timer to expire is O(1) and removing a timer is
+ * O(log n) amortised, so the time spent with interrupts disabled no longer
+ * grows linearly with the number of outstanding timeouts.
+ *
  * TODO:
  * - monotonic should not be volatile
  * - realtime_offset should not be volatile
@@ -50,6 +55,7 @@
 #include <sig.h>
 #include <stdlib.h>	    /* remove when lldiv is no longer required */
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/time.h>
 #include <task.h>
 #include <thread.h>
@@ -60,9 +66,15 @@ static volatile uint_fast64_t realtime_offset;	    /* monotonic + realtime_offse
 
 static struct event	timer_event;	/* event to wakeup a timer thread */
 static struct event	delay_event;	/* event for the thread delay */
-static struct list	timer_list;	/* list of active timers */
+static struct timer    *timer_heap;	/* heap of active timers */
 static struct list	expire_list;	/* list of expired timers */
 
+/*
+ * Timer states
+ */
+#define TMR_QUEUED	1	/* timer is in timer_heap */
+#define TMR_EXPIRED	2	/* timer is on expire_list */
+
 /*
  * Get remaining nanoseconds to the expiration time.
  * Return 0 if time already passed.
@@ -77,27 +89,118 @@ time_remain(uint_fast64_t expire)
 }
 
 /*
- * Insert a timer element into the timer list in the proper place.
+ * Merge two timer heaps, returning the root of the merged heap.
+ */
+static struct timer *
+heap_meld(struct timer *a, struct timer *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (b->expire < a->expire) {
+		struct timer *t = a;
+		a = b;
+		b = t;
+	}
+
+	/* make b the first child of a */
+	b->prev = a;
+	b->next = a->child;
+	if (a->child)
+		a->child->prev = b;
+	a->child = b;
+	return a;
+}
+
+/*
+ * Merge a list of sibling heaps into a single heap.
+ *
+ * This is the standard two pass pairing: siblings are melded in pairs from
+ * left to right, then the resulting heaps are melded from right to left.
+ * Done iteratively as kernel stacks are small.
+ */
+static struct timer *
+heap_merge_pairs(struct timer *first)
+{
+	struct timer *pairs = NULL;
+
+	/* first pass: meld pairs, building a reversed list of results */
+	while (first) {
+		struct timer *a = first, *b = first->next;
+		first = b ? b->next : NULL;
+		a->next = a->prev = NULL;
+		if (b)
+			b->next = b->prev = NULL;
+		a = heap_meld(a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+
+	/* second pass: meld results from right to left */
+	struct timer *root = NULL;
+	while (pairs) {
+		struct timer *a = pairs;
+		pairs = pairs->next;
+		a->next = NULL;
+		root = heap_meld(root, a);
+	}
+	return root;
+}
+
+/*
+ * Insert a timer element into the timer heap.
  * Requires interrupts to be disabled by the caller.
  */
 static void
 timer_insert(struct timer *tmr)
 {
-	struct list *head, *n;
-	struct timer *t;
+	tmr->child = tmr->next = tmr->prev = NULL;
+	tmr->active = TMR_QUEUED;
+	timer_heap = heap_meld(timer_heap, tmr);
+}
 
-	/*
-	 * We sort the timer list by time. So, we can
-	 * quickly get the next expiration time from
-	 * the head element of the timer list.
-	 */
-	head = &timer_list;
-	for (n = list_first(head); n != head; n = list_next(n)) {
-		t = list_entry(n, struct timer, link);
-		if (tmr->expire < t->expire)
-			break;
+/*
+ * Remove a timer element from the timer heap.
+ * Requires interrupts to be disabled by the caller.
+ */
+static void
+timer_remove(struct timer *tmr)
+{
+	assert(tmr->active == TMR_QUEUED);
+
+	if (tmr == timer_heap) {
+		timer_heap = heap_merge_pairs(tmr->child);
+		return;
+	}
+
+	/* unlink from parent or previous sibling */
+	if (tmr->prev->child == tmr)
+		tmr->prev->child = tmr->next;
+	else
+		tmr->prev->next = tmr->next;
+	if (tmr->next)
+		tmr->next->prev = tmr->prev;
+
+	/* children go back into the heap */
+	timer_heap = heap_meld(timer_heap, heap_merge_pairs(tmr->child));
+}
+
+/*
+ * Remove an active timer from the timer heap or the expired timer list.
+ * Requires interrupts to be disabled by the caller.
+ */
+static void
+timer_dequeue(struct timer *tmr)
+{
+	switch (tmr->active) {
+	case TMR_QUEUED:
+		timer_remove(tmr);
+		break;
+	case TMR_EXPIRED:
+		list_remove(&tmr->link);
+		break;
 	}
-	list_insert(list_prev(n), &tmr->link);
 }
 
 /*
@@ -191,11 +294,9 @@ timer_callout(struct timer *tmr, uint_fast64_t nsec, uint_fast64_t interval,
 	const uint_fast64_t period = 1000000000 / CONFIG_HZ;
 
 	const int s = irq_disable();
-	if (tmr->active)
-		list_remove(&tmr->link);
+	timer_dequeue(tmr);
 	tmr->func = func;
 	tmr->arg = arg;
-	tmr->active = 1;
 	tmr->interval = interval;
 	/*
 	 * Guarantee that we will call out after at least nsec.
@@ -228,10 +329,8 @@ timer_stop(struct timer *tmr)
 	assert(tmr);
 
 	const int s = irq_disable();
-	if (tmr->active) {
-		list_remove(&tmr->link);
-		tmr->active = 0;
-	}
+	timer_dequeue(tmr);
+	tmr->active = 0;
 	irq_restore(s);
 }
 
@@ -341,7 +440,7 @@ timer_tick(int ticks)
 	/*
 	 * Convert elapsed time to nanoseconds
 	 */
-	const uint_fast32_t ns = ticks * 1000000000 / CONFIG_HZ;
+	const uint_fast32_t ns = ticks * (1000000000 / CONFIG_HZ);
 
 	/*
 	 * Bump time.
@@ -351,18 +450,18 @@ timer_tick(int ticks)
 	/*
 	 * Handle all of the timer elements that have expired.
 	 */
-	while (!list_empty(&timer_list)) {
+	while ((tmr = timer_heap)) {
 		/*
 		 * Check timer expiration.
 		 */
-		tmr = list_entry(list_first(&timer_list), struct timer, link);
 		if (monotonic < tmr->expire)
 			break;
 		/*
-		 * Move expired timers from timer list to expire list.
+		 * Move expired timers from timer heap to expire list.
 		 */
-		list_remove(&tmr->link);
-		list_insert(&expire_list, &tmr->link);
+		timer_remove(tmr);
+		list_insert(list_last(&expire_list), &tmr->link);
+		tmr->active = TMR_EXPIRED;
 		wakeup = 1;
 	}
 	if (wakeup)
@@ -378,6 +477,35 @@ timer_tick(int ticks)
 	sch_elapse(ns);
 }
 
+#if defined(CONFIG_TICKLESS)
+/*
+ * Idle until the next timer expiry or quantum expiry.
+ *
+ * Called from the idle thread. The periodic tick is stopped until the next
+ * event and time catches up when the clock wakes on any interrupt. Idle time
+ * is limited to one second so that the elapsed nanoseconds passed to
+ * timer_tick() can not overflow.
+ */
+void
+timer_idle(void)
+{
+	const uint32_t period = 1000000000 / CONFIG_HZ;
+	uint32_t ns = 1000000000;
+
+	interrupt_disable();
+
+	if (timer_heap)
+		ns = MIN(ns, time_remain(timer_heap->expire));
+	ns = MIN(ns, sch_timeleft());
+
+	clock_idle((ns + period - 1) / period);
+	machine_idle();
+	clock_wake();
+
+	interrupt_enable();
+}
+#endif
+
 /*
  * Return monotonic time
  */
@@ -438,7 +566,6 @@ timer_init(void)
 {
 	struct thread *th;
 
-	list_init(&timer_list);
 	list_init(&expire_list);
 	event_init(&timer_event, "timer", ev_SLEEP);
 	event_init(&delay_event, "delay", ev_SLEEP);
@@ -43,8 +43,11 @@
  *  2) All blocks divided in the same page are linked.
  *  3) All free blocks of the same size are linked.
  *
- * Currently, it can not handle the memory size exceeding one page.
- * Instead, a driver can use page_alloc() to allocate larger memory.
+ * Blocks which do not fit in one page are allocated directly from
+ * the page allocator with a small header in front of the block.
+ *
+ * Frequently allocated fixed size objects should use an object cache
+ * (see kmem_cache.c) instead.
  *
  * The kmem functions are used by not only the kernel core but
  * also by the buggy drivers. If such kernel code illegally
@@ -101,6 +104,19 @@ struct page_hdr {
 	struct block_hdr    first_blk;	/* first block in this page */
 };
 
+/*
+ * Large block header
+ *
+ * Blocks larger than MAX_ALLOC_SIZE are allocated from the page
+ * allocator. The header ends with a block header so that the magic
+ * number is found at the same offset from the block as for small
+ * blocks.
+ */
+struct large_hdr {
+	size_t		    size;	/* size of pages allocated */
+	struct block_hdr    blk;	/* block header, only magic is used */
+};
+
 #define ALIGN_SIZE	16
 #define ALIGN_MASK	(ALIGN_SIZE - 1)
 #define ALLOC_ALIGN(n)	(((uintptr_t)(n) + ALIGN_MASK) & (uintptr_t)~ALIGN_MASK)
@@ -108,13 +124,16 @@ struct page_hdr {
 #define ALLOC_MAGIC	0xcafe		/* alloc magic offset by memory type */
 #define FREE_MAGIC	0xdead
 #define PAGE_MAGIC	0xabcdbeef	/* page magic offset by memory type */
+#define LARGE_MAGIC	0xb10c		/* large magic offset by memory type */
 
 #define ALLOC_MAGIC_OK(x) ((x)->magic >= ALLOC_MAGIC && (x)->magic < ALLOC_MAGIC + MEM_ALLOC)
 #define FREE_MAGIC_OK(x) ((x)->magic == FREE_MAGIC)
 #define PAGE_MAGIC_OK(x) ((x)->magic >= PAGE_MAGIC && (x)->magic < PAGE_MAGIC + MEM_ALLOC)
+#define LARGE_MAGIC_OK(x) ((x)->magic >= LARGE_MAGIC && (x)->magic < LARGE_MAGIC + MEM_ALLOC)
 
 #define BLKHDR_SIZE	(sizeof(struct block_hdr))
 #define PGHDR_SIZE	(sizeof(struct page_hdr))
+#define LGHDR_SIZE	ALLOC_ALIGN(sizeof(struct large_hdr))
 #define MAX_ALLOC_SIZE	(size_t)(PAGE_SIZE - PGHDR_SIZE)
 
 #define MIN_BLOCK_SIZE	(BLKHDR_SIZE + 16)
@@ -124,6 +143,10 @@ struct page_hdr {
 #define PAGE_TOP(n)	(struct page_hdr *) \
 			    ((uintptr_t)(n) & (uintptr_t)~(PAGE_SIZE - 1))
 
+/* macro to point the large block header from block address */
+#define LARGE_HDR(p)	(struct large_hdr *) \
+			    ((char *)(p) - sizeof(struct large_hdr))
+
 /* index of free block list */
 #define BLKIDX(b)	((u_int)((b)->size) >> 4)
 
@@ -203,6 +226,72 @@ block_find(size_t size, unsigned type)
 	return list_entry(n, struct block_hdr, link);
 }
 
+/*
+ * Allocate large memory block from the page allocator
+ *
+ * The block starts LGHDR_SIZE bytes into the first page so that it
+ * has the same alignment as small blocks.
+ */
+static void *
+large_alloc(size_t size, unsigned type)
+{
+	if (size > SIZE_MAX - PAGE_SIZE - LGHDR_SIZE)
+		return NULL;
+	size = PAGE_ALIGN(size + LGHDR_SIZE);
+
+	phys *const pp = page_alloc(size,
+	    type_to_attr(type) | PAF_EXACT_SPEED, &kern_task);
+	if (!pp)
+		return NULL;
+
+	char *p = (char *)phys_to_virt(pp) + LGHDR_SIZE;
+	struct large_hdr *hdr = LARGE_HDR(p);
+	hdr->size = size;
+	hdr->blk.magic = LARGE_MAGIC + type;
+	return p;
+}
+
+/*
+ * Free large memory block
+ */
+static void
+large_free(struct large_hdr *hdr)
+{
+	char *const top = (char *)(hdr + 1) - LGHDR_SIZE;
+
+	hdr->blk.magic = 0;
+	page_free(virt_to_phys(top), hdr->size, &kern_task);
+}
+
+/*
+ * Resize large memory block in place
+ *
+ * Shrinking releases pages from the end of the block. Growing succeeds
+ * only if the pages following the block are free.
+ * Returns true on success.
+ */
+static bool
+large_resize(struct large_hdr *hdr, size_t size)
+{
+	char *const top = (char *)(hdr + 1) - LGHDR_SIZE;
+
+	if (size > SIZE_MAX - PAGE_SIZE - LGHDR_SIZE)
+		return false;
+	size = PAGE_ALIGN(size + LGHDR_SIZE);
+
+	if (size <= hdr->size) {
+		page_free(virt_to_phys(top + size), hdr->size - size,
+		    &kern_task);
+		hdr->size = size;
+		return true;
+	}
+	if (!page_reserve(virt_to_phys(top + hdr->size), size - hdr->size,
+	    0, &kern_task))
+		return false;
+	hdr->size = size;
+	return true;
+}
+
 /*
  * Allocate memory block for kernel
  *
@@ -218,6 +307,10 @@ kmem_alloc_internal(size_t size, unsigned type)
 
 	assert(type < MEM_ALLOC);
 
+	if (size > MAX_ALLOC_SIZE ||
+	    ALLOC_ALIGN(size + BLKHDR_SIZE) > MAX_ALLOC_SIZE)
+		return large_alloc(size, type);
+
 	spinlock_lock(&kmem_lock);
 	kmem_check();
 	/*
@@ -343,18 +436,25 @@ realloc(void *p, size_t size)
 	if (!p)
 		return malloc(size);
 
+	size_t avail;
 	struct block_hdr *blk = (struct block_hdr *)((char *)p - BLKHDR_SIZE);
-	if (!ALLOC_MAGIC_OK(blk))
+	if (LARGE_MAGIC_OK(blk)) {
+		struct large_hdr *hdr = LARGE_HDR(p);
+		if (large_resize(hdr, size))
+			return p;
+		avail = hdr->size - LGHDR_SIZE;
+	} else if (ALLOC_MAGIC_OK(blk)) {
+		avail = blk->size - BLKHDR_SIZE;
+		if (avail >= size)
+			return p;
+	} else
 		panic("realloc: invalid address");
 
-	if (blk->size >= size)
-		return p;
-
 	void *np = malloc(size);
 	if (!np)
 		return NULL;
 
-	memcpy(np, p, MIN(size, blk->size));
+	memcpy(np, p, MIN(size, avail));
 	free(p);
 
 	return np;
@@ -379,11 +479,16 @@ kmem_free(void *ptr)
 	if (!ptr)
 		return;
 
+	/* Get the block header */
+	blk = (struct block_hdr *)((char *)ptr - BLKHDR_SIZE);
+	if (LARGE_MAGIC_OK(blk)) {
+		large_free(LARGE_HDR(ptr));
+		return;
+	}
+
 	spinlock_lock(&kmem_lock);
 	kmem_check();
 
-	/* Get the block header */
-	blk = (struct block_hdr *)((char *)ptr - BLKHDR_SIZE);
 	if (!ALLOC_MAGIC_OK(blk))
 		panic("kmem_free: invalid address");
 
@@ -520,6 +625,8 @@ kmem_dump(void)
 #endif
 	}
 	spinlock_unlock(&kmem_lock);
+
+	kmem_cache_dump();
 }
 
 void
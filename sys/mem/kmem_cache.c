@@ -0,0 +1,296 @@
+/*
+ * kmem_cache.c - object caches for fixed size kernel objects
+ *
+ * Each cache carves single pages (slabs) into equally sized objects. A slab
+ * header at the top of each page records the owning cache and a free list
+ * of objects, so allocation and free are constant time, have no per object
+ * header and only hold the lock of the cache concerned.
+ *
+ * Slabs with free objects are kept on the partial list and full slabs on the
+ * full list. When a slab becomes empty it is returned to the page allocator
+ * unless the cache has no spare slab, in which case it is kept as the spare
+ * to avoid page churn when a single object is repeatedly allocated & freed.
+ *
+ * Objects are handed out uninitialised.
+ */
+
+#include <kmem.h>
+
+#include <assert.h>
+#include <conf/config.h>
+#include <debug.h>
+#include <kernel.h>
+#include <list.h>
+#include <page.h>
+#include <stdlib.h>
+#include <sync.h>
+#include <task.h>
+
+#define SLAB_MAGIC	0x51ab51ab
+
+#define OBJ_ALIGN	8
+#define OBJ_ALIGN_UP(n)	(((n) + OBJ_ALIGN - 1) & ~(size_t)(OBJ_ALIGN - 1))
+
+/*
+ * Slab header, placed at the top of each slab page
+ */
+struct slab {
+	uint32_t	    magic;	/* magic number */
+	unsigned	    inuse;	/* number of allocated objects */
+	struct kmem_cache  *cache;	/* owning cache */
+	struct list	    link;	/* link on partial or full list */
+	void		   *free;	/* first free object */
+	char		   *unused;	/* first never allocated object */
+};
+
+#define SLAB_HDR_SIZE	OBJ_ALIGN_UP(sizeof(struct slab))
+
+/* macro to point to the slab header from an object address */
+#define SLAB_TOP(n)	(struct slab *) \
+			    ((uintptr_t)(n) & (uintptr_t)~(PAGE_SIZE - 1))
+
+/*
+ * Object cache
+ */
+struct kmem_cache {
+	struct spinlock	    lock;
+	struct list	    partial;	/* slabs with free objects */
+	struct list	    full;	/* slabs without free objects */
+	struct slab	   *spare;	/* empty slab kept for reuse */
+	struct list	    link;	/* link on cache list */
+	const char	   *name;	/* cache name for dump */
+	size_t		    size;	/* object size */
+	unsigned	    per_slab;	/* objects per slab */
+	long		    mem_attr;	/* memory attributes for slabs */
+
+	/* statistics */
+	size_t		    inuse;	/* objects allocated */
+	size_t		    peak;	/* peak objects allocated */
+	size_t		    slabs;	/* slabs allocated */
+	unsigned long	    allocs;	/* total allocations */
+	unsigned long	    fails;	/* failed allocations */
+};
+
+static struct list kmem_caches = LIST_INIT(kmem_caches);
+static struct spinlock kmem_caches_lock;
+
+/*
+ * slab_alloc - allocate & initialise a new slab
+ *
+ * Must be called with cache locked.
+ */
+static struct slab *
+slab_alloc(struct kmem_cache *c)
+{
+	struct slab *s;
+
+	if (c->spare) {
+		s = c->spare;
+		c->spare = NULL;
+		return s;
+	}
+
+	phys *const pp = page_alloc_order(0, c->mem_attr, &kern_task);
+	if (!pp)
+		return NULL;
+	s = (struct slab *)phys_to_virt(pp);
+	s->magic = SLAB_MAGIC;
+	s->inuse = 0;
+	s->cache = c;
+	s->free = NULL;
+	s->unused = (char *)s + SLAB_HDR_SIZE;
+	++c->slabs;
+	return s;
+}
+
+/*
+ * slab_release - release an empty slab
+ *
+ * Must be called with cache locked.
+ */
+static void
+slab_release(struct kmem_cache *c, struct slab *s)
+{
+	assert(!s->inuse);
+
+	if (!c->spare) {
+		/* reset free list so objects are carved in address order */
+		s->free = NULL;
+		s->unused = (char *)s + SLAB_HDR_SIZE;
+		c->spare = s;
+		return;
+	}
+	s->magic = 0;
+	--c->slabs;
+	page_free(virt_to_phys(s), PAGE_SIZE, &kern_task);
+}
+
+/*
+ * kmem_cache_create - create a cache of objects of size bytes
+ *
+ * Returns NULL on failure.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, long mem_attr)
+{
+	struct kmem_cache *c;
+
+	size = OBJ_ALIGN_UP(size ?: 1);
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	if (size > PAGE_SIZE - SLAB_HDR_SIZE)
+		return NULL;
+
+	if (!(c = kmem_alloc(sizeof(*c), MA_NORMAL)))
+		return NULL;
+
+	*c = (struct kmem_cache){
+		.name = name,
+		.size = size,
+		.per_slab = (PAGE_SIZE - SLAB_HDR_SIZE) / size,
+		.mem_attr = mem_attr,
+	};
+	spinlock_init(&c->lock);
+	list_init(&c->partial);
+	list_init(&c->full);
+
+	spinlock_lock(&kmem_caches_lock);
+	list_insert(&kmem_caches, &c->link);
+	spinlock_unlock(&kmem_caches_lock);
+
+	return c;
+}
+
+/*
+ * kmem_cache_destroy - destroy an object cache
+ *
+ * All objects must have been freed.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *c)
+{
+	if (!c)
+		return;
+
+	spinlock_lock(&kmem_caches_lock);
+	list_remove(&c->link);
+	spinlock_unlock(&kmem_caches_lock);
+
+	spinlock_lock(&c->lock);
+	if (c->inuse)
+		panic("kmem_cache_destroy: cache in use");
+	assert(list_empty(&c->partial) && list_empty(&c->full));
+	if (c->spare) {
+		c->spare->magic = 0;
+		page_free(virt_to_phys(c->spare), PAGE_SIZE, &kern_task);
+	}
+	spinlock_unlock(&c->lock);
+
+	kmem_free(c);
+}
+
+/*
+ * kmem_cache_alloc - allocate an object from a cache
+ *
+ * Returns NULL on failure.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct slab *s;
+	void *p = NULL;
+
+	spinlock_lock(&c->lock);
+
+	if (list_empty(&c->partial)) {
+		if (!(s = slab_alloc(c))) {
+			++c->fails;
+			dbg("kmem_cache_alloc: %s: out of memory\n", c->name);
+			goto out;
+		}
+		list_insert(&c->partial, &s->link);
+	} else
+		s = list_entry(list_first(&c->partial), struct slab, link);
+
+	if (s->free) {
+		p = s->free;
+		s->free = *(void **)p;
+	} else {
+		p = s->unused;
+		s->unused += c->size;
+	}
+
+	if (++s->inuse == c->per_slab) {
+		list_remove(&s->link);
+		list_insert(&c->full, &s->link);
+	}
+
+	++c->allocs;
+	if (++c->inuse > c->peak)
+		c->peak = c->inuse;
+out:
+	spinlock_unlock(&c->lock);
+	return p;
+}
+
+/*
+ * kmem_cache_free - return an object to its cache
+ */
+void
+kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	if (!p)
+		return;
+
+	struct slab *s = SLAB_TOP(p);
+	if (s->magic != SLAB_MAGIC || s->cache != c)
+		panic("kmem_cache_free: invalid address");
+#ifdef CONFIG_KMEM_CHECK
+	if (((char *)p - ((char *)s + SLAB_HDR_SIZE)) % c->size ||
+	    (char *)p >= s->unused)
+		panic("kmem_cache_free: invalid object");
+#endif
+
+	spinlock_lock(&c->lock);
+
+	assert(s->inuse);
+	*(void **)p = s->free;
+	s->free = p;
+
+	if (s->inuse-- == c->per_slab) {
+		list_remove(&s->link);
+		list_insert(&c->partial, &s->link);
+	}
+	if (!s->inuse) {
+		list_remove(&s->link);
+		slab_release(c, s);
+	}
+
+	--c->inuse;
+
+	spinlock_unlock(&c->lock);
+}
+
+/*
+ * kmem_cache_dump - dump object cache statistics
+ */
+void
+kmem_cache_dump(void)
+{
+	struct kmem_cache *c;
+
+	info("kmem cache dump\n");
+	info("===============\n");
+	info(" name             size   inuse    peak   slabs     allocs  fails\n");
+	info(" ---------------- ---- ------- ------- ------- ---------- ------\n");
+
+	spinlock_lock(&kmem_caches_lock);
+	list_for_each_entry(c, &kmem_caches, link) {
+		spinlock_lock(&c->lock);
+		info(" %-16s %4zu %7zu %7zu %7zu %10lu %6lu\n", c->name,
+		    c->size, c->inuse, c->peak, c->slabs, c->allocs,
+		    c->fails);
+		spinlock_unlock(&c->lock);
+	}
+	spinlock_unlock(&kmem_caches_lock);
+}
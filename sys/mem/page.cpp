@@ -24,6 +24,7 @@
 #include <page.h>
 
 #include <algorithm>
+#include <arch.h>
 #include <bootargs.h>
 #include <cassert>
 #include <cstdio>
@@ -31,6 +32,7 @@
 #include <debug.h>
 #include <elf.h>
 #include <errno.h>
+#include <fs.h>
 #include <inttypes.h>
 #include <kernel.h>
 #include <list.h>
@@ -300,6 +302,7 @@ page_alloc_order(const size_t o, unsigned long attr, void *owner)
 	const auto st = attr & PAF_MAPPED ? PG_MAPPED : PG_FIXED;
 	const auto exact_speed = attr & PAF_EXACT_SPEED;
 	attr &= ~PAF_MASK;
+	const auto requested = attr;
 
 	/* find_block returns first page of free block with order >= o */
 	auto find_block = [](const region &r, const size_t o) -> ptrdiff_t {
@@ -334,6 +337,12 @@ page_alloc_order(const size_t o, unsigned long attr, void *owner)
 			continue;
 		}
 
+		/* try again after releasing unused file cache pages */
+		if (!interrupt_running() && pcache_reclaim(PAGE_SIZE << o)) {
+			attr = requested;
+			continue;
+		}
+
 		/* can't find suitable pages */
 		return 0;
 	}
@@ -85,8 +85,50 @@ as_map(as *a, void *addr, size_t len, int prot, int flags,
     std::unique_ptr<vnode> vn, off_t off, long attr)
 {
 	int r = 0;
+	void *x;
 	const auto fixed = flags & MAP_FIXED;
 
+	/* file system pages can never be made writable, so only share them
+	 * with mappings which can't expect a private copy: shared mappings
+	 * and executable text */
+	const bool share = vn.get() && !(prot & PROT_WRITE) &&
+	    (flags & MAP_SHARED || prot & PROT_EXEC);
+
+	/* directly addressable files execute in place */
+	if (share && (x = vn_xip(vn.get(), off, len)) &&
+	    !((uintptr_t)x & PAGE_MASK) && (!fixed || x == addr)) {
+		if ((r = as_insert(a, std::unique_ptr<phys>{(phys*)x, {0, a}},
+		    len, prot, flags, std::move(vn), off, attr)) < 0)
+			return (void*)r;
+#if defined(CONFIG_MPU)
+		if (a == task_cur()->as)
+			mpu_map(x, len, prot);
+#endif
+		return x;
+	}
+
+	/* other files share page cache pages */
+	if (share && !fixed) {
+		if (auto p = pcache_map(vn.get(), off, len)) {
+			vnode *v = vn.get();
+			vn_reference(v);
+			if (prot & PROT_EXEC)
+				cache_coherent_exec(p, len);
+			r = as_insert(a, std::unique_ptr<phys>{p, {0, a}}, len,
+			    prot, flags, std::move(vn), off, attr);
+			if (r < 0)
+				pcache_unmap(v, p, len);
+			vn_close(v);
+			if (r < 0)
+				return (void*)r;
+#if defined(CONFIG_MPU)
+			if (a == task_cur()->as)
+				mpu_map(p, len, prot);
+#endif
+			return p;
+		}
+	}
+
 	std::unique_ptr<phys> pages(fixed
 	    ? page_reserve((phys*)addr, len, attr, a)
 	    : page_alloc(len, attr, a),
@@ -125,8 +167,13 @@ as_map(as *a, void *addr, size_t len, int prot, int flags,
 int
 as_unmap(as *a, void *addr, size_t len, vnode *vn, off_t off)
 {
+	/* file system owns execute in place and page cache pages */
+	const bool shared = vn && (vn_xip(vn, off, len) == addr ||
+	    pcache_unmap(vn, addr, len));
+
 #if defined(DEBUG)
-	memset(addr, 0, len);
+	if (!shared)
+		memset(addr, 0, len);
 #endif
 
 #if defined(CONFIG_MPU)
@@ -134,6 +181,8 @@ as_unmap(as *a, void *addr, size_t len, vnode *vn, off_t off)
 		mpu_unmap(addr, len);
 #endif
 
+	if (shared)
+		return 0;
 	return page_free((phys*)addr, len, a);
 }
 
@@ -48,6 +48,8 @@ struct as {
 #endif
 };
 
+static kmem_cache *seg_cache;
+
 /*
  * do_vm_io - walk local and remote iovs calling f for each overlapping area
  */
@@ -113,7 +115,7 @@ seg_insert(seg *prev, std::unique_ptr<phys> pages, size_t len, int prot,
     std::unique_ptr<vnode> vn, off_t off, long attr)
 {
 	seg *ns;
-	if (!(ns = (seg*)kmem_alloc(sizeof(seg), MA_FAST)))
+	if (!(ns = (seg*)kmem_cache_alloc(seg_cache)))
 		return DERR(-ENOMEM);
 	ns->prot = prot;
 	ns->base = pages.release();
@@ -125,6 +127,16 @@ seg_insert(seg *prev, std::unique_ptr<phys> pages, size_t len, int prot,
 	return 0;
 }
 
+/*
+ * seg_shared - test if segment maps pages owned by the file system
+ */
+static bool
+seg_shared(const seg *s)
+{
+	return s->vn && (vn_xip(s->vn, s->off, s->len) == s->base ||
+	    pcache_owns(s->vn, s->base));
+}
+
 /*
  * seg_combine - combine contiguous segments
  */
@@ -137,7 +149,8 @@ seg_combine(as *a)
 	list_for_each_entry_safe(s, tmp, list_next(&a->segs), link) {
 		if (p->prot != s->prot || seg_end(p) != s->base ||
 		    p->attr != s->attr || p->vn != s->vn ||
-		    (p->vn && p->off + p->len != s->off)) {
+		    (p->vn && p->off + p->len != s->off) ||
+		    seg_shared(p) || seg_shared(s)) {
 			p = s;
 			continue;
 		}
@@ -146,7 +159,7 @@ seg_combine(as *a)
 		if (s->vn)
 			vn_close(s->vn);
 		list_remove(&s->link);
-		kmem_free(s);
+		kmem_cache_free(seg_cache, s);
 	}
 }
 
@@ -175,22 +188,24 @@ do_munmapfor(as *a, void *const vaddr, const size_t ulen, bool remap)
 			continue;
 		if (s->base >= uend)
 			break;
+		/* only private pages can be reused by a remap */
+		const bool unmap = !remap || seg_shared(s);
 		if (s->base >= uaddr && send <= uend) {
 			/* entire segment */
-			if (!remap)
+			if (unmap)
 				err = as_unmap(a, s->base, s->len, s->vn,
 				    s->off);
 			list_remove(&s->link);
 			if (s->vn)
 				vn_close(s->vn);
-			kmem_free(s);
+			kmem_cache_free(seg_cache, s);
 		} else if (s->base < uaddr && send > uend) {
 			/* hole in segment */
 			seg *ns;
-			if (!(ns = (seg*)kmem_alloc(sizeof(seg), MA_FAST)))
+			if (!(ns = (seg*)kmem_cache_alloc(seg_cache)))
 				return DERR(-ENOMEM);
 			s->len = uaddr - (char*)s->base;
-			if (!remap)
+			if (unmap)
 				err = as_unmap(a, uaddr, ulen, s->vn,
 				    s->off + s->len);
 			*ns = *s;
@@ -206,14 +221,14 @@ do_munmapfor(as *a, void *const vaddr, const size_t ulen, bool remap)
 		} else if (s->base < uaddr) {
 			/* end of segment */
 			const auto l = uaddr - (char*)s->base;
-			if (!remap)
+			if (unmap)
 				err = as_unmap(a, uaddr, s->len - l, s->vn,
 				    s->off + l);
 			s->len = l;
 		} else if (s->base < uend) {
 			/* start of segment */
 			const auto l = uend - (char*)s->base;
-			if (!remap)
+			if (unmap)
 				err = as_unmap(a, s->base, l, s->vn, s->off);
 			if (s->vn)
 				s->off += l;
@@ -228,6 +243,49 @@ do_munmapfor(as *a, void *const vaddr, const size_t ulen, bool remap)
 	return err;
 }
 
+/*
+ * do_unmap_shared - unmap file system pages from locked address space
+ *
+ * A fixed mapping reuses the private pages already mapped at its address.
+ * Pages owned by the file system can't be reused, so they are unmapped and
+ * any page cache pages which are no longer mapped are evicted.
+ *
+ * Must be called with address space write lock held.
+ */
+static int
+do_unmap_shared(as *a, void *const vaddr, const size_t ulen)
+{
+	const auto uaddr = (char*)vaddr;
+	const auto uend = uaddr + ulen;
+
+	for (;;) {
+		seg *s, *found = nullptr;
+		list_for_each_entry(s, &a->segs, link) {
+			if ((char*)seg_end(s) <= uaddr)
+				continue;
+			if (s->base >= uend)
+				break;
+			if (seg_shared(s)) {
+				found = s;
+				break;
+			}
+		}
+		if (!found)
+			return 0;
+
+		const auto b = std::max((char*)found->base, uaddr);
+		const auto l = std::min((char*)seg_end(found), uend) - b;
+		vnode *vn = found->vn;
+		vn_reference(vn);
+		const int err = do_munmapfor(a, b, l, false);
+		if (err == 0)
+			pcache_evict(vn, b, l);
+		vn_close(vn);
+		if (err < 0)
+			return err;
+	}
+}
+
 /*
  * do_mmapfor - map memory into locked address space
  *
@@ -255,6 +313,11 @@ do_mmapfor(as *a, void *addr, size_t len, int prot, int flags, int fd,
 			return (void*)DERR(-EBADF);
 	}
 
+	if (flags & MAP_FIXED) {
+		if (int err = do_unmap_shared(a, addr, len); err < 0)
+			return (void*)err;
+	}
+
 	return as_map(a, addr, len, prot, flags, std::move(vn), off, attr);
 }
 
@@ -320,6 +383,9 @@ mprotectfor(as *a, void *const vaddr, const size_t ulen, const int prot)
 			break;
 		if (s->prot == prot)
 			continue;
+		/* file system pages are shared and must stay read-only */
+		if (prot & PROT_WRITE && seg_shared(s))
+			return DERR(-EACCES);
 		if (s->base >= uaddr && send <= uend) {
 			/* entire segment */
 			err = as_mprotect(a, s->base, s->len, prot);
@@ -327,10 +393,10 @@ mprotectfor(as *a, void *const vaddr, const size_t ulen, const int prot)
 		} else if (s->base < uaddr && send > uend) {
 			/* hole in segment */
 			seg *ns1, *ns2;
-			if (!(ns1 = (seg*)kmem_alloc(sizeof(seg), MA_FAST)))
+			if (!(ns1 = (seg*)kmem_cache_alloc(seg_cache)))
 				return DERR(-ENOMEM);
-			if (!(ns2 = (seg*)kmem_alloc(sizeof(seg), MA_FAST))) {
-				kmem_free(ns1);
+			if (!(ns2 = (seg*)kmem_cache_alloc(seg_cache))) {
+				kmem_cache_free(seg_cache, ns1);
 				return DERR(-ENOMEM);
 			}
 
@@ -361,7 +427,7 @@ mprotectfor(as *a, void *const vaddr, const size_t ulen, const int prot)
 		} else if (s->base < uaddr) {
 			/* end of segment */
 			seg *ns;
-			if (!(ns = (seg*)kmem_alloc(sizeof(seg), MA_FAST)))
+			if (!(ns = (seg*)kmem_cache_alloc(seg_cache)))
 				return DERR(-ENOMEM);
 
 			const auto l = uaddr - (char*)s->base;
@@ -381,7 +447,7 @@ mprotectfor(as *a, void *const vaddr, const size_t ulen, const int prot)
 		} else if (s->base < uend) {
 			/* start of segment */
 			seg *ns;
-			if (!(ns = (seg*)kmem_alloc(sizeof(seg), MA_FAST)))
+			if (!(ns = (seg*)kmem_cache_alloc(seg_cache)))
 				return DERR(-ENOMEM);
 			const auto l = uend - (char*)s->base;
 			err = as_mprotect(a, s->base, l, prot);
@@ -584,7 +650,8 @@ sc_brk(void *addr)
 void
 vm_init()
 {
-
+	if (!(seg_cache = kmem_cache_create("seg", sizeof(seg), MA_FAST)))
+		panic("vm_init");
 }
 
 /*
@@ -656,7 +723,7 @@ as_destroy(as *a)
 		as_unmap(a, s->base, s->len, s->vn, s->off);
 		if (s->vn)
 			vn_close(s->vn);
-		kmem_free(s);
+		kmem_cache_free(seg_cache, s);
 	}
 	a->lock.write().unlock();
 	kmem_free(a);
@@ -4,7 +4,9 @@
 #include <arch.h>
 #include <debug.h>
 #include <errno.h>
+#include <jhash3.h>
 #include <kernel.h>
+#include <kmem.h>
 #include <limits.h>
 #include <sch.h>
 #include <stdalign.h>
@@ -13,84 +15,118 @@
 #include <sys/mman.h>
 #include <task.h>
 #include <thread.h>
+#include <timer.h>
 #include <vm.h>
 
 #define trace(...)
 
 /*
- * TODO: optimise search using hash map?
- * TODO: free unused futexes?
+ * Futexes are kept in a hash table keyed by task and physical address of the
+ * futex word. An entry only exists while there are waiters on the futex or an
+ * operation on it is in progress, so the table stays small regardless of how
+ * many futex words a program uses.
  */
+#define FUTEX_BUCKETS	64	/* must be power of 2 */
 
 /*
  * futex - kernel data for a userspace futex
  */
 struct futex {
+	struct task *task;	/* task which owns futex */
 	phys *addr;		/* futex address */
+	unsigned refs;		/* operations in progress */
 	struct spinlock lock;	/* to synchronise operations on this futex */
-	struct event event;	/* event */
-	struct list link;	/* linkage on futexes list */
+	struct pi pi;		/* waiters & priority inheritance state */
+	struct list link;	/* linkage on hash bucket */
 };
 
-/*
- * futexes_impl - internal details of struct futexes
- */
-struct futexes_impl {
-	struct spinlock lock;
-	struct list list;
-};
-static_assert(sizeof(struct futexes_impl) == sizeof(struct futexes), "");
-static_assert(alignof(struct futexes_impl) == alignof(struct futexes), "");
-
-/*
- * futexes - retrieve futexes_impl from task
- */
-static struct futexes_impl *
-futexes(struct task *t)
-{
-	return (struct futexes_impl *)task_futexes(t);
-}
+static struct spinlock futex_lock;	/* protects futex_table & refs */
+static struct list futex_table[FUTEX_BUCKETS];
+static struct kmem_cache *futex_cache;
 
 /*
- * futex_find - search for futex associated with uaddr
+ * futex_hash - get hash bucket for futex
  */
-static struct futex *
-futex_find(struct futexes_impl *fi, int *uaddr)
+static struct list *
+futex_hash(struct task *t, phys *addr)
 {
-	struct futex *f;
-	list_for_each_entry(f, &fi->list, link) {
-		if (f->addr == virt_to_phys(uaddr))
-			return f;
-	}
-	return 0;
+	return &futex_table[jhash_2words((uint32_t)addr, (uint32_t)t) &
+	    (FUTEX_BUCKETS - 1)];
 }
 
 /*
- * futex_get - find or create futex for uaddr
+ * futex_get - find futex associated with uaddr, optionally creating it
+ *
+ * Returns a referenced futex which must be released with futex_put.
  */
 static struct futex *
-futex_get(struct futexes_impl *fi, int *uaddr)
+futex_get(struct task *t, int *uaddr, bool create)
 {
 	struct futex *f;
+	phys *addr = virt_to_phys(uaddr);
+	struct list *head = futex_hash(t, addr);
 
-	spinlock_lock(&fi->lock);
+	spinlock_lock(&futex_lock);
 
-	if ((f = futex_find(fi, uaddr)))
-		goto out;
+	list_for_each_entry(f, head, link) {
+		if (f->addr == addr && f->task == t)
+			goto found;
+	}
 
-	if (!(f = malloc(sizeof(struct futex))))
+	if (!create || !(f = kmem_cache_alloc(futex_cache))) {
+		f = NULL;
 		goto out;
+	}
 
-	f->addr = virt_to_phys(uaddr);
+	f->task = t;
+	f->addr = addr;
+	f->refs = 0;
 	spinlock_init(&f->lock);
-	event_init(&f->event, "futex", ev_LOCK);
-	list_insert(&fi->list, &f->link);
+	sch_pi_init(&f->pi, "futex");
+	list_insert(head, &f->link);
 
+found:
+	++f->refs;
 out:
-	spinlock_unlock(&fi->lock);
+	spinlock_unlock(&futex_lock);
 	return f;
 }
 
+/*
+ * futex_put - release futex reference, freeing futex if it is unused
+ *
+ * Threads can only start waiting on a futex while holding a reference, so
+ * once the last reference is dropped the waiter count can only decrease.
+ */
+static void
+futex_put(struct futex *f)
+{
+	spinlock_lock(&futex_lock);
+	assert(f->refs > 0);
+	if (--f->refs == 0 && !sch_pi_waiting(&f->pi)) {
+		assert(!f->pi.owner);
+		list_remove(&f->link);
+		kmem_cache_free(futex_cache, f);
+	}
+	spinlock_unlock(&futex_lock);
+}
+
+/*
+ * futex_reclaim - free futex associated with uaddr if it is unused
+ *
+ * Called by waiters after waking as a waiter which times out or is
+ * interrupted leaves without any other thread touching the futex. A requeued
+ * waiter can leave an unused futex behind on the requeue target, this is
+ * reclaimed by the next operation on that futex or when the task exits.
+ */
+static void
+futex_reclaim(struct task *t, int *uaddr)
+{
+	struct futex *f;
+	if ((f = futex_get(t, uaddr, false)))
+		futex_put(f);
+}
+
 /*
  * futex_wait - perform FUTEX_WAIT operation
  */
@@ -102,10 +138,6 @@ futex_wait(struct task *t, int *uaddr, int val, const struct timespec *ts)
 	if (ts && (ts->tv_sec < 0 || ts->tv_nsec > 1000000000))
 		return -EINVAL;
 
-	struct futex *f;
-	if (!(f = futex_get(futexes(t), uaddr)))
-		return DERR(-ENOMEM);
-
 	if ((err = u_access_begin()) < 0)
 		return err;
 	if (!u_access_okfor(t->as, uaddr, 4, PROT_READ)) {
@@ -113,25 +145,36 @@ futex_wait(struct task *t, int *uaddr, int val, const struct timespec *ts)
 		return DERR(-EFAULT);
 	}
 
+	struct futex *f;
+	if (!(f = futex_get(t, uaddr, true))) {
+		u_access_end();
+		return DERR(-ENOMEM);
+	}
+
 	spinlock_lock(&f->lock);
 	uval = atomic_load((uint32_t *)uaddr);
 	u_access_end();
 
 	if (uval != val) {
 		spinlock_unlock(&f->lock);
+		futex_put(f);
 		return -EAGAIN;
 	}
 
 	trace("futex_wait th:%p uaddr:%p val:%x ns:%llu\n",
 	    thread_cur(), uaddr, val, ts ? ts_to_ns(ts) : 0);
 
-	err = sch_prepare_sleep(&f->event, ts ? ts_to_ns(ts) : 0);
+	err = sch_prepare_sleep(&f->pi.event, ts ? ts_to_ns(ts) : 0);
 	spinlock_unlock(&f->lock);
+	futex_put(f);
 	if (err)
 		return err;
-	return sch_continue_sleep();
+	err = sch_continue_sleep();
 	/* Be _very_ careful. Requeue can move us from one futex to another, so
-	 * we are not necessarily waiting on 'f' anymore. */
+	 * we are not necessarily waiting on 'f' anymore, and 'f' may have been
+	 * freed by the thread which woke us. */
+	futex_reclaim(t, uaddr);
+	return err;
 }
 
 /*
@@ -149,23 +192,24 @@ futex_wake(struct task *t, int *uaddr, int val)
 
 	int n;
 	struct futex *f;
-	if (!(f = futex_find(futexes(t), uaddr)))
+	if (!(f = futex_get(t, uaddr, false)))
 		return 0;
 
 	spinlock_lock(&f->lock);
 	switch (val) {
 	case 1:
-		val = sch_wakeone(&f->event) ? 1 : 0;
+		val = sch_wakeone(&f->pi.event) ? 1 : 0;
 		break;
 	case INT_MAX:
-		val = sch_wakeup(&f->event, 0);
+		val = sch_wakeup(&f->pi.event, 0);
 		break;
 	default:
 		n = val;
-		while (n && sch_wakeone(&f->event)) --n;
+		while (n && sch_wakeone(&f->pi.event)) --n;
 		val -= n;
 	}
 	spinlock_unlock(&f->lock);
+	futex_put(f);
 
 	return val;
 }
@@ -183,27 +227,174 @@ futex_requeue(struct task *t, int *uaddr, int val, int val2, int *uaddr2)
 		return DERR(-EINVAL);
 
 	struct futex *l;
-	if (!(l = futex_find(futexes(t), uaddr)))
+	if (!(l = futex_get(t, uaddr, false)))
 		return 0;
 
 	spinlock_lock(&l->lock);
 
 	int n = val;
-	while (n && sch_wakeone(&l->event)) --n;
+	while (n && sch_wakeone(&l->pi.event)) --n;
+	const bool waiting = sch_pi_waiting(&l->pi);
 
 	spinlock_unlock(&l->lock);
 
-	if (val2) {
+	if (val2 && waiting) {
 		struct futex *r;
-		if (!(r = futex_get(futexes(t), uaddr2)))
+		if (!(r = futex_get(t, uaddr2, true))) {
+			futex_put(l);
 			return DERR(-ENOMEM);
+		}
 
-		while (val2-- && sch_requeue(&l->event, &r->event));
+		while (val2-- && sch_requeue(&l->pi.event, &r->pi.event));
+		futex_put(r);
 	}
+	futex_put(l);
 
 	return val - n;
 }
 
+/*
+ * futex_lock_pi - perform FUTEX_LOCK_PI & FUTEX_TRYLOCK_PI operations
+ *
+ * The futex word holds the thread id of the owner. While we wait the owner
+ * inherits our priority. Timeout is absolute CLOCK_REALTIME.
+ */
+static int
+futex_lock_pi(struct task *t, int *uaddr, const struct timespec *ts,
+    bool trylock)
+{
+	int err;
+	uint_fast64_t nsec = 0;
+
+	if (ts) {
+		if (ts->tv_sec < 0 || ts->tv_nsec >= 1000000000)
+			return DERR(-EINVAL);
+		const uint_fast64_t now = timer_realtime();
+		const uint_fast64_t abs = ts_to_ns(ts);
+		nsec = abs > now ? abs - now : 0;
+	}
+
+	if ((err = u_access_begin()) < 0)
+		return err;
+	if (!u_access_okfor(t->as, uaddr, 4, PROT_READ | PROT_WRITE)) {
+		u_access_end();
+		return DERR(-EFAULT);
+	}
+
+	struct futex *f;
+	if (!(f = futex_get(t, uaddr, true))) {
+		u_access_end();
+		return DERR(-ENOMEM);
+	}
+
+	const uint32_t tid = thread_id(thread_cur());
+	struct thread *owner = NULL;
+	_Atomic uint32_t *word = (_Atomic uint32_t *)uaddr;
+
+	spinlock_lock(&f->lock);
+	uint32_t uval = atomic_load(word);
+	for (;;) {
+		if ((uval & FUTEX_TID_MASK) == tid) {
+			err = DERR(-EDEADLK);
+			break;
+		}
+
+		/* lock is free, take it */
+		if (!(uval & FUTEX_TID_MASK)) {
+			const uint32_t n = tid | (uval & FUTEX_OWNER_DIED) |
+			    (sch_pi_waiting(&f->pi) ? FUTEX_WAITERS : 0);
+			if (atomic_compare_exchange_strong(word, &uval, n)) {
+				err = 0;
+				break;
+			}
+			continue;
+		}
+
+		if (trylock) {
+			err = -EWOULDBLOCK;
+			break;
+		}
+
+		/* force owner to unlock through the kernel */
+		if (!(uval & FUTEX_WAITERS) && !atomic_compare_exchange_strong(
+		    word, &uval, uval | FUTEX_WAITERS))
+			continue;
+
+		/* owner must not be freed while it inherits our priority */
+		owner = thread_find(uval & FUTEX_TID_MASK);
+		if (!owner || !thread_ref(owner))
+			err = DERR(-ESRCH);
+		else if (ts && !nsec) {
+			thread_unref(owner);
+			err = -ETIMEDOUT;
+		} else
+			err = 1;
+		break;
+	}
+	u_access_end();
+
+	if (err <= 0) {
+		spinlock_unlock(&f->lock);
+		futex_put(f);
+		return err;
+	}
+
+	trace("futex_lock_pi th:%p uaddr:%p owner:%p ns:%llu\n",
+	    thread_cur(), uaddr, owner, nsec);
+
+	/* wait for owner to hand us the lock */
+	err = sch_pi_prepare_sleep(&f->pi, owner, nsec);
+	thread_unref(owner);
+	spinlock_unlock(&f->lock);
+	futex_put(f);
+	if (err)
+		return err;
+	err = sch_continue_sleep();
+	futex_reclaim(t, uaddr);
+	return err;
+}
+
+/*
+ * futex_unlock_pi - perform FUTEX_UNLOCK_PI operation
+ *
+ * Ownership is handed directly to the highest priority waiter.
+ */
+static int
+futex_unlock_pi(struct task *t, int *uaddr)
+{
+	int err;
+
+	trace("futex_unlock_pi th:%p uaddr:%p\n", thread_cur(), uaddr);
+
+	if ((err = u_access_begin()) < 0)
+		return err;
+	if (!u_access_okfor(t->as, uaddr, 4, PROT_READ | PROT_WRITE)) {
+		u_access_end();
+		return DERR(-EFAULT);
+	}
+
+	struct futex *f = futex_get(t, uaddr, false);
+
+	_Atomic uint32_t *word = (_Atomic uint32_t *)uaddr;
+
+	if (f)
+		spinlock_lock(&f->lock);
+	if ((atomic_load(word) & FUTEX_TID_MASK) != thread_id(thread_cur()))
+		err = DERR(-EPERM);
+	else {
+		struct thread *th = f ? sch_pi_wakeone(&f->pi) : NULL;
+		atomic_store(word, th ? thread_id(th) |
+		    (sch_pi_waiting(&f->pi) ? FUTEX_WAITERS : 0) : 0);
+	}
+	if (f) {
+		spinlock_unlock(&f->lock);
+		futex_put(f);
+	}
+	u_access_end();
+
+	return err;
+}
+
 /*
  * futex - kernel implementation of futex
  */
@@ -230,10 +421,13 @@ futex(struct task *t, int *uaddr, int op, int val, void *val2, int *uaddr2)
 		return futex_wake(t, uaddr, val);
 	case FUTEX_REQUEUE:
 		return futex_requeue(t, uaddr, val, (int)val2, uaddr2);
-	/*
-	 * TODO(FUTEX_LOCK_PI)
-	 * TODO(FUTEX_UNOCK_PI)
-	 */
+	case FUTEX_LOCK_PI:
+		assert(!sch_locks());
+		return futex_lock_pi(t, uaddr, val2, false);
+	case FUTEX_TRYLOCK_PI:
+		return futex_lock_pi(t, uaddr, NULL, true);
+	case FUTEX_UNLOCK_PI:
+		return futex_unlock_pi(t, uaddr);
 	default:
 		return DERR(-ENOTSUP);
 	}
@@ -251,6 +445,7 @@ sc_futex(int *uaddr, int op, int val, void *val2, int *uaddr2)
 	/* copy in userspace timespec */
 	switch (op & FUTEX_OP_MASK) {
 	case FUTEX_WAIT:
+	case FUTEX_LOCK_PI:
 		if (!val2)
 			break;
 		if ((ret = vm_read(task_cur()->as, &ts, val2, sizeof(ts))) < 0)
@@ -262,30 +457,36 @@ sc_futex(int *uaddr, int op, int val, void *val2, int *uaddr2)
 }
 
 /*
- * futexes_init - initialise futexes structure
+ * futexes_destroy - free any futexes belonging to task
  */
 void
-futexes_init(struct futexes *fs)
+futexes_destroy(struct task *t)
 {
-	struct futexes_impl *fi = (struct futexes_impl *)fs;
-
-	spinlock_init(&fi->lock);
-	list_init(&fi->list);
+	struct futex *f, *tmp;
+
+	spinlock_lock(&futex_lock);
+	for (size_t i = 0; i < FUTEX_BUCKETS; ++i) {
+		list_for_each_entry_safe(f, tmp, &futex_table[i], link) {
+			if (f->task != t)
+				continue;
+			assert(!f->refs && !sch_pi_waiting(&f->pi));
+			list_remove(&f->link);
+			kmem_cache_free(futex_cache, f);
+		}
+	}
+	spinlock_unlock(&futex_lock);
 }
 
 /*
- * futexes_destroy - destroy futexes structure
+ * futex_init - initialise futex hash table & cache
  */
 void
-futexes_destroy(struct futexes *fs)
+futex_init(void)
 {
-	struct futexes_impl *fi = (struct futexes_impl *)fs;
-
-	spinlock_lock(&fi->lock);
-	struct list *n;
-	for (n = list_first(&fi->list); n != &fi->list; n = list_next(n)) {
-		struct futex *fk = list_entry(n, struct futex, link);
-		free(fk);
-	}
-	spinlock_unlock(&fi->lock);
+	if (!(futex_cache = kmem_cache_create("futex", sizeof(struct futex),
+	    MA_NORMAL)))
+		panic("futex_init");
+	spinlock_init(&futex_lock);
+	for (size_t i = 0; i < FUTEX_BUCKETS; ++i)
+		list_init(&futex_table[i]);
 }
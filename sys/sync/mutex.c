@@ -36,6 +36,9 @@
  * can use mutex_lock() to ensure that global resource is not
  * accessed by other thread.
  *
+ * Mutexes implement priority inheritance. While a thread waits
+ * on a mutex the owner runs with at least the waiter's priority.
+ *
  * TODO: remove recursive mutex support.
  *	 SMP: spin before going to sleep.
  */
@@ -57,7 +60,7 @@ struct mutex_private {
 	atomic_intptr_t owner;	/* owner thread locking this mutex */
 	struct spinlock lock;	/* lock to protect struct mutex contents */
 	unsigned count;		/* counter for recursive lock */
-	struct event event;	/* event */
+	struct pi pi;		/* priority inheritance state */
 };
 
 static_assert(sizeof(struct mutex_private) == sizeof(struct mutex), "");
@@ -74,7 +77,7 @@ mutex_init(struct mutex *m)
 	atomic_store_explicit(&mp->owner, 0, memory_order_relaxed);
 	spinlock_init(&mp->lock);
 	mp->count = 0;
-	event_init(&mp->event, "mutex", ev_LOCK);
+	sch_pi_init(&mp->pi, "mutex");
 }
 
 /*
@@ -117,14 +120,15 @@ mutex_lock_slowpath(struct mutex *m)
 		return 0;
 	}
 
-	atomic_fetch_or_explicit(
+	const intptr_t owner = atomic_fetch_or_explicit(
 	    &mp->owner,
 	    MUTEX_WAITERS,
 	    memory_order_relaxed
 	);
 
-	/* wait for unlock */
-	r = sch_prepare_sleep(&mp->event, 0);
+	/* wait for unlock, lending our priority to the owner */
+	r = sch_pi_prepare_sleep(&mp->pi,
+	    (struct thread *)(owner & MUTEX_TID_MASK), 0);
 	spinlock_unlock(&mp->lock);
 	if (r == 0)
 		r = sch_continue_sleep();
@@ -198,11 +202,11 @@ mutex_unlock_slowpath(struct mutex *m)
 		return 0;
 	}
 
-	/* wake up one waiter and set new owner */
-	struct thread *waiter = sch_wakeone(&mp->event);
+	/* wake up one waiter, set new owner and drop inherited priority */
+	struct thread *waiter = sch_pi_wakeone(&mp->pi);
 	atomic_store_explicit(
 	    &mp->owner,
-	    (intptr_t)waiter | (event_waiting(&mp->event) ? MUTEX_WAITERS : 0),
+	    (intptr_t)waiter | (sch_pi_waiting(&mp->pi) ? MUTEX_WAITERS : 0),
 	    memory_order_relaxed
 	);
 